@@ -0,0 +1,205 @@
+//
+// Measures how the throughput of GrpcClient::Call scales with the number of caller threads.
+// Every call goes to a stub that simulates a fixed network latency, therefore if the calls are
+// not serialized inside of the client, the RPS should grow linearly with the number of threads.
+//
+// Usage: grpc_client_bench [latency_us] [duration_ms]
+//
+#include "pitaya.h"
+#include "pitaya/binding_storage.h"
+#include "pitaya/constants.h"
+#include "pitaya/grpc/rpc_client.h"
+#include "pitaya/protos/pitaya.grpc.pb.h"
+#include "pitaya/service_discovery.h"
+#include "spdlog/spdlog.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+
+static constexpr int kNumServers = 4;
+
+// Service discovery that knows no servers, they are given to the client directly.
+class NullServiceDiscovery : public pitaya::service_discovery::ServiceDiscovery
+{
+public:
+    boost::optional<pitaya::Server> GetServerById(const std::string& id) override
+    {
+        return boost::none;
+    }
+
+    std::vector<pitaya::Server> GetServersByType(const std::string& type) override { return {}; }
+
+    void AddListener(pitaya::service_discovery::Listener* listener) override {}
+
+    void RemoveListener(pitaya::service_discovery::Listener* listener) override {}
+};
+
+class NullBindingStorage : public pitaya::BindingStorage
+{
+public:
+    std::string GetUserFrontendId(const std::string& uid, const std::string& frontendType) override
+    {
+        return "";
+    }
+};
+
+// Stub that answers every call after sleeping for the simulated network latency.
+class SleepingStub : public protos::Pitaya::StubInterface
+{
+public:
+    explicit SleepingStub(microseconds latency)
+        : _latency(latency)
+    {}
+
+    grpc::Status Call(grpc::ClientContext* context,
+                      const protos::Request& request,
+                      protos::Response* response) override
+    {
+        std::this_thread::sleep_for(_latency);
+        return grpc::Status::OK;
+    }
+
+    grpc::Status PushToUser(grpc::ClientContext* context,
+                            const protos::Push& request,
+                            protos::Response* response) override
+    {
+        return grpc::Status::OK;
+    }
+
+    grpc::Status SessionBindRemote(grpc::ClientContext* context,
+                                   const protos::BindMsg& request,
+                                   protos::Response* response) override
+    {
+        return grpc::Status::OK;
+    }
+
+    grpc::Status KickUser(grpc::ClientContext* context,
+                          const protos::KickMsg& request,
+                          protos::KickAnswer* response) override
+    {
+        return grpc::Status::OK;
+    }
+
+private:
+    // The benchmark only makes synchronous calls.
+    using ResponseReader = grpc::ClientAsyncResponseReaderInterface<protos::Response>;
+    using KickAnswerReader = grpc::ClientAsyncResponseReaderInterface<protos::KickAnswer>;
+
+    ResponseReader* AsyncCallRaw(grpc::ClientContext*,
+                                 const protos::Request&,
+                                 grpc::CompletionQueue*) override
+    {
+        return nullptr;
+    }
+    ResponseReader* PrepareAsyncCallRaw(grpc::ClientContext*,
+                                        const protos::Request&,
+                                        grpc::CompletionQueue*) override
+    {
+        return nullptr;
+    }
+    ResponseReader* AsyncPushToUserRaw(grpc::ClientContext*,
+                                       const protos::Push&,
+                                       grpc::CompletionQueue*) override
+    {
+        return nullptr;
+    }
+    ResponseReader* PrepareAsyncPushToUserRaw(grpc::ClientContext*,
+                                              const protos::Push&,
+                                              grpc::CompletionQueue*) override
+    {
+        return nullptr;
+    }
+    ResponseReader* AsyncSessionBindRemoteRaw(grpc::ClientContext*,
+                                              const protos::BindMsg&,
+                                              grpc::CompletionQueue*) override
+    {
+        return nullptr;
+    }
+    ResponseReader* PrepareAsyncSessionBindRemoteRaw(grpc::ClientContext*,
+                                                     const protos::BindMsg&,
+                                                     grpc::CompletionQueue*) override
+    {
+        return nullptr;
+    }
+    KickAnswerReader* AsyncKickUserRaw(grpc::ClientContext*,
+                                       const protos::KickMsg&,
+                                       grpc::CompletionQueue*) override
+    {
+        return nullptr;
+    }
+    KickAnswerReader* PrepareAsyncKickUserRaw(grpc::ClientContext*,
+                                              const protos::KickMsg&,
+                                              grpc::CompletionQueue*) override
+    {
+        return nullptr;
+    }
+
+    const microseconds _latency;
+};
+
+int
+main(int argc, char* argv[])
+{
+    const auto latency = microseconds(argc > 1 ? std::atoi(argv[1]) : 1000);
+    const auto runFor = milliseconds(argc > 2 ? std::atoi(argv[2]) : 2000);
+
+    spdlog::set_level(spdlog::level::off);
+
+    auto client = std::unique_ptr<pitaya::GrpcClient>(new pitaya::GrpcClient(
+        pitaya::GrpcConfig(),
+        std::make_shared<NullServiceDiscovery>(),
+        std::unique_ptr<pitaya::BindingStorage>(new NullBindingStorage()),
+        [latency](std::shared_ptr<grpc::ChannelInterface>)
+            -> std::unique_ptr<protos::Pitaya::StubInterface> {
+            return std::unique_ptr<protos::Pitaya::StubInterface>(new SleepingStub(latency));
+        }));
+
+    std::vector<pitaya::Server> servers;
+    for (int i = 0; i < kNumServers; ++i) {
+        auto server = pitaya::Server(
+                          pitaya::Server::Kind::Backend, "server-" + std::to_string(i), "bench")
+                          .WithMetadata(pitaya::constants::kGrpcHostKey, "localhost")
+                          .WithMetadata(pitaya::constants::kGrpcPortKey, "3030");
+        client->ServerAdded(server);
+        servers.push_back(server);
+    }
+
+    std::printf("latency = %lldus, duration = %lldms\n",
+                static_cast<long long>(latency.count()),
+                static_cast<long long>(runFor.count()));
+    std::printf("%8s %12s %12s\n", "threads", "rps", "rps/thread");
+
+    for (int numThreads = 1; numThreads <= 64; numThreads *= 2) {
+        std::atomic_bool running(true);
+        std::atomic<long> numCalls(0);
+        std::vector<std::thread> threads;
+
+        for (int t = 0; t < numThreads; ++t) {
+            threads.emplace_back([&, t]() {
+                protos::Request req;
+                const auto& target = servers[t % servers.size()];
+                while (running) {
+                    client->Call(target, req);
+                    numCalls++;
+                }
+            });
+        }
+
+        std::this_thread::sleep_for(runFor);
+        running = false;
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        double rps = numCalls / duration_cast<duration<double>>(runFor).count();
+        std::printf("%8d %12.0f %12.0f\n", numThreads, rps, rps / numThreads);
+    }
+
+    return 0;
+}
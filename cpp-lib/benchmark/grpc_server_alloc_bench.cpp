@@ -0,0 +1,141 @@
+//
+// Counts the heap allocations done per RPC by the gRPC server.
+// Every operator new is counted. Allocations done by the completion queue threads of the
+// server are also counted separately; those threads are recognized by the handler,
+// which runs on them. They are split into the ones done by pitaya, which are the handler
+// and Finish, and the parsing of the request, and the remaining ones, done by gRPC.
+// The request is moved out of its CallData to the handler, so it is parsed into a new
+// message on every call; that cost is measured by parsing the same request on the main
+// thread.
+//
+// Usage: grpc_server_alloc_bench [num_rpcs]
+//
+#include "pitaya.h"
+#include "pitaya/grpc/rpc_server.h"
+#include "pitaya/protos/pitaya.grpc.pb.h"
+#include "spdlog/spdlog.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <grpcpp/create_channel.h>
+#include <new>
+#include <string>
+
+static std::atomic<uint64_t> gNumAllocs(0);
+static std::atomic<uint64_t> gNumServerAllocs(0);
+static thread_local bool gIsServerThread = false;
+static thread_local bool gIsInHandler = false;
+static std::atomic<uint64_t> gNumHandlerAllocs(0);
+static thread_local uint64_t gNumThreadAllocs = 0;
+
+void*
+operator new(size_t size)
+{
+    gNumAllocs.fetch_add(1, std::memory_order_relaxed);
+    ++gNumThreadAllocs;
+    if (gIsServerThread) {
+        gNumServerAllocs.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (gIsInHandler) {
+        gNumHandlerAllocs.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void
+operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+int
+main(int argc, char* argv[])
+{
+    const int numRpcs = argc > 1 ? std::atoi(argv[1]) : 20000;
+    const int numWarmupRpcs = 1000;
+
+    spdlog::set_level(spdlog::level::off);
+
+    pitaya::GrpcConfig config;
+    config.host = "127.0.0.1";
+    config.port = 3434;
+
+    protos::Response res;
+    res.set_data("response data");
+
+    pitaya::GrpcServer server(config);
+    server.Start([&res](protos::Request req, pitaya::Rpc* rpc) {
+        if (rpc) {
+            gIsServerThread = true;
+            gIsInHandler = true;
+            rpc->Finish(res);
+            gIsInHandler = false;
+        }
+    });
+
+    auto stub = protos::Pitaya::NewStub(grpc::CreateChannel(
+        config.host + ":" + std::to_string(config.port), grpc::InsecureChannelCredentials()));
+
+    auto msg = new protos::Msg();
+    msg->set_route("bench.handler.method");
+    msg->set_data("request data");
+
+    protos::Request req;
+    req.set_allocated_msg(msg);
+    req.set_type(protos::RPCType::User);
+
+    auto call = [&]() {
+        grpc::ClientContext ctx;
+        protos::Response callRes;
+        auto status = stub->Call(&ctx, req, &callRes);
+        if (!status.ok()) {
+            std::fprintf(stderr, "rpc failed: %s\n", status.error_message().c_str());
+            std::exit(1);
+        }
+    };
+
+    for (int i = 0; i < numWarmupRpcs; ++i) {
+        call();
+    }
+
+    uint64_t allocsBefore = gNumAllocs;
+    uint64_t serverAllocsBefore = gNumServerAllocs;
+    uint64_t handlerAllocsBefore = gNumHandlerAllocs;
+
+    for (int i = 0; i < numRpcs; ++i) {
+        call();
+    }
+
+    double allocsPerRpc = static_cast<double>(gNumAllocs - allocsBefore) / numRpcs;
+    double serverAllocsPerRpc = static_cast<double>(gNumServerAllocs - serverAllocsBefore) / numRpcs;
+    double handlerAllocsPerRpc =
+        static_cast<double>(gNumHandlerAllocs - handlerAllocsBefore) / numRpcs;
+
+    const std::string reqBytes = req.SerializeAsString();
+    uint64_t parseAllocsBefore = gNumThreadAllocs;
+    for (int i = 0; i < numRpcs; ++i) {
+        protos::Request parsed;
+        parsed.ParseFromString(reqBytes);
+    }
+    double parseAllocsPerRpc = static_cast<double>(gNumThreadAllocs - parseAllocsBefore) / numRpcs;
+
+    std::printf("rpcs = %d\n", numRpcs);
+    std::printf("allocations per rpc (whole process) = %.2f\n", allocsPerRpc);
+    std::printf("allocations per rpc (server threads) = %.2f\n", serverAllocsPerRpc);
+    std::printf("  pitaya, handler and Finish = %.2f\n", handlerAllocsPerRpc);
+    std::printf("  pitaya, parsing the request = %.2f\n", parseAllocsPerRpc);
+    std::printf("  grpc = %.2f\n", serverAllocsPerRpc - handlerAllocsPerRpc - parseAllocsPerRpc);
+
+    server.Shutdown();
+    return 0;
+}
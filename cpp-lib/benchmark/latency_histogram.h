@@ -0,0 +1,120 @@
+#ifndef PITAYA_BENCHMARK_LATENCY_HISTOGRAM_H
+#define PITAYA_BENCHMARK_LATENCY_HISTOGRAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+//
+// Log-linear histogram in the style of HdrHistogram. Values below 128 have their own
+// bucket. Above that, every power of two is split into 64 buckets, so the recorded
+// values have at least two significant decimal digits of precision (< 1.6% error).
+// Recording is lock-free and can be done concurrently from any number of threads.
+//
+class LatencyHistogram
+{
+public:
+    LatencyHistogram()
+        : _counts(new std::atomic<uint64_t>[kNumBuckets])
+        , _count(0)
+        , _sum(0)
+        , _max(0)
+    {
+        for (size_t i = 0; i < kNumBuckets; ++i) {
+            _counts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void Record(uint64_t value)
+    {
+        value = std::min(value, kMaxValue);
+        _counts[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(value, std::memory_order_relaxed);
+
+        uint64_t max = _max.load(std::memory_order_relaxed);
+        while (value > max &&
+               !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t Count() const { return _count.load(std::memory_order_relaxed); }
+
+    uint64_t Max() const { return _max.load(std::memory_order_relaxed); }
+
+    double Mean() const
+    {
+        auto count = Count();
+        return count ? static_cast<double>(_sum.load(std::memory_order_relaxed)) / count : 0;
+    }
+
+    // Returns the highest value equivalent to the one at the given percentile (0-100],
+    // capped to the maximum recorded value.
+    uint64_t Percentile(double percentile) const
+    {
+        auto count = Count();
+        if (count == 0) {
+            return 0;
+        }
+        auto target = static_cast<uint64_t>(std::ceil(count * percentile / 100.0));
+        target = std::max<uint64_t>(1, std::min(target, count));
+
+        uint64_t accumulated = 0;
+        for (size_t i = 0; i < kNumBuckets; ++i) {
+            accumulated += _counts[i].load(std::memory_order_relaxed);
+            if (accumulated >= target) {
+                return std::min(HighestEquivalentValue(i), Max());
+            }
+        }
+        return Max();
+    }
+
+private:
+    static constexpr int kSubBucketBits = 7;
+    static constexpr uint64_t kSubBucketCount = uint64_t(1) << kSubBucketBits;
+    static constexpr uint64_t kSubBucketHalfCount = kSubBucketCount / 2;
+    // Values are capped to 2^40 (about 18 minutes in nanoseconds).
+    static constexpr int kMaxShift = 40 - kSubBucketBits;
+    static constexpr uint64_t kMaxValue = (uint64_t(1) << 40) - 1;
+    static constexpr size_t kNumBuckets = kSubBucketCount + kMaxShift * kSubBucketHalfCount;
+
+    static int MostSignificantBit(uint64_t value)
+    {
+        int msb = 0;
+        while (value >>= 1) {
+            ++msb;
+        }
+        return msb;
+    }
+
+    static size_t BucketIndex(uint64_t value)
+    {
+        if (value < kSubBucketCount) {
+            return static_cast<size_t>(value);
+        }
+        int shift = MostSignificantBit(value) - (kSubBucketBits - 1);
+        uint64_t subBucket = value >> shift;
+        return static_cast<size_t>(kSubBucketCount + (shift - 1) * kSubBucketHalfCount +
+                                   (subBucket - kSubBucketHalfCount));
+    }
+
+    static uint64_t HighestEquivalentValue(size_t index)
+    {
+        if (index < kSubBucketCount) {
+            return index;
+        }
+        int shift = static_cast<int>((index - kSubBucketCount) / kSubBucketHalfCount) + 1;
+        uint64_t subBucket = (index - kSubBucketCount) % kSubBucketHalfCount + kSubBucketHalfCount;
+        return ((subBucket + 1) << shift) - 1;
+    }
+
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]> _counts;
+    std::atomic<uint64_t> _count;
+    std::atomic<uint64_t> _sum;
+    std::atomic<uint64_t> _max;
+};
+
+#endif // PITAYA_BENCHMARK_LATENCY_HISTOGRAM_H
@@ -0,0 +1,285 @@
+//
+// In-process RPC load test. A gRPC server listens on loopback and the cluster sends
+// RPCs to itself through the gRPC client, so nothing besides this process is needed:
+// service discovery and binding storage are replaced by local stand-ins.
+//
+// A fixed number of asynchronous RPCs is kept in flight during the whole run and the
+// latency of every RPC is recorded in a histogram.
+//
+// Usage: pitaya_bench [options]
+//   --duration <seconds>        duration of the measured run (default 10)
+//   --warmup <seconds>          duration of the warm up, not measured (default 1)
+//   --concurrency <n>           number of RPCs in flight (default 64)
+//   --request-size <bytes>      size of the request payload (default 128)
+//   --response-size <bytes>     size of the response payload (default 128)
+//   --handler-threads <n>       number of threads calling WaitForRpc (default 4)
+//   --server-threads <n>        gRPC server threads, zero for one per core (default 0)
+//   --client-threads <n>        gRPC client completion queue threads (default 1)
+//   --sharded                   enables sharded dispatch on the gRPC server
+//   --pin-threads               pins the gRPC server threads to cores
+//   --port <port>               port of the gRPC server (default 3435)
+//
+#include "latency_histogram.h"
+#include "pitaya.h"
+#include "pitaya/binding_storage.h"
+#include "pitaya/cluster.h"
+#include "pitaya/constants.h"
+#include "pitaya/grpc/rpc_client.h"
+#include "pitaya/grpc/rpc_server.h"
+#include "pitaya/service_discovery.h"
+#include "pitaya/utils/semaphore.h"
+#include "spdlog/spdlog.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace pitaya;
+using namespace std::chrono;
+
+// Service discovery that only knows the servers given to it.
+class LocalServiceDiscovery : public service_discovery::ServiceDiscovery
+{
+public:
+    explicit LocalServiceDiscovery(std::vector<Server> servers)
+        : _servers(std::move(servers))
+    {}
+
+    boost::optional<Server> GetServerById(const std::string& id) override
+    {
+        for (const auto& server : _servers) {
+            if (server.Id() == id) {
+                return server;
+            }
+        }
+        return boost::none;
+    }
+
+    std::vector<Server> GetServersByType(const std::string& type) override
+    {
+        std::vector<Server> servers;
+        for (const auto& server : _servers) {
+            if (server.Type() == type) {
+                servers.push_back(server);
+            }
+        }
+        return servers;
+    }
+
+    void AddListener(service_discovery::Listener* listener) override
+    {
+        for (const auto& server : _servers) {
+            listener->ServerAdded(server);
+        }
+    }
+
+    void RemoveListener(service_discovery::Listener* listener) override {}
+
+private:
+    const std::vector<Server> _servers;
+};
+
+class NullBindingStorage : public BindingStorage
+{
+public:
+    std::string GetUserFrontendId(const std::string& uid, const std::string& frontendType) override
+    {
+        return "";
+    }
+};
+
+struct Options
+{
+    int durationSec = 10;
+    int warmupSec = 1;
+    int concurrency = 64;
+    int requestSize = 128;
+    int responseSize = 128;
+    int handlerThreads = 4;
+    int serverThreads = 0;
+    int clientThreads = 1;
+    bool sharded = false;
+    bool pinThreads = false;
+    int port = 3435;
+};
+
+static void
+Usage(const char* program)
+{
+    std::fprintf(stderr,
+                 "usage: %s [--duration s] [--warmup s] [--concurrency n] [--request-size b]\n"
+                 "          [--response-size b] [--handler-threads n] [--server-threads n]\n"
+                 "          [--client-threads n] [--sharded] [--pin-threads] [--port p]\n",
+                 program);
+    std::exit(1);
+}
+
+static Options
+ParseOptions(int argc, char* argv[])
+{
+    Options opts;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (std::strcmp(arg, "--sharded") == 0) {
+            opts.sharded = true;
+            continue;
+        }
+        if (std::strcmp(arg, "--pin-threads") == 0) {
+            opts.pinThreads = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            Usage(argv[0]);
+        }
+        int value = std::atoi(argv[++i]);
+        if (std::strcmp(arg, "--duration") == 0) {
+            opts.durationSec = value;
+        } else if (std::strcmp(arg, "--warmup") == 0) {
+            opts.warmupSec = value;
+        } else if (std::strcmp(arg, "--concurrency") == 0) {
+            opts.concurrency = value;
+        } else if (std::strcmp(arg, "--request-size") == 0) {
+            opts.requestSize = value;
+        } else if (std::strcmp(arg, "--response-size") == 0) {
+            opts.responseSize = value;
+        } else if (std::strcmp(arg, "--handler-threads") == 0) {
+            opts.handlerThreads = value;
+        } else if (std::strcmp(arg, "--server-threads") == 0) {
+            opts.serverThreads = value;
+        } else if (std::strcmp(arg, "--client-threads") == 0) {
+            opts.clientThreads = value;
+        } else if (std::strcmp(arg, "--port") == 0) {
+            opts.port = value;
+        } else {
+            Usage(argv[0]);
+        }
+    }
+    if (opts.concurrency < 1 || opts.handlerThreads < 1 || opts.durationSec < 1) {
+        Usage(argv[0]);
+    }
+    return opts;
+}
+
+int
+main(int argc, char* argv[])
+{
+    const Options opts = ParseOptions(argc, argv);
+
+    spdlog::set_level(spdlog::level::off);
+
+    GrpcConfig grpcConfig;
+    grpcConfig.host = "127.0.0.1";
+    grpcConfig.port = opts.port;
+    grpcConfig.serverNumThreads = opts.serverThreads;
+    grpcConfig.serverShardedDispatch = opts.sharded;
+    grpcConfig.serverPinThreads = opts.pinThreads;
+    grpcConfig.clientNumCompletionQueueThreads = opts.clientThreads;
+
+    Server server(Server::Kind::Backend, "bench-server", "bench");
+    server.WithMetadata(constants::kGrpcHostKey, grpcConfig.host)
+        .WithMetadata(constants::kGrpcPortKey, std::to_string(grpcConfig.port));
+
+    auto sd = std::make_shared<LocalServiceDiscovery>(std::vector<Server>{ server });
+
+    Cluster::Instance().Initialize(
+        server,
+        sd,
+        std::unique_ptr<RpcServer>(new GrpcServer(grpcConfig)),
+        std::unique_ptr<RpcClient>(new GrpcClient(
+            grpcConfig, sd, std::unique_ptr<BindingStorage>(new NullBindingStorage()))));
+
+    protos::Response response;
+    response.set_data(std::string(opts.responseSize, 'r'));
+
+    std::vector<std::thread> handlers;
+    for (int i = 0; i < opts.handlerThreads; ++i) {
+        handlers.emplace_back([&response]() {
+            while (auto rpcData = Cluster::Instance().WaitForRpc()) {
+                rpcData->rpc->Finish(response);
+            }
+        });
+    }
+
+    auto msg = new protos::Msg();
+    msg->set_route("bench.handler.method");
+    msg->set_data(std::string(opts.requestSize, 'q'));
+
+    protos::Request req;
+    req.set_type(protos::RPCType::User);
+    req.set_allocated_msg(msg);
+
+    LatencyHistogram histogram;
+    std::atomic<uint64_t> numErrors(0);
+    std::atomic_bool measuring(false);
+    std::atomic_bool running(true);
+
+    // The sender keeps `concurrency` RPCs in flight. Every callback frees a slot.
+    utils::Semaphore window;
+    window.NotifyAll(opts.concurrency);
+
+    std::thread sender([&]() {
+        while (running) {
+            window.Wait();
+            if (!running) {
+                break;
+            }
+            auto start = steady_clock::now();
+            Cluster::Instance().RPCAsync(
+                server.Id(),
+                msg->route(),
+                req,
+                [&, start](boost::optional<PitayaError> err, protos::Response res) {
+                    if (measuring) {
+                        if (err) {
+                            numErrors++;
+                        } else {
+                            auto elapsed = steady_clock::now() - start;
+                            histogram.Record(duration_cast<nanoseconds>(elapsed).count());
+                        }
+                    }
+                    window.Notify();
+                });
+        }
+    });
+
+    std::this_thread::sleep_for(seconds(opts.warmupSec));
+    measuring = true;
+    auto start = steady_clock::now();
+    std::this_thread::sleep_for(seconds(opts.durationSec));
+    measuring = false;
+    auto elapsed = duration_cast<duration<double>>(steady_clock::now() - start).count();
+
+    running = false;
+    window.Notify();
+    sender.join();
+
+    // Destroying the client waits for the RPCs in flight, then the server stops the handlers.
+    Cluster::Instance().Terminate();
+    for (auto& thread : handlers) {
+        thread.join();
+    }
+
+    auto toUs = [](double ns) { return ns / 1000.0; };
+
+    std::printf("duration       = %.2f s\n", elapsed);
+    std::printf("concurrency    = %d\n", opts.concurrency);
+    std::printf("request size   = %d bytes\n", opts.requestSize);
+    std::printf("response size  = %d bytes\n", opts.responseSize);
+    std::printf("sharded        = %s\n", opts.sharded ? "yes" : "no");
+    std::printf("rpcs           = %llu\n", static_cast<unsigned long long>(histogram.Count()));
+    std::printf("errors         = %llu\n", static_cast<unsigned long long>(numErrors.load()));
+    std::printf("rps            = %.0f\n", histogram.Count() / elapsed);
+    std::printf("latency mean   = %.1f us\n", toUs(histogram.Mean()));
+    std::printf("latency p50    = %.1f us\n", toUs(histogram.Percentile(50)));
+    std::printf("latency p99    = %.1f us\n", toUs(histogram.Percentile(99)));
+    std::printf("latency p999   = %.1f us\n", toUs(histogram.Percentile(99.9)));
+    std::printf("latency max    = %.1f us\n", toUs(histogram.Max()));
+
+    return 0;
+}
@@ -0,0 +1,277 @@
+//
+// Microbenchmarks for the utilities used on the path of every RPC and of every
+// service discovery update.
+//
+// Usage: pitaya_microbench [google benchmark flags, e.g. --benchmark_filter=Route]
+//
+#include "pitaya.h"
+#include "pitaya/constants.h"
+#include "pitaya/etcdv3_service_discovery/worker.h"
+#include "pitaya/load_balancer.h"
+#include "pitaya/utils.h"
+#include "pitaya/utils/grpc.h"
+#include "pitaya/utils/route_cache.h"
+#include "pitaya/utils/semaphore.h"
+#include "pitaya/utils/sync_deque.h"
+
+#include <benchmark/benchmark.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace pitaya;
+
+//
+// Topics
+//
+
+static void
+BM_GetTopicForServer(benchmark::State& state)
+{
+    const std::string serverId = "5f7c2a1e-9b1d-4c1e-8f3a-2d6b9e0c4a71";
+    const std::string serverType = "connector";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(utils::GetTopicForServer(serverId, serverType));
+    }
+}
+BENCHMARK(BM_GetTopicForServer);
+
+static void
+BM_GetUserKickTopic(benchmark::State& state)
+{
+    const std::string userId = "user-1234567890";
+    const std::string serverType = "connector";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(utils::GetUserKickTopic(userId, serverType));
+    }
+}
+BENCHMARK(BM_GetUserKickTopic);
+
+//
+// Server selection
+//
+
+static void
+BM_RandomServer(benchmark::State& state)
+{
+    std::vector<Server> servers;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        servers.emplace_back(Server::Kind::Backend, "server-" + std::to_string(i), "room")
+            .WithMetadata(constants::kGrpcHostKey, "10.0.0.1")
+            .WithMetadata(constants::kGrpcPortKey, "3434");
+    }
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(utils::RandomServer(servers));
+    }
+}
+BENCHMARK(BM_RandomServer)->Arg(1)->Arg(16)->Arg(256)->Arg(4096);
+
+static void
+BM_LoadBalancerPick(benchmark::State& state)
+{
+    auto lb = CreateLoadBalancer(static_cast<LoadBalancingStrategy>(state.range(0)));
+    std::vector<Server> servers;
+    for (int i = 0; i < 64; ++i) {
+        servers.emplace_back(Server::Kind::Backend, "server-" + std::to_string(i), "room");
+    }
+    lb->ServersChanged(servers, {});
+    for (const auto& server : servers) {
+        lb->RpcStarted(server.Id());
+    }
+    protos::Request req;
+    req.mutable_session()->set_uid("user-1234567890");
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(lb->Pick(servers, req));
+    }
+}
+BENCHMARK(BM_LoadBalancerPick)
+    ->ArgName("strategy")
+    ->Arg(static_cast<int>(LoadBalancingStrategy::Random))
+    ->Arg(static_cast<int>(LoadBalancingStrategy::RoundRobin))
+    ->Arg(static_cast<int>(LoadBalancingStrategy::PowerOfTwoChoices))
+    ->Arg(static_cast<int>(LoadBalancingStrategy::ConsistentHash));
+
+//
+// Parsing
+//
+
+static void
+BM_ParseEtcdKey(benchmark::State& state)
+{
+    const std::string key = "pitaya/servers/room/5f7c2a1e-9b1d-4c1e-8f3a-2d6b9e0c4a71";
+    const std::string prefix = "pitaya/";
+    std::vector<std::string> filters;
+    if (state.range(0)) {
+        filters = { "connector", "metagame", "room" };
+    }
+    std::string serverType, serverId;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(utils::ParseEtcdKey(key, prefix, filters, serverType, serverId));
+    }
+}
+BENCHMARK(BM_ParseEtcdKey)->ArgName("filters")->Arg(0)->Arg(1);
+
+static void
+BM_Route(benchmark::State& state)
+{
+    const std::string route = "room.roomHandler.join";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Route(route));
+    }
+}
+BENCHMARK(BM_Route);
+
+static void
+BM_RouteCache(benchmark::State& state)
+{
+    const std::string route = "room.roomHandler.join";
+    utils::RouteCache routes;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(routes.Get(route));
+    }
+}
+BENCHMARK(BM_RouteCache);
+
+static void
+BM_WorkerParseServer(benchmark::State& state)
+{
+    const std::string json =
+        R"({"id":"5f7c2a1e-9b1d-4c1e-8f3a-2d6b9e0c4a71","type":"room",)"
+        R"("metadata":{"grpcHost":"10.0.0.1","grpcPort":"3434","region":"us-east"},)"
+        R"("hostname":"room-7d9f8c6b5-x2x4z","frontend":false})";
+    auto log = utils::CloneLoggerOrCreate(nullptr, "microbench");
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(etcdv3_service_discovery::Worker::ParseServer(json, log));
+    }
+}
+BENCHMARK(BM_WorkerParseServer);
+
+// Parses every server of a snapshot, as done when the worker synchronizes the servers
+// from etcd.
+static void
+BM_WorkerParseServerSnapshot(benchmark::State& state)
+{
+    std::vector<std::string> snapshot;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        snapshot.push_back(
+            R"({"id":"server-)" + std::to_string(i) +
+            R"(","type":"room","metadata":{"grpcHost":"10.0.)" + std::to_string(i / 256) +
+            "." + std::to_string(i % 256) +
+            R"(","grpcPort":"3434","region":"us-east"},"hostname":"room-)" +
+            std::to_string(i) + R"(","frontend":false})");
+    }
+    auto log = utils::CloneLoggerOrCreate(nullptr, "microbench");
+    for (auto _ : state) {
+        for (const auto& json : snapshot) {
+            benchmark::DoNotOptimize(etcdv3_service_discovery::Worker::ParseServer(json, log));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_WorkerParseServerSnapshot)
+    ->ArgName("servers")
+    ->Arg(10000)
+    ->Unit(benchmark::kMillisecond);
+
+//
+// Server copies
+//
+
+// Copies the servers of a type, as done by every GetServersByType call and by every
+// broadcast to the service discovery listeners.
+static void
+BM_CopyServers(benchmark::State& state)
+{
+    std::vector<Server> servers;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        servers.emplace_back(Server::Kind::Backend,
+                             "5f7c2a1e-9b1d-4c1e-8f3a-" + std::to_string(i),
+                             "room",
+                             "room-7d9f8c6b5-" + std::to_string(i))
+            .WithMetadata(constants::kGrpcHostKey, "10.0.0.1")
+            .WithMetadata(constants::kGrpcPortKey, "3434");
+    }
+    for (auto _ : state) {
+        auto copy = servers;
+        benchmark::DoNotOptimize(copy.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CopyServers)->ArgName("servers")->Arg(10000)->Arg(100000);
+
+//
+// Server metadata
+//
+
+static void
+BM_ServerWithMetadata(benchmark::State& state)
+{
+    for (auto _ : state) {
+        Server server(Server::Kind::Backend, "server-id", "room");
+        for (int64_t i = 0; i < state.range(0); ++i) {
+            server.WithMetadata("key" + std::to_string(i), "value");
+        }
+        benchmark::DoNotOptimize(server);
+    }
+}
+BENCHMARK(BM_ServerWithMetadata)->ArgName("keys")->Arg(1)->Arg(2)->Arg(8);
+
+static void
+BM_GetGrpcAddressFromServer(benchmark::State& state)
+{
+    Server server(Server::Kind::Backend, "server-id", "room");
+    server.WithMetadata(constants::kGrpcHostKey, "10.0.0.1")
+        .WithMetadata(constants::kGrpcPortKey, "3434");
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(utils::GetGrpcAddressFromServer(server));
+    }
+}
+BENCHMARK(BM_GetGrpcAddressFromServer);
+
+//
+// Synchronization primitives under contention. Every thread pushes and pops on the
+// same instance.
+//
+
+static utils::SyncDeque<int> gDeque;
+
+static void
+BM_SyncDequeContention(benchmark::State& state)
+{
+    for (auto _ : state) {
+        {
+            std::lock_guard<decltype(gDeque)> lock(gDeque);
+            gDeque.PushBack(1);
+        }
+        {
+            std::lock_guard<decltype(gDeque)> lock(gDeque);
+            benchmark::DoNotOptimize(gDeque.PopFront());
+        }
+    }
+}
+BENCHMARK(BM_SyncDequeContention)->ThreadRange(1, 16)->UseRealTime();
+
+static utils::Semaphore gSemaphore;
+
+static void
+BM_SemaphoreContention(benchmark::State& state)
+{
+    for (auto _ : state) {
+        gSemaphore.Notify();
+        gSemaphore.Wait();
+    }
+}
+BENCHMARK(BM_SemaphoreContention)->ThreadRange(1, 16)->UseRealTime();
+
+int
+main(int argc, char** argv)
+{
+    spdlog::set_level(spdlog::level::off);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
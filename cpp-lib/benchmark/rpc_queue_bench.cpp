@@ -0,0 +1,282 @@
+//
+// Measures the hand-off of incoming RPCs from the rpc server threads (producers) to the
+// threads calling Cluster::WaitForRpc (consumers) under contention.
+// It compares the previous SyncDeque + Semaphore hand-off, the MpmcQueue alone, the
+// ShardedQueue with one shard per producer and the full
+// Cluster::OnIncomingRpc -> Cluster::WaitForRpc path.
+//
+// Usage: rpc_queue_bench [rpcs_per_producer]
+//
+#include "pitaya.h"
+#include "pitaya/cluster.h"
+#include "pitaya/rpc_client.h"
+#include "pitaya/rpc_server.h"
+#include "pitaya/service_discovery.h"
+#include "pitaya/utils/mpmc_queue.h"
+#include "pitaya/utils/semaphore.h"
+#include "pitaya/utils/sharded_queue.h"
+#include "pitaya/utils/sync_deque.h"
+#include "spdlog/spdlog.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std::chrono;
+
+class NoopRpc : public pitaya::Rpc
+{
+public:
+    void Finish(const protos::Response& res) override { (void)res; }
+};
+
+// Rpc server that only keeps the handler, the benchmark calls it from its producer threads.
+class HandlerRpcServer : public pitaya::RpcServer
+{
+public:
+    explicit HandlerRpcServer(pitaya::RpcHandlerFunc* handler)
+        : _handler(handler)
+    {}
+
+    void Start(pitaya::RpcHandlerFunc handler) override { *_handler = std::move(handler); }
+
+    void Shutdown() override {}
+
+private:
+    pitaya::RpcHandlerFunc* _handler;
+};
+
+class NullRpcClient : public pitaya::RpcClient
+{
+public:
+    protos::Response Call(const pitaya::Server& target, const protos::Request& req) override
+    {
+        return protos::Response();
+    }
+
+    void CallAsync(const pitaya::Server& target,
+                   const protos::Request& req,
+                   pitaya::CallCallback callback) override
+    {
+        callback(protos::Response());
+    }
+
+    boost::optional<pitaya::PitayaError> SendPushToUser(const std::string& serverId,
+                                                        const std::string& serverType,
+                                                        const protos::Push& push) override
+    {
+        return boost::none;
+    }
+
+    boost::optional<pitaya::PitayaError> SendKickToUser(const std::string& serverId,
+                                                        const std::string& serverType,
+                                                        const protos::KickMsg& kick) override
+    {
+        return boost::none;
+    }
+};
+
+class NullServiceDiscovery : public pitaya::service_discovery::ServiceDiscovery
+{
+public:
+    boost::optional<pitaya::Server> GetServerById(const std::string& id) override
+    {
+        return boost::none;
+    }
+
+    std::vector<pitaya::Server> GetServersByType(const std::string& type) override { return {}; }
+
+    void AddListener(pitaya::service_discovery::Listener* listener) override {}
+
+    void RemoveListener(pitaya::service_discovery::Listener* listener) override {}
+};
+
+static double
+Run(int numProducers,
+    int numConsumers,
+    int rpcsPerProducer,
+    std::function<void()> produce,
+    std::function<bool()> consume,
+    std::function<void()> finish)
+{
+    auto start = steady_clock::now();
+
+    std::vector<std::thread> consumers;
+    for (int i = 0; i < numConsumers; ++i) {
+        consumers.emplace_back([&]() {
+            while (consume()) {
+            }
+        });
+    }
+
+    std::vector<std::thread> producers;
+    for (int i = 0; i < numProducers; ++i) {
+        producers.emplace_back([&]() {
+            for (int j = 0; j < rpcsPerProducer; ++j) {
+                produce();
+            }
+        });
+    }
+
+    for (auto& thread : producers) {
+        thread.join();
+    }
+    finish();
+    for (auto& thread : consumers) {
+        thread.join();
+    }
+
+    auto elapsed = duration_cast<duration<double>>(steady_clock::now() - start).count();
+    return (static_cast<double>(numProducers) * rpcsPerProducer) / elapsed;
+}
+
+static double
+RunSyncDeque(int numProducers, int numConsumers, int rpcsPerProducer)
+{
+    NoopRpc rpc;
+    pitaya::utils::SyncDeque<pitaya::Cluster::RpcData> queue;
+    pitaya::utils::Semaphore semaphore;
+    bool finished = false;
+
+    return Run(
+        numProducers,
+        numConsumers,
+        rpcsPerProducer,
+        [&]() {
+            std::lock_guard<decltype(queue)> lock(queue);
+            pitaya::Cluster::RpcData rpcData;
+            rpcData.rpc = &rpc;
+            queue.PushBack(std::move(rpcData));
+            semaphore.Notify();
+        },
+        [&]() {
+            semaphore.Wait();
+            std::lock_guard<decltype(queue)> lock(queue);
+            if (queue.Size() > 0) {
+                queue.PopFront();
+                return true;
+            }
+            return !finished;
+        },
+        [&]() {
+            std::lock_guard<decltype(queue)> lock(queue);
+            finished = true;
+            semaphore.NotifyAll(numConsumers);
+        });
+}
+
+static double
+RunMpmcQueue(int numProducers, int numConsumers, int rpcsPerProducer)
+{
+    NoopRpc rpc;
+    pitaya::utils::MpmcQueue<pitaya::Cluster::RpcData> queue(4096);
+
+    return Run(
+        numProducers,
+        numConsumers,
+        rpcsPerProducer,
+        [&]() {
+            pitaya::Cluster::RpcData rpcData;
+            rpcData.rpc = &rpc;
+            queue.Push(std::move(rpcData));
+        },
+        [&]() {
+            pitaya::Cluster::RpcData rpcData;
+            return queue.Pop(rpcData);
+        },
+        [&]() { queue.Close(); });
+}
+
+static double
+RunShardedQueue(int numProducers, int numConsumers, int rpcsPerProducer)
+{
+    NoopRpc rpc;
+    pitaya::utils::ShardedQueue<pitaya::Cluster::RpcData> queue(numProducers, 4096);
+    queue.Close();
+    queue.Reopen(numProducers);
+
+    std::atomic<size_t> nextProducer(0);
+    std::atomic<size_t> nextConsumer(0);
+
+    return Run(
+        numProducers,
+        numConsumers,
+        rpcsPerProducer,
+        [&]() {
+            thread_local size_t shard = nextProducer++;
+            pitaya::Cluster::RpcData rpcData;
+            rpcData.rpc = &rpc;
+            queue.Push(std::move(rpcData), shard);
+        },
+        [&]() {
+            thread_local size_t shard = nextConsumer++;
+            pitaya::Cluster::RpcData rpcData;
+            return queue.Pop(rpcData, shard);
+        },
+        [&]() { queue.Close(); });
+}
+
+static double
+RunCluster(int numProducers, int numConsumers, int rpcsPerProducer)
+{
+    NoopRpc rpc;
+    pitaya::RpcHandlerFunc handler;
+
+    pitaya::Cluster::Instance().Initialize(
+        pitaya::Server(pitaya::Server::Kind::Backend, "bench-id", "bench"),
+        std::make_shared<NullServiceDiscovery>(),
+        std::unique_ptr<pitaya::RpcServer>(new HandlerRpcServer(&handler)),
+        std::unique_ptr<pitaya::RpcClient>(new NullRpcClient()));
+
+    protos::Request req;
+    auto rps = Run(
+        numProducers,
+        numConsumers,
+        rpcsPerProducer,
+        [&]() { handler(req, &rpc); },
+        [&]() { return static_cast<bool>(pitaya::Cluster::Instance().WaitForRpc()); },
+        [&]() { handler(req, nullptr); });
+
+    pitaya::Cluster::Instance().Terminate();
+    return rps;
+}
+
+int
+main(int argc, char* argv[])
+{
+    const int rpcsPerProducer = argc > 1 ? std::atoi(argv[1]) : 200000;
+
+    spdlog::set_level(spdlog::level::off);
+
+    const std::vector<std::pair<int, int>> configs = {
+        { 1, 1 }, { 1, 4 }, { 4, 1 }, { 2, 2 }, { 4, 4 }, { 8, 8 }, { 16, 16 },
+    };
+
+    std::printf("rpcs per producer = %d\n", rpcsPerProducer);
+    std::printf("%9s %9s %16s %16s %16s %16s\n",
+                "producers",
+                "consumers",
+                "sync_deque rps",
+                "mpmc rps",
+                "sharded rps",
+                "cluster rps");
+
+    for (const auto& config : configs) {
+        int numProducers = config.first;
+        int numConsumers = config.second;
+        std::printf("%9d %9d %16.0f %16.0f %16.0f %16.0f\n",
+                    numProducers,
+                    numConsumers,
+                    RunSyncDeque(numProducers, numConsumers, rpcsPerProducer),
+                    RunMpmcQueue(numProducers, numConsumers, rpcsPerProducer),
+                    RunShardedQueue(numProducers, numConsumers, rpcsPerProducer),
+                    RunCluster(numProducers, numConsumers, rpcsPerProducer));
+    }
+
+    return 0;
+}
@@ -38,14 +38,14 @@ namespace etcd
         std::string const & address,
         std::string const & key,
         bool const recursive,
-        int const fromRevision,
+        int64_t const fromRevision,
         std::function<void(Response)> callback,
         pplx::task_options const & task_options = pplx::task_options());
     Watcher(
         std::shared_ptr<Channel> const & channel,
         std::string const & key,
         bool const recursive,
-        int const fromRevision,
+        int64_t const fromRevision,
         std::function<void(Response)> callback,
         pplx::task_options const & task_options = pplx::task_options());
     void cancel();
@@ -23,7 +23,7 @@ etcd::Watcher::Watcher(
     std::string const & address,
     std::string const & key,
     bool const recursive,
-    int const fromRevision,
+    int64_t const fromRevision,
     std::function<void(Response)> callback,
     pplx::task_options const & task_options)
   : Watcher::Watcher(etcd::utils::createChannel(address), key, recursive, fromRevision, callback, task_options)
@@ -33,7 +33,7 @@ etcd::Watcher::Watcher(
     std::shared_ptr<grpc::Channel> const & channel,
     std::string const & key,
     bool const recursive,
-    int const fromRevision,
+    int64_t const fromRevision,
     std::function<void(Response)> callback,
     pplx::task_options const & task_options)
   : channel(channel)
@@ -62,7 +62,7 @@ etcd::Watcher::Watcher(
   watch_action_parameters.withPrefix = recursive;
   watch_action_parameters.watch_stub = watchServiceStub.get();
   // if fromRevision is 0, interested revision for user is current + 1
-  watch_action_parameters.revision = 0;
+  watch_action_parameters.revision = fromRevision;
   try
   {
     doWatch();
@@ -4,10 +4,15 @@
 #include "pitaya/protos/request.pb.h"
 #include "pitaya/protos/response.pb.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 namespace pitaya {
 
@@ -15,10 +20,20 @@ class Rpc
 {
 public:
     virtual ~Rpc() = default;
-    virtual void Finish(protos::Response res) = 0;
+    virtual void Finish(const protos::Response& res) = 0;
+
+    // Gives access to the request bytes as they were received, for transports that keep them.
+    // The bytes are valid until Finish is called.
+    virtual bool RawRequest(const uint8_t** data, size_t* size) const
+    {
+        (void)data;
+        (void)size;
+        return false;
+    }
 };
 
-using RpcHandlerFunc = std::function<void(const protos::Request&, Rpc*)>;
+// The request is given by value so that it can be moved all the way to the consumer.
+using RpcHandlerFunc = std::function<void(protos::Request, Rpc*)>;
 
 class PitayaException : public std::exception
 {
@@ -45,6 +60,13 @@ struct Route
         , method(method){};
 
     Route(const std::string& route_str);
+
+    // Splits a route into its server type, handler and method without allocating. The views
+    // point into `route_str`. Returns false when one of the parts is missing.
+    static bool Split(std::string_view route_str,
+                      std::string_view& sv_type,
+                      std::string_view& handler,
+                      std::string_view& method);
 };
 
 class Server
@@ -56,41 +78,63 @@ public:
         Frontend = 1,
     };
 
-    std::string Id() const { return _id; }
-    std::string Type() const { return _type; }
-    std::string Metadata() const { return _metadata; }
-    std::string Hostname() const { return _hostname; }
-    bool IsFrontend() const { return _frontend; }
+    // Metadata entry. Values that are json strings are kept decoded, the others keep
+    // their compact json text.
+    struct MetadataEntry
+    {
+        std::string key;
+        std::string value;
+        bool isString;
+
+        bool operator==(const MetadataEntry& e) const
+        {
+            return key == e.key && value == e.value && isString == e.isString;
+        }
+    };
+
+    // Servers are handles to immutable shared data, copying them only increments a reference
+    // count. WithMetadata and WithRawMetadata give the server a changed copy of the data.
+    const std::string& Id() const;
+    // Servers of the same type share the same interned string.
+    const std::string& Type() const;
+    const std::string& Hostname() const;
+    bool IsFrontend() const;
+
+    // Metadata as a json object. It is only serialized the first time it is needed. Metadata
+    // that could not be parsed is returned as it was given.
+    const std::string& Metadata() const;
+
+    bool HasMetadata() const;
+    // Why the metadata given to WithRawMetadata could not be parsed, empty when it was.
+    const std::string& MetadataError() const;
+    const std::vector<MetadataEntry>& MetadataEntries() const;
+    // Value of a string entry, nullptr when there is no such entry.
+    const std::string* MetadataValue(const std::string& key) const;
+
+    // The gRPC address is looked up when the metadata is parsed. Empty when it is missing.
+    const std::string& GrpcHost() const;
+    const std::string& GrpcPort() const;
 
     Server() = default;
 
-    Server(Kind kind, std::string id, std::string type, std::string hostname = "")
-        : _id(std::move(id))
-        , _type(std::move(type))
-        , _hostname(std::move(hostname))
-        , _frontend(static_cast<int>(kind))
-    {}
+    Server(Kind kind, std::string id, std::string type, std::string hostname = "");
 
     Server& WithMetadata(const std::string& key, const std::string& val);
 
-    Server& WithRawMetadata(std::string metadata)
-    {
-        _metadata = std::move(metadata);
-        return *this;
-    }
+    // Parses a json object with the metadata.
+    Server& WithRawMetadata(std::string metadata);
 
-    bool operator==(const Server& sv) const
-    {
-        return _id == sv._id && _type == sv._type && _metadata == sv._metadata &&
-               _hostname == sv._hostname && _frontend == sv._frontend;
-    }
+    bool operator==(const Server& sv) const;
+
+private:
+    struct Data;
+    struct MetadataBody;
+
+    Data& MutableData();
+    const MetadataBody* MetadataPtr() const;
 
 private:
-    std::string _id;
-    std::string _type;
-    std::string _metadata;
-    std::string _hostname;
-    bool _frontend;
+    std::shared_ptr<Data> _data;
 };
 
 struct PitayaError
@@ -122,4 +122,17 @@ extern "C"
                                  const char* server_type,
                                  MemoryBuffer* memBuf,
                                  CPitayaError* retErr);
+
+    // RPC received by the server. `req` is either borrowed from the rpc or allocated with
+    // malloc, tfg_pitc_FinishRpcCall releases it.
+    struct CRpc
+    {
+        MemoryBuffer* req;
+        void* tag;
+    };
+
+    // Returns null once the server finished.
+    CRpc* tfg_pitc_WaitForRpc();
+
+    void tfg_pitc_FinishRpcCall(MemoryBuffer* mb, CRpc* crpc);
 }
@@ -2,24 +2,30 @@
 #define PITAYA_CLUSTER_H
 
 #include "pitaya.h"
+#include "pitaya/consistent_hash_ring.h"
 #include "pitaya/etcd_config.h"
 #include "pitaya/grpc_config.h"
+#include "pitaya/load_balancer.h"
 #include "pitaya/nats_config.h"
 #include "pitaya/protos/request.pb.h"
 #include "pitaya/protos/response.pb.h"
 #include "pitaya/rpc_client.h"
 #include "pitaya/rpc_server.h"
 #include "pitaya/service_discovery.h"
-#include "pitaya/utils/semaphore.h"
-#include "pitaya/utils/sync_deque.h"
+#include "pitaya/utils/route_cache.h"
+#include "pitaya/utils/sharded_queue.h"
 #include "spdlog/spdlog.h"
 
+#include <atomic>
 #include <boost/optional.hpp>
+#include <functional>
 #include <google/protobuf/message_lite.h>
 #include <ostream>
 
 namespace pitaya {
 
+using RpcCallback = std::function<void(boost::optional<PitayaError>, protos::Response)>;
+
 class Cluster
 {
 public:
@@ -29,11 +35,13 @@ public:
         return instance;
     }
 
+    // Route based RPCs are balanced with `loadBalancer`, or randomly when it is null.
     void Initialize(Server server,
                     std::shared_ptr<service_discovery::ServiceDiscovery> sd,
                     std::unique_ptr<RpcServer> rpcServer,
                     std::unique_ptr<RpcClient> rpcClient,
-                    const char* loggerName = nullptr);
+                    const char* loggerName = nullptr,
+                    std::shared_ptr<LoadBalancer> loadBalancer = nullptr);
 
     void InitializeWithNats(NatsConfig natsConfig,
                             EtcdServiceDiscoveryConfig sdConfig,
@@ -54,6 +62,8 @@ public:
 
     service_discovery::ServiceDiscovery& GetServiceDiscovery() { return *_sd.get(); }
 
+    // The metadata of the request may carry tracing keys as a json object
+    // (see utils::JsonObjectFromPairs). They are merged with the peer keys of this server.
     boost::optional<PitayaError> RPC(const std::string& serverId,
                                      const std::string& route,
                                      protos::Request& req,
@@ -63,6 +73,29 @@ public:
                                      protos::Request& req,
                                      protos::Response& ret);
 
+    // Sends the RPC to the server of the route type that owns `key` on a consistent hash
+    // ring, e.g. the uid of a user. The same key goes to the same server while the servers
+    // of the type do not change, and only about 1/N of the keys move when they do.
+    boost::optional<PitayaError> RPCByKey(const std::string& route,
+                                          const std::string& key,
+                                          protos::Request& req,
+                                          protos::Response& ret);
+
+    // Asynchronous versions of RPC. They return right away and call the callback once
+    // the response arrives, usually from a thread owned by the rpc client.
+    // Errors (including server not found) are always reported through the callback.
+    void RPCAsync(const std::string& serverId,
+                  const std::string& route,
+                  protos::Request& req,
+                  RpcCallback callback);
+
+    void RPCAsync(const std::string& route, protos::Request& req, RpcCallback callback);
+
+    void RPCAsyncByKey(const std::string& route,
+                       const std::string& key,
+                       protos::Request& req,
+                       RpcCallback callback);
+
     boost::optional<PitayaError> SendPushToUser(const std::string& server_id,
                                                 const std::string& server_type,
                                                 protos::Push& push);
@@ -71,27 +104,77 @@ public:
                                                 const std::string& server_type,
                                                 protos::KickMsg& kick);
 
+    // Sends the pushes to users on servers of the given type. Over NATS they are all sent
+    // before waiting for the acknowledgements. Returns the first error.
+    boost::optional<PitayaError> SendPushesToUsers(const std::string& server_type,
+                                                   const std::vector<protos::Push>& pushes);
+
+    // Move-only, the request is moved from the rpc server to the caller of WaitForRpc.
     struct RpcData
     {
+        RpcData() = default;
+        RpcData(RpcData&&) = default;
+        RpcData& operator=(RpcData&&) = default;
+        RpcData(const RpcData&) = delete;
+        RpcData& operator=(const RpcData&) = delete;
+
         protos::Request req;
-        Rpc* rpc;
+        Rpc* rpc = nullptr;
     };
 
     boost::optional<RpcData> WaitForRpc();
 
+    // Maximum number of received RPCs that were not picked up by WaitForRpc yet. Once it is
+    // reached, new RPCs are answered right away with kCodeServiceUnavailable, so that the
+    // threads of the rpc server are never blocked. With -1 (the default) they are only
+    // bounded by the capacity of the queue (see SetWaitingRpcShardCapacity).
+    void SetMaxWaitingRpcs(int maxWaitingRpcs) { _maxWaitingRpcs = maxWaitingRpcs; }
+
+    // Capacity of each shard of the queue of received RPCs, used from the next Initialize.
+    // With 0 (the default) it is the serverMaxNumberOfRpcs of the config given to
+    // InitializeWithGrpc or InitializeWithNats, since their servers never have more RPCs in
+    // process, or kDefaultWaitingRpcShardCapacity when the server has no such limit.
+    void SetWaitingRpcShardCapacity(size_t capacity) { _waitingRpcShardCapacity = capacity; }
+
+    static constexpr size_t kDefaultWaitingRpcShardCapacity = 16384;
+
 private:
-    void OnIncomingRpc(const protos::Request& req, Rpc* rpc);
+    void OnIncomingRpc(protos::Request req, Rpc* rpc);
+    // Calls a server of the type picked by the rpc client (see RpcClient::CallsServerTypes).
+    boost::optional<PitayaError> RPCServerType(const std::string& serverType,
+                                               const std::string& route,
+                                               protos::Request& req,
+                                               protos::Response& ret);
+    void RPCAsyncServerType(const std::string& serverType,
+                            const std::string& route,
+                            protos::Request& req,
+                            RpcCallback callback);
+    void SetRequestMetadata(protos::Request& req);
 
 private:
     std::shared_ptr<spdlog::logger> _log;
     std::shared_ptr<service_discovery::ServiceDiscovery> _sd;
     std::unique_ptr<RpcClient> _rpcClient;
     std::unique_ptr<RpcServer> _rpcSv;
+    std::shared_ptr<LoadBalancer> _loadBalancer;
+    std::shared_ptr<ConsistentHashRing> _hashRing;
+    // Routes of the route based RPCs, parsed once.
+    utils::RouteCache _routes;
     Server _server;
-
-    utils::SyncDeque<RpcData> _waitingRpcs;
-    std::unique_ptr<utils::Semaphore> _waitingRpcsSemaphore;
-    bool _waitingRpcsFinished;
+    std::string _requestMetadata;
+
+    // Queue of received RPCs that were not picked up by WaitForRpc yet. RPCs that do not fit
+    // are refused, like the ones over _maxWaitingRpcs.
+    static constexpr size_t kMaxWaitingRpcShards = 64;
+
+    utils::ShardedQueue<RpcData> _waitingRpcs{ kMaxWaitingRpcShards,
+                                               kDefaultWaitingRpcShardCapacity };
+    size_t _waitingRpcShardCapacity = 0;
+    // serverMaxNumberOfRpcs of the config given to InitializeWithGrpc or InitializeWithNats,
+    // only valid during the Initialize they call.
+    int _serverMaxNumberOfRpcs = -1;
+    std::atomic_int _maxWaitingRpcs{ -1 };
+    std::atomic_int _numWaitingRpcs{ 0 };
 };
 
 } // namespace pitaya
@@ -0,0 +1,81 @@
+#ifndef PITAYA_CONSISTENT_HASH_RING_H
+#define PITAYA_CONSISTENT_HASH_RING_H
+
+#include "pitaya.h"
+#include "pitaya/service_discovery.h"
+#include "pitaya/utils/snapshot.h"
+
+#include <boost/optional.hpp>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace pitaya {
+
+//
+// Consistent hash ring (ketama) per server type. Every server is placed on the ring of its
+// type at a number of points (virtual nodes) and a key belongs to the server of the first
+// point after the hash of the key. When a server joins or leaves, only about 1/N of the
+// keys move.
+//
+// The rings are kept up to date as a service discovery listener. Updates only touch the
+// points of the servers that changed, every ring is rebuilt once per batch of changes and
+// lookups never lock. A server added again with the id of a server on the ring replaces it
+// without moving any key.
+//
+// The hashes do not depend on the platform nor on the order in which the servers were
+// added, so every process with the same servers maps a key to the same server.
+//
+class ConsistentHashRing : public service_discovery::Listener
+{
+public:
+    static constexpr size_t kDefaultNumVirtualNodes = 160;
+
+    explicit ConsistentHashRing(size_t numVirtualNodes = kDefaultNumVirtualNodes);
+
+    // Returns the server of the given type that owns the key, or none when there are no
+    // servers of the type.
+    boost::optional<pitaya::Server> ServerForKey(const std::string& serverType,
+                                                 const std::string& key) const;
+    boost::optional<std::string> ServerIdForKey(const std::string& serverType,
+                                                const std::string& key) const;
+
+    void ServerAdded(const pitaya::Server& server) override;
+    void ServerRemoved(const pitaya::Server& server) override;
+    void ServersChanged(const std::vector<pitaya::Server>& added,
+                        const std::vector<pitaya::Server>& removed) override;
+
+    static uint64_t Hash(const std::string& str);
+
+private:
+    struct Point
+    {
+        uint64_t hash;
+        uint32_t server;
+    };
+
+    struct Ring
+    {
+        std::vector<pitaya::Server> servers;
+        // Sorted by hash, then by server id, so points with the same hash are in the same
+        // order whatever the order in which their servers were added.
+        std::vector<Point> points;
+    };
+
+    using Rings = std::unordered_map<std::string, std::shared_ptr<const Ring>>;
+
+    // Returns the ring with the servers removed and added, or null when no server is left.
+    std::shared_ptr<const Ring> Rebuild(const std::shared_ptr<const Ring>& current,
+                                        const std::vector<const pitaya::Server*>& added,
+                                        const std::vector<const pitaya::Server*>& removed) const;
+
+private:
+    const size_t _numVirtualNodes;
+    utils::Snapshot<Rings> _rings;
+};
+
+} // namespace pitaya
+
+#endif // PITAYA_CONSISTENT_HASH_RING_H
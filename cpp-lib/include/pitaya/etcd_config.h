@@ -1,6 +1,8 @@
 #ifndef PITAYA_ETCD_CONFIG_H
 #define PITAYA_ETCD_CONFIG_H
 
+#include "pitaya/load_balancer.h"
+
 #include <chrono>
 #include <string>
 #include <vector>
@@ -23,6 +25,9 @@ struct EtcdServiceDiscoveryConfig
     // Delay used on the exponential backoff retry (given in
     // milliseconds).
     int32_t retryDelayMilliseconds;
+    // How the cluster chooses the server of a route based RPC among the servers
+    // of its type.
+    LoadBalancingStrategy loadBalancing;
 
     EtcdServiceDiscoveryConfig()
         : heartbeatTTLSec(std::chrono::seconds(60))
@@ -32,6 +37,7 @@ struct EtcdServiceDiscoveryConfig
         , syncServersIntervalSec(std::chrono::seconds(60))
         , maxNumberOfRetries(10)
         , retryDelayMilliseconds(100)
+        , loadBalancing(LoadBalancingStrategy::Random)
     {}
 };
 
@@ -12,13 +12,27 @@ struct GrpcConfig
     int32_t port;
     std::chrono::milliseconds serverShutdownDeadline;
     int32_t serverMaxNumberOfRpcs;
+    // Number of threads polling the completion queues of the server.
+    // Zero means one thread per hardware thread.
+    int32_t serverNumThreads;
+    // Gives each server thread its own queue of received RPCs. Threads calling
+    // Cluster::WaitForRpc take RPCs from one queue and steal from the others when it is empty.
+    bool serverShardedDispatch;
+    // Pins each server thread to a core. Only supported on linux.
+    bool serverPinThreads;
     std::chrono::milliseconds clientRpcTimeout;
+    // Number of threads polling the completion queues of asynchronous client calls.
+    int32_t clientNumCompletionQueueThreads;
 
     GrpcConfig()
         : port(0)
         , serverShutdownDeadline(5)
         , serverMaxNumberOfRpcs(-1)
+        , serverNumThreads(0)
+        , serverShardedDispatch(false)
+        , serverPinThreads(false)
         , clientRpcTimeout(60000)
+        , clientNumCompletionQueueThreads(1)
     {}
 };
 
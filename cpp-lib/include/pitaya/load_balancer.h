@@ -0,0 +1,82 @@
+#ifndef PITAYA_LOAD_BALANCER_H
+#define PITAYA_LOAD_BALANCER_H
+
+#include "pitaya.h"
+#include "pitaya/consistent_hash_ring.h"
+#include "pitaya/protos/request.pb.h"
+#include "pitaya/service_discovery.h"
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace pitaya {
+
+enum class LoadBalancingStrategy
+{
+    // Picks a random server.
+    Random,
+    // Picks every server in turn.
+    RoundRobin,
+    // Picks two random servers and uses the one with fewer RPCs in flight, or the one
+    // with the lowest latency when both have the same number of RPCs in flight.
+    PowerOfTwoChoices,
+    // Picks the server that owns the uid of the session of the request on a consistent
+    // hash ring (see ConsistentHashRing), so the requests of a user go to the same server
+    // while the servers do not change. Requests without a session uid go to a random server.
+    // The ring is the one used by Cluster::RPCByKey.
+    ConsistentHash,
+};
+
+//
+// Chooses the server of a given type that receives a route based RPC.
+// The cluster registers the load balancer as a service discovery listener and reports
+// every RPC it sends to it, so that implementations can keep per server state.
+// Every method can be called concurrently.
+//
+class LoadBalancer : public service_discovery::Listener
+{
+public:
+    // `servers` is never empty and every server in it has the same type.
+    virtual pitaya::Server Pick(const std::vector<pitaya::Server>& servers,
+                                const protos::Request& req) = 0;
+
+    // The consistent hash ring kept by the load balancer, if any. The cluster uses it for
+    // Cluster::RPCByKey instead of keeping a ring of its own.
+    virtual std::shared_ptr<ConsistentHashRing> HashRing() const { return nullptr; }
+
+    // State the load balancer keeps for an RPC in flight, null when it keeps none. The
+    // cluster gives the token returned by RpcStarted back to RpcFinished, so implementations
+    // only count as finished the RPCs they counted as started.
+    using RpcToken = std::shared_ptr<void>;
+
+    virtual RpcToken RpcStarted(const std::string& serverId)
+    {
+        (void)serverId;
+        return nullptr;
+    }
+    virtual void RpcFinished(const std::string& serverId,
+                             std::chrono::nanoseconds latency,
+                             const RpcToken& token)
+    {
+        (void)serverId;
+        (void)latency;
+        (void)token;
+    }
+
+    void ServerAdded(const pitaya::Server& server) override { (void)server; }
+    void ServerRemoved(const pitaya::Server& server) override { (void)server; }
+    void ServersChanged(const std::vector<pitaya::Server>& added,
+                        const std::vector<pitaya::Server>& removed) override
+    {
+        (void)added;
+        (void)removed;
+    }
+};
+
+std::shared_ptr<LoadBalancer> CreateLoadBalancer(LoadBalancingStrategy strategy);
+
+} // namespace pitaya
+
+#endif // PITAYA_LOAD_BALANCER_H
@@ -3,11 +3,16 @@
 
 #include "pitaya.h"
 #include "pitaya/nats_config.h"
+#include "pitaya/utils/pending_requests.h"
+#include "pitaya/utils/ticker.h"
 
 #include "spdlog/logger.h"
 
+#include <atomic>
 #include <chrono>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <nats.h>
 #include <unordered_map>
 #include <vector>
@@ -51,20 +56,67 @@ enum class NatsApiType
     Asynchronous,
 };
 
+using RequestCallback = std::function<void(natsStatus, std::shared_ptr<NatsMsg>)>;
+
 class NatsClient
 {
 public:
     virtual ~NatsClient() = default;
 
+    // The data is copied by the client before these functions return, so it can live in a
+    // buffer that is reused right after.
     virtual natsStatus Request(std::shared_ptr<NatsMsg>* natsMsg,
                                const std::string& topic,
-                               const std::vector<uint8_t>& data,
+                               const uint8_t* data,
+                               size_t size,
                                std::chrono::milliseconds timeout) = 0;
 
+    // Publishes the request and returns right away. The callback is called exactly once,
+    // either with the reply or with NATS_TIMEOUT if no reply arrives before the timeout.
+    // If the returned status is not NATS_OK the callback is never called, and the caller
+    // reports the error itself. A request that times out while its publish fails is
+    // reported through the callback only, and NATS_OK is returned.
+    virtual natsStatus RequestAsync(const std::string& topic,
+                                    const uint8_t* data,
+                                    size_t size,
+                                    std::chrono::milliseconds timeout,
+                                    RequestCallback callback) = 0;
+
     virtual natsStatus Subscribe(const std::string& topic,
                                  std::function<void(std::shared_ptr<NatsMsg>)> onMessage) = 0;
 
-    virtual natsStatus Publish(const char* reply, const std::vector<uint8_t>& buf) = 0;
+    // Subscribes as a member of the queue group `queue`. Each message of the topic is
+    // delivered to a single member of the group.
+    virtual natsStatus QueueSubscribe(const std::string& topic,
+                                      const std::string& queue,
+                                      std::function<void(std::shared_ptr<NatsMsg>)> onMessage) = 0;
+
+    virtual natsStatus Publish(const char* reply, const uint8_t* data, size_t size) = 0;
+
+    // Drains the subscriptions made with Subscribe and QueueSubscribe, waiting for their
+    // callbacks to finish, and removes them. The connection is left open.
+    virtual void DrainSubscriptions() {}
+
+    natsStatus Request(std::shared_ptr<NatsMsg>* natsMsg,
+                       const std::string& topic,
+                       const std::vector<uint8_t>& data,
+                       std::chrono::milliseconds timeout)
+    {
+        return Request(natsMsg, topic, data.data(), data.size(), timeout);
+    }
+
+    natsStatus RequestAsync(const std::string& topic,
+                            const std::vector<uint8_t>& data,
+                            std::chrono::milliseconds timeout,
+                            RequestCallback callback)
+    {
+        return RequestAsync(topic, data.data(), data.size(), timeout, std::move(callback));
+    }
+
+    natsStatus Publish(const char* reply, const std::vector<uint8_t>& buf)
+    {
+        return Publish(reply, buf.data(), buf.size());
+    }
 };
 
 class NatsClientImpl : public NatsClient
@@ -73,15 +125,32 @@ public:
     NatsClientImpl(NatsApiType apiType, const NatsConfig& opts, const char* loggerName = nullptr);
     ~NatsClientImpl();
 
+    using NatsClient::Publish;
+    using NatsClient::Request;
+    using NatsClient::RequestAsync;
+
     natsStatus Request(std::shared_ptr<NatsMsg>* natsMsg,
                        const std::string& topic,
-                       const std::vector<uint8_t>& data,
+                       const uint8_t* data,
+                       size_t size,
                        std::chrono::milliseconds timeout) override;
 
+    natsStatus RequestAsync(const std::string& topic,
+                            const uint8_t* data,
+                            size_t size,
+                            std::chrono::milliseconds timeout,
+                            RequestCallback callback) override;
+
     natsStatus Subscribe(const std::string& topic,
                          std::function<void(std::shared_ptr<NatsMsg>)> onMessage) override;
 
-    natsStatus Publish(const char* reply, const std::vector<uint8_t>& buf) override;
+    natsStatus QueueSubscribe(const std::string& topic,
+                              const std::string& queue,
+                              std::function<void(std::shared_ptr<NatsMsg>)> onMessage) override;
+
+    natsStatus Publish(const char* reply, const uint8_t* data, size_t size) override;
+
+    void DrainSubscriptions() override;
 
 private:
     static void DisconnectedCb(natsConnection* nc, void* user);
@@ -92,11 +161,17 @@ private:
                            natsStatus err,
                            void* user);
     static void HandleMsg(natsConnection* nc, natsSubscription* sub, natsMsg* msg, void* user);
+    static void HandleReply(natsConnection* nc, natsSubscription* sub, natsMsg* msg, void* user);
+
+    natsStatus SubscribeToReplies();
+    void ExpirePendingRequests();
+    // Drains the subscription, waiting for its callbacks to finish, and destroys it.
+    void DrainSubscription(natsSubscription* sub);
 
 private:
     struct SubscriptionHandler
     {
-        natsSubscription* natsSubscription = nullptr;
+        natsSubscription* sub = nullptr;
         std::function<void(std::shared_ptr<NatsMsg>)> onMessage;
     };
 
@@ -105,9 +180,21 @@ private:
     std::chrono::milliseconds _subscriptionDrainTimeout;
     natsOptions* _opts;
     natsConnection* _conn;
-    natsSubscription* _sub;
-    std::function<void(std::shared_ptr<NatsMsg>)> _onMessage;
+    // Every subscription is delivered on its own thread, unless the config sets a message
+    // delivery pool.
+    std::mutex _subscriptionsMutex;
+    std::vector<std::unique_ptr<SubscriptionHandler>> _subscriptions;
     bool _connClosed;
+
+    // Asynchronous requests share a single wildcard subscription on the inbox prefix.
+    // Each request gets its own token appended to the prefix, which is used to find the
+    // pending request when the reply arrives.
+    std::once_flag _replySubOnce;
+    natsStatus _replySubStatus;
+    natsSubscription* _replySub;
+    std::string _replyPrefix;
+    utils::PendingRequests<RequestCallback> _pendingRequests;
+    std::unique_ptr<utils::Ticker> _requestTimeoutTicker;
 };
 
 } // namespace pitaya
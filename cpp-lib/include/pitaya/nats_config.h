@@ -19,6 +19,25 @@ struct NatsConfig
     int maxPendingMsgs;
     int reconnectWait;
     int reconnectBufSize;
+    // Publishes pushes and kicks without waiting for the receiving server to acknowledge
+    // them. Errors are then only reported when the message could not be published.
+    bool publishPushesWithoutAck;
+    // Number of connections to the NATS server. Publishes and requests are spread over
+    // them by topic.
+    int numConnections;
+    // Gives the subscriptions a connection of their own, apart from the ones above.
+    bool dedicatedSubscriptionConnection;
+    // Number of subscriptions of the rpc server to its topic. They share a queue group, so
+    // every RPC goes to one of them and they are decoded on as many threads.
+    int serverNumSubscriptions;
+    // Also subscribes the rpc server to the topic of its server type, in a queue group
+    // shared with the other servers of the type, and makes the rpc client send the RPCs by
+    // route to that topic. NATS then balances them among the servers of the type instead of
+    // the load balancer. Every server of the cluster must use the same value.
+    bool serverQueueGroupByType;
+    // Size of the thread pool delivering the messages of every subscription of the
+    // process. Zero gives every subscription a thread of its own.
+    int messageDeliveryPoolSize;
 
     NatsConfig(const std::string& addr,
                std::chrono::milliseconds requestTimeout,
@@ -38,6 +57,12 @@ struct NatsConfig
         , maxPendingMsgs(maxPendingMsgs)
         , reconnectWait(reconnectWait)
         , reconnectBufSize(reconnectBufSize)
+        , publishPushesWithoutAck(false)
+        , numConnections(1)
+        , dedicatedSubscriptionConnection(false)
+        , serverNumSubscriptions(1)
+        , serverQueueGroupByType(false)
+        , messageDeliveryPoolSize(0)
     {}
 
     NatsConfig()
@@ -49,6 +74,12 @@ struct NatsConfig
         , maxPendingMsgs(100)
         , reconnectWait(2000)
         , reconnectBufSize(4*1024*1024) // 4mb
+        , publishPushesWithoutAck(false)
+        , numConnections(1)
+        , dedicatedSubscriptionConnection(false)
+        , serverNumSubscriptions(1)
+        , serverQueueGroupByType(false)
+        , messageDeliveryPoolSize(0)
     {}
 };
 
@@ -0,0 +1,72 @@
+#ifndef PITAYA_NATS_CONNECTION_POOL_H
+#define PITAYA_NATS_CONNECTION_POOL_H
+
+#include "pitaya/nats_client.h"
+#include "pitaya/nats_config.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pitaya {
+
+//
+// NatsClient spreading the traffic over several connections, each one with its own socket
+// and its own nats threads. Publishes and requests are sharded by the hash of their topic,
+// so messages on the same topic keep their order. Subscriptions can be given a connection
+// of their own, so that a slow consumer does not hold back the publishes.
+//
+class NatsConnectionPool : public NatsClient
+{
+public:
+    // `subscriber` receives the subscriptions. When it is null, they are sharded like the
+    // publishes.
+    NatsConnectionPool(std::vector<std::unique_ptr<NatsClient>> connections,
+                       std::unique_ptr<NatsClient> subscriber = nullptr);
+    ~NatsConnectionPool();
+
+    using NatsClient::Publish;
+    using NatsClient::Request;
+    using NatsClient::RequestAsync;
+
+    natsStatus Request(std::shared_ptr<NatsMsg>* natsMsg,
+                       const std::string& topic,
+                       const uint8_t* data,
+                       size_t size,
+                       std::chrono::milliseconds timeout) override;
+
+    natsStatus RequestAsync(const std::string& topic,
+                            const uint8_t* data,
+                            size_t size,
+                            std::chrono::milliseconds timeout,
+                            RequestCallback callback) override;
+
+    natsStatus Subscribe(const std::string& topic,
+                         std::function<void(std::shared_ptr<NatsMsg>)> onMessage) override;
+
+    natsStatus QueueSubscribe(const std::string& topic,
+                              const std::string& queue,
+                              std::function<void(std::shared_ptr<NatsMsg>)> onMessage) override;
+
+    natsStatus Publish(const char* reply, const uint8_t* data, size_t size) override;
+
+    void DrainSubscriptions() override;
+
+private:
+    NatsClient& ConnectionForTopic(std::string_view topic);
+
+private:
+    std::vector<std::unique_ptr<NatsClient>> _connections;
+    std::unique_ptr<NatsClient> _subscriber;
+};
+
+// Creates a single connection, or a pool when the config asks for more than one
+// connection or for a dedicated subscription connection.
+std::unique_ptr<NatsClient> CreateNatsClient(NatsApiType apiType,
+                                             const NatsConfig& config,
+                                             const char* loggerName = nullptr);
+
+} // namespace pitaya
+
+#endif // PITAYA_NATS_CONNECTION_POOL_H
@@ -2,26 +2,76 @@
 #define PITAYA_RPC_CLIENT_H
 
 #include "pitaya.h"
+#include "pitaya/constants.h"
 #include "pitaya/protos/kick.pb.h"
 #include "pitaya/protos/push.pb.h"
 #include "pitaya/protos/request.pb.h"
 #include "pitaya/protos/response.pb.h"
 
 #include <boost/optional.hpp>
+#include <functional>
+#include <string>
+#include <vector>
 
 namespace pitaya {
 
+using CallCallback = std::function<void(protos::Response)>;
+
 class RpcClient
 {
 public:
     virtual ~RpcClient() = default;
     virtual protos::Response Call(const pitaya::Server& target, const protos::Request& req) = 0;
+    // Sends the request without blocking the calling thread. The callback is called exactly
+    // once with the response, or with an error response, usually from a thread owned
+    // by the client.
+    virtual void CallAsync(const pitaya::Server& target,
+                           const protos::Request& req,
+                           CallCallback callback) = 0;
+
+    // Whether the client can call a server type, leaving the choice of the server to the
+    // transport (e.g. a NATS queue group) instead of the load balancer.
+    virtual bool CallsServerTypes() const { return false; }
+
+    // Calls one of the servers of the type. Only used when CallsServerTypes returns true.
+    virtual protos::Response CallServerType(const std::string& serverType,
+                                            const protos::Request& req)
+    {
+        (void)req;
+        protos::Response res;
+        auto err = res.mutable_error();
+        err->set_code(constants::kCodeInternalError);
+        err->set_msg("the rpc client cannot call the server type " + serverType);
+        return res;
+    }
+
+    virtual void CallServerTypeAsync(const std::string& serverType,
+                                     const protos::Request& req,
+                                     CallCallback callback)
+    {
+        callback(CallServerType(serverType, req));
+    }
+
     virtual boost::optional<PitayaError> SendPushToUser(const std::string& serverId,
                                                         const std::string& serverType,
                                                         const protos::Push& push) = 0;
     virtual boost::optional<PitayaError> SendKickToUser(const std::string& serverId,
                                                         const std::string& serverType,
                                                         const protos::KickMsg& kick) = 0;
+
+    // Sends every push to its user on a server of the given type. Clients that can should
+    // send them without waiting for each one to be acknowledged. Returns the first error.
+    virtual boost::optional<PitayaError> SendPushesToUsers(const std::string& serverType,
+                                                           const std::vector<protos::Push>& pushes)
+    {
+        for (const auto& push : pushes) {
+            auto error = SendPushToUser("", serverType, push);
+            if (error) {
+                return error;
+            }
+        }
+        return boost::none;
+    }
 };
 
 } // namespace pitaya
@@ -14,6 +14,10 @@ public:
     virtual void Start(pitaya::RpcHandlerFunc handler) = 0;
 
     virtual void Shutdown() = 0;
+
+    // Number of queues the received RPCs are spread over before being picked up by
+    // Cluster::WaitForRpc. Usually one per thread of the server that calls the handler.
+    virtual size_t NumDispatchShards() const { return 1; }
 };
 
 } // namespace pitaya
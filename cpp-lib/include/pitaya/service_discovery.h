@@ -6,6 +6,7 @@
 #include <boost/optional.hpp>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace pitaya {
 namespace service_discovery {
@@ -17,6 +18,21 @@ public:
 
     virtual void ServerAdded(const pitaya::Server& server) = 0;
     virtual void ServerRemoved(const pitaya::Server& server) = 0;
+
+    // Called once for every batch of changes. The removed servers are applied before the
+    // added ones, so a server that was replaced appears in both lists. Override it to
+    // update state that is expensive to rebuild only once per batch; by default every
+    // server is reported to ServerRemoved and ServerAdded.
+    virtual void ServersChanged(const std::vector<pitaya::Server>& added,
+                                const std::vector<pitaya::Server>& removed)
+    {
+        for (const auto& server : removed) {
+            ServerRemoved(server);
+        }
+        for (const auto& server : added) {
+            ServerAdded(server);
+        }
+    }
 };
 
 class ServiceDiscovery
@@ -26,6 +42,14 @@ public:
 
     virtual boost::optional<pitaya::Server> GetServerById(const std::string& id) = 0;
     virtual std::vector<pitaya::Server> GetServersByType(const std::string& type) = 0;
+
+    // Returns the servers of the given type without copying them. The list is immutable,
+    // later changes are only seen by calling the method again.
+    virtual std::shared_ptr<const std::vector<pitaya::Server>> GetServerListByType(
+        const std::string& type)
+    {
+        return std::make_shared<const std::vector<pitaya::Server>>(GetServersByType(type));
+    }
     virtual void AddListener(Listener* listener) = 0;
     virtual void RemoveListener(service_discovery::Listener* listener) = 0;
 };
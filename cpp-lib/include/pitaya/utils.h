@@ -5,8 +5,11 @@
 
 #include "spdlog/logger.h"
 
+#include <random>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 namespace pitaya {
 namespace utils {
@@ -17,7 +20,12 @@ std::string GetUserMessagesTopic(const std::string& userId, const std::string& s
 
 std::string GetTopicForServer(const std::string& serverId, const std::string& serverType);
 
-Server RandomServer(const std::vector<Server>& vec);
+std::string GetTopicForServerType(const std::string& serverType);
+
+// Random engine of the calling thread, seeded on first use.
+std::mt19937& RandomEngine();
+
+const Server& RandomServer(const std::vector<Server>& vec);
 
 bool ParseEtcdKey(const std::string& key,
                   const std::string& etcdPrefix,
@@ -25,6 +33,15 @@ bool ParseEtcdKey(const std::string& key,
                   std::string& serverType,
                   std::string& serverId);
 
+// Serializes the pairs as a json object with string values.
+std::string JsonObjectFromPairs(const std::vector<std::pair<std::string, std::string>>& pairs);
+
+// Merges two serialized json objects without decoding their values. The members of `first`
+// whose keys are in `second` are replaced by the ones of `second`, which come last, so merging
+// the same `second` again leaves the result unchanged.
+// Returns false if any of them is not a json object.
+bool MergeJsonObjects(const std::string& first, const std::string& second, std::string& merged);
+
 std::shared_ptr<spdlog::logger> CloneLoggerOrCreate(const char* loggerNameToClone,
                                                     const char* loggerName);
 
@@ -50,6 +67,27 @@ inline void SetThreadName(const char* name, std::shared_ptr<spdlog::logger> log)
 #endif
 }
 
+// `log` can be null.
+inline void SetThreadAffinity(unsigned cpu, std::shared_ptr<spdlog::logger> log)
+{
+#ifdef linux
+    if (log) {
+        log->debug("Pinning thread to cpu {}", cpu);
+    }
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu % CPU_SETSIZE, &cpuSet);
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+    if (log && res) {
+        log->error("Failed to pin thread to cpu {}", cpu);
+    }
+#else
+    if (log) {
+        log->warn("Not pinning thread to cpu {}, only implemented on linux", cpu);
+    }
+#endif
+}
+
 } // namespace utils
 } // namespace pitaya
 
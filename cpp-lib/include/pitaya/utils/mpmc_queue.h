@@ -0,0 +1,250 @@
+#ifndef PITAYA_UTILS_MPMC_QUEUE_H
+#define PITAYA_UTILS_MPMC_QUEUE_H
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace pitaya {
+namespace utils {
+
+//
+// Bounded multi-producer multi-consumer queue (D. Vyukov's ring buffer).
+// TryPush and TryPop never take a lock. The blocking Push and Pop spin for a while
+// and then park on a condition variable. The mutex is only touched when a thread
+// actually parks, or when a thread has to wake up a parked one.
+//
+// Once the queue is closed, Push fails and Pop returns the remaining elements,
+// failing after the queue is empty.
+//
+template<typename T>
+class MpmcQueue
+{
+public:
+    explicit MpmcQueue(size_t capacity)
+        : _mask(RoundUpToPowerOfTwo(capacity) - 1)
+        , _cells(new Cell[_mask + 1])
+        , _enqueuePos(0)
+        , _dequeuePos(0)
+        , _closed(false)
+        , _numParkedConsumers(0)
+        , _numParkedProducers(0)
+    {
+        for (size_t i = 0; i <= _mask; ++i) {
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t Capacity() const { return _mask + 1; }
+
+    bool TryPush(T&& value)
+    {
+        if (!Enqueue(value)) {
+            return false;
+        }
+        WakeUp(_numParkedConsumers, _notEmpty);
+        return true;
+    }
+
+    bool TryPop(T& value)
+    {
+        if (!Dequeue(value)) {
+            return false;
+        }
+        WakeUp(_numParkedProducers, _notFull);
+        return true;
+    }
+
+    // Waits until there is room in the queue. Returns false if the queue is closed.
+    bool Push(T value)
+    {
+        bool pushed = Wait(_numParkedProducers, _notFull, [&]() {
+            if (_closed.load(std::memory_order_acquire)) {
+                return Outcome::Failed;
+            }
+            return Enqueue(value) ? Outcome::Done : Outcome::Retry;
+        });
+        if (pushed) {
+            WakeUp(_numParkedConsumers, _notEmpty);
+        }
+        return pushed;
+    }
+
+    // Waits until there is an element in the queue. Returns false if the queue
+    // is closed and there are no more elements.
+    bool Pop(T& value)
+    {
+        bool popped = Wait(_numParkedConsumers, _notEmpty, [&]() {
+            if (Dequeue(value)) {
+                return Outcome::Done;
+            }
+            return _closed.load(std::memory_order_acquire) ? Outcome::Failed : Outcome::Retry;
+        });
+        if (popped) {
+            WakeUp(_numParkedProducers, _notFull);
+        }
+        return popped;
+    }
+
+    // Wakes up every waiting thread. Elements already in the queue can still be popped.
+    void Close()
+    {
+        std::lock_guard<decltype(_parkMutex)> lock(_parkMutex);
+        _closed.store(true, std::memory_order_seq_cst);
+        _notEmpty.notify_all();
+        _notFull.notify_all();
+    }
+
+    // Allows the queue to be used again after being closed.
+    void Reopen()
+    {
+        std::lock_guard<decltype(_parkMutex)> lock(_parkMutex);
+        _closed.store(false, std::memory_order_seq_cst);
+    }
+
+    bool IsClosed() const { return _closed.load(std::memory_order_acquire); }
+
+    MpmcQueue& operator=(const MpmcQueue&) = delete;
+    MpmcQueue(const MpmcQueue&) = delete;
+
+private:
+    static constexpr size_t kCacheLineSize = 64;
+    static constexpr int kNumSpins = 64;
+
+    enum class Outcome
+    {
+        Done,
+        Failed,
+        Retry,
+    };
+
+    struct alignas(kCacheLineSize) Cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    // Moves from `value` only if the element was enqueued.
+    bool Enqueue(T& value)
+    {
+        Cell* cell;
+        size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &_cells[pos & _mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Full
+                return false;
+            } else {
+                pos = _enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->data = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Dequeue(T& value)
+    {
+        Cell* cell;
+        size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &_cells[pos & _mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Empty
+                return false;
+            } else {
+                pos = _dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        value = std::move(cell->data);
+        cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    // The sequence numbers can't tell a full ring from an empty one with a single cell,
+    // therefore the capacity is at least two.
+    static size_t RoundUpToPowerOfTwo(size_t n)
+    {
+        assert(n > 0);
+        size_t power = 2;
+        while (power < n) {
+            power <<= 1;
+        }
+        return power;
+    }
+
+    template<typename Fn>
+    bool Wait(std::atomic<int>& numParked, std::condition_variable& cv, Fn attempt)
+    {
+        for (int i = 0; i < kNumSpins; ++i) {
+            auto outcome = attempt();
+            if (outcome != Outcome::Retry) {
+                return outcome == Outcome::Done;
+            }
+            std::this_thread::yield();
+        }
+
+        std::unique_lock<decltype(_parkMutex)> lock(_parkMutex);
+        numParked.fetch_add(1, std::memory_order_seq_cst);
+        // Pairs with the fence in WakeUp: either the other side sees that we are parked,
+        // or we see the change it made before it looked.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (;;) {
+            auto outcome = attempt();
+            if (outcome != Outcome::Retry) {
+                numParked.fetch_sub(1, std::memory_order_relaxed);
+                return outcome == Outcome::Done;
+            }
+            cv.wait(lock);
+        }
+    }
+
+    void WakeUp(std::atomic<int>& numParked, std::condition_variable& cv)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (numParked.load(std::memory_order_relaxed) > 0) {
+            // Taking the lock guarantees that the parked thread is already waiting
+            // on the condition variable.
+            std::lock_guard<decltype(_parkMutex)> lock(_parkMutex);
+            cv.notify_one();
+        }
+    }
+
+private:
+    const size_t _mask;
+    std::unique_ptr<Cell[]> _cells;
+
+    alignas(kCacheLineSize) std::atomic<size_t> _enqueuePos;
+    alignas(kCacheLineSize) std::atomic<size_t> _dequeuePos;
+    alignas(kCacheLineSize) std::atomic_bool _closed;
+
+    std::atomic<int> _numParkedConsumers;
+    std::atomic<int> _numParkedProducers;
+    std::mutex _parkMutex;
+    std::condition_variable _notEmpty;
+    std::condition_variable _notFull;
+};
+
+} // namespace utils
+} // namespace pitaya
+
+#endif // PITAYA_UTILS_MPMC_QUEUE_H
@@ -0,0 +1,126 @@
+#ifndef PITAYA_UTILS_PENDING_REQUESTS_H
+#define PITAYA_UTILS_PENDING_REQUESTS_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+namespace pitaya {
+namespace utils {
+
+//
+// Callbacks of requests waiting for a reply, by token. Each request is taken out exactly
+// once: by its reply with Take, or by TakeExpired once its deadline passes.
+//
+// The deadlines are kept in a min-heap, earliest first, so that expiring the requests does
+// not scan every pending one. Requests taken by their reply stay in the heap and are dropped
+// when their deadline passes.
+//
+template<typename Callback>
+class PendingRequests
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    PendingRequests()
+        : _nextToken(0)
+    {}
+
+    // Returns the token of the request.
+    uint64_t Add(Callback callback, Clock::time_point deadline)
+    {
+        std::lock_guard<decltype(_mutex)> lock(_mutex);
+        uint64_t token = _nextToken++;
+        _callbacks.emplace(token, std::move(callback));
+        _deadlines.push(Deadline{ deadline, token });
+        return token;
+    }
+
+    // Adds the request and sends it by calling `send` with its token, which returns whether
+    // sending succeeded. If it failed, the request is taken back and false is returned.
+    // A request may expire while it is being sent, though: its callback is then called by
+    // whoever took it, so true is returned and the caller must not report the failure.
+    template<typename Send>
+    bool AddAndSend(Callback callback, Clock::time_point deadline, Send send)
+    {
+        uint64_t token = Add(std::move(callback), deadline);
+        if (send(token)) {
+            return true;
+        }
+        return !Take(token);
+    }
+
+    // Returns an empty callback if the request was already taken.
+    Callback Take(uint64_t token)
+    {
+        std::lock_guard<decltype(_mutex)> lock(_mutex);
+        auto it = _callbacks.find(token);
+        if (it == _callbacks.end()) {
+            return Callback();
+        }
+        auto callback = std::move(it->second);
+        _callbacks.erase(it);
+        return callback;
+    }
+
+    // Takes the requests whose deadline is not after `now`, earliest first.
+    std::vector<Callback> TakeExpired(Clock::time_point now)
+    {
+        std::vector<Callback> expired;
+        std::lock_guard<decltype(_mutex)> lock(_mutex);
+        while (!_deadlines.empty() && _deadlines.top().deadline <= now) {
+            auto it = _callbacks.find(_deadlines.top().token);
+            _deadlines.pop();
+            if (it != _callbacks.end()) {
+                expired.push_back(std::move(it->second));
+                _callbacks.erase(it);
+            }
+        }
+        return expired;
+    }
+
+    std::vector<Callback> TakeAll()
+    {
+        std::vector<Callback> all;
+        std::lock_guard<decltype(_mutex)> lock(_mutex);
+        all.reserve(_callbacks.size());
+        for (auto& entry : _callbacks) {
+            all.push_back(std::move(entry.second));
+        }
+        _callbacks.clear();
+        _deadlines = decltype(_deadlines)();
+        return all;
+    }
+
+    size_t Size() const
+    {
+        std::lock_guard<decltype(_mutex)> lock(_mutex);
+        return _callbacks.size();
+    }
+
+    PendingRequests& operator=(const PendingRequests&) = delete;
+    PendingRequests(const PendingRequests&) = delete;
+
+private:
+    struct Deadline
+    {
+        Clock::time_point deadline;
+        uint64_t token;
+
+        bool operator>(const Deadline& other) const { return deadline > other.deadline; }
+    };
+
+    mutable std::mutex _mutex;
+    uint64_t _nextToken;
+    std::unordered_map<uint64_t, Callback> _callbacks;
+    std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> _deadlines;
+};
+
+} // namespace utils
+} // namespace pitaya
+
+#endif // PITAYA_UTILS_PENDING_REQUESTS_H
@@ -0,0 +1,129 @@
+#ifndef PITAYA_UTILS_ROUTE_CACHE_H
+#define PITAYA_UTILS_ROUTE_CACHE_H
+
+#include "pitaya.h"
+
+#include <atomic>
+#include <boost/optional.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace pitaya {
+namespace utils {
+
+//
+// Parsed routes by their string. Applications call a small set of routes over and over,
+// so every route is parsed once and later calls only look it up.
+//
+// Routes are cached as given, without lowercasing them: server types and the names of the
+// handlers and remotes registered by the servers are case sensitive (e.g. "roomHandler").
+//
+// The routes live in an open addressing table of atomic pointers that is sized for
+// `maxRoutes` routes and never rehashed. Lookups do not lock nor touch reference counts,
+// and cached routes are never evicted, so the references returned stay valid for the
+// lifetime of the cache. Once the cache holds `maxRoutes` routes, new ones are parsed on
+// every call instead.
+//
+class RouteCache
+{
+public:
+    explicit RouteCache(size_t maxRoutes = 1024)
+        : _maxRoutes(maxRoutes)
+        , _numSlots(NumSlots(maxRoutes))
+        , _slots(new std::atomic<const Entry*>[_numSlots])
+        , _numRoutes(0)
+    {
+        for (size_t i = 0; i < _numSlots; ++i) {
+            _slots[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~RouteCache()
+    {
+        for (size_t i = 0; i < _numSlots; ++i) {
+            delete _slots[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    RouteCache& operator=(const RouteCache&) = delete;
+    RouteCache(const RouteCache&) = delete;
+
+    // Throws PitayaException if the route is invalid. A route that does not fit in the
+    // cache is returned in a buffer of the calling thread, which is valid until the next
+    // call on the same thread.
+    const Route& Get(const std::string& routeStr)
+    {
+        size_t slot = std::hash<std::string>()(routeStr) & (_numSlots - 1);
+        // There is always a free slot, since the table holds at most half of its capacity.
+        for (auto entry = _slots[slot].load(std::memory_order_acquire); entry;
+             entry = _slots[slot].load(std::memory_order_acquire)) {
+            if (entry->key == routeStr) {
+                return entry->route;
+            }
+            slot = (slot + 1) & (_numSlots - 1);
+        }
+
+        std::string_view svType, handler, method;
+        if (!Route::Split(routeStr, svType, handler, method)) {
+            throw PitayaException("error parsing route");
+        }
+        Route route{ std::string(svType), std::string(handler), std::string(method) };
+
+        if (_numRoutes.load(std::memory_order_relaxed) < _maxRoutes &&
+            _numRoutes.fetch_add(1, std::memory_order_relaxed) < _maxRoutes) {
+            return Insert(slot, new Entry{ routeStr, std::move(route) });
+        }
+
+        thread_local boost::optional<Route> uncached;
+        uncached = std::move(route);
+        return uncached.value();
+    }
+
+private:
+    struct Entry
+    {
+        std::string key;
+        Route route;
+    };
+
+    static size_t NumSlots(size_t maxRoutes)
+    {
+        size_t numSlots = 1;
+        while (numSlots < maxRoutes * 2) {
+            numSlots *= 2;
+        }
+        return numSlots;
+    }
+
+    // Publishes the entry in the first free slot from `slot` on. When another thread
+    // published the same route first, its entry is returned instead.
+    const Route& Insert(size_t slot, const Entry* entry)
+    {
+        for (;;) {
+            const Entry* current = nullptr;
+            if (_slots[slot].compare_exchange_strong(
+                    current, entry, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                return entry->route;
+            }
+            if (current->key == entry->key) {
+                delete entry;
+                _numRoutes.fetch_sub(1, std::memory_order_relaxed);
+                return current->route;
+            }
+            slot = (slot + 1) & (_numSlots - 1);
+        }
+    }
+
+private:
+    const size_t _maxRoutes;
+    const size_t _numSlots;
+    std::unique_ptr<std::atomic<const Entry*>[]> _slots;
+    std::atomic_size_t _numRoutes;
+};
+
+} // namespace utils
+} // namespace pitaya
+
+#endif // PITAYA_UTILS_ROUTE_CACHE_H
@@ -0,0 +1,256 @@
+#ifndef PITAYA_UTILS_SHARDED_QUEUE_H
+#define PITAYA_UTILS_SHARDED_QUEUE_H
+
+#include "pitaya/utils/mpmc_queue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pitaya {
+namespace utils {
+
+//
+// Set of MpmcQueues (shards) with work stealing. Producers push into the shard they
+// choose, usually one per producer thread, so that producers on different cores do not
+// contend on the same positions of a single ring. Consumers pop from their home shard
+// first and steal from the other shards when it is empty.
+//
+// Consumers park on a single condition variable shared by every shard, producers
+// park on the shard that is full unless they use TryPush.
+//
+// Producers count themselves on their shard while they push, and Close waits for them
+// before consumers are told that the queue is closed. Therefore an element is either
+// refused or seen by the consumers' final drain.
+//
+// The number of shards and their capacity can be changed with Reopen while the queue is
+// closed. Shards are only ever created, never destroyed before the queue, so consumers still
+// draining a closed queue are safe.
+//
+template<typename T>
+class ShardedQueue
+{
+public:
+    ShardedQueue(size_t maxShards, size_t shardCapacity)
+        : _shardCapacity(shardCapacity)
+        , _shards(maxShards)
+        , _numShards(0)
+        , _numCreatedShards(0)
+        , _closing(false)
+        , _closed(false)
+        , _numParkedConsumers(0)
+    {
+        assert(maxShards > 0);
+        Reopen(1, shardCapacity);
+    }
+
+    size_t NumShards() const { return _numShards.load(std::memory_order_acquire); }
+
+    size_t MaxShards() const { return _shards.size(); }
+
+    size_t ShardCapacity() const { return _shardCapacity; }
+
+    // Waits until there is room in the shard. Returns false if the queue is closed.
+    bool Push(T value, size_t shard)
+    {
+        auto& s = *_shards[shard % NumShards()].load(std::memory_order_acquire);
+        if (!BeginPush(s)) {
+            return false;
+        }
+        bool pushed = s.queue.Push(std::move(value));
+        EndPush(s);
+        if (pushed) {
+            WakeUpConsumer();
+        }
+        return pushed;
+    }
+
+    // Pushes without waiting. Returns false, leaving `value` untouched, if the shard is full
+    // or the queue is closed.
+    bool TryPush(T& value, size_t shard)
+    {
+        auto& s = *_shards[shard % NumShards()].load(std::memory_order_acquire);
+        if (!BeginPush(s)) {
+            return false;
+        }
+        bool pushed = s.queue.TryPush(std::move(value));
+        EndPush(s);
+        if (pushed) {
+            WakeUpConsumer();
+        }
+        return pushed;
+    }
+
+    // Waits until there is an element in any of the shards, looking first at the home
+    // shard. Returns false if the queue is closed and there are no more elements.
+    bool Pop(T& value, size_t homeShard)
+    {
+        for (int i = 0; i < kNumSpins; ++i) {
+            if (TryPop(value, homeShard)) {
+                return true;
+            }
+            if (_closed.load(std::memory_order_acquire)) {
+                // Elements pushed before the close are visible now.
+                return TryPop(value, homeShard);
+            }
+            std::this_thread::yield();
+        }
+
+        std::unique_lock<decltype(_parkMutex)> lock(_parkMutex);
+        _numParkedConsumers.fetch_add(1, std::memory_order_seq_cst);
+        // Pairs with the fence in WakeUpConsumer.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for (;;) {
+            if (TryPop(value, homeShard)) {
+                _numParkedConsumers.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+            if (_closed.load(std::memory_order_acquire)) {
+                _numParkedConsumers.fetch_sub(1, std::memory_order_relaxed);
+                return TryPop(value, homeShard);
+            }
+            _notEmpty.wait(lock);
+        }
+    }
+
+    // Wakes up every waiting thread. Elements already in the queue can still be popped.
+    // Waits for the pushes that already started, so it must not be called by a producer.
+    void Close()
+    {
+        _closing.store(true, std::memory_order_seq_cst);
+        const size_t numCreated = _numCreatedShards.load(std::memory_order_acquire);
+        // Wakes up the producers waiting for room, their pushes fail.
+        for (size_t i = 0; i < numCreated; ++i) {
+            _shards[i].load(std::memory_order_acquire)->queue.Close();
+        }
+        for (size_t i = 0; i < numCreated; ++i) {
+            auto& shard = *_shards[i].load(std::memory_order_acquire);
+            while (shard.numPushing.load(std::memory_order_acquire) > 0) {
+                std::this_thread::yield();
+            }
+        }
+
+        std::lock_guard<decltype(_parkMutex)> lock(_parkMutex);
+        _closed.store(true, std::memory_order_seq_cst);
+        _notEmpty.notify_all();
+    }
+
+    // Allows the queue to be used again, with the given number of shards. The number of
+    // shards is capped to MaxShards.
+    void Reopen(size_t numShards) { Reopen(numShards, _shardCapacity); }
+
+    // Same, changing the capacity of the shards. When it changes, every shard is replaced
+    // and the elements left in the old ones are dropped.
+    void Reopen(size_t numShards, size_t shardCapacity)
+    {
+        std::lock_guard<decltype(_parkMutex)> lock(_parkMutex);
+        numShards = std::max<size_t>(1, std::min(numShards, _shards.size()));
+        size_t numCreated = _numCreatedShards.load(std::memory_order_relaxed);
+        if (shardCapacity != _shardCapacity) {
+            // Consumers may still be looking at the old shards, so they are kept until the
+            // queue is destroyed.
+            _shardCapacity = shardCapacity;
+            numCreated = 0;
+        }
+        for (size_t i = 0; i < numCreated; ++i) {
+            _shards[i].load(std::memory_order_relaxed)->queue.Reopen();
+        }
+        for (; numCreated < numShards; ++numCreated) {
+            _ownedShards.emplace_back(new Shard(_shardCapacity));
+            _shards[numCreated].store(_ownedShards.back().get(), std::memory_order_release);
+        }
+        _numCreatedShards.store(numCreated, std::memory_order_release);
+        _numShards.store(numShards, std::memory_order_release);
+        _closed.store(false, std::memory_order_seq_cst);
+        _closing.store(false, std::memory_order_seq_cst);
+    }
+
+    // True once Close was called, pushes fail from then on.
+    bool IsClosed() const { return _closing.load(std::memory_order_acquire); }
+
+    ShardedQueue& operator=(const ShardedQueue&) = delete;
+    ShardedQueue(const ShardedQueue&) = delete;
+
+private:
+    static constexpr int kNumSpins = 64;
+    static constexpr size_t kCacheLineSize = 64;
+
+    struct Shard
+    {
+        explicit Shard(size_t capacity)
+            : queue(capacity)
+            , numPushing(0)
+        {}
+
+        MpmcQueue<T> queue;
+        // Producers of this shard that passed the check of _closing and did not finish
+        // their push yet.
+        alignas(kCacheLineSize) std::atomic<int> numPushing;
+    };
+
+    bool BeginPush(Shard& shard)
+    {
+        // Pairs with Close: either the producer sees _closing, or Close sees the producer.
+        shard.numPushing.fetch_add(1, std::memory_order_seq_cst);
+        if (_closing.load(std::memory_order_seq_cst)) {
+            EndPush(shard);
+            return false;
+        }
+        return true;
+    }
+
+    void EndPush(Shard& shard) { shard.numPushing.fetch_sub(1, std::memory_order_release); }
+
+    // Looks at every created shard, including the ones above the current number of
+    // shards, since they may still hold elements pushed before the last Reopen.
+    bool TryPop(T& value, size_t homeShard)
+    {
+        const size_t numCreated = _numCreatedShards.load(std::memory_order_acquire);
+        const size_t first = homeShard % numCreated;
+        for (size_t i = 0; i < numCreated; ++i) {
+            size_t shard = first + i;
+            if (shard >= numCreated) {
+                shard -= numCreated;
+            }
+            if (_shards[shard].load(std::memory_order_acquire)->queue.TryPop(value)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void WakeUpConsumer()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_numParkedConsumers.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<decltype(_parkMutex)> lock(_parkMutex);
+            _notEmpty.notify_one();
+        }
+    }
+
+private:
+    size_t _shardCapacity;
+    std::vector<std::atomic<Shard*>> _shards;
+    // Every shard ever created, including the ones replaced by Reopen.
+    std::vector<std::unique_ptr<Shard>> _ownedShards;
+    std::atomic<size_t> _numShards;
+    std::atomic<size_t> _numCreatedShards;
+    // Set first by Close, refuses new pushes.
+    std::atomic_bool _closing;
+    // Set once the pushes in flight finished, tells the consumers to stop after draining.
+    std::atomic_bool _closed;
+
+    std::atomic<int> _numParkedConsumers;
+    std::mutex _parkMutex;
+    std::condition_variable _notEmpty;
+};
+
+} // namespace utils
+} // namespace pitaya
+
+#endif // PITAYA_UTILS_SHARDED_QUEUE_H
@@ -0,0 +1,63 @@
+#ifndef PITAYA_UTILS_SNAPSHOT_H
+#define PITAYA_UTILS_SNAPSHOT_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+namespace pitaya {
+namespace utils {
+
+//
+// Holds an immutable value that is read far more often than it is written.
+// Readers grab a reference counted pointer to the current value without taking
+// the writers mutex, so they are not blocked by writers copying the value.
+// Writers copy the current value, modify the copy and publish it atomically.
+//
+// Note that std::atomic_load on a shared_ptr is not lock-free in libstdc++: it takes
+// a lock from a global pool for the duration of the pointer copy, and every reader
+// touches the reference count of the value.
+//
+template<typename T>
+class Snapshot
+{
+public:
+    Snapshot()
+        : _value(std::make_shared<const T>())
+    {}
+
+    explicit Snapshot(T value)
+        : _value(std::make_shared<const T>(std::move(value)))
+    {}
+
+    std::shared_ptr<const T> Load() const { return std::atomic_load(&_value); }
+
+    void Store(T value)
+    {
+        std::lock_guard<decltype(_writeMutex)> lock(_writeMutex);
+        std::atomic_store(&_value, std::shared_ptr<const T>(std::make_shared<T>(std::move(value))));
+    }
+
+    // Calls `fn` with a mutable copy of the current value and publishes the copy
+    // afterwards. Concurrent updates are serialized.
+    template<typename Fn>
+    void Update(Fn fn)
+    {
+        std::lock_guard<decltype(_writeMutex)> lock(_writeMutex);
+        auto copy = std::make_shared<T>(*std::atomic_load(&_value));
+        fn(*copy);
+        std::atomic_store(&_value, std::shared_ptr<const T>(std::move(copy)));
+    }
+
+    Snapshot& operator=(const Snapshot&) = delete;
+    Snapshot(const Snapshot&) = delete;
+
+private:
+    std::shared_ptr<const T> _value;
+    std::mutex _writeMutex;
+};
+
+} // namespace utils
+} // namespace pitaya
+
+#endif // PITAYA_UTILS_SNAPSHOT_H
@@ -3,6 +3,7 @@
 
 #include <deque>
 #include <mutex>
+#include <utility>
 
 namespace pitaya {
 namespace utils {
@@ -15,13 +16,13 @@ public:
     void lock() { _mutex.lock(); }
     void unlock() { _mutex.unlock(); }
 
-    void PushBack(T val) { _deque.push_back(val); }
+    void PushBack(T val) { _deque.push_back(std::move(val)); }
 
     void Clear() { _deque.clear(); }
 
     T PopFront()
     {
-        T val = _deque.front();
+        T val = std::move(_deque.front());
         _deque.pop_front();
         return val;
     }
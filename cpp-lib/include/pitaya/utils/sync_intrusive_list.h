@@ -0,0 +1,154 @@
+#ifndef PITAYA_UTILS_SYNC_INTRUSIVE_LIST_H
+#define PITAYA_UTILS_SYNC_INTRUSIVE_LIST_H
+
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+#include <mutex>
+
+namespace pitaya {
+namespace utils {
+
+template<typename T>
+class SyncIntrusiveList;
+
+// Base class for elements that can be inserted in a SyncIntrusiveList.
+// An element can be in at most one list at a time.
+template<typename T>
+class IntrusiveListNode
+{
+public:
+    bool IsLinked() const { return _linked; }
+
+private:
+    friend class SyncIntrusiveList<T>;
+
+    T* _prev = nullptr;
+    T* _next = nullptr;
+    bool _linked = false;
+};
+
+//
+// Doubly-linked list whose links live inside of the elements, therefore inserting and
+// removing an element is O(1) and never allocates. The list does not own the elements.
+//
+template<typename T>
+class SyncIntrusiveList
+{
+public:
+    class Iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T*;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T**;
+        using reference = T*;
+
+        explicit Iterator(T* node)
+            : _node(node)
+        {}
+
+        T* operator*() const { return _node; }
+
+        Iterator& operator++()
+        {
+            _node = Node(_node)->_next;
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const { return _node == other._node; }
+        bool operator!=(const Iterator& other) const { return _node != other._node; }
+
+    private:
+        T* _node;
+    };
+
+    SyncIntrusiveList()
+        : _head(nullptr)
+        , _tail(nullptr)
+        , _size(0)
+    {}
+
+    // BasicLockable interface for usage with std::lock_guard
+    void lock() { _mutex.lock(); }
+    void unlock() { _mutex.unlock(); }
+
+    void PushBack(T* el)
+    {
+        auto node = Node(el);
+        assert(!node->_linked);
+        node->_prev = _tail;
+        node->_next = nullptr;
+        node->_linked = true;
+        if (_tail) {
+            Node(_tail)->_next = el;
+        } else {
+            _head = el;
+        }
+        _tail = el;
+        ++_size;
+    }
+
+    // Removes the element from the list. Does nothing if the element is not linked.
+    void Erase(T* el)
+    {
+        auto node = Node(el);
+        if (!node->_linked) {
+            return;
+        }
+        if (node->_prev) {
+            Node(node->_prev)->_next = node->_next;
+        } else {
+            _head = node->_next;
+        }
+        if (node->_next) {
+            Node(node->_next)->_prev = node->_prev;
+        } else {
+            _tail = node->_prev;
+        }
+        node->_prev = nullptr;
+        node->_next = nullptr;
+        node->_linked = false;
+        --_size;
+    }
+
+    size_t Size() const { return _size; }
+
+    // Unlinks every element.
+    void Clear()
+    {
+        T* el = _head;
+        while (el) {
+            auto node = Node(el);
+            el = node->_next;
+            node->_prev = nullptr;
+            node->_next = nullptr;
+            node->_linked = false;
+        }
+        _head = nullptr;
+        _tail = nullptr;
+        _size = 0;
+    }
+
+    // Make type iterable with range-based for loop.
+    Iterator begin() { return Iterator(_head); }
+    Iterator end() { return Iterator(nullptr); }
+
+    SyncIntrusiveList& operator=(const SyncIntrusiveList&) = delete;
+    SyncIntrusiveList(const SyncIntrusiveList&) = delete;
+
+private:
+    static IntrusiveListNode<T>* Node(T* el) { return static_cast<IntrusiveListNode<T>*>(el); }
+
+private:
+    T* _head;
+    T* _tail;
+    size_t _size;
+    std::mutex _mutex;
+};
+
+} // namespace utils
+} // namespace pitaya
+
+#endif // PITAYA_UTILS_SYNC_INTRUSIVE_LIST_H
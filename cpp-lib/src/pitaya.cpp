@@ -1,39 +1,333 @@
 #include "pitaya.h"
 
-#include <boost/algorithm/string.hpp>
-#include <cpprest/json.h>
+#include "pitaya/constants.h"
+#include "pitaya/utils/json.h"
 
-namespace json = web::json;
+#include <algorithm>
+#include <mutex>
+#include <unordered_set>
+
+struct pitaya::Server::MetadataBody
+{
+    std::vector<MetadataEntry> entries;
+    // Metadata that could not be parsed, kept as it was given.
+    std::string raw;
+    std::string error;
+    // Positions of the well known entries, -1 when they are missing.
+    int grpcHost = -1;
+    int grpcPort = -1;
+
+    mutable std::once_flag serializeOnce;
+    mutable std::string json;
+
+    void IndexEntries()
+    {
+        grpcHost = grpcPort = -1;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (!entries[i].isString) {
+                continue;
+            }
+            if (entries[i].key == constants::kGrpcHostKey) {
+                grpcHost = static_cast<int>(i);
+            } else if (entries[i].key == constants::kGrpcPortKey) {
+                grpcPort = static_cast<int>(i);
+            }
+        }
+    }
+
+    void Set(MetadataEntry entry)
+    {
+        for (auto& e : entries) {
+            if (e.key == entry.key) {
+                e = std::move(entry);
+                return;
+            }
+        }
+        entries.push_back(std::move(entry));
+    }
+};
+
+struct pitaya::Server::Data
+{
+    std::string id;
+    const std::string* type;
+    std::string hostname;
+    bool frontend;
+    std::shared_ptr<const MetadataBody> metadata;
+};
+
+static const std::string kEmpty;
+
+// Returns a string with the same contents that lives until the program exits. Server
+// types are few and long lived, so they are never released.
+static const std::string*
+InternString(std::string str)
+{
+    static std::mutex mutex;
+    static std::unordered_set<std::string> strings;
+
+    std::lock_guard<decltype(mutex)> lock(mutex);
+    return &*strings.insert(std::move(str)).first;
+}
+
+pitaya::Server::Server(Kind kind, std::string id, std::string type, std::string hostname)
+    : _data(std::make_shared<Data>())
+{
+    _data->id = std::move(id);
+    _data->type = InternString(std::move(type));
+    _data->hostname = std::move(hostname);
+    _data->frontend = static_cast<int>(kind);
+}
+
+// The data is never changed once it is shared. A reference count of one does not prove that
+// it is not: use_count is a relaxed load, so the reads of a copy that another thread just
+// released may still race with the write. Every change goes to a fresh copy instead.
+pitaya::Server::Data&
+pitaya::Server::MutableData()
+{
+    if (_data) {
+        _data = std::make_shared<Data>(*_data);
+    } else {
+        _data = std::make_shared<Data>();
+        _data->type = &kEmpty;
+        _data->frontend = false;
+    }
+    return *_data;
+}
+
+const pitaya::Server::MetadataBody*
+pitaya::Server::MetadataPtr() const
+{
+    return _data ? _data->metadata.get() : nullptr;
+}
+
+const std::string&
+pitaya::Server::Id() const
+{
+    return _data ? _data->id : kEmpty;
+}
+
+const std::string&
+pitaya::Server::Type() const
+{
+    return _data ? *_data->type : kEmpty;
+}
+
+const std::string&
+pitaya::Server::Hostname() const
+{
+    return _data ? _data->hostname : kEmpty;
+}
+
+bool
+pitaya::Server::IsFrontend() const
+{
+    return _data && _data->frontend;
+}
+
+static const std::vector<pitaya::Server::MetadataEntry> kNoEntries;
+
+const std::string&
+pitaya::Server::Metadata() const
+{
+    auto metadata = MetadataPtr();
+    if (!metadata) {
+        return kEmpty;
+    }
+    if (!metadata->error.empty()) {
+        return metadata->raw;
+    }
+
+    std::call_once(metadata->serializeOnce, [metadata] {
+        auto& json = metadata->json;
+        json.push_back('{');
+        for (const auto& entry : metadata->entries) {
+            if (json.size() > 1) {
+                json.push_back(',');
+            }
+            utils::AppendJsonString(json, entry.key);
+            json.push_back(':');
+            if (entry.isString) {
+                utils::AppendJsonString(json, entry.value);
+            } else {
+                json += entry.value;
+            }
+        }
+        json.push_back('}');
+    });
+    return metadata->json;
+}
+
+bool
+pitaya::Server::HasMetadata() const
+{
+    return MetadataPtr() != nullptr;
+}
+
+const std::string&
+pitaya::Server::MetadataError() const
+{
+    auto metadata = MetadataPtr();
+    return metadata ? metadata->error : kEmpty;
+}
+
+const std::vector<pitaya::Server::MetadataEntry>&
+pitaya::Server::MetadataEntries() const
+{
+    auto metadata = MetadataPtr();
+    return metadata ? metadata->entries : kNoEntries;
+}
+
+const std::string*
+pitaya::Server::MetadataValue(const std::string& key) const
+{
+    for (const auto& entry : MetadataEntries()) {
+        if (entry.isString && entry.key == key) {
+            return &entry.value;
+        }
+    }
+    return nullptr;
+}
+
+const std::string&
+pitaya::Server::GrpcHost() const
+{
+    auto metadata = MetadataPtr();
+    return metadata && metadata->grpcHost >= 0 ? metadata->entries[metadata->grpcHost].value
+                                               : kEmpty;
+}
+
+const std::string&
+pitaya::Server::GrpcPort() const
+{
+    auto metadata = MetadataPtr();
+    return metadata && metadata->grpcPort >= 0 ? metadata->entries[metadata->grpcPort].value
+                                               : kEmpty;
+}
 
 pitaya::Server&
 pitaya::Server::WithMetadata(const std::string& key, const std::string& val)
 {
-    json::value metadataJson;
-    if (_metadata.empty()) {
-        metadataJson = json::value::object();
-    } else {
-        metadataJson = json::value::parse(_metadata);
+    auto metadata = MetadataPtr();
+    if (metadata && !metadata->error.empty()) {
+        throw PitayaException("Server metadata is not an object");
     }
 
-    if (!metadataJson.is_object()) {
-        throw new PitayaException("Server metadata is not an object");
+    // The body is shared with the copies of the server, so a new one is built.
+    auto body = std::make_shared<MetadataBody>();
+    if (metadata) {
+        body->entries = metadata->entries;
     }
+    body->Set(MetadataEntry{ key, val, true });
+    body->IndexEntries();
 
-    metadataJson[key] = json::value::string(val);
+    MutableData().metadata = std::move(body);
+    return *this;
+}
+
+pitaya::Server&
+pitaya::Server::WithRawMetadata(std::string metadata)
+{
+    using Type = utils::JsonReader::Type;
 
-    _metadata = metadataJson.serialize();
+    if (metadata.empty()) {
+        if (HasMetadata()) {
+            MutableData().metadata.reset();
+        }
+        return *this;
+    }
 
+    auto body = std::make_shared<MetadataBody>();
+    utils::JsonReader reader(metadata);
+    if (reader.Peek() != Type::Object) {
+        body->error = "metadata is not a json object";
+    } else {
+        std::string key;
+        reader.EnterObject();
+        while (reader.NextKey(key)) {
+            MetadataEntry entry{ std::move(key), "", reader.Peek() == Type::String };
+            if (entry.isString) {
+                reader.ReadString(entry.value);
+            } else {
+                std::string_view raw;
+                if (reader.SkipValue(&raw)) {
+                    utils::AppendCompactJson(entry.value, raw);
+                }
+            }
+            body->Set(std::move(entry));
+        }
+
+        if (reader.Failed()) {
+            body->error = reader.Error();
+        } else if (!reader.AtEnd()) {
+            body->error = "unexpected data after the object";
+        }
+    }
+
+    if (body->error.empty()) {
+        body->IndexEntries();
+    } else {
+        body->entries.clear();
+        body->raw = std::move(metadata);
+    }
+
+    MutableData().metadata = std::move(body);
     return *this;
 }
 
+bool
+pitaya::Server::operator==(const Server& sv) const
+{
+    if (_data == sv._data) {
+        return true;
+    }
+    if (Id() != sv.Id() || Type() != sv.Type() || Hostname() != sv.Hostname() ||
+        IsFrontend() != sv.IsFrontend()) {
+        return false;
+    }
+
+    auto metadata = MetadataPtr();
+    auto otherMetadata = sv.MetadataPtr();
+    if (metadata == otherMetadata) {
+        return true;
+    }
+    if (!metadata || !otherMetadata) {
+        return false;
+    }
+    return metadata->error == otherMetadata->error && metadata->raw == otherMetadata->raw &&
+           metadata->entries == otherMetadata->entries;
+}
+
 pitaya::Route::Route(const std::string& route_str)
 {
-    std::vector<std::string> strs;
-    boost::split(strs, route_str, boost::is_any_of("."));
-    if (strs.size() < 3) {
+    std::string_view svType, handler, method;
+    if (!Split(route_str, svType, handler, method)) {
         throw PitayaException("error parsing route");
     }
-    server_type = strs[0];
-    handler = strs[1];
-    method = strs[2];
-};
+    server_type.assign(svType);
+    this->handler.assign(handler);
+    this->method.assign(method);
+}
+
+bool
+pitaya::Route::Split(std::string_view route_str,
+                     std::string_view& sv_type,
+                     std::string_view& handler,
+                     std::string_view& method)
+{
+    auto typeEnd = route_str.find('.');
+    if (typeEnd == std::string_view::npos) {
+        return false;
+    }
+    auto handlerEnd = route_str.find('.', typeEnd + 1);
+    if (handlerEnd == std::string_view::npos) {
+        return false;
+    }
+    // Parts after the method are ignored.
+    auto methodEnd = std::min(route_str.find('.', handlerEnd + 1), route_str.size());
+
+    sv_type = route_str.substr(0, typeEnd);
+    handler = route_str.substr(typeEnd + 1, handlerEnd - typeEnd - 1);
+    method = route_str.substr(handlerEnd + 1, methodEnd - handlerEnd - 1);
+    return true;
+}
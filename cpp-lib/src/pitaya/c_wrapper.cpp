@@ -313,12 +313,7 @@ extern "C"
             return false;
         }
 
-        pitaya::Server server = maybeServer.value();
-        retServer->frontend = server.IsFrontend(); // FromPitayaServer(server);
-        retServer->hostname = ConvertToCString(server.Hostname());
-        retServer->id = ConvertToCString(server.Id());
-        retServer->metadata = ConvertToCString(server.Metadata());
-        retServer->type = ConvertToCString(server.Type());
+        FromPitayaServer(retServer, maybeServer.value());
         return true;
     }
 
@@ -464,12 +459,6 @@ extern "C"
         signal(SIGKILL, OnSignal);
     }
 
-    struct CRpc
-    {
-        MemoryBuffer* req;
-        void* tag;
-    };
-
     void tfg_pitc_FinishRpcCall(MemoryBuffer* mb, CRpc* crpc)
     {
         auto rpc = reinterpret_cast<pitaya::Rpc*>(crpc->tag);
@@ -484,9 +473,17 @@ extern "C"
             res.set_allocated_error(err);
         }
 
+        // The request buffer may be borrowed from the rpc, in which case it is only
+        // valid until Finish is called and must not be freed here.
+        const uint8_t* rawReq = nullptr;
+        size_t rawReqSize = 0;
+        bool borrowed = rpc->RawRequest(&rawReq, &rawReqSize) && rawReq == crpc->req->data;
+
         rpc->Finish(res);
 
-        free(crpc->req->data);
+        if (!borrowed) {
+            free(crpc->req->data);
+        }
         delete crpc->req;
         delete crpc;
     }
@@ -501,14 +498,24 @@ extern "C"
         }
 
         MemoryBuffer* reqBuffer = new MemoryBuffer();
-        size_t size = rpcData->req.ByteSizeLong();
-        reqBuffer->data = malloc(size);
-        reqBuffer->size = size;
 
-        bool success = rpcData->req.SerializeToArray(reqBuffer->data, size);
-        if (!success) {
-            // TODO: send in response?
-            gLogger->error("failed to serialize protobuf request!");
+        const uint8_t* rawReq = nullptr;
+        size_t rawReqSize = 0;
+        if (rpcData->rpc->RawRequest(&rawReq, &rawReqSize)) {
+            // Hand the bytes received from the network directly, instead of serializing
+            // the request again.
+            reqBuffer->data = const_cast<uint8_t*>(rawReq);
+            reqBuffer->size = rawReqSize;
+        } else {
+            size_t size = rpcData->req.ByteSizeLong();
+            reqBuffer->data = malloc(size);
+            reqBuffer->size = size;
+
+            bool success = rpcData->req.SerializeToArray(reqBuffer->data, size);
+            if (!success) {
+                // TODO: send in response?
+                gLogger->error("failed to serialize protobuf request!");
+            }
         }
 
         CRpc* crpc = new CRpc();
@@ -11,12 +11,12 @@
 #include "pitaya/protos/msg.pb.h"
 #include "pitaya/utils.h"
 
-#include <cpprest/json.h>
+#include <atomic>
+#include <chrono>
 #include <spdlog/sinks/stdout_color_sinks.h>
 
 using namespace pitaya;
 using namespace std;
-namespace json = web::json;
 using boost::optional;
 
 using std::placeholders::_1;
@@ -26,6 +26,25 @@ using google::protobuf::MessageLite;
 
 namespace pitaya {
 
+// Every thread gets a fixed shard of the waiting rpcs queue, in the order the threads
+// first use it. Rpc server threads push to their shard and threads calling WaitForRpc
+// pop from theirs first.
+static size_t
+ProducerShard()
+{
+    static std::atomic<size_t> nextShard(0);
+    thread_local size_t shard = nextShard++;
+    return shard;
+}
+
+static size_t
+ConsumerShard()
+{
+    static std::atomic<size_t> nextShard(0);
+    thread_local size_t shard = nextShard++;
+    return shard;
+}
+
 using etcdv3_service_discovery::Etcdv3ServiceDiscovery;
 using service_discovery::ServiceDiscovery;
 
@@ -73,7 +92,13 @@ Cluster::InitializeWithGrpc(GrpcConfig config,
                        },
                        loggerName));
 
-    Initialize(server, serviceDiscovery, std::move(rpcServer), std::move(rpcClient), loggerName);
+    _serverMaxNumberOfRpcs = config.serverMaxNumberOfRpcs;
+    Initialize(server,
+               serviceDiscovery,
+               std::move(rpcServer),
+               std::move(rpcClient),
+               loggerName,
+               CreateLoadBalancer(sdConfig.loadBalancing));
 }
 
 void
@@ -87,12 +112,19 @@ Cluster::InitializeWithNats(NatsConfig natsConfig,
     // therefore maybe calling a server that it is not started yet.
     auto rpcServer = std::unique_ptr<RpcServer>(new NatsRpcServer(server, natsConfig, loggerName));
     auto rpcClient = std::unique_ptr<RpcClient>(new NatsRpcClient(natsConfig, loggerName));
+    auto loadBalancer = CreateLoadBalancer(sdConfig.loadBalancing);
     auto etcdClient = std::unique_ptr<EtcdClient>(new EtcdClientV3(
         sdConfig.endpoints, sdConfig.etcdPrefix + "servers/metagame/", sdConfig.logHeartbeat, loggerName));
     auto serviceDiscovery = std::shared_ptr<ServiceDiscovery>(
         new Etcdv3ServiceDiscovery(std::move(sdConfig), server, std::move(etcdClient), loggerName));
 
-    Initialize(server, std::move(serviceDiscovery), std::move(rpcServer), std::move(rpcClient), loggerName);
+    _serverMaxNumberOfRpcs = natsConfig.serverMaxNumberOfRpcs;
+    Initialize(server,
+               std::move(serviceDiscovery),
+               std::move(rpcServer),
+               std::move(rpcClient),
+               loggerName,
+               std::move(loadBalancer));
 }
 
 void
@@ -100,17 +132,38 @@ Cluster::Initialize(Server server,
                     std::shared_ptr<service_discovery::ServiceDiscovery> sd,
                     std::unique_ptr<RpcServer> rpcServer,
                     std::unique_ptr<RpcClient> rpcClient,
-                    const char* loggerName)
+                    const char* loggerName,
+                    std::shared_ptr<LoadBalancer> loadBalancer)
 {
     _log = utils::CloneLoggerOrCreate(loggerName, "cluster");
-    _waitingRpcsFinished = false;
     _sd = std::move(sd);
     _rpcSv = std::move(rpcServer);
     _rpcClient = std::move(rpcClient);
+    _loadBalancer = loadBalancer ? std::move(loadBalancer)
+                                 : CreateLoadBalancer(LoadBalancingStrategy::Random);
+    _sd->AddListener(_loadBalancer.get());
+    // A load balancer that keeps a ring already receives the service discovery events.
+    _hashRing = _loadBalancer->HashRing();
+    if (!_hashRing) {
+        _hashRing = std::make_shared<ConsistentHashRing>();
+        _sd->AddListener(_hashRing.get());
+    }
     _server = server;
-    // NOTE: Not destroying the semaphore at the Terminate func due to the fact that threads
-    // may still be running and using it. Then, it will surely crash.
-    _waitingRpcsSemaphore.reset(new utils::Semaphore());
+    // The identity of the server does not change, therefore the metadata sent with every
+    // request is serialized only once.
+    _requestMetadata = utils::JsonObjectFromPairs({
+        { constants::kPeerIdKey, _server.Id() },
+        { constants::kPeerServiceKey, _server.Type() },
+    });
+    // The queue is closed when the previous rpc server finished. It is not recreated here,
+    // since threads may still be waiting on it.
+    size_t shardCapacity = _waitingRpcShardCapacity;
+    if (shardCapacity == 0) {
+        shardCapacity = _serverMaxNumberOfRpcs > 0 ? static_cast<size_t>(_serverMaxNumberOfRpcs)
+                                                   : kDefaultWaitingRpcShardCapacity;
+    }
+    _serverMaxNumberOfRpcs = -1;
+    _waitingRpcs.Reopen(_rpcSv->NumDispatchShards(), shardCapacity);
 
     _rpcSv->Start(std::bind(&Cluster::OnIncomingRpc, this, _1, _2));
 }
@@ -121,12 +174,23 @@ Cluster::Terminate()
     if (_log) {
         _log->flush();
     }
+    if (_sd) {
+        if (_loadBalancer) {
+            _sd->RemoveListener(_loadBalancer.get());
+        }
+        if (_hashRing && (!_loadBalancer || _hashRing != _loadBalancer->HashRing())) {
+            _sd->RemoveListener(_hashRing.get());
+        }
+    }
     _sd.reset();
     _rpcClient.reset();
     if (_rpcSv) {
         _rpcSv->Shutdown();
         _rpcSv.reset();
     }
+    // Reset last, the rpc client may still finish RPCs while it is destroyed.
+    _loadBalancer.reset();
+    _hashRing.reset();
     _log.reset();
 }
 
@@ -146,16 +210,36 @@ boost::optional<PitayaError>
 Cluster::RPC(const string& route, protos::Request& req, protos::Response& ret)
 {
     try {
-        auto r = pitaya::Route(route);
-        auto sv_type = r.server_type;
-        auto servers = _sd->GetServersByType(sv_type);
-        if (servers.size() < 1) {
+        const auto& r = _routes.Get(route);
+        auto servers = _sd->GetServerListByType(r.server_type);
+        if (servers->empty()) {
             return PitayaError(constants::kCodeNotFound, "no servers found for route: " + route);
         }
-        pitaya::Server sv = pitaya::utils::RandomServer(servers);
+        if (_rpcClient->CallsServerTypes()) {
+            return RPCServerType(r.server_type, route, req, ret);
+        }
+        auto sv = _loadBalancer->Pick(*servers, req);
         return RPC(sv.Id(), route, req, ret);
-    } catch (PitayaException* e) {
-        return PitayaError(constants::kCodeInternalError, e->what());
+    } catch (const PitayaException& e) {
+        return PitayaError(constants::kCodeInternalError, e.what());
+    }
+}
+
+boost::optional<PitayaError>
+Cluster::RPCByKey(const string& route,
+                  const string& key,
+                  protos::Request& req,
+                  protos::Response& ret)
+{
+    try {
+        const auto& r = _routes.Get(route);
+        auto serverId = _hashRing->ServerIdForKey(r.server_type, key);
+        if (!serverId) {
+            return PitayaError(constants::kCodeNotFound, "no servers found for route: " + route);
+        }
+        return RPC(serverId.value(), route, req, ret);
+    } catch (const PitayaException& e) {
+        return PitayaError(constants::kCodeInternalError, e.what());
     }
 }
 
@@ -187,6 +271,19 @@ Cluster::SendKickToUser(const string& serverId, const string& serverType, protos
     return error;
 }
 
+boost::optional<PitayaError>
+Cluster::SendPushesToUsers(const string& serverType, const vector<protos::Push>& pushes)
+{
+    _log->debug("Sending {} pushes to users on servers of type {}", pushes.size(), serverType);
+
+    auto error = _rpcClient->SendPushesToUsers(serverType, pushes);
+    if (error) {
+        _log->error("Received error sending pushes: {}", error.value().msg);
+    }
+
+    return error;
+}
+
 boost::optional<PitayaError>
 Cluster::RPC(const string& serverId,
              const string& route,
@@ -200,16 +297,13 @@ Cluster::RPC(const string& serverId,
         return PitayaError(constants::kCodeNotFound, "server not found");
     }
 
-    // TODO proper jaeger setup
-    json::value metadata;
-    metadata.object();
-    metadata[constants::kPeerIdKey] = json::value::string(_server.Id());
-    metadata[constants::kPeerServiceKey] = json::value::string(_server.Type());
-    string metadataStr = metadata.serialize();
-    req.set_metadata(metadataStr);
+    SetRequestMetadata(req);
 
     pitaya::Server server = sv.value();
+    auto start = std::chrono::steady_clock::now();
+    auto token = _loadBalancer->RpcStarted(serverId);
     ret = _rpcClient->Call(sv.value(), req);
+    _loadBalancer->RpcFinished(serverId, std::chrono::steady_clock::now() - start, token);
     if (ret.has_error()) {
         _log->error("Received error calling client rpc for server id->{} hostname->{} on route->{} : {}",serverId, server.Hostname(), route, ret.error().msg());
         return PitayaError(ret.error().code(), ret.error().msg());
@@ -223,49 +317,203 @@ Cluster::RPC(const string& serverId,
 }
 
 void
-Cluster::OnIncomingRpc(const protos::Request& req, Rpc* rpc)
+Cluster::RPCAsync(const string& route, protos::Request& req, RpcCallback callback)
+{
+    try {
+        const auto& r = _routes.Get(route);
+        auto servers = _sd->GetServerListByType(r.server_type);
+        if (servers->empty()) {
+            callback(PitayaError(constants::kCodeNotFound, "no servers found for route: " + route),
+                     protos::Response());
+            return;
+        }
+        if (_rpcClient->CallsServerTypes()) {
+            RPCAsyncServerType(r.server_type, route, req, std::move(callback));
+            return;
+        }
+        auto sv = _loadBalancer->Pick(*servers, req);
+        RPCAsync(sv.Id(), route, req, std::move(callback));
+    } catch (const PitayaException& e) {
+        callback(PitayaError(constants::kCodeInternalError, e.what()), protos::Response());
+    }
+}
+
+void
+Cluster::RPCAsyncByKey(const string& route,
+                       const string& key,
+                       protos::Request& req,
+                       RpcCallback callback)
+{
+    try {
+        const auto& r = _routes.Get(route);
+        auto serverId = _hashRing->ServerIdForKey(r.server_type, key);
+        if (!serverId) {
+            callback(PitayaError(constants::kCodeNotFound, "no servers found for route: " + route),
+                     protos::Response());
+            return;
+        }
+        RPCAsync(serverId.value(), route, req, std::move(callback));
+    } catch (const PitayaException& e) {
+        callback(PitayaError(constants::kCodeInternalError, e.what()), protos::Response());
+    }
+}
+
+void
+Cluster::RPCAsync(const string& serverId,
+                  const string& route,
+                  protos::Request& req,
+                  RpcCallback callback)
 {
-    std::lock_guard<decltype(_waitingRpcs)> lock(_waitingRpcs);
+    _log->debug("Calling async RPC on server {}", serverId);
+    auto sv = _sd->GetServerById(serverId);
+    if (!sv) {
+        _log->error("Did not find server id {}", serverId);
+        callback(PitayaError(constants::kCodeNotFound, "server not found"), protos::Response());
+        return;
+    }
+
+    SetRequestMetadata(req);
+
+    auto log = _log;
+    auto loadBalancer = _loadBalancer;
+    auto start = std::chrono::steady_clock::now();
+    auto token = loadBalancer->RpcStarted(serverId);
+    _rpcClient->CallAsync(
+        sv.value(),
+        req,
+        [log, loadBalancer, start, token, serverId, route, callback](protos::Response res) {
+            loadBalancer->RpcFinished(serverId, std::chrono::steady_clock::now() - start, token);
+            if (res.has_error()) {
+                log->error("Received error calling client rpc for server id->{} on route->{} : {}",
+                           serverId,
+                           route,
+                           res.error().msg());
+                auto err = PitayaError(res.error().code(), res.error().msg());
+                callback(std::move(err), std::move(res));
+                return;
+            }
+            log->debug("Async RPC to server {} succeeded", serverId);
+            callback(boost::none, std::move(res));
+        });
+}
 
-    assert(_waitingRpcsFinished == false);
+boost::optional<PitayaError>
+Cluster::RPCServerType(const string& serverType,
+                       const string& route,
+                       protos::Request& req,
+                       protos::Response& ret)
+{
+    // The server is picked by the rpc client, so the load balancer does not track the rpc.
+    _log->debug("Calling RPC on server type {}", serverType);
+    SetRequestMetadata(req);
 
-    if (rpc) {
-        RpcData rpcData = {};
-        rpcData.req = req;
-        rpcData.rpc = rpc;
-        _waitingRpcs.PushBack(rpcData);
-        _waitingRpcsSemaphore->Notify();
-    } else {
-        // TODO, FIXME: intead of incrementing the count to 2000 here,
-        // solve this in a more elegant way.
-        _waitingRpcsFinished = true;
-        _waitingRpcsSemaphore->NotifyAll(2000);
+    ret = _rpcClient->CallServerType(serverType, req);
+    if (ret.has_error()) {
+        _log->error("Received error calling client rpc for server type->{} on route->{} : {}",
+                    serverType,
+                    route,
+                    ret.error().msg());
+        return PitayaError(ret.error().code(), ret.error().msg());
     }
+
+    _log->debug("Successfuly called rpc: {}", ret.data());
+    return boost::none;
 }
 
-boost::optional<Cluster::RpcData>
-Cluster::WaitForRpc()
+void
+Cluster::RPCAsyncServerType(const string& serverType,
+                            const string& route,
+                            protos::Request& req,
+                            RpcCallback callback)
+{
+    _log->debug("Calling async RPC on server type {}", serverType);
+    SetRequestMetadata(req);
+
+    auto log = _log;
+    _rpcClient->CallServerTypeAsync(
+        serverType, req, [log, serverType, route, callback](protos::Response res) {
+            if (res.has_error()) {
+                log->error(
+                    "Received error calling client rpc for server type->{} on route->{} : {}",
+                    serverType,
+                    route,
+                    res.error().msg());
+                auto err = PitayaError(res.error().code(), res.error().msg());
+                callback(std::move(err), std::move(res));
+                return;
+            }
+            log->debug("Async RPC to server type {} succeeded", serverType);
+            callback(boost::none, std::move(res));
+        });
+}
+
+void
+Cluster::SetRequestMetadata(protos::Request& req)
 {
-    // TODO: there are probably too many locks being used here.
-    // After adding some benchmarks, research a better way of doing this.
-    // (e.g., merging the semaphore and queue, atomics, etc.)
-    _waitingRpcsSemaphore->Wait();
+    // TODO proper jaeger setup
+    if (req.metadata().empty()) {
+        req.set_metadata(_requestMetadata);
+        return;
+    }
+
+    // The peer keys replace the ones already in the metadata, so that a request that is sent
+    // again does not accumulate them.
+    string merged;
+    if (!utils::MergeJsonObjects(req.metadata(), _requestMetadata, merged)) {
+        _log->warn("Ignoring request metadata, it is not a json object: {}", req.metadata());
+        req.set_metadata(_requestMetadata);
+        return;
+    }
+    req.set_metadata(std::move(merged));
+}
 
-    std::lock_guard<decltype(_waitingRpcs)> lock(_waitingRpcs);
+void
+Cluster::OnIncomingRpc(protos::Request req, Rpc* rpc)
+{
+    if (!rpc) {
+        // The rpc server finished, wake up every thread waiting for rpcs.
+        _waitingRpcs.Close();
+        return;
+    }
 
-    if (_waitingRpcs.Size() > 0) {
-        // There are still rpcs to process, so return one.
-        RpcData rpcData = _waitingRpcs.PopFront();
-        return rpcData;
+    RpcData rpcData;
+    rpcData.req = std::move(req);
+    rpcData.rpc = rpc;
+
+    // Reserve a slot for the RPC, giving it back if it does not fit. This runs on the threads
+    // of the rpc server, so it never waits for room.
+    const int maxWaitingRpcs = _maxWaitingRpcs.load(std::memory_order_relaxed);
+    const int numWaitingRpcs = _numWaitingRpcs.fetch_add(1, std::memory_order_relaxed) + 1;
+    if ((maxWaitingRpcs == -1 || numWaitingRpcs <= maxWaitingRpcs) &&
+        _waitingRpcs.TryPush(rpcData, ProducerShard())) {
+        return;
+    }
+    _numWaitingRpcs.fetch_sub(1, std::memory_order_relaxed);
+
+    protos::Response res;
+    auto err = new protos::Error();
+    err->set_code(constants::kCodeServiceUnavailable);
+    if (_waitingRpcs.IsClosed()) {
+        _log->error("Received rpc after the rpc server finished");
+        err->set_msg("server is shutting down");
+    } else {
+        _log->warn("Refusing rpc, there are already {} rpcs waiting", numWaitingRpcs - 1);
+        err->set_msg("The server is already processing the maximum amount of RPC's");
     }
+    res.set_allocated_error(err);
+    rpc->Finish(res);
+}
 
-    // There are no more RPCs in the queue. Since the thread was woken up,
-    // it means that the queue was finished.
-    if (_waitingRpcsFinished) {
-        return boost::none;
+boost::optional<Cluster::RpcData>
+Cluster::WaitForRpc()
+{
+    RpcData rpcData;
+    if (_waitingRpcs.Pop(rpcData, ConsumerShard())) {
+        _numWaitingRpcs.fetch_sub(1, std::memory_order_relaxed);
+        return boost::optional<RpcData>(std::move(rpcData));
     }
 
-    _log->warn("The waiting rpcs queue is empty but the queue is not finished!");
+    // The queue was closed and there are no more rpcs to process.
     return boost::none;
 }
 
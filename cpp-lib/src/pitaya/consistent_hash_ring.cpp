@@ -0,0 +1,200 @@
+#include "pitaya/consistent_hash_ring.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include <limits>
+#include <unordered_set>
+
+using std::string;
+
+namespace pitaya {
+
+constexpr size_t ConsistentHashRing::kDefaultNumVirtualNodes;
+
+ConsistentHashRing::ConsistentHashRing(size_t numVirtualNodes)
+    : _numVirtualNodes(numVirtualNodes)
+{
+    assert(numVirtualNodes > 0);
+}
+
+uint64_t
+ConsistentHashRing::Hash(const string& str)
+{
+    // FNV-1a, followed by the finalizer of splitmix64 to spread similar keys.
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : str) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+boost::optional<Server>
+ConsistentHashRing::ServerForKey(const string& serverType, const string& key) const
+{
+    auto rings = _rings.Load();
+    auto it = rings->find(serverType);
+    if (it == rings->end()) {
+        return boost::none;
+    }
+
+    const Ring& ring = *it->second;
+    assert(!ring.points.empty());
+    auto hashLess = [](const Point& point, uint64_t hash) { return point.hash < hash; };
+    auto point = std::lower_bound(ring.points.begin(), ring.points.end(), Hash(key), hashLess);
+    if (point == ring.points.end()) {
+        point = ring.points.begin();
+    }
+    return ring.servers[point->server];
+}
+
+boost::optional<string>
+ConsistentHashRing::ServerIdForKey(const string& serverType, const string& key) const
+{
+    auto server = ServerForKey(serverType, key);
+    if (!server) {
+        return boost::none;
+    }
+    return server->Id();
+}
+
+void
+ConsistentHashRing::ServerAdded(const Server& server)
+{
+    ServersChanged({ server }, {});
+}
+
+void
+ConsistentHashRing::ServerRemoved(const Server& server)
+{
+    ServersChanged({}, { server });
+}
+
+void
+ConsistentHashRing::ServersChanged(const std::vector<Server>& added,
+                                   const std::vector<Server>& removed)
+{
+    struct TypeChanges
+    {
+        std::vector<const Server*> added;
+        std::vector<const Server*> removed;
+    };
+
+    std::unordered_map<string, TypeChanges> changesByType;
+    for (const auto& server : added) {
+        changesByType[server.Type()].added.push_back(&server);
+    }
+    for (const auto& server : removed) {
+        changesByType[server.Type()].removed.push_back(&server);
+    }
+    if (changesByType.empty()) {
+        return;
+    }
+
+    _rings.Update([this, &changesByType](Rings& rings) {
+        for (const auto& pair : changesByType) {
+            auto it = rings.find(pair.first);
+            auto ring = Rebuild(it == rings.end() ? nullptr : it->second,
+                                pair.second.added,
+                                pair.second.removed);
+            if (ring) {
+                rings[pair.first] = std::move(ring);
+            } else if (it != rings.end()) {
+                rings.erase(it);
+            }
+        }
+    });
+}
+
+std::shared_ptr<const ConsistentHashRing::Ring>
+ConsistentHashRing::Rebuild(const std::shared_ptr<const Ring>& current,
+                            const std::vector<const Server*>& added,
+                            const std::vector<const Server*>& removed) const
+{
+    auto ring = std::make_shared<Ring>();
+
+    std::unordered_set<string> removedIds;
+    for (const auto* server : removed) {
+        removedIds.insert(server->Id());
+    }
+
+    // The servers that are kept are compacted, `indexes` maps their old index to the new one.
+    const uint32_t kRemoved = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> indexes;
+    std::unordered_map<string, uint32_t> serverIndexes;
+    if (current) {
+        indexes.reserve(current->servers.size());
+        for (const auto& server : current->servers) {
+            if (removedIds.count(server.Id()) > 0) {
+                indexes.push_back(kRemoved);
+            } else {
+                indexes.push_back(static_cast<uint32_t>(ring->servers.size()));
+                serverIndexes.emplace(server.Id(), indexes.back());
+                ring->servers.push_back(server);
+            }
+        }
+    }
+
+    std::vector<Point> points;
+    bool replaced = false;
+    for (const auto* server : added) {
+        const auto index = static_cast<uint32_t>(ring->servers.size());
+        auto inserted = serverIndexes.emplace(server->Id(), index);
+        if (!inserted.second) {
+            // A server that is already on the ring keeps its points, but the ring returns the
+            // server last reported, with its current metadata.
+            ring->servers[inserted.first->second] = *server;
+            replaced = true;
+            continue;
+        }
+        ring->servers.push_back(*server);
+        for (size_t i = 0; i < _numVirtualNodes; ++i) {
+            points.push_back(Point{ Hash(server->Id() + "-" + std::to_string(i)), index });
+        }
+    }
+    const auto& servers = ring->servers;
+    auto pointLess = [&servers](const Point& a, const Point& b) {
+        if (a.hash != b.hash) {
+            return a.hash < b.hash;
+        }
+        return servers[a.server].Id() < servers[b.server].Id();
+    };
+    std::sort(points.begin(), points.end(), pointLess);
+
+    if (current && points.empty() && !replaced &&
+        ring->servers.size() == current->servers.size()) {
+        // Nothing changed.
+        return current;
+    }
+    if (ring->servers.empty()) {
+        return nullptr;
+    }
+
+    std::vector<Point> kept;
+    if (current) {
+        kept.reserve(current->points.size());
+        for (auto point : current->points) {
+            point.server = indexes[point.server];
+            if (point.server != kRemoved) {
+                kept.push_back(point);
+            }
+        }
+    }
+
+    ring->points.reserve(kept.size() + points.size());
+    std::merge(kept.begin(),
+               kept.end(),
+               points.begin(),
+               points.end(),
+               std::back_inserter(ring->points),
+               pointLess);
+    return ring;
+}
+
+} // namespace pitaya
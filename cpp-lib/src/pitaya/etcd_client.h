@@ -16,6 +16,8 @@ struct WatchResponse
     std::string action;
     std::string key;
     std::string value;
+    // Revision of the change.
+    int64_t revision = 0;
 };
 
 struct LeaseGrantResponse
@@ -42,6 +44,10 @@ struct ListResponse
     bool ok;
     std::string errorMsg;
     std::vector<std::string> keys;
+    // Values of the keys, in the same order.
+    std::vector<std::string> values;
+    // Revision of the store when the keys were listed.
+    int64_t revision = 0;
 };
 
 struct GetResponse
@@ -66,8 +72,11 @@ public:
     virtual LeaseRevokeResponse LeaseRevoke(int64_t leaseId) = 0;
     virtual SetResponse Set(const std::string& key, const std::string& val, int64_t leaseId) = 0;
     virtual GetResponse Get(const std::string& key) = 0;
+    // Lists the keys with the given prefix and their values in a single request.
     virtual ListResponse List(const std::string& prefix) = 0;
-    virtual void Watch(std::function<void(WatchResponse)> onWatch) = 0;
+    // Watches for changes after `fromRevision`, or for new changes when it is zero.
+    // A previous watch is replaced. Throws PitayaException if the revision was compacted.
+    virtual void Watch(int64_t fromRevision, std::function<void(WatchResponse)> onWatch) = 0;
     virtual void CancelWatch() = 0;
 
     virtual void LeaseKeepAlive(int64_t leaseId,
@@ -89,7 +89,12 @@ EtcdClientV3::List(const std::string& prefix)
 
     ListResponse res;
     res.ok = etcdRes.is_ok();
+    res.revision = etcdRes.revision;
     res.keys = std::move(etcdRes.keys);
+    res.values.reserve(etcdRes.values.size());
+    for (auto& value : etcdRes.values) {
+        res.values.push_back(std::move(value.value));
+    }
     if (!res.ok) {
         res.errorMsg = (etcdRes.status.etcd_error_code == etcd::StatusCode::UNDERLYING_GRPC_ERROR)
                            ? "gRPC error: " + etcdRes.status.grpc_error_message
@@ -112,12 +117,14 @@ EtcdClientV3::StopLeaseKeepAlive()
 }
 
 void
-EtcdClientV3::Watch(std::function<void(WatchResponse)> onWatch)
+EtcdClientV3::Watch(int64_t fromRevision, std::function<void(WatchResponse)> onWatch)
 {
     try {
+        // The previous watcher is cancelled before its callback is replaced.
+        _watcher.reset();
         _onWatch = std::move(onWatch);
-        _watcher = std::unique_ptr<etcd::Watcher>(
-            new etcd::Watcher(_endpoint, _prefix, std::bind(&EtcdClientV3::OnWatch, this, _1)));
+        _watcher = std::unique_ptr<etcd::Watcher>(new etcd::Watcher(
+            _endpoint, _prefix, true, fromRevision, std::bind(&EtcdClientV3::OnWatch, this, _1)));
     } catch (const etcd::watch_error& exc) {
         throw PitayaException(exc.what());
     }
@@ -137,6 +144,7 @@ EtcdClientV3::OnWatch(etcd::Response res)
     watchRes.action = res.action;
     watchRes.key = res.value.key;
     watchRes.value = res.value.value;
+    watchRes.revision = res.value.modified_revision;
     _onWatch(watchRes);
 }
 
@@ -22,7 +22,7 @@ public:
     SetResponse Set(const std::string& key, const std::string& val, int64_t leaseId) override;
     GetResponse Get(const std::string& key) override;
     ListResponse List(const std::string& prefix) override;
-    void Watch(std::function<void(WatchResponse)> onWatch) override;
+    void Watch(int64_t fromRevision, std::function<void(WatchResponse)> onWatch) override;
     void CancelWatch() override;
 
     void LeaseKeepAlive(int64_t leaseId,
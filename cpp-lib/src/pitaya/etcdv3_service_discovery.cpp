@@ -59,6 +59,12 @@ Etcdv3ServiceDiscovery::GetServersByType(const std::string& type)
     return _worker->GetServersByType(type);
 }
 
+std::shared_ptr<const vector<Server>>
+Etcdv3ServiceDiscovery::GetServerListByType(const std::string& type)
+{
+    return _worker->GetServerListByType(type);
+}
+
 void
 Etcdv3ServiceDiscovery::AddListener(service_discovery::Listener* listener)
 {
@@ -27,6 +27,8 @@ public:
 
     boost::optional<pitaya::Server> GetServerById(const std::string& id) override;
     std::vector<pitaya::Server> GetServersByType(const std::string& type) override;
+    std::shared_ptr<const std::vector<pitaya::Server>> GetServerListByType(
+        const std::string& type) override;
     void AddListener(service_discovery::Listener* listener) override;
     void RemoveListener(service_discovery::Listener* listener) override;
 
@@ -1,11 +1,11 @@
 #include "pitaya/etcdv3_service_discovery/worker.h"
 
 #include "pitaya/utils.h"
+#include "pitaya/utils/json.h"
 #include "pitaya/utils/string_utils.h"
 
 #include <algorithm>
 #include <assert.h>
-#include <cpprest/json.h>
 #include <sstream>
 
 using boost::optional;
@@ -13,7 +13,6 @@ using std::string;
 using std::vector;
 using std::placeholders::_1;
 using namespace pitaya;
-namespace json = web::json;
 
 static constexpr const char* kLogTag = "service_discovery_worker";
 
@@ -32,6 +31,7 @@ Worker::Worker(const EtcdServiceDiscoveryConfig& config,
     , _etcdClient(std::move(etcdClient))
     , _log(utils::CloneLoggerOrCreate(loggerName, kLogTag))
     , _numKeepAliveRetriesLeft(5)
+    , _lastRevision(0)
     , _syncServersTicker(config.syncServersIntervalSec, std::bind(&Worker::SyncServers, this)) {
 
     if (_config.logServerSync) {
@@ -43,8 +43,7 @@ Worker::Worker(const EtcdServiceDiscoveryConfig& config,
     for (const auto& filter : config.serverTypeFilters) {
         _log->info("Adding server type filter: {}", filter);
     }
-    
-    _etcdClient->Watch(std::bind(&Worker::OnWatch, this, _1));
+
     _workerThread = std::thread(&Worker::StartThread, this);
 } catch (const spdlog::spdlog_ex& exc) {
     throw PitayaException(
@@ -104,167 +103,136 @@ Worker::StartThread()
     for (;;) {
         _semaphore.Wait();
 
-        // Get the next job from the queue
-        Job job;
+        // Takes every queued job at once, so the watch events that arrived since the last
+        // wake up are applied together. The semaphore was notified once per job, the extra
+        // wake ups find the queue empty.
+        std::vector<Job> jobs;
         {
             std::lock_guard<decltype(_jobQueue)> lock(_jobQueue);
-            if (_jobQueue.Empty()) {
-                _log->warn("Job queue empty, ignoring");
-                continue;
+            jobs.reserve(_jobQueue.Size());
+            while (!_jobQueue.Empty()) {
+                jobs.push_back(_jobQueue.PopFront());
             }
-            job = _jobQueue.PopFront();
         }
 
-        assert(job.info != JobInfo::Invalid);
+        std::vector<WatchResponse> watches;
+        for (auto& job : jobs) {
+            assert(job.info != JobInfo::Invalid);
 
-        switch (job.info) {
-            case JobInfo::SyncServers: {
-                _log->debug("Will synchronize servers");
-
-                ListResponse res = _etcdClient->List(_config.etcdPrefix + "servers/metagame/");
+            if (job.info == JobInfo::Watch) {
+                watches.push_back(std::move(job.watchRes));
+                continue;
+            }
 
-                if (!res.ok) {
-                    _log->warn("Error synchronizing servers: {}", res.errorMsg);
-                    break;
-                }
+            // The other jobs see the changes that were watched before them.
+            if (!watches.empty()) {
+                HandleWatches(watches);
+                watches.clear();
+            }
+            if (!RunJob(job)) {
+                return;
+            }
+        }
 
-                vector<string> allIds;
-
-                for (size_t i = 0; i < res.keys.size(); ++i) {
-                    // 1. Parse key
-                    string serverType, serverId;
-                    if (!utils::ParseEtcdKey(
-                            res.keys[i], _config.etcdPrefix, _config.serverTypeFilters, serverType, serverId)) {
-                        _log->debug("Ignoring key {}", res.keys[i]);
-                        continue;
-                    }
-
-                    allIds.push_back(serverId);
-
-                    if (_serversById.FindWithLock(serverId) == _serversById.end()) {
-                        _log->info("Loading info from missing server: {}/{}", serverType, serverId);
-                        auto server = GetServerFromEtcd(serverId, serverType);
-                        if (!server) {
-                            _log->error("Error getting server from etcd: {}", serverId);
-                            continue;
-                        }
-
-                        AddServer(std::move(server.value()));
-                    }
-                }
+        if (!watches.empty()) {
+            HandleWatches(watches);
+        }
+    }
 
-                DeleteLocalInvalidServers(std::move(allIds));
+    _log->debug("Thread exited loop");
+}
 
-                if (_config.logServerDetails) {
-                    PrintServers();
-                }
-                if (_config.logServerSync) {
-                    _log->debug("Servers synchronized");
-                }
+bool
+Worker::RunJob(const Job& job)
+{
+    switch (job.info) {
+        case JobInfo::SyncServers: {
+            _log->debug("Will synchronize servers");
+            if (!FullSync()) {
                 break;
             }
-            case JobInfo::Watch: {
-                assert(!job.watchRes.key.empty());
-                assert(!job.watchRes.action.empty());
-
-                // First we need to parse the etcd key to figure out if it
-                // belongs to the same prefix and it is actually a server.
-                string serverType, serverId;
-                if (!utils::ParseEtcdKey(
-                        job.watchRes.key, _config.etcdPrefix, _config.serverTypeFilters, serverType, serverId)) {
-                    _log->debug("Watch: Ignoring {}", job.watchRes.key);
-                    break;
-                }
-
-                if (job.watchRes.action == "create") {
-                    _log->debug("Watch: received create action for server {}", job.watchRes.key);
-                    auto server = ParseServer(job.watchRes.value);
-                    if (!server) {
-                        _log->error("Watch: Error parsing server: {}", job.watchRes.value);
-                        break;
-                    }
-                    AddServer(std::move(server.value()));
-                } else if (job.watchRes.action == "delete") {
-                    _log->debug("Watch: received delete action for server {}", job.watchRes.key);
-                    DeleteServer(serverId);
-                }
-
+            if (_config.logServerDetails) {
                 PrintServers();
-                break;
             }
-            case JobInfo::AddListener: {
-                _log->debug("Adding listener");
-                assert(job.listener && "listener should not be null");
-                // Whenever we add a new listener, we want to call ServerAdded
-                // for all existent servers on the class.
-                {
-                    std::lock_guard<decltype(_serversById)> lock(_serversById);
-                    for (const auto& pair : _serversById) {
-                        const Server& server = pair.second;
-                        _log->debug("Broadcasting server added to the listener for id {}", server.Id());
-                        job.listener->ServerAdded(server);
-                    }
-                }
-
-                std::lock_guard<decltype(_listeners)> lock(_listeners);
-                _listeners.PushBack(job.listener);
-                break;
+            if (_config.logServerSync) {
+                _log->debug("Servers synchronized");
             }
-            case JobInfo::EtcdReconnectionFailure: {
-                _log->error("Reconnection failure, {} retries left!", _numKeepAliveRetriesLeft);
-                _etcdClient->StopLeaseKeepAlive();
-                _syncServersTicker.Stop();
-
-                while (_numKeepAliveRetriesLeft > 0) {
-                    _log->info("ETCD retries left: {}", _numKeepAliveRetriesLeft);
-                    auto delay_milliseconds = 300 << (5 - _numKeepAliveRetriesLeft);
-                    _log->info("ETCD retry waiting for {}ms", delay_milliseconds);
-                    std::this_thread::sleep_for(std::chrono::milliseconds(delay_milliseconds));
-
-                    --_numKeepAliveRetriesLeft;
-                    auto ok = Bootstrap();
-
-                    if (ok) {
-                        _log->info("Etcd reconnection successful");
-                        // FIXME(leo): Do not reset the number of keep alive retries yet,
-                        // since we do not want the server to be keep reconnecting forever in an
-                        // unknown state.
-                        // _numKeepAliveRetriesLeft = _config.maxNumberOfRetries;
-                        _log->info("Restarting etcd watcher");
-                        _etcdClient->Watch(std::bind(&Worker::OnWatch, this, _1));
-                        StartLeaseKeepAlive();
-                        _syncServersTicker.Start();
-                        break;
-                    }
+            break;
+        }
+        case JobInfo::AddListener: {
+            _log->debug("Adding listener");
+            assert(job.listener && "listener should not be null");
+            // Whenever we add a new listener, we want to report all existent
+            // servers to it as a single batch.
+            {
+                auto registry = _registry.Load();
+                std::vector<Server> servers;
+                servers.reserve(registry->serversById.size());
+                for (const auto& pair : registry->serversById) {
+                    servers.push_back(pair.second.server);
                 }
-
-                if (_numKeepAliveRetriesLeft <= 0) {
-                    _log->critical("Failed to reconnect to etcd, shutting down");
-                    Shutdown();
-                    std::thread(std::bind(raise, SIGTERM)).detach();
-                    _log->debug("Exiting loop");
-                    return;
+                if (!servers.empty()) {
+                    _log->debug("Broadcasting {} servers to the listener", servers.size());
+                    job.listener->ServersChanged(servers, {});
                 }
-
-                break;
             }
-            case JobInfo::WatchError: {
-                _log->error("Watch error");
-                break;
+
+            std::lock_guard<decltype(_listeners)> lock(_listeners);
+            _listeners.PushBack(job.listener);
+            break;
+        }
+        case JobInfo::EtcdReconnectionFailure: {
+            _log->error("Reconnection failure, {} retries left!", _numKeepAliveRetriesLeft);
+            _etcdClient->StopLeaseKeepAlive();
+            _syncServersTicker.Stop();
+
+            while (_numKeepAliveRetriesLeft > 0) {
+                _log->info("ETCD retries left: {}", _numKeepAliveRetriesLeft);
+                auto delay_milliseconds = 300 << (5 - _numKeepAliveRetriesLeft);
+                _log->info("ETCD retry waiting for {}ms", delay_milliseconds);
+                std::this_thread::sleep_for(std::chrono::milliseconds(delay_milliseconds));
+
+                --_numKeepAliveRetriesLeft;
+                auto ok = Bootstrap();
+
+                if (ok) {
+                    _log->info("Etcd reconnection successful");
+                    // FIXME(leo): Do not reset the number of keep alive retries yet,
+                    // since we do not want the server to be keep reconnecting forever in an
+                    // unknown state.
+                    // _numKeepAliveRetriesLeft = _config.maxNumberOfRetries;
+                    StartLeaseKeepAlive();
+                    _syncServersTicker.Start();
+                    break;
+                }
             }
-            case JobInfo::Shutdown: {
+
+            if (_numKeepAliveRetriesLeft <= 0) {
+                _log->critical("Failed to reconnect to etcd, shutting down");
                 Shutdown();
+                std::thread(std::bind(raise, SIGTERM)).detach();
                 _log->debug("Exiting loop");
-                return;
-            }
-            default: {
-                _log->error("This code should be unreachable");
-                assert(false);
+                return false;
             }
+
+            break;
+        }
+        case JobInfo::WatchError: {
+            _log->error("Watch error, resuming the watch after revision {}", _lastRevision);
+            StartWatch();
+            break;
+        }
+        case JobInfo::Shutdown: {
+            Shutdown();
+            _log->debug("Exiting loop");
+            return false;
+        }
+        default: {
+            _log->error("This code should be unreachable");
+            assert(false);
         }
     }
-
-    _log->debug("Thread exited loop");
+    return true;
 }
 
 void
@@ -326,7 +294,9 @@ Worker::Bootstrap()
         return false;
     }
 
-    SyncServers();
+    // The watch starts right after the revision of the sync, so no change is lost between them.
+    FullSync();
+    StartWatch();
     return true;
 }
 
@@ -340,73 +310,247 @@ Worker::AddServerToEtcd(const Server& server)
 }
 
 void
-Worker::AddServer(const Server& server)
+Worker::SyncServers()
 {
-    {
-        std::lock_guard<decltype(_serversById)> lock(_serversById);
+    std::lock_guard<decltype(_jobQueue)> lock(_jobQueue);
+    _jobQueue.PushBack(Job::NewSyncServers());
+    _semaphore.Notify();
+}
+
+bool
+Worker::FullSync()
+{
+    // The keys and the values of every server come in a single request.
+    ListResponse res = _etcdClient->List(_config.etcdPrefix + "servers/metagame/");
+    if (!res.ok) {
+        _log->warn("Error synchronizing servers: {}", res.errorMsg);
+        return false;
+    }
+    if (res.values.size() != res.keys.size()) {
+        _log->error("Error synchronizing servers: received {} keys and {} values",
+                    res.keys.size(),
+                    res.values.size());
+        return false;
+    }
+
+    auto registry = _registry.Load();
+    std::unordered_set<string> actualServers;
+    actualServers.reserve(res.keys.size());
+    std::vector<Server> added;
+
+    for (size_t i = 0; i < res.keys.size(); ++i) {
+        string serverType, serverId;
+        if (!utils::ParseEtcdKey(
+                res.keys[i], _config.etcdPrefix, _config.serverTypeFilters, serverType, serverId)) {
+            _log->debug("Ignoring key {}", res.keys[i]);
+            continue;
+        }
+
+        actualServers.insert(serverId);
 
-        if (_serversById.Find(server.Id()) != _serversById.end()) {
-            return;
+        if (registry->serversById.count(serverId) == 0) {
+            _log->info("Loading info from missing server: {}/{}", serverType, serverId);
+            auto server = ParseServer(res.values[i], _log);
+            if (!server) {
+                _log->error("Error parsing server {}: {}", serverId, res.values[i]);
+                continue;
+            }
+            added.push_back(std::move(server.value()));
         }
+    }
 
-        _log->debug("Adding server {} with metadata {} to service_discovery",
-                    server.Id(),
-                    server.Metadata());
-        _serversById[server.Id()] = server;
-        _serversByType[server.Type()][server.Id()] = server;
+    std::vector<string> removedIds;
+    for (const auto& pair : registry->serversById) {
+        string serverId(pair.first);
+        if (actualServers.count(serverId) == 0) {
+            _log->warn("Invalid local server {}, removing from server list", serverId);
+            removedIds.push_back(std::move(serverId));
+        }
     }
 
-    BroadcastServerAdded(server);
+    ApplyChanges(std::move(added), removedIds);
+    _lastRevision = std::max(_lastRevision, res.revision);
+    return true;
 }
 
 void
-Worker::SyncServers()
+Worker::StartWatch()
 {
-    std::lock_guard<decltype(_jobQueue)> lock(_jobQueue);
-    _jobQueue.PushBack(Job::NewSyncServers());
-    _semaphore.Notify();
+    // Without a known revision, only new changes are watched.
+    int64_t fromRevision = _lastRevision > 0 ? _lastRevision + 1 : 0;
+    try {
+        _etcdClient->Watch(fromRevision, std::bind(&Worker::OnWatch, this, _1));
+        return;
+    } catch (const PitayaException& exc) {
+        _log->warn("Failed to watch from revision {}, synchronizing all servers: {}",
+                   fromRevision,
+                   exc.what());
+    }
+
+    // The revision was compacted, the changes since then are only known by listing every
+    // server again.
+    FullSync();
+    try {
+        _etcdClient->Watch(_lastRevision > 0 ? _lastRevision + 1 : 0,
+                           std::bind(&Worker::OnWatch, this, _1));
+    } catch (const PitayaException& exc) {
+        _log->error("Failed to watch servers: {}", exc.what());
+    }
 }
 
-optional<pitaya::Server>
-Worker::GetServerFromEtcd(const std::string& serverId, const std::string& serverType)
+void
+Worker::HandleWatches(const std::vector<WatchResponse>& responses)
 {
-    auto serverKey = fmt::format("{}{}", _config.etcdPrefix, GetServerKey(serverId, serverType));
+    struct Change
+    {
+        // Value of the last create, null if the last event was a delete.
+        const string* value = nullptr;
+        bool deleted = false;
+    };
+
+    // Coalesces the events of every server, keeping the order in which they first changed.
+    std::unordered_map<string, Change> changes;
+    std::vector<string> changedIds;
+
+    for (const auto& res : responses) {
+        assert(!res.key.empty());
+        assert(!res.action.empty());
+
+        if (res.revision > 0 && res.revision <= _lastRevision) {
+            // The change is older than the last full sync, which already has it.
+            _log->debug("Watch: ignoring {} at revision {}", res.key, res.revision);
+            continue;
+        }
+        _lastRevision = std::max(_lastRevision, res.revision);
+
+        // First we need to parse the etcd key to figure out if it
+        // belongs to the same prefix and it is actually a server.
+        string serverType, serverId;
+        if (!utils::ParseEtcdKey(
+                res.key, _config.etcdPrefix, _config.serverTypeFilters, serverType, serverId)) {
+            _log->debug("Watch: Ignoring {}", res.key);
+            continue;
+        }
 
-    try {
-        GetResponse res = _etcdClient->Get(serverKey);
+        auto it = changes.find(serverId);
+        if (it == changes.end()) {
+            it = changes.emplace(serverId, Change()).first;
+            changedIds.push_back(serverId);
+        }
+
+        if (res.action == "create") {
+            _log->debug("Watch: received create action for server {}", res.key);
+            it->second.value = &res.value;
+        } else if (res.action == "delete") {
+            _log->debug("Watch: received delete action for server {}", res.key);
+            it->second.value = nullptr;
+            it->second.deleted = true;
+        }
+    }
+
+    auto registry = _registry.Load();
+    std::vector<Server> added;
+    std::vector<string> removedIds;
+
+    for (const auto& serverId : changedIds) {
+        const Change& change = changes[serverId];
+        bool known = registry->serversById.count(serverId) > 0;
+
+        optional<Server> server;
+        if (change.value) {
+            server = ParseServer(*change.value, _log);
+            if (!server) {
+                _log->error("Watch: Error parsing server: {}", *change.value);
+            }
+        }
 
-        if (!res.ok) {
-            _log->error("Failed to get key {} from server: {}", serverKey, res.errorMsg);
-            return boost::none;
+        // A server that was created and deleted in the same batch is never reported, and
+        // one that was deleted and created again replaces the known one.
+        if (known && change.deleted) {
+            removedIds.push_back(serverId);
+        }
+        if (server && (!known || change.deleted)) {
+            added.push_back(std::move(server.value()));
         }
+    }
 
-        return ParseServer(res.value);
-    } catch (const std::exception& exc) {
-        _log->error("Error in communication with server: {}", exc.what());
-        return boost::none;
+    if (added.empty() && removedIds.empty()) {
+        return;
+    }
+
+    ApplyChanges(std::move(added), removedIds);
+
+    if (_log->should_log(spdlog::level::debug)) {
+        PrintServers();
     }
 }
 
 void
-Worker::DeleteLocalInvalidServers(const vector<string>& actualServers)
+Worker::ApplyChanges(std::vector<Server> added, const std::vector<string>& removedIds)
 {
-    // NOTE(lhahn): Both maps are locked, since we do not want to have them
-    // possibly in an inconsistent state.
-    std::lock_guard<decltype(_serversById)> serversByIdLock(_serversById);
-    std::lock_guard<decltype(_serversByType)> serversByTypeLock(_serversByType);
+    std::vector<Server> removed;
+    _registry.Update([&](ServerRegistry& registry) {
+        // Copies of the lists that changed, each list is copied only once.
+        std::unordered_map<string, std::shared_ptr<ServerRegistry::ServerList>> changedLists;
+        auto mutableList = [&](const string& type) -> ServerRegistry::ServerList& {
+            auto& list = changedLists[type];
+            if (!list) {
+                auto it = registry.serversByType.find(type);
+                list = it == registry.serversByType.end()
+                           ? std::make_shared<ServerRegistry::ServerList>()
+                           : std::make_shared<ServerRegistry::ServerList>(*it->second);
+            }
+            return *list;
+        };
 
-    std::vector<std::string> invalidServers;
+        for (const auto& serverId : removedIds) {
+            auto it = registry.serversById.find(serverId);
+            if (it == registry.serversById.end()) {
+                continue;
+            }
+            _log->debug("Server {} deleted", serverId);
 
-    for (const auto& pair : _serversById) {
-        if (std::find(actualServers.begin(), actualServers.end(), pair.first) ==
-            actualServers.end()) {
-            invalidServers.push_back(pair.first);
+            auto& list = mutableList(it->second.server.Type());
+            size_t index = it->second.index;
+            if (index != list.size() - 1) {
+                list[index] = std::move(list.back());
+                registry.serversById.at(list[index].Id()).index = index;
+            }
+            list.pop_back();
+
+            removed.push_back(std::move(it->second.server));
+            registry.serversById.erase(it);
         }
-    }
 
-    for (const auto& invalidServer : invalidServers) {
-        _log->warn("Invalid local server {}, removing from server list", invalidServer);
-        DeleteServer(invalidServer);
+        // Servers that are already known are ignored.
+        std::vector<Server> newServers;
+        newServers.reserve(added.size());
+        for (auto& server : added) {
+            if (registry.serversById.count(server.Id()) > 0) {
+                continue;
+            }
+            _log->debug("Adding server {} with metadata {} to service_discovery",
+                        server.Id(),
+                        server.Metadata());
+            auto& list = mutableList(server.Type());
+            registry.serversById.emplace(server.Id(),
+                                         ServerRegistry::Entry{ server, list.size() });
+            list.push_back(server);
+            newServers.push_back(std::move(server));
+        }
+        added = std::move(newServers);
+
+        for (auto& pair : changedLists) {
+            if (pair.second->empty()) {
+                registry.serversByType.erase(pair.first);
+            } else {
+                registry.serversByType[pair.first] = std::move(pair.second);
+            }
+        }
+    });
+
+    if (!added.empty() || !removed.empty()) {
+        BroadcastServersChanged(added, removed);
     }
 }
 
@@ -425,60 +569,44 @@ Worker::RevokeLease()
 void
 Worker::PrintServers()
 {
-    std::lock_guard<decltype(_serversByType)> lock(_serversByType);
-    for (const auto& typePair : _serversByType) {
+    auto registry = _registry.Load();
+    for (const auto& typePair : registry->serversByType) {
         _log->debug("Type: {}, Servers:", typePair.first);
-        for (const auto& svPair : typePair.second) {
-            PrintServer(svPair.second);
+        for (const auto& server : *typePair.second) {
+            PrintServer(server);
         }
     }
 }
 
-void
-Worker::DeleteServer(const string& serverId)
-{
-    // NOTE(lhahn): DeleteServer assumes that the resources are already locked.
-    if (_serversById.Find(serverId) == _serversById.end()) {
-        return;
-    }
-
-    Server server = _serversById[serverId];
-    _serversById.Erase(serverId);
-
-    if (_serversByType.Find(server.Type()) != _serversByType.end()) {
-        auto& serverMap = _serversByType[server.Type()];
-        serverMap.erase(server.Id());
-    }
-
-    _log->debug("Server {} deleted", server.Id());
-    BroadcastServerRemoved(server);
-}
-
 optional<pitaya::Server>
 Worker::GetServerById(const std::string& id)
 {
-    std::lock_guard<decltype(_serversById)> lock(_serversById);
-    if (_serversById.Find(id) == _serversById.end()) {
+    auto registry = _registry.Load();
+    auto it = registry->serversById.find(id);
+    if (it == registry->serversById.end()) {
         return optional<Server>();
     }
 
-    return optional<Server>(_serversById[id]);
+    return optional<Server>(it->second.server);
 }
 
 std::vector<pitaya::Server>
 Worker::GetServersByType(const std::string& type)
 {
-    std::lock_guard<decltype(_serversByType)> lock(_serversByType);
-    vector<Server> servers;
+    return *GetServerListByType(type);
+}
 
-    if (_serversByType.Find(type) != _serversByType.end()) {
-        const auto& svMap = _serversByType[type];
-        for (const auto& pair : svMap) {
-            servers.push_back(pair.second);
-        }
-    }
+std::shared_ptr<const std::vector<pitaya::Server>>
+Worker::GetServerListByType(const std::string& type)
+{
+    static const auto kEmptyList = std::make_shared<const ServerRegistry::ServerList>();
 
-    return servers;
+    auto registry = _registry.Load();
+    auto it = registry->serversByType.find(type);
+    if (it == registry->serversByType.end()) {
+        return kEmptyList;
+    }
+    return it->second;
 }
 
 void
@@ -525,61 +653,74 @@ Worker::PrintServer(const Server& server)
 static string
 ServerAsJson(const Server& server)
 {
-    json::value obj;
-    obj.object();
-    obj["id"] = json::value::string(server.Id());
-    obj["type"] = json::value::string(server.Type());
-    try {
-        obj["metadata"] = json::value::parse(server.Metadata());
-    } catch (const json::json_exception& exc) {
-        obj["metadata"] = json::value::string("");
+    string json = "{\"id\":";
+    utils::AppendJsonString(json, server.Id());
+    json += ",\"type\":";
+    utils::AppendJsonString(json, server.Type());
+    json += ",\"metadata\":";
+    if (server.HasMetadata() && server.MetadataError().empty()) {
+        json += server.Metadata();
+    } else {
+        json += "\"\"";
     }
-    obj["hostname"] = json::value::string(server.Hostname());
-    obj["frontend"] = json::value::boolean(server.IsFrontend());
-    return obj.serialize();
+    json += ",\"hostname\":";
+    utils::AppendJsonString(json, server.Hostname());
+    json += ",\"frontend\":";
+    json += server.IsFrontend() ? "true" : "false";
+    json += "}";
+    return json;
 }
 
 optional<Server>
-Worker::ParseServer(const string& jsonStr)
+Worker::ParseServer(const string& jsonStr, const std::shared_ptr<spdlog::logger>& log)
 {
-    try {
-        auto jsonSrv = json::value::parse(jsonStr);
-
-        if (!jsonSrv.is_object()) {
-            _log->error("Server json is not an object {}", jsonStr);
-            return boost::none;
-        }
+    using Type = utils::JsonReader::Type;
 
-        bool frontend = false;
-        std::string hostname, type, id, metadata;
-
-        if (jsonSrv.has_boolean_field("frontend")) {
-            frontend = jsonSrv["frontend"].as_bool();
-        }
-        if (jsonSrv.has_string_field("type")) {
-            type = jsonSrv["type"].as_string();
-        }
-        if (jsonSrv.has_string_field("id")) {
-            id = jsonSrv["id"].as_string();
-        }
-        if (jsonSrv.has_object_field("metadata")) {
-            metadata = jsonSrv["metadata"].serialize();
-        }
-        if (jsonSrv.has_string_field("hostname")) {
-            hostname = jsonSrv["hostname"].as_string();
-        }
+    // The server is read in a single pass over the json. The text of the metadata object is
+    // handed to the server, which parses it into its entries.
+    utils::JsonReader reader(jsonStr);
+    if (reader.Peek() != Type::Object) {
+        log->error("Server json is not an object {}", jsonStr);
+        return boost::none;
+    }
 
-        if (id.empty() || type.empty()) {
-            return boost::none;
+    bool frontend = false;
+    std::string hostname, type, id, metadata, key;
+
+    reader.EnterObject();
+    while (reader.NextKey(key)) {
+        auto valueType = reader.Peek();
+        if (key == "id" && valueType == Type::String) {
+            reader.ReadString(id);
+        } else if (key == "type" && valueType == Type::String) {
+            reader.ReadString(type);
+        } else if (key == "hostname" && valueType == Type::String) {
+            reader.ReadString(hostname);
+        } else if (key == "frontend" && valueType == Type::Bool) {
+            reader.ReadBool(frontend);
+        } else if (key == "metadata" && valueType == Type::Object) {
+            std::string_view rawMetadata;
+            if (reader.SkipValue(&rawMetadata)) {
+                metadata.assign(rawMetadata);
+            }
+        } else {
+            reader.SkipValue();
         }
+    }
 
-        auto sv = Server((Server::Kind)frontend, id, type, hostname).WithRawMetadata(metadata);
+    if (reader.Failed() || !reader.AtEnd()) {
+        log->error("Failed to parse server json ({}): {}",
+                   jsonStr,
+                   reader.Failed() ? reader.Error() : "unexpected data after the server");
+        return boost::none;
+    }
 
-        return sv;
-    } catch (const json::json_exception& exc) {
-        _log->error("Failed to parse server json ({}): {}", jsonStr, exc.what());
+    if (id.empty() || type.empty()) {
         return boost::none;
     }
+
+    return Server((Server::Kind)frontend, std::move(id), std::move(type), std::move(hostname))
+        .WithRawMetadata(std::move(metadata));
 }
 
 void
@@ -602,23 +743,13 @@ Worker::RemoveListener(service_discovery::Listener* listener)
 }
 
 void
-Worker::BroadcastServerAdded(const pitaya::Server& server)
-{
-    std::lock_guard<decltype(_listeners)> lock(_listeners);
-    for (auto l : _listeners) {
-        if (l) {
-            l->ServerAdded(server);
-        }
-    }
-}
-
-void
-Worker::BroadcastServerRemoved(const pitaya::Server& server)
+Worker::BroadcastServersChanged(const std::vector<pitaya::Server>& added,
+                                const std::vector<pitaya::Server>& removed)
 {
     std::lock_guard<decltype(_listeners)> lock(_listeners);
     for (auto l : _listeners) {
         if (l) {
-            l->ServerRemoved(server);
+            l->ServersChanged(added, removed);
         }
     }
 }
@@ -6,8 +6,8 @@
 #include "pitaya/etcd_config.h"
 #include "pitaya/service_discovery.h"
 #include "pitaya/utils/semaphore.h"
+#include "pitaya/utils/snapshot.h"
 #include "pitaya/utils/sync_deque.h"
-#include "pitaya/utils/sync_map.h"
 #include "pitaya/utils/sync_vector.h"
 #include "pitaya/utils/ticker.h"
 #include "spdlog/spdlog.h"
@@ -19,7 +19,11 @@
 #include <etcd/Watcher.hpp>
 #include <pplx/pplxtasks.h>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace pitaya {
 namespace etcdv3_service_discovery {
@@ -75,6 +79,28 @@ private:
     {}
 };
 
+// Immutable view of the known servers. The worker thread publishes a new registry
+// whenever a server is added or removed, readers never lock.
+struct ServerRegistry
+{
+    using ServerList = std::vector<pitaya::Server>;
+
+    struct Entry
+    {
+        pitaya::Server server;
+        // Position of the server in the list of its type.
+        size_t index;
+    };
+
+    // The keys point to the ids held by the servers themselves, which are shared between
+    // copies, so every server is stored only once.
+    std::unordered_map<std::string_view, Entry> serversById;
+    // Dense lists, so that servers are picked by position. A server is removed by moving
+    // the last one of its list to its place. The lists are shared between registries, only
+    // the list of the type that changed is copied.
+    std::unordered_map<std::string, std::shared_ptr<const ServerList>> serversByType;
+};
+
 class Worker
 {
 public:
@@ -86,10 +112,18 @@ public:
 
     boost::optional<pitaya::Server> GetServerById(const std::string& id);
     std::vector<pitaya::Server> GetServersByType(const std::string& type);
+    std::shared_ptr<const std::vector<pitaya::Server>> GetServerListByType(
+        const std::string& type);
     void WaitUntilInitialized();
     void AddListener(service_discovery::Listener* listener);
     void RemoveListener(service_discovery::Listener* listener);
 
+    // Parses the json that a server stores in etcd. Returns none if the json is invalid
+    // or if it does not have the id or the type of the server.
+    static boost::optional<pitaya::Server> ParseServer(
+        const std::string& jsonStr,
+        const std::shared_ptr<spdlog::logger>& log);
+
 private:
     void Shutdown();
     void StartThread();
@@ -97,21 +131,25 @@ private:
     void StartLeaseKeepAlive();
     bool Init();
     bool Bootstrap();
+    // Runs a job other than a watch. Returns false when the worker thread must exit.
+    bool RunJob(const Job& job);
     bool AddServerToEtcd(const pitaya::Server& server);
-    void AddServer(const pitaya::Server& server);
     void SyncServers();
+    bool FullSync();
+    void StartWatch();
+    // Applies a batch of watch events, only the last change of every server counts.
+    void HandleWatches(const std::vector<WatchResponse>& responses);
     void PrintServers();
-    void DeleteServer(const std::string& serverId);
 
     void PrintServer(const pitaya::Server& server);
     void RevokeLease();
-    boost::optional<pitaya::Server> GetServerFromEtcd(const std::string& serverId,
-                                                      const std::string& serverType);
-    void DeleteLocalInvalidServers(const std::vector<std::string>& actualServers);
-    boost::optional<pitaya::Server> ParseServer(const std::string& jsonStr);
 
-    void BroadcastServerAdded(const pitaya::Server& server);
-    void BroadcastServerRemoved(const pitaya::Server& server);
+    // Publishes a single registry with the servers added and removed and notifies the
+    // listeners about the servers that actually changed.
+    void ApplyChanges(std::vector<pitaya::Server> added,
+                      const std::vector<std::string>& removedIds);
+    void BroadcastServersChanged(const std::vector<pitaya::Server>& added,
+                                 const std::vector<pitaya::Server>& removed);
 
 private:
     EtcdServiceDiscoveryConfig _config;
@@ -127,12 +165,15 @@ private:
 
     int _numKeepAliveRetriesLeft;
 
+    // Revision of the last change applied to the registry, either from a full sync or
+    // from the watch. The watch is resumed from the next one. Only used by the worker thread.
+    int64_t _lastRevision;
+
     utils::Ticker _syncServersTicker;
 
     utils::Semaphore _semaphore;
     utils::SyncDeque<Job> _jobQueue;
-    utils::SyncMap<std::string, pitaya::Server> _serversById;
-    utils::SyncMap<std::string, std::unordered_map<std::string, pitaya::Server>> _serversByType;
+    utils::Snapshot<ServerRegistry> _registry;
 
     utils::SyncVector<service_discovery::Listener*> _listeners;
 };
@@ -6,6 +6,7 @@
 
 #include "spdlog/sinks/stdout_color_sinks.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <cpprest/json.h>
 #include <grpcpp/create_channel.h>
@@ -17,6 +18,18 @@ namespace pitaya {
 
 static constexpr const char* kLogTag = "grpc_client";
 
+struct GrpcClient::AsyncCall
+{
+    grpc::ClientContext context;
+    protos::Response res;
+    grpc::Status status;
+    // Keeps the stub alive while the call is running, even if the server is removed.
+    StubPtr stub;
+    pitaya::Server target;
+    CallCallback callback;
+    std::unique_ptr<grpc::ClientAsyncResponseReaderInterface<protos::Response>> reader;
+};
+
 GrpcClient::GrpcClient(GrpcConfig config,
                        std::shared_ptr<service_discovery::ServiceDiscovery> serviceDiscovery,
                        std::unique_ptr<BindingStorage> bindingStorage,
@@ -42,10 +55,19 @@ GrpcClient::GrpcClient(GrpcConfig config,
     , _serviceDiscovery(std::move(serviceDiscovery))
     , _createStub(std::move(createStub))
     , _bindingStorage(std::move(bindingStorage))
+    , _nextCompletionQueue(0)
 {
     assert(_bindingStorage != nullptr);
     assert(_serviceDiscovery != nullptr);
 
+    int numThreads = std::max(_config.clientNumCompletionQueueThreads, 1);
+    for (int i = 0; i < numThreads; ++i) {
+        _completionQueues.emplace_back(new grpc::CompletionQueue());
+    }
+    for (const auto& cq : _completionQueues) {
+        _completionQueueThreads.emplace_back(&GrpcClient::ProcessAsyncCalls, this, cq.get());
+    }
+
     _log->info("Registering gRPC client as a listener to the service discovery");
 
     // FIXME: this call here makes the service discovery call the GRPC client sometimes when the
@@ -59,6 +81,25 @@ GrpcClient::~GrpcClient()
 {
     _log->info("Unregistering gRPC client as a listener to the service discovery");
     _serviceDiscovery->RemoveListener(this);
+
+    // Pending asynchronous calls are cancelled, so that their callbacks are called
+    // before the completion queue threads exit.
+    {
+        std::lock_guard<decltype(_pendingCallsMutex)> lock(_pendingCallsMutex);
+        for (auto call : _pendingCalls) {
+            call->context.TryCancel();
+        }
+    }
+
+    for (const auto& cq : _completionQueues) {
+        cq->Shutdown();
+    }
+
+    for (auto& thread : _completionQueueThreads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
 }
 
 static protos::Response
@@ -78,43 +119,102 @@ GrpcClient::Call(const pitaya::Server& target, const protos::Request& req)
 {
     // In order to send an rpc to a server, we need to first find the connection to the
     // server in the map.
-    {
-        std::lock_guard<decltype(_stubsForServers)> lock(_stubsForServers);
-        if (_stubsForServers.Find(target.Id()) == _stubsForServers.end()) {
-            auto msg = fmt::format(
-                "Cannot call server {}, since it is not added to the connections map", target.Id());
-            _log->error(msg);
-            return NewErrorResponse(constants::kCodeInternalError, msg);
-        } else {
-            _log->debug("Found server on the connections map");
-        }
+    auto stub = FindStub(target.Id());
+    if (!stub) {
+        auto msg = fmt::format(
+            "Cannot call server {}, since it is not added to the connections map", target.Id());
+        _log->error(msg);
+        return NewErrorResponse(constants::kCodeInternalError, msg);
     }
 
-    // The stub is contained in the map. We then retrieve it and call the desired RPC function.
+    _log->debug("Found server on the connections map");
+
+    // NOTE: no lock is held from here on, so calls to different (or the same) servers
+    // run in parallel.
+    protos::Response res;
+    grpc::ClientContext context;
+    _log->debug("Making RPC call with {} milliseconds of timeout", _config.clientRpcTimeout.count());
+    context.set_deadline(std::chrono::system_clock::now() + _config.clientRpcTimeout);
+    auto status = stub->Call(&context, req, &res);
+
+    if (!status.ok()) {
+        return ResponseFromStatus(status, target);
+    }
+
+    return res;
+}
+
+void
+GrpcClient::CallAsync(const pitaya::Server& target,
+                      const protos::Request& req,
+                      CallCallback callback)
+{
+    auto stub = FindStub(target.Id());
+    if (!stub) {
+        auto msg = fmt::format(
+            "Cannot call server {}, since it is not added to the connections map", target.Id());
+        _log->error(msg);
+        callback(NewErrorResponse(constants::kCodeInternalError, msg));
+        return;
+    }
+
+    auto call = new AsyncCall();
+    call->stub = std::move(stub);
+    call->target = target;
+    call->callback = std::move(callback);
+    call->context.set_deadline(std::chrono::system_clock::now() + _config.clientRpcTimeout);
+
     {
-        std::lock_guard<decltype(_stubsForServers)> lock(_stubsForServers);
-        protos::Pitaya::StubInterface* stub = _stubsForServers[target.Id()].get();
-
-        protos::Response res;
-        grpc::ClientContext context;
-        _log->debug("Making RPC call with {} milliseconds of timeout", _config.clientRpcTimeout.count());
-        context.set_deadline(std::chrono::system_clock::now() + _config.clientRpcTimeout);
-        auto status = stub->Call(&context, req, &res);
-        
-        if (!status.ok()) {
-            auto msg = fmt::format("Call RPC failed: error_code = {}, error_message = {}, error_details = {}",
-                                   status.error_code(), status.error_message(), status.error_details());
-            _log->error(msg);
-            _log->error("Server details: id = {}, type = {}, hostname = {}, isFrontend = {}, metadata = {}",
-                        target.Id(), target.Type(), target.Hostname(), target.IsFrontend(), target.Metadata());
-            if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
-                return NewErrorResponse(constants::kCodeTimeout, msg);
-            } else {
-                return NewErrorResponse(constants::kCodeInternalError, msg);
-            }
+        std::lock_guard<decltype(_pendingCallsMutex)> lock(_pendingCallsMutex);
+        _pendingCalls.insert(call);
+    }
+
+    // Spread the calls between the completion queues.
+    auto cq = _completionQueues[_nextCompletionQueue++ % _completionQueues.size()].get();
+
+    call->reader = call->stub->PrepareAsyncCall(&call->context, req, cq);
+    call->reader->StartCall();
+    call->reader->Finish(&call->res, &call->status, call);
+}
+
+void
+GrpcClient::ProcessAsyncCalls(grpc::CompletionQueue* cq)
+{
+    utils::SetThreadName("NPitGrpcClWk", _log);
+
+    void* tag;
+    bool ok;
+    while (cq->Next(&tag, &ok)) {
+        auto call = static_cast<AsyncCall*>(tag);
+
+        {
+            std::lock_guard<decltype(_pendingCallsMutex)> lock(_pendingCallsMutex);
+            _pendingCalls.erase(call);
         }
 
-        return res;
+        // NOTE: the Finish tag of a client call is always returned with ok = true.
+        if (call->status.ok()) {
+            call->callback(std::move(call->res));
+        } else {
+            call->callback(ResponseFromStatus(call->status, call->target));
+        }
+
+        delete call;
+    }
+}
+
+protos::Response
+GrpcClient::ResponseFromStatus(const grpc::Status& status, const pitaya::Server& target)
+{
+    auto msg = fmt::format("Call RPC failed: error_code = {}, error_message = {}, error_details = {}",
+                           status.error_code(), status.error_message(), status.error_details());
+    _log->error(msg);
+    _log->error("Server details: id = {}, type = {}, hostname = {}, isFrontend = {}, metadata = {}",
+                target.Id(), target.Type(), target.Hostname(), target.IsFrontend(), target.Metadata());
+    if (status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED) {
+        return NewErrorResponse(constants::kCodeTimeout, msg);
+    } else {
+        return NewErrorResponse(constants::kCodeInternalError, msg);
     }
 }
 
@@ -137,20 +237,14 @@ GrpcClient::SendPushToUser(const std::string& providedServerId,
         serverId = providedServerId;
     }
 
-    // TODO: It it good to have two locks here instead of one??
-    {
-        std::lock_guard<decltype(_stubsForServers)> lock(_stubsForServers);
-        if (_stubsForServers.Find(serverId) == _stubsForServers.end()) {
-            auto msg = fmt::format(
-                "Cannot push to server {}, since it is not added to the connections map", serverId);
-            _log->error(msg);
-            return PitayaError(constants::kCodeInternalError, msg);
-        }
+    auto stub = FindStub(serverId);
+    if (!stub) {
+        auto msg = fmt::format(
+            "Cannot push to server {}, since it is not added to the connections map", serverId);
+        _log->error(msg);
+        return PitayaError(constants::kCodeInternalError, msg);
     }
 
-    std::lock_guard<decltype(_stubsForServers)> lock(_stubsForServers);
-    protos::Pitaya::StubInterface* stub = _stubsForServers[serverId].get();
-
     protos::Response res;
     grpc::ClientContext context;
     auto status = stub->PushToUser(&context, push, &res);
@@ -187,20 +281,14 @@ GrpcClient::SendKickToUser(const std::string& providedServerId,
         serverId = providedServerId;
     }
 
-    {
-        std::lock_guard<decltype(_stubsForServers)> lock(_stubsForServers);
-        if (_stubsForServers.Find(serverId) == _stubsForServers.end()) {
-            return PitayaError(
-                constants::kCodeInternalError,
-                fmt::format(
-                    "Cannot kick on server {}, since it is not added to the connections map",
-                    serverId));
-        }
+    auto stub = FindStub(serverId);
+    if (!stub) {
+        return PitayaError(
+            constants::kCodeInternalError,
+            fmt::format("Cannot kick on server {}, since it is not added to the connections map",
+                        serverId));
     }
 
-    std::lock_guard<decltype(_stubsForServers)> lock(_stubsForServers);
-    protos::Pitaya::StubInterface* stub = _stubsForServers[serverId].get();
-
     grpc::ClientContext context;
     auto status = stub->KickUser(&context, kick, &kickAns);
 
@@ -219,42 +307,80 @@ GrpcClient::SendKickToUser(const std::string& providedServerId,
 void
 GrpcClient::ServerAdded(const pitaya::Server& server)
 {
-    if (server.Metadata() == "") {
-        // Ignore the server, since it has no metadata.
-        return;
+    ServersChanged({ server }, {});
+}
+
+void
+GrpcClient::ServerRemoved(const pitaya::Server& server)
+{
+    ServersChanged({}, { server });
+}
+
+void
+GrpcClient::ServersChanged(const std::vector<pitaya::Server>& added,
+                           const std::vector<pitaya::Server>& removed)
+{
+    // The channels are created before the connections map is published, so the whole batch
+    // is applied with a single copy of the map.
+    std::vector<std::pair<std::string, StubPtr>> newStubs;
+    newStubs.reserve(added.size());
+    for (const auto& server : added) {
+        if (!server.HasMetadata()) {
+            // Ignore the server, since it has no metadata.
+            continue;
+        }
+
+        // First, we need to get the server host (address and port)
+        std::string address;
+        try {
+            address = utils::GetGrpcAddressFromServer(server);
+        } catch (const PitayaException& exc) {
+            // We were not able to fetch the address from the server,
+            // therefore we just ignoore it.
+            continue;
+        }
+
+        auto channel = grpc::CreateChannel(address, ::grpc::InsecureChannelCredentials());
+        newStubs.emplace_back(server.Id(), StubPtr(_createStub(std::move(channel))));
     }
 
-    // First, we need to get the server host (address and port)
-    std::string address;
-    try {
-        address = utils::GetGrpcAddressFromServer(server);
-    } catch (const PitayaException& exc) {
-        // We were not able to fetch the address from the server,
-        // therefore we just ignoore it.
+    if (newStubs.empty() && removed.empty()) {
         return;
     }
 
-    auto channel = grpc::CreateChannel(address, ::grpc::InsecureChannelCredentials());
-    auto stub = _createStub(std::move(channel));
+    std::vector<std::string> notSynchronized;
+    _stubsForServers.Update([&](StubMap& stubs) {
+        for (const auto& server : removed) {
+            if (stubs.erase(server.Id()) == 0) {
+                notSynchronized.push_back(server.Id());
+            }
+        }
+        for (auto& pair : newStubs) {
+            stubs[pair.first] = std::move(pair.second);
+        }
+    });
+
+    for (const auto& serverId : notSynchronized) {
+        _log->warn("Server {} was removed, however it was not synchronized in the grpc rpc client",
+                   serverId);
+    }
 
-    std::lock_guard<decltype(_stubsForServers)> lock(_stubsForServers);
-    _stubsForServers[server.Id()] = std::move(stub);
-    _log->debug("New server {} added", server.Id());
+    // NOTE: RPCs that are still running hold their own reference to the stub, so it is only
+    // destroyed after they finish.
+    _log->debug("{} servers added and {} servers removed",
+                newStubs.size(),
+                removed.size() - notSynchronized.size());
 }
 
-void
-GrpcClient::ServerRemoved(const pitaya::Server& server)
+GrpcClient::StubPtr
+GrpcClient::FindStub(const std::string& serverId) const
 {
-    std::lock_guard<decltype(_stubsForServers)> lock(_stubsForServers);
-
-    if (_stubsForServers.Find(server.Id()) == _stubsForServers.end()) {
-        _log->warn("Server {} was removed, however it was not synchronized in the grpc rpc client",
-                   server.Id());
-        return;
+    auto stubs = _stubsForServers.Load();
+    auto it = stubs->find(serverId);
+    if (it == stubs->end()) {
+        return nullptr;
     }
-
-    _stubsForServers.Erase(server.Id());
-    _log->debug("Removed server {}", server.Id());
+    return it->second;
 }
 
 } // namespace pitaya
@@ -6,12 +6,18 @@
 #include "pitaya/protos/pitaya.grpc.pb.h"
 #include "pitaya/rpc_client.h"
 #include "pitaya/service_discovery.h"
-#include "pitaya/utils/sync_map.h"
+#include "pitaya/utils/snapshot.h"
 #include "spdlog/spdlog.h"
 
+#include <atomic>
 #include <chrono>
 #include <grpcpp/channel.h>
+#include <grpcpp/completion_queue.h>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace pitaya {
 
@@ -34,6 +40,9 @@ public:
                const char* loggerName = nullptr);
     ~GrpcClient();
     protos::Response Call(const pitaya::Server& target, const protos::Request& req) override;
+    void CallAsync(const pitaya::Server& target,
+                   const protos::Request& req,
+                   CallCallback callback) override;
     boost::optional<PitayaError> SendPushToUser(const std::string& serverId,
                                                 const std::string& serverType,
                                                 const protos::Push& push) override;
@@ -43,14 +52,36 @@ public:
 
     void ServerAdded(const pitaya::Server& server) override;
     void ServerRemoved(const pitaya::Server& server) override;
+    void ServersChanged(const std::vector<pitaya::Server>& added,
+                        const std::vector<pitaya::Server>& removed) override;
+
+private:
+    using StubPtr = std::shared_ptr<protos::Pitaya::StubInterface>;
+    using StubMap = std::unordered_map<std::string, StubPtr>;
+
+    struct AsyncCall;
+
+    // Returns the stub for the given server or nullptr if it is not on the connections map.
+    // The returned stub stays valid even if the server is removed while the RPC is running.
+    StubPtr FindStub(const std::string& serverId) const;
+    protos::Response ResponseFromStatus(const grpc::Status& status,
+                                        const pitaya::Server& target);
+    void ProcessAsyncCalls(grpc::CompletionQueue* cq);
 
 private:
     std::shared_ptr<spdlog::logger> _log;
     GrpcConfig _config;
-    utils::SyncMap<std::string, std::unique_ptr<protos::Pitaya::StubInterface>> _stubsForServers;
+    utils::Snapshot<StubMap> _stubsForServers;
     std::shared_ptr<service_discovery::ServiceDiscovery> _serviceDiscovery;
     CreateStubFunc _createStub;
     std::unique_ptr<BindingStorage> _bindingStorage;
+
+    std::vector<std::unique_ptr<grpc::CompletionQueue>> _completionQueues;
+    std::vector<std::thread> _completionQueueThreads;
+    std::atomic_uint _nextCompletionQueue;
+    // Asynchronous calls that did not finish yet. They are cancelled when the client is destroyed.
+    std::mutex _pendingCallsMutex;
+    std::unordered_set<AsyncCall*> _pendingCalls;
 };
 
 } // namespace pitaya
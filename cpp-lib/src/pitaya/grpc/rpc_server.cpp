@@ -8,14 +8,20 @@
 
 #include "spdlog/sinks/stdout_color_sinks.h"
 
+#include <algorithm>
+#include <boost/optional.hpp>
 #include <cpprest/json.h>
+#include <cstddef>
 #include <functional>
+#include <google/protobuf/arena.h>
 #include <grpcpp/server_builder.h>
 #include <thread>
 
 using namespace grpc;
 
-class CallData : public pitaya::Rpc
+class CallData
+    : public pitaya::Rpc
+    , public pitaya::utils::IntrusiveListNode<CallData>
 {
 public:
     enum class Status
@@ -26,24 +32,49 @@ public:
     };
 
     Status status;
-    ServerContext ctx;
+    // The context and the responder cannot be reused between calls, therefore they are
+    // recreated in place whenever the CallData is reused.
+    boost::optional<ServerContext> ctx;
+    // Moved to the handler, therefore it is parsed into a new message by every call.
     protos::Request request;
-    protos::Response response;
-    ServerAsyncResponseWriter<protos::Response> responder;
+    boost::optional<ServerAsyncResponseWriter<protos::Response>> responder;
     std::atomic_bool isValid;
 
-    explicit CallData()
+    CallData()
         : status(Status::Create)
-        , responder(&ctx)
         , isValid(true)
-    {}
+        , _arena(MakeArenaOptions(_arenaBlock, sizeof(_arenaBlock)))
+    {
+        ctx.emplace();
+        responder.emplace(ctx.get_ptr());
+    }
+
+    // Prepares the instance to receive a new call.
+    void Reset()
+    {
+        status = Status::Create;
+        responder = boost::none;
+        ctx = boost::none;
+        ctx.emplace();
+        responder.emplace(ctx.get_ptr());
+        request.Clear();
+        _arena.Reset();
+        isValid = true;
+    }
 
-    void Finish(protos::Response res) override
+    // Messages created here live until the CallData is reset. As long as they fit in the
+    // initial arena block, creating them does not allocate.
+    protos::Response* CreateResponse()
+    {
+        return google::protobuf::Arena::CreateMessage<protos::Response>(&_arena);
+    }
+
+    void Finish(const protos::Response& res) override
     {
         // TODO: use the right memory order.
         if (isValid) {
             status = Status::Finish;
-            responder.Finish(res, grpc::Status::OK, this);
+            responder->Finish(res, grpc::Status::OK, this);
         } else {
             // NOTE(leo): The case where a CallData is not valid is whenever the
             // server is Shutdown and Finish is called after that. In such cases,
@@ -52,6 +83,61 @@ public:
             delete this;
         }
     }
+
+private:
+    static constexpr size_t kArenaBlockSize = 1024;
+
+    static google::protobuf::ArenaOptions MakeArenaOptions(char* block, size_t size)
+    {
+        google::protobuf::ArenaOptions options;
+        options.initial_block = block;
+        options.initial_block_size = size;
+        return options;
+    }
+
+    alignas(std::max_align_t) char _arenaBlock[kArenaBlockSize];
+    google::protobuf::Arena _arena;
+};
+
+//
+// Finished CallData instances of a completion queue thread, kept to be reused by the
+// next calls. Every tag of a CallData comes back on the completion queue that requested
+// it, therefore the pool is only ever used by a single thread.
+//
+class CallDataPool
+{
+public:
+    ~CallDataPool()
+    {
+        for (auto callData : _free) {
+            delete callData;
+        }
+    }
+
+    CallData* Acquire()
+    {
+        if (_free.empty()) {
+            return new CallData();
+        }
+        auto callData = _free.back();
+        _free.pop_back();
+        callData->Reset();
+        return callData;
+    }
+
+    void Release(CallData* callData)
+    {
+        if (_free.size() >= kMaxSize) {
+            delete callData;
+            return;
+        }
+        _free.push_back(callData);
+    }
+
+private:
+    static constexpr size_t kMaxSize = 256;
+
+    std::vector<CallData*> _free;
 };
 
 namespace pitaya {
@@ -63,8 +149,16 @@ GrpcServer::GrpcServer(GrpcConfig config, const char* loggerName)
     , _handlerFunc(nullptr)
     , _shuttingDown(false)
     , _config(std::move(config))
+    , _numThreads(_config.serverNumThreads > 0 ? _config.serverNumThreads
+                                               : std::thread::hardware_concurrency())
     , _service(new protos::Pitaya::AsyncService())
-{}
+    , _numInProcessRpcs(0)
+{
+    // hardware_concurrency may return zero when it cannot tell.
+    if (_numThreads == 0) {
+        _numThreads = 1;
+    }
+}
 
 GrpcServer::~GrpcServer()
 {
@@ -79,8 +173,7 @@ GrpcServer::Start(pitaya::RpcHandlerFunc handler)
     const auto address = _config.host + ":" + std::to_string(_config.port);
     grpc::ServerBuilder builder;
 
-    auto concurrentThreadsSupported = std::thread::hardware_concurrency();
-    for (unsigned i = 0; i < concurrentThreadsSupported; i++) {
+    for (unsigned i = 0; i < _numThreads; i++) {
         _completionQueues.push_back(builder.AddCompletionQueue());
     }
 
@@ -92,8 +185,10 @@ GrpcServer::Start(pitaya::RpcHandlerFunc handler)
         throw PitayaException(fmt::format("Failed to start gRPC server at address {}", address));
     }
 
-    _log->info(
-        "gRPC server started at {} with {} grpc threads", address, concurrentThreadsSupported);
+    _log->info("gRPC server started at {} with {} grpc threads{}",
+               address,
+               _numThreads,
+               _config.serverShardedDispatch ? " and sharded dispatch" : "");
 
     for (size_t i = 0; i < _completionQueues.size(); ++i) {
         _workerThreads.emplace_back(
@@ -144,16 +239,27 @@ GrpcServer::Shutdown()
     _log->info("Shutdown complete");
 }
 
+size_t
+GrpcServer::NumDispatchShards() const
+{
+    return _config.serverShardedDispatch ? _numThreads : 1;
+}
+
 void
 GrpcServer::ProcessRpcs(ServerCompletionQueue* cq, int threadId)
 {
     utils::SetThreadName("NPitGrpcSvWk", _log);
+    if (_config.serverPinThreads) {
+        // Thread ids start at one.
+        const unsigned numCpus = std::max(1u, std::thread::hardware_concurrency());
+        utils::SetThreadAffinity((threadId - 1) % numCpus, _log);
+    }
     // _log->info("Started processing rpcs on thread {}", threadId);
 
     // Request the first rpc so that the first tag can be
     // received from Next.
-    auto callData = new CallData();
-    ProcessCallData(callData, cq, threadId);
+    CallDataPool pool;
+    ProcessCallData(pool.Acquire(), cq, &pool, threadId);
 
     for (;;) {
         void* tag; // uniquely identifies a request.
@@ -179,18 +285,29 @@ GrpcServer::ProcessRpcs(ServerCompletionQueue* cq, int threadId)
             } else {
                 assert(false);
             }
+            // An RPC that was accepted is still in the list, unless it was invalidated.
+            {
+                std::lock_guard<decltype(_inProcessRpcs)> lock(_inProcessRpcs);
+                if (callData->IsLinked()) {
+                    _inProcessRpcs.Erase(callData);
+                    _numInProcessRpcs.fetch_sub(1);
+                }
+            }
             delete callData;
             continue;
         }
 
         // _log->debug("[thread {}] Got a new tag", threadId);
 
-        ProcessCallData(callData, cq, threadId);
+        ProcessCallData(callData, cq, &pool, threadId);
     }
 }
 
 void
-GrpcServer::ProcessCallData(CallData* callData, ServerCompletionQueue* cq, int threadId)
+GrpcServer::ProcessCallData(CallData* callData,
+                            ServerCompletionQueue* cq,
+                            CallDataPool* pool,
+                            int threadId)
 {
     assert(callData);
     assert(cq);
@@ -199,8 +316,12 @@ GrpcServer::ProcessCallData(CallData* callData, ServerCompletionQueue* cq, int t
         case CallData::Status::Create: {
             _log->debug("[thread {}] CREATE", threadId);
             // Request for a new Call RPC from the pitaya async service.
-            _service->RequestCall(
-                &callData->ctx, &callData->request, &callData->responder, cq, cq, callData);
+            _service->RequestCall(callData->ctx.get_ptr(),
+                                  &callData->request,
+                                  callData->responder.get_ptr(),
+                                  cq,
+                                  cq,
+                                  callData);
             callData->status = CallData::Status::Process;
             break;
         }
@@ -210,8 +331,7 @@ GrpcServer::ProcessCallData(CallData* callData, ServerCompletionQueue* cq, int t
             // TODO: use the correct memory order for _shuttingDown.
             if (!_shuttingDown.load()) {
                 // _log->debug("[thread {}] Adding new call data at thread", threadId);
-                auto nextCallData = new CallData();
-                ProcessCallData(nextCallData, cq, threadId);
+                ProcessCallData(pool->Acquire(), cq, pool, threadId);
             }
             
             // --------------------------------------------------------------------------------
@@ -219,50 +339,49 @@ GrpcServer::ProcessCallData(CallData* callData, ServerCompletionQueue* cq, int t
             // If that is the case, simply ignore it.
             // --------------------------------------------------------------------------------
 
-            // We lock the current in process RPCs vector and check wether there is enough space
-            // to process another RPC.
-            std::lock_guard<decltype(_inProcessRpcs)> lock(_inProcessRpcs);
-
-            const bool slotsAvailable = _inProcessRpcs.Size() < _config.serverMaxNumberOfRpcs;
+            // Reserve a slot for the RPC, giving it back if there is no space to process it.
+            const int numInProcessRpcs = _numInProcessRpcs.fetch_add(1) + 1;
             const bool infiniteSlots = _config.serverMaxNumberOfRpcs == -1;
 
-            if (infiniteSlots || slotsAvailable) {
-                _inProcessRpcs.PushBack(callData);
+            if (infiniteSlots || numInProcessRpcs <= _config.serverMaxNumberOfRpcs) {
+                {
+                    std::lock_guard<decltype(_inProcessRpcs)> lock(_inProcessRpcs);
+                    _inProcessRpcs.PushBack(callData);
+                }
                 _log->debug("[thread {}] Will start processing the next RPC ({}/{} rpcs)",
                             threadId,
-                            _inProcessRpcs.Size(),
+                            numInProcessRpcs,
                             _config.serverMaxNumberOfRpcs);
-                _handlerFunc(callData->request, callData);
+                _handlerFunc(std::move(callData->request), callData);
             } else {
+                _numInProcessRpcs.fetch_sub(1);
                 _log->warn("The server is under maximum load, cannot process RPC");
                 // There are no space for processing RPCs anymore. We then just return an error
                 // to the client.
-                auto err = new protos::Error();
+                auto errorRes = callData->CreateResponse();
+                auto err = errorRes->mutable_error();
                 err->set_code(constants::kCodeServiceUnavailable);
                 err->set_msg("The server is under maximum load, cannot process RPC");
 
-                protos::Response errorRes;
-                errorRes.set_allocated_error(err);
-
-                callData->Finish(errorRes);
+                callData->Finish(*errorRes);
             }
 
             break;
         }
         case CallData::Status::Finish: {
             // _log->debug("[thread {}] FINISH", threadId);
-            // The RPC was finished. Therefore we remove from the _inProcessRpcs vector.
-            std::lock_guard<decltype(_inProcessRpcs)> lock(_inProcessRpcs);
-            auto it = std::find(_inProcessRpcs.begin(), _inProcessRpcs.end(), callData);
-            if (it != _inProcessRpcs.end()) {
-                _inProcessRpcs.Erase(it);
-                // _log->debug("[thread {}] Decreasing number of in process rpcs: {}",
-                //             threadId,
-                //             _inProcessRpcs.Size());
+            // The RPC was finished. Therefore we remove it from the in process rpcs.
+            // Rejected rpcs were never added, and invalidated ones were already removed.
+            {
+                std::lock_guard<decltype(_inProcessRpcs)> lock(_inProcessRpcs);
+                if (callData->IsLinked()) {
+                    _inProcessRpcs.Erase(callData);
+                    _numInProcessRpcs.fetch_sub(1);
+                }
             }
 
-            // The RPC was finished. Therefore we delete the CallData instance.
-            delete callData;
+            // The RPC was finished. Therefore we give the CallData instance back to the pool.
+            pool->Release(callData);
             break;
         }
     }
@@ -282,6 +401,8 @@ GrpcServer::InvalidateInProcessRpcs()
         rpc->isValid.store(false);
     }
 
+    // RPCs that reserved a slot but were not pushed to the list yet keep it until they finish.
+    _numInProcessRpcs.fetch_sub(static_cast<int>(_inProcessRpcs.Size()));
     _inProcessRpcs.Clear();
 }
 
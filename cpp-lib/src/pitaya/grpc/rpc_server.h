@@ -7,7 +7,7 @@
 #include "pitaya/protos/request.pb.h"
 #include "pitaya/protos/response.pb.h"
 #include "pitaya/rpc_server.h"
-#include "pitaya/utils/sync_vector.h"
+#include "pitaya/utils/sync_intrusive_list.h"
 
 #include "spdlog/logger.h"
 
@@ -17,6 +17,7 @@
 
 class PitayaGrpcImpl;
 class CallData;
+class CallDataPool;
 
 namespace pitaya {
 
@@ -30,10 +31,15 @@ public:
 
     void Shutdown() override;
 
+    size_t NumDispatchShards() const override;
+
 private:
     void ThreadStart();
     void ProcessRpcs(grpc::ServerCompletionQueue* cq, int threadId);
-    void ProcessCallData(CallData* callData, grpc::ServerCompletionQueue* cq, int threadId);
+    void ProcessCallData(CallData* callData,
+                         grpc::ServerCompletionQueue* cq,
+                         CallDataPool* pool,
+                         int threadId);
     void InvalidateInProcessRpcs();
 
 private:
@@ -41,13 +47,16 @@ private:
     RpcHandlerFunc _handlerFunc;
     std::atomic_bool _shuttingDown;
     GrpcConfig _config;
+    unsigned _numThreads;
     std::unique_ptr<grpc::Server> _grpcServer;
     std::unique_ptr<protos::Pitaya::AsyncService> _service;
     std::vector<std::thread> _workerThreads;
     std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> _completionQueues;
 
-    // Tracks the number of RPCs that are being processed.
-    utils::SyncVector<CallData*> _inProcessRpcs;
+    // Tracks the RPCs that are being processed, so that they can be invalidated on shutdown.
+    // The counter is kept apart from the list so that admission does not need the lock.
+    utils::SyncIntrusiveList<CallData> _inProcessRpcs;
+    std::atomic_int _numInProcessRpcs;
 };
 
 } // namespace pitaya
@@ -0,0 +1,217 @@
+#include "pitaya/load_balancer.h"
+
+#include "pitaya/consistent_hash_ring.h"
+#include "pitaya/utils.h"
+#include "pitaya/utils/snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <random>
+#include <unordered_map>
+
+using std::string;
+using std::vector;
+
+namespace pitaya {
+
+namespace {
+
+class RandomLoadBalancer : public LoadBalancer
+{
+public:
+    Server Pick(const vector<Server>& servers, const protos::Request& req) override
+    {
+        return utils::RandomServer(servers);
+    }
+};
+
+class RoundRobinLoadBalancer : public LoadBalancer
+{
+public:
+    RoundRobinLoadBalancer()
+        : _next(0)
+    {}
+
+    Server Pick(const vector<Server>& servers, const protos::Request& req) override
+    {
+        return servers[_next.fetch_add(1, std::memory_order_relaxed) % servers.size()];
+    }
+
+private:
+    std::atomic<size_t> _next;
+};
+
+class PowerOfTwoChoicesLoadBalancer : public LoadBalancer
+{
+public:
+    Server Pick(const vector<Server>& servers, const protos::Request& req) override
+    {
+        if (servers.size() == 1) {
+            return servers[0];
+        }
+
+        auto& engine = utils::RandomEngine();
+        std::uniform_int_distribution<size_t> dist(0, servers.size() - 1);
+        size_t first = dist(engine);
+        // Picks a second index different from the first one.
+        size_t second = std::uniform_int_distribution<size_t>(0, servers.size() - 2)(engine);
+        if (second >= first) {
+            ++second;
+        }
+
+        auto stats = _stats.Load();
+        auto firstStats = Find(*stats, servers[first].Id());
+        auto secondStats = Find(*stats, servers[second].Id());
+        if (!firstStats || !secondStats) {
+            // Servers without stats did not receive any RPC yet, they are the best choice.
+            return !firstStats ? servers[first] : servers[second];
+        }
+
+        auto firstInFlight = firstStats->inFlight.load(std::memory_order_relaxed);
+        auto secondInFlight = secondStats->inFlight.load(std::memory_order_relaxed);
+        if (firstInFlight != secondInFlight) {
+            return firstInFlight < secondInFlight ? servers[first] : servers[second];
+        }
+        return firstStats->latencyNs.load(std::memory_order_relaxed) <=
+                       secondStats->latencyNs.load(std::memory_order_relaxed)
+                   ? servers[first]
+                   : servers[second];
+    }
+
+    // The token is the stats the RPC was counted in, so the RPC is taken out of the same
+    // stats even if the server was removed or added again while it was in flight.
+    RpcToken RpcStarted(const string& serverId) override
+    {
+        auto stats = Find(*_stats.Load(), serverId);
+        if (!stats) {
+            // The server was removed, or its addition was not reported yet.
+            return nullptr;
+        }
+        stats->inFlight.fetch_add(1, std::memory_order_relaxed);
+        return stats;
+    }
+
+    void RpcFinished(const string& serverId,
+                     std::chrono::nanoseconds latency,
+                     const RpcToken& token) override
+    {
+        if (!token) {
+            // The start of the RPC was not counted.
+            return;
+        }
+        auto stats = static_cast<Stats*>(token.get());
+        stats->inFlight.fetch_sub(1, std::memory_order_relaxed);
+
+        // Exponentially weighted moving average with a weight of 1/8 for the new sample.
+        int64_t sample = latency.count();
+        int64_t average = stats->latencyNs.load(std::memory_order_relaxed);
+        int64_t updated;
+        do {
+            updated = average == 0 ? sample : average + (sample - average) / 8;
+        } while (!stats->latencyNs.compare_exchange_weak(
+            average, updated, std::memory_order_relaxed));
+    }
+
+    void ServerAdded(const Server& server) override { ServersChanged({ server }, {}); }
+
+    void ServerRemoved(const Server& server) override { ServersChanged({}, { server }); }
+
+    // Only the servers reported by service discovery have stats, so the map does not grow
+    // with RPCs sent to servers that were already removed.
+    void ServersChanged(const vector<Server>& added, const vector<Server>& removed) override
+    {
+        auto stats = _stats.Load();
+        auto hasStats = [&stats](const Server& s) { return stats->count(s.Id()) > 0; };
+        if (!std::all_of(added.begin(), added.end(), hasStats) ||
+            std::any_of(removed.begin(), removed.end(), hasStats)) {
+            _stats.Update([&added, &removed](StatsMap& map) {
+                for (const auto& server : removed) {
+                    map.erase(server.Id());
+                }
+                for (const auto& server : added) {
+                    auto& entry = map[server.Id()];
+                    if (!entry) {
+                        entry = std::make_shared<Stats>();
+                    }
+                }
+            });
+        }
+    }
+
+private:
+    struct Stats
+    {
+        std::atomic<int64_t> inFlight{ 0 };
+        std::atomic<int64_t> latencyNs{ 0 };
+    };
+
+    using StatsMap = std::unordered_map<string, std::shared_ptr<Stats>>;
+
+    static std::shared_ptr<Stats> Find(const StatsMap& map, const string& serverId)
+    {
+        auto it = map.find(serverId);
+        return it == map.end() ? nullptr : it->second;
+    }
+
+private:
+    utils::Snapshot<StatsMap> _stats;
+};
+
+// Cluster::RPCByKey uses the ring of this load balancer, so route based RPCs of a user go to
+// the same server as the RPCs keyed by its uid.
+class ConsistentHashLoadBalancer : public LoadBalancer
+{
+public:
+    ConsistentHashLoadBalancer()
+        : _ring(std::make_shared<ConsistentHashRing>())
+    {}
+
+    Server Pick(const vector<Server>& servers, const protos::Request& req) override
+    {
+        const string& key = req.session().uid();
+        if (!key.empty()) {
+            auto server = _ring->ServerForKey(servers[0].Type(), key);
+            if (server) {
+                return std::move(*server);
+            }
+        }
+        // The request has no uid, or the ring was not updated with the servers yet.
+        return utils::RandomServer(servers);
+    }
+
+    std::shared_ptr<ConsistentHashRing> HashRing() const override { return _ring; }
+
+    void ServerAdded(const Server& server) override { _ring->ServerAdded(server); }
+
+    void ServerRemoved(const Server& server) override { _ring->ServerRemoved(server); }
+
+    void ServersChanged(const vector<Server>& added, const vector<Server>& removed) override
+    {
+        _ring->ServersChanged(added, removed);
+    }
+
+private:
+    std::shared_ptr<ConsistentHashRing> _ring;
+};
+
+} // namespace
+
+std::shared_ptr<LoadBalancer>
+CreateLoadBalancer(LoadBalancingStrategy strategy)
+{
+    switch (strategy) {
+        case LoadBalancingStrategy::Random:
+            return std::make_shared<RandomLoadBalancer>();
+        case LoadBalancingStrategy::RoundRobin:
+            return std::make_shared<RoundRobinLoadBalancer>();
+        case LoadBalancingStrategy::PowerOfTwoChoices:
+            return std::make_shared<PowerOfTwoChoicesLoadBalancer>();
+        case LoadBalancingStrategy::ConsistentHash:
+            return std::make_shared<ConsistentHashLoadBalancer>();
+    }
+    assert(false && "unknown load balancing strategy");
+    return std::make_shared<RandomLoadBalancer>();
+}
+
+} // namespace pitaya
@@ -2,15 +2,19 @@
 
 #include "pitaya.h"
 #include "pitaya/constants.h"
+#include "pitaya/nats_connection_pool.h"
 #include "pitaya/nats_config.h"
 #include "pitaya/protos/kick.pb.h"
 #include "pitaya/protos/request.pb.h"
 #include "pitaya/protos/response.pb.h"
 #include "pitaya/utils.h"
+#include "pitaya/utils/protobuf.h"
 
 #include "spdlog/sinks/stdout_color_sinks.h"
 
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
 #include <string>
 
 using std::string;
@@ -22,10 +26,9 @@ static constexpr const char* kLogTag = "nats_rpc_client";
 namespace pitaya {
 
 NatsRpcClient::NatsRpcClient(const NatsConfig& config, const char* loggerName)
-    : NatsRpcClient(
-          config,
-          std::unique_ptr<NatsClient>(new NatsClientImpl(NatsApiType::Synchronous, config, loggerName)),
-          loggerName)
+    : NatsRpcClient(config,
+                    CreateNatsClient(NatsApiType::Synchronous, config, loggerName),
+                    loggerName)
 {}
 
 NatsRpcClient::NatsRpcClient(const NatsConfig& config,
@@ -34,6 +37,8 @@ NatsRpcClient::NatsRpcClient(const NatsConfig& config,
     : _log(utils::CloneLoggerOrCreate(loggerName, kLogTag))
     , _natsClient(std::move(natsClient))
     , _requestTimeout(config.requestTimeout)
+    , _publishPushesWithoutAck(config.publishPushesWithoutAck)
+    , _callServerTypes(config.serverQueueGroupByType)
 {
     _log->info("nats rpc client configured!");
 }
@@ -44,17 +49,9 @@ NatsRpcClient::~NatsRpcClient()
     _log->flush();
 }
 
-protos::Response
-NatsRpcClient::Call(const pitaya::Server& target, const protos::Request& req)
+static protos::Response
+ResponseFromReply(natsStatus status, const std::shared_ptr<NatsMsg>& reply)
 {
-    auto topic = utils::GetTopicForServer(target.Id(), target.Type());
-
-    std::vector<uint8_t> buffer(req.ByteSizeLong());
-    req.SerializeToArray(buffer.data(), buffer.size());
-
-    std::shared_ptr<NatsMsg> reply;
-    natsStatus status = _natsClient->Request(&reply, topic, buffer, _requestTimeout);
-
     protos::Response res;
 
     if (status != NATS_OK) {
@@ -76,6 +73,71 @@ NatsRpcClient::Call(const pitaya::Server& target, const protos::Request& req)
     return res;
 }
 
+protos::Response
+NatsRpcClient::Call(const pitaya::Server& target, const protos::Request& req)
+{
+    return CallTopic(utils::GetTopicForServer(target.Id(), target.Type()), req);
+}
+
+void
+NatsRpcClient::CallAsync(const pitaya::Server& target,
+                         const protos::Request& req,
+                         CallCallback callback)
+{
+    CallTopicAsync(utils::GetTopicForServer(target.Id(), target.Type()), req, std::move(callback));
+}
+
+protos::Response
+NatsRpcClient::CallServerType(const std::string& serverType, const protos::Request& req)
+{
+    return CallTopic(utils::GetTopicForServerType(serverType), req);
+}
+
+void
+NatsRpcClient::CallServerTypeAsync(const std::string& serverType,
+                                   const protos::Request& req,
+                                   CallCallback callback)
+{
+    CallTopicAsync(utils::GetTopicForServerType(serverType), req, std::move(callback));
+}
+
+protos::Response
+NatsRpcClient::CallTopic(const std::string& topic, const protos::Request& req)
+{
+    size_t size;
+    auto data = utils::SerializeToThreadBuffer(req, &size);
+
+    std::shared_ptr<NatsMsg> reply;
+    natsStatus status = _natsClient->Request(&reply, topic, data, size, _requestTimeout);
+
+    return ResponseFromReply(status, reply);
+}
+
+void
+NatsRpcClient::CallTopicAsync(const std::string& topic,
+                              const protos::Request& req,
+                              CallCallback callback)
+{
+    size_t size;
+    auto data = utils::SerializeToThreadBuffer(req, &size);
+
+    // The callback is shared so that it is still available here if the request could not
+    // be sent, in which case the nats client never calls it.
+    auto sharedCallback = std::make_shared<CallCallback>(std::move(callback));
+    natsStatus status = _natsClient->RequestAsync(
+        topic,
+        data,
+        size,
+        _requestTimeout,
+        [sharedCallback](natsStatus status, std::shared_ptr<NatsMsg> reply) {
+            (*sharedCallback)(ResponseFromReply(status, reply));
+        });
+
+    if (status != NATS_OK) {
+        (*sharedCallback)(ResponseFromReply(status, nullptr));
+    }
+}
+
 optional<PitayaError>
 NatsRpcClient::SendKickToUser(const std::string& serverId,
                               const std::string& serverType,
@@ -93,29 +155,7 @@ NatsRpcClient::SendKickToUser(const std::string& serverId,
                            "SendKickToUser received an empty server type");
     }
 
-    std::string topic = utils::GetUserKickTopic(kick.userid(), serverType);
-
-    std::vector<uint8_t> buffer(kick.ByteSizeLong());
-    kick.SerializeToArray(buffer.data(), buffer.size());
-
-    std::shared_ptr<NatsMsg> reply;
-    natsStatus status = _natsClient->Request(&reply, topic, buffer, _requestTimeout);
-
-    optional<PitayaError> error;
-
-    if (status != NATS_OK) {
-        if (status == NATS_TIMEOUT) {
-            error = PitayaError(constants::kCodeTimeout, "nats timeout - sending kick to user");
-        } else {
-            std::string err_str("nats error - ");
-            err_str.append(natsStatus_GetText(status));
-            error = PitayaError(constants::kCodeInternalError, err_str);
-        }
-    } else {
-        error = boost::none;
-    }
-
-    return error;
+    return SendToUser(utils::GetUserKickTopic(kick.userid(), serverType), kick, "kick");
 }
 
 optional<PitayaError>
@@ -135,29 +175,118 @@ NatsRpcClient::SendPushToUser(const std::string& serverId,
                            "SendKickToUser received an empty server type");
     }
 
-    std::string topic = utils::GetUserMessagesTopic(push.uid(), serverType);
+    return SendToUser(utils::GetUserMessagesTopic(push.uid(), serverType), push, "push");
+}
 
-    std::vector<uint8_t> buffer(push.ByteSizeLong());
-    push.SerializeToArray(buffer.data(), buffer.size());
+optional<PitayaError>
+NatsRpcClient::SendPushesToUsers(const std::string& serverType,
+                                 const std::vector<protos::Push>& pushes)
+{
+    if (serverType.empty()) {
+        return PitayaError(constants::kCodeInternalError,
+                           "SendPushesToUsers received an empty server type");
+    }
 
-    std::shared_ptr<NatsMsg> reply;
-    natsStatus status = _natsClient->Request(&reply, topic, buffer, _requestTimeout);
+    // Nothing is sent if any push is invalid, so that the caller knows none was delivered.
+    for (const auto& push : pushes) {
+        if (push.uid().empty()) {
+            return PitayaError(constants::kCodeInternalError, "Received an empty user id");
+        }
+    }
 
-    optional<PitayaError> error;
+    if (_publishPushesWithoutAck) {
+        for (const auto& push : pushes) {
+            auto error =
+                SendToUser(utils::GetUserMessagesTopic(push.uid(), serverType), push, "push");
+            if (error) {
+                return error;
+            }
+        }
+        return boost::none;
+    }
 
-    if (status != NATS_OK) {
-        if (status == NATS_TIMEOUT) {
-            error = PitayaError(constants::kCodeTimeout, "nats timeout - sending push to user");
-        } else {
-            std::string err_str("nats error - ");
-            err_str.append(natsStatus_GetText(status));
-            error = PitayaError(constants::kCodeInternalError, err_str);
+    // Every push is sent before waiting for the acknowledgements, so the batch waits for
+    // about one round trip instead of one per push.
+    struct Acks
+    {
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t numPending = 0;
+        std::vector<natsStatus> statuses;
+    };
+    auto acks = std::make_shared<Acks>();
+    acks->statuses.resize(pushes.size(), NATS_OK);
+
+    for (size_t i = 0; i < pushes.size(); ++i) {
+        size_t size;
+        auto data = utils::SerializeToThreadBuffer(pushes[i], &size);
+        {
+            std::lock_guard<std::mutex> lock(acks->mutex);
+            ++acks->numPending;
+        }
+        natsStatus status = _natsClient->RequestAsync(
+            utils::GetUserMessagesTopic(pushes[i].uid(), serverType),
+            data,
+            size,
+            _requestTimeout,
+            [acks, i](natsStatus status, std::shared_ptr<NatsMsg> reply) {
+                (void)reply;
+                std::lock_guard<std::mutex> lock(acks->mutex);
+                acks->statuses[i] = status;
+                if (--acks->numPending == 0) {
+                    acks->done.notify_all();
+                }
+            });
+        if (status != NATS_OK) {
+            // The callback is never called for a request that was not sent.
+            std::lock_guard<std::mutex> lock(acks->mutex);
+            acks->statuses[i] = status;
+            --acks->numPending;
         }
+    }
+
+    std::unique_lock<std::mutex> lock(acks->mutex);
+    acks->done.wait(lock, [&acks] { return acks->numPending == 0; });
+    for (auto status : acks->statuses) {
+        if (status != NATS_OK) {
+            return StatusError(status, "push");
+        }
+    }
+    return boost::none;
+}
+
+optional<PitayaError>
+NatsRpcClient::SendToUser(const std::string& topic,
+                          const google::protobuf::MessageLite& msg,
+                          const char* what)
+{
+    size_t size;
+    auto data = utils::SerializeToThreadBuffer(msg, &size);
+
+    natsStatus status;
+    if (_publishPushesWithoutAck) {
+        status = _natsClient->Publish(topic.c_str(), data, size);
     } else {
-        error = boost::none;
+        std::shared_ptr<NatsMsg> reply;
+        status = _natsClient->Request(&reply, topic, data, size, _requestTimeout);
     }
 
-    return error;
+    if (status == NATS_OK) {
+        return boost::none;
+    }
+    return StatusError(status, what);
+}
+
+PitayaError
+NatsRpcClient::StatusError(natsStatus status, const char* what)
+{
+    if (status == NATS_TIMEOUT) {
+        return PitayaError(constants::kCodeTimeout,
+                           std::string("nats timeout - sending ") + what + " to user");
+    }
+    std::string err_str("nats error - ");
+    err_str.append(natsStatus_GetText(status));
+    return PitayaError(constants::kCodeInternalError, err_str);
 }
 
 } // namespace pitaya
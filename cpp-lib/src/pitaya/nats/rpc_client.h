@@ -9,7 +9,9 @@
 #include "pitaya/rpc_client.h"
 #include "spdlog/spdlog.h"
 
+#include <google/protobuf/message_lite.h>
 #include <string>
+#include <vector>
 
 namespace pitaya {
 
@@ -22,17 +24,49 @@ public:
     NatsRpcClient(const NatsConfig& config, const char* loggerName = nullptr);
     ~NatsRpcClient();
     protos::Response Call(const pitaya::Server& target, const protos::Request& req) override;
+    void CallAsync(const pitaya::Server& target,
+                   const protos::Request& req,
+                   CallCallback callback) override;
+    // True when the servers join the queue group of their type (see
+    // NatsConfig::serverQueueGroupByType).
+    bool CallsServerTypes() const override { return _callServerTypes; }
+    protos::Response CallServerType(const std::string& serverType,
+                                    const protos::Request& req) override;
+    void CallServerTypeAsync(const std::string& serverType,
+                             const protos::Request& req,
+                             CallCallback callback) override;
     boost::optional<PitayaError> SendPushToUser(const std::string& serverId,
                                                 const std::string& serverType,
                                                 const protos::Push& push) override;
     boost::optional<PitayaError> SendKickToUser(const std::string& serverId,
                                                 const std::string& serverType,
                                                 const protos::KickMsg& kick) override;
+    // Checks every push before sending any. Unless NatsConfig::publishPushesWithoutAck is
+    // set, every push is sent as an asynchronous request and the batch waits once for all
+    // of the acknowledgements. Returns the error of the first push that failed.
+    boost::optional<PitayaError> SendPushesToUsers(
+        const std::string& serverType,
+        const std::vector<protos::Push>& pushes) override;
 
 private:
+    protos::Response CallTopic(const std::string& topic, const protos::Request& req);
+    void CallTopicAsync(const std::string& topic,
+                        const protos::Request& req,
+                        CallCallback callback);
+
+    // Sends a push or a kick, waiting for the acknowledgement unless the client is
+    // configured not to. `what` describes the message in errors.
+    boost::optional<PitayaError> SendToUser(const std::string& topic,
+                                            const google::protobuf::MessageLite& msg,
+                                            const char* what);
+    // Error of a push or a kick that could not be sent or acknowledged.
+    static PitayaError StatusError(natsStatus status, const char* what);
+
     std::shared_ptr<spdlog::logger> _log;
     std::unique_ptr<NatsClient> _natsClient;
     std::chrono::milliseconds _requestTimeout;
+    bool _publishPushesWithoutAck;
+    bool _callServerTypes;
 };
 
 } // namespace pitaya
@@ -2,9 +2,11 @@
 
 #include "pitaya.h"
 #include "pitaya/constants.h"
+#include "pitaya/nats_connection_pool.h"
 #include "pitaya/protos/request.pb.h"
 #include "pitaya/protos/response.pb.h"
 #include "pitaya/utils.h"
+#include "pitaya/utils/protobuf.h"
 
 #include "spdlog/sinks/stdout_color_sinks.h"
 
@@ -20,30 +22,43 @@ static constexpr const char* kLogTag = "nats_rpc_server";
 
 namespace pitaya {
 
-struct NatsRpcServer::CallData : public pitaya::Rpc
+struct NatsRpcServer::CallData
+    : public pitaya::Rpc
+    , public utils::IntrusiveListNode<CallData>
 {
     std::mutex mutex;
     NatsClient* natsClient;
     std::shared_ptr<NatsMsg> msg;
-    utils::SyncVector<CallData*>* inProcessRpcs;
+    utils::SyncIntrusiveList<CallData>* inProcessRpcs;
+    std::atomic_int* numInProcessRpcs;
     std::shared_ptr<spdlog::logger> log;
 
     CallData(NatsClient* natsClient,
              std::shared_ptr<NatsMsg> msg,
-             utils::SyncVector<CallData*>* inProcessRpcs,
+             utils::SyncIntrusiveList<CallData>* inProcessRpcs,
+             std::atomic_int* numInProcessRpcs,
              std::shared_ptr<spdlog::logger> log)
         : natsClient(natsClient)
         , msg(msg)
         , inProcessRpcs(inProcessRpcs)
+        , numInProcessRpcs(numInProcessRpcs)
         , log(log)
     {
         assert(this->natsClient);
         assert(this->msg);
         assert(this->inProcessRpcs);
+        assert(this->numInProcessRpcs);
         assert(this->log);
     }
 
-    void Finish(protos::Response res) override
+    bool RawRequest(const uint8_t** data, size_t* size) const override
+    {
+        *data = msg->GetData();
+        *size = msg->GetSize();
+        return true;
+    }
+
+    void Finish(const protos::Response& res) override
     {
         // NOTE: the whole code is indented here since the mutex
         // unlocked by lock guard has to be done before we call
@@ -55,24 +70,20 @@ struct NatsRpcServer::CallData : public pitaya::Rpc
             // shutdown. Therefore we need to check it so that we know
             // the server is still valid.
             if (inProcessRpcs) {
-                // If the server is still valid, lock the mutex
-                // related with this rpc and finish it.
-                std::lock_guard<decltype(*inProcessRpcs)> lock(*inProcessRpcs);
-
-                std::vector<uint8_t> buf(res.ByteSizeLong());
-                res.SerializeToArray(buf.data(), buf.size());
+                // If the server is still valid, finish the rpc.
+                size_t size;
+                auto data = utils::SerializeToThreadBuffer(res, &size);
 
-                natsStatus status = natsClient->Publish(msg->GetReply(), std::move(buf));
+                natsStatus status = natsClient->Publish(msg->GetReply(), data, size);
                 if (status != NATS_OK) {
                     log->error("Failed to publish RPC response");
                 }
 
                 // the RPC response was published, now remove it from the in process rpcs
-                auto it = std::find(inProcessRpcs->begin(), inProcessRpcs->end(), this);
-                if (it != inProcessRpcs->end()) {
-                    inProcessRpcs->Erase(it);
-                    log->debug("Decreasing number of in process rpcs: {}", inProcessRpcs->Size());
-                }
+                std::lock_guard<decltype(*inProcessRpcs)> lock(*inProcessRpcs);
+                inProcessRpcs->Erase(this);
+                auto numRpcs = numInProcessRpcs->fetch_sub(1) - 1;
+                log->debug("Decreasing number of in process rpcs: {}", numRpcs);
             }
         }
 
@@ -83,11 +94,10 @@ struct NatsRpcServer::CallData : public pitaya::Rpc
 std::atomic_int NatsRpcServer::_cnt;
 
 NatsRpcServer::NatsRpcServer(const Server& server, const NatsConfig& config, const char* loggerName)
-    : NatsRpcServer(
-          server,
-          config,
-          std::unique_ptr<NatsClient>(new NatsClientImpl(NatsApiType::Asynchronous, config, loggerName)),
-          loggerName)
+    : NatsRpcServer(server,
+                    config,
+                    CreateNatsClient(NatsApiType::Asynchronous, config, loggerName),
+                    loggerName)
 {}
 
 NatsRpcServer::NatsRpcServer(const Server& server,
@@ -98,6 +108,7 @@ NatsRpcServer::NatsRpcServer(const Server& server,
     , _config(config)
     , _natsClient(std::move(natsClient))
     , _server(server)
+    , _numInProcessRpcs(0)
 {}
 
 NatsRpcServer::~NatsRpcServer()
@@ -112,9 +123,34 @@ NatsRpcServer::Start(RpcHandlerFunc handler)
     using std::placeholders::_1;
     _handlerFunc = handler;
 
+    auto onMessage = std::bind(&NatsRpcServer::OnNewMessage, this, _1);
+
     auto topic = utils::GetTopicForServer(_server.Id(), _server.Type());
-    natsStatus status =
-        _natsClient->Subscribe(topic, std::bind(&NatsRpcServer::OnNewMessage, this, _1));
+    if (_config.serverNumSubscriptions > 1) {
+        // The subscriptions share a queue group named after the topic, so every RPC is
+        // delivered to only one of them.
+        for (int i = 0; i < _config.serverNumSubscriptions; ++i) {
+            Subscribe(topic, topic, onMessage);
+        }
+    } else {
+        Subscribe(topic, "", onMessage);
+    }
+
+    if (_config.serverQueueGroupByType) {
+        Subscribe(utils::GetTopicForServerType(_server.Type()), _server.Type(), onMessage);
+    }
+
+    _log->info("Nats rpc server started!");
+}
+
+void
+NatsRpcServer::Subscribe(const std::string& topic,
+                         const std::string& queue,
+                         std::function<void(std::shared_ptr<NatsMsg>)> onMessage)
+{
+    natsStatus status = queue.empty()
+                            ? _natsClient->Subscribe(topic, std::move(onMessage))
+                            : _natsClient->QueueSubscribe(topic, queue, std::move(onMessage));
 
     if (status != NATS_OK) {
         throw PitayaException(
@@ -122,7 +158,6 @@ NatsRpcServer::Start(RpcHandlerFunc handler)
     }
 
     _log->debug("Subscription at topic {} was created", topic);
-    _log->info("Nats rpc server started!");
 }
 
 void
@@ -131,17 +166,8 @@ NatsRpcServer::Shutdown()
     assert(_handlerFunc);
 
     // Check if we need to wait for RPCs to finish.
-    bool shouldWait = false;
-    {
-        std::lock_guard<decltype(_inProcessRpcs)> lock(_inProcessRpcs);
-        if (_inProcessRpcs.Size() > 0) {
-            // There are still rpcs being processed, so we signal
-            // the thread to wait until the deadline.
-            shouldWait = true;
-        }
-    }
-
-    if (shouldWait) {
+    if (_numInProcessRpcs > 0) {
+        // There are still rpcs being processed, so we wait until the deadline.
         std::this_thread::sleep_for(_config.serverShutdownDeadline);
     }
 
@@ -153,6 +179,9 @@ NatsRpcServer::Shutdown()
             std::lock_guard<decltype(rpc->mutex)> rpcLock(rpc->mutex);
             rpc->inProcessRpcs = nullptr;
         }
+        // Only the removed RPCs give their slots back: an RPC that reserved a slot but was not
+        // pushed to the list yet still releases its own slot when it finishes.
+        _numInProcessRpcs.fetch_sub(static_cast<int>(_inProcessRpcs.Size()));
         _inProcessRpcs.Clear();
     }
 
@@ -179,25 +208,22 @@ NatsRpcServer::OnNewMessage(std::shared_ptr<NatsMsg> msg)
         return;
     }
 
-    auto callData = new CallData(_natsClient.get(), msg, &_inProcessRpcs, _log);
+    // Reserve a slot for the RPC, giving it back if there is no space to process it.
+    const int numInProcessRpcs = _numInProcessRpcs.fetch_add(1) + 1;
+    const bool infiniteSlots = _config.serverMaxNumberOfRpcs == -1;
 
-    // Check wether the rpc should be processed or not.
-    bool shouldProcessRpc;
-    {
-        std::lock_guard<decltype(_inProcessRpcs)> lock(_inProcessRpcs);
-        if (_inProcessRpcs.Size() == _config.serverMaxNumberOfRpcs) {
-            _log->debug("Will NOT process rpc");
-            shouldProcessRpc = false;
-        } else {
-            shouldProcessRpc = true;
-            _log->info("Saving new call data to queue: {}", (void*)callData);
+    if (infiniteSlots || numInProcessRpcs <= _config.serverMaxNumberOfRpcs) {
+        auto callData =
+            new CallData(_natsClient.get(), msg, &_inProcessRpcs, &_numInProcessRpcs, _log);
+        {
+            std::lock_guard<decltype(_inProcessRpcs)> lock(_inProcessRpcs);
             _inProcessRpcs.PushBack(callData);
         }
-    }
-
-    if (shouldProcessRpc) {
-        _handlerFunc(req, callData);
+        _log->debug("Saving new call data to queue: {}", (void*)callData);
+        _handlerFunc(std::move(req), callData);
     } else {
+        _numInProcessRpcs.fetch_sub(1);
+        _log->debug("Will NOT process rpc");
         auto error = new protos::Error();
         error->set_code(constants::kCodeServiceUnavailable);
         error->set_msg("The server is already processing the maximum amount of RPC's");
@@ -205,35 +231,16 @@ NatsRpcServer::OnNewMessage(std::shared_ptr<NatsMsg> msg)
         protos::Response res;
         res.set_allocated_error(error);
 
-        std::vector<uint8_t> buf(res.ByteSizeLong());
-        res.SerializeToArray(buf.data(), buf.size());
+        size_t size;
+        auto data = utils::SerializeToThreadBuffer(res, &size);
 
-        natsStatus status = _natsClient->Publish(msg->GetReply(), std::move(buf));
+        natsStatus status = _natsClient->Publish(msg->GetReply(), data, size);
         if (status != NATS_OK) {
             _log->error("Failed to publish RPC response");
         }
     }
 }
 
-void
-NatsRpcServer::OnRpcFinished(const char* reply,
-                             std::vector<uint8_t> responseBuf,
-                             CallData* callData)
-{
-    natsStatus status = _natsClient->Publish(reply, std::move(responseBuf));
-    if (status != NATS_OK) {
-        _log->error("Failed to publish RPC response");
-    }
-
-    // the RPC response was published, now remove it from the in process rpcs
-    std::lock_guard<decltype(_inProcessRpcs)> lock(_inProcessRpcs);
-    auto it = std::find(_inProcessRpcs.begin(), _inProcessRpcs.end(), callData);
-    if (it != _inProcessRpcs.end()) {
-        _inProcessRpcs.Erase(it);
-        _log->debug("Decreasing number of in process rpcs: {}", _inProcessRpcs.Size());
-    }
-}
-
 // void
 // NatsRpcServer::PrintSubStatus(natsSubscription* subscription)
 // {
@@ -7,9 +7,10 @@
 #include "pitaya/protos/request.pb.h"
 #include "pitaya/protos/response.pb.h"
 #include "pitaya/rpc_server.h"
-#include "pitaya/utils/sync_vector.h"
+#include "pitaya/utils/sync_intrusive_list.h"
 #include "spdlog/spdlog.h"
 
+#include <atomic>
 #include <nats.h>
 #include <string>
 
@@ -33,9 +34,11 @@ public:
 private:
     struct CallData;
 
+    void Subscribe(const std::string& topic,
+                   const std::string& queue,
+                   std::function<void(std::shared_ptr<NatsMsg>)> onMessage);
     void PrintSubStatus(natsSubscription* sub);
     void OnNewMessage(std::shared_ptr<NatsMsg> msg);
-    void OnRpcFinished(const char* reply, std::vector<uint8_t> responseBuf, CallData* callData);
 
 private:
     std::shared_ptr<spdlog::logger> _log;
@@ -45,8 +48,10 @@ private:
     Server _server;
     static std::atomic_int _cnt;
 
-    // Tracks the number of RPCs that are being processed.
-    utils::SyncVector<CallData*> _inProcessRpcs;
+    // Tracks the RPCs that are being processed, so that they can be invalidated on shutdown.
+    // The counter is kept apart from the list so that admission does not need the lock.
+    utils::SyncIntrusiveList<CallData> _inProcessRpcs;
+    std::atomic_int _numInProcessRpcs;
 };
 
 } // namespace pitaya
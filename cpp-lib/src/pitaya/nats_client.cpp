@@ -2,6 +2,7 @@
 
 #include "pitaya/utils.h"
 
+#include <cstdlib>
 #include <string>
 
 namespace pitaya {
@@ -39,6 +40,7 @@ NatsMsgImpl::GetReply() const
 }
 
 static constexpr const char* kLogTag = "nats_client";
+static constexpr auto kRequestTimeoutResolution = std::chrono::milliseconds(10);
 
 //
 // NatsClientImpl
@@ -47,10 +49,12 @@ NatsClientImpl::NatsClientImpl(NatsApiType apiType,
                                const NatsConfig& config,
                                const char* loggerName)
     : _log(utils::CloneLoggerOrCreate(loggerName, kLogTag))
+    , _subscriptionDrainTimeout(config.serverShutdownDeadline)
     , _opts(nullptr)
     , _conn(nullptr)
-    , _sub(nullptr)
     , _connClosed(false)
+    , _replySubStatus(NATS_OK)
+    , _replySub(nullptr)
 {
     if (config.natsAddr.empty()) {
         throw PitayaException("NATS address should not be empty");
@@ -81,6 +85,11 @@ NatsClientImpl::NatsClientImpl(NatsApiType apiType,
         natsOptions_SetMaxPendingMsgs(_opts, config.maxPendingMsgs);
         natsOptions_SetErrorHandler(_opts, ErrHandler, this);
     }
+    if (config.messageDeliveryPoolSize > 0) {
+        // The pool is shared by every connection of the process.
+        nats_SetMessageDeliveryPoolSize(config.messageDeliveryPoolSize);
+        natsOptions_UseGlobalMessageDelivery(_opts, true);
+    }
     natsOptions_SetURL(_opts, config.natsAddr.c_str());
 
     _log->info("NATS Connection Timeout - " + std::to_string(config.connectionTimeout.count()));
@@ -99,29 +108,23 @@ NatsClientImpl::NatsClientImpl(NatsApiType apiType,
     
 NatsClientImpl::~NatsClientImpl()
 {
-    if (_sub) {
-        // Remove interest from the subscription. Note that pending message may still
-        // be received by the client.
-        natsStatus status;
-        status = natsSubscription_Unsubscribe(_sub);
-        if (status != NATS_OK) {
-            _log->error("Failed to unsubscribe");
-        }
-        
-        status = natsSubscription_Drain(_sub);
-        if (status != NATS_OK) {
-            _log->error("Failed to drain subscription");
-        }
-        
-        status =
-            natsSubscription_WaitForDrainCompletion(_sub, _subscriptionDrainTimeout.count());
-        if (status != NATS_OK) {
-            _log->error("Failed to wait for subscription drain");
-        }
-        // Called only here, because it needs to wait for the natsSubscription_WaitForDrainCompletion
-        natsSubscription_Destroy(_sub);
+    if (_requestTimeoutTicker) {
+        _requestTimeoutTicker->Stop();
+    }
+
+    if (_replySub) {
+        // The replies that already arrived are still delivered, so HandleReply is not running
+        // once the drain completes.
+        DrainSubscription(_replySub);
     }
 
+    // Requests that did not receive a reply yet will never receive one.
+    for (auto& callback : _pendingRequests.TakeAll()) {
+        callback(NATS_CONNECTION_CLOSED, nullptr);
+    }
+
+    DrainSubscriptions();
+
     natsConnection_Close(_conn);
     while (!_connClosed) {
         // Wait until the connection is actually closed. This will be reported on a different
@@ -132,15 +135,49 @@ NatsClientImpl::~NatsClientImpl()
     natsOptions_Destroy(_opts);
 }
 
+void
+NatsClientImpl::DrainSubscriptions()
+{
+    decltype(_subscriptions) subscriptions;
+    {
+        std::lock_guard<decltype(_subscriptionsMutex)> lock(_subscriptionsMutex);
+        subscriptions.swap(_subscriptions);
+    }
+
+    // The handlers are destroyed only after their subscription finished draining.
+    for (auto& subscription : subscriptions) {
+        DrainSubscription(subscription->sub);
+    }
+}
+
+void
+NatsClientImpl::DrainSubscription(natsSubscription* sub)
+{
+    // Draining removes the interest from the subscription, but the messages that are pending
+    // are still delivered to it.
+    natsStatus status = natsSubscription_Drain(sub);
+    if (status != NATS_OK) {
+        _log->error("Failed to drain subscription");
+    } else {
+        status = natsSubscription_WaitForDrainCompletion(sub, _subscriptionDrainTimeout.count());
+        if (status != NATS_OK) {
+            _log->error("Failed to wait for subscription drain");
+        }
+    }
+    // Called only here, because it needs to wait for the natsSubscription_WaitForDrainCompletion
+    natsSubscription_Destroy(sub);
+}
+
 natsStatus
 NatsClientImpl::Request(std::shared_ptr<NatsMsg>* msg,
                         const std::string& topic,
-                        const std::vector<uint8_t>& data,
+                        const uint8_t* data,
+                        size_t size,
                         std::chrono::milliseconds timeout)
 {
     natsMsg* reply = nullptr;
-    natsStatus status = natsConnection_Request(
-        &reply, _conn, topic.c_str(), data.data(), data.size(), timeout.count());
+    natsStatus status =
+        natsConnection_Request(&reply, _conn, topic.c_str(), data, size, timeout.count());
 
     if (status == NATS_OK) {
         *msg = std::shared_ptr<NatsMsg>(new NatsMsgImpl(reply));
@@ -154,24 +191,118 @@ NatsClientImpl::Request(std::shared_ptr<NatsMsg>* msg,
     }
 }
 
+natsStatus
+NatsClientImpl::RequestAsync(const std::string& topic,
+                             const uint8_t* data,
+                             size_t size,
+                             std::chrono::milliseconds timeout,
+                             RequestCallback callback)
+{
+    std::call_once(_replySubOnce, [this]() { _replySubStatus = SubscribeToReplies(); });
+    if (_replySubStatus != NATS_OK) {
+        return _replySubStatus;
+    }
+
+    natsStatus status = NATS_OK;
+    bool sent = _pendingRequests.AddAndSend(
+        std::move(callback), std::chrono::steady_clock::now() + timeout, [&](uint64_t token) {
+            auto reply = _replyPrefix + std::to_string(token);
+            status =
+                natsConnection_PublishRequest(_conn, topic.c_str(), reply.c_str(), data, size);
+            return status == NATS_OK;
+        });
+
+    // If the request expired while the publish was failing, the callback was already called
+    // with NATS_TIMEOUT and the failure must not be reported again.
+    return sent ? NATS_OK : status;
+}
+
+natsStatus
+NatsClientImpl::SubscribeToReplies()
+{
+    natsInbox* inbox = nullptr;
+    natsStatus status = natsInbox_Create(&inbox);
+    if (status != NATS_OK) {
+        _log->error("Failed to create inbox for asynchronous requests");
+        return status;
+    }
+
+    _replyPrefix = std::string(inbox) + ".";
+    natsInbox_Destroy(inbox);
+
+    auto subject = _replyPrefix + "*";
+    status = natsConnection_Subscribe(&_replySub, _conn, subject.c_str(), HandleReply, this);
+    if (status != NATS_OK) {
+        _log->error("Failed to subscribe to asynchronous replies");
+        return status;
+    }
+
+    // Every request in flight may have its reply waiting to be delivered, so the replies
+    // are never dropped for being too many.
+    status = natsSubscription_SetPendingLimits(_replySub, -1, -1);
+    if (status != NATS_OK) {
+        _log->error("Failed to set the pending limits of the asynchronous replies");
+        return status;
+    }
+
+    _requestTimeoutTicker.reset(
+        new utils::Ticker(kRequestTimeoutResolution, [this]() { ExpirePendingRequests(); }));
+    _requestTimeoutTicker->Start();
+    return status;
+}
+
+void
+NatsClientImpl::ExpirePendingRequests()
+{
+    for (auto& callback : _pendingRequests.TakeExpired(std::chrono::steady_clock::now())) {
+        callback(NATS_TIMEOUT, nullptr);
+    }
+}
+
 natsStatus
 NatsClientImpl::Subscribe(const std::string& topic,
                           std::function<void(std::shared_ptr<NatsMsg>)> onMessage)
 {
-    _log->info("Subscribing to topic {}", topic);
-    _onMessage = std::move(onMessage);
-    natsStatus status = natsConnection_Subscribe(&_sub, _conn, topic.c_str(), HandleMsg, this);
+    return QueueSubscribe(topic, "", std::move(onMessage));
+}
+
+natsStatus
+NatsClientImpl::QueueSubscribe(const std::string& topic,
+                               const std::string& queue,
+                               std::function<void(std::shared_ptr<NatsMsg>)> onMessage)
+{
+    if (queue.empty()) {
+        _log->info("Subscribing to topic {}", topic);
+    } else {
+        _log->info("Subscribing to topic {} on queue group {}", topic, queue);
+    }
+
+    // The handler is kept alive until the subscription is destroyed.
+    std::unique_ptr<SubscriptionHandler> handler(new SubscriptionHandler());
+    handler->onMessage = std::move(onMessage);
+
+    std::lock_guard<decltype(_subscriptionsMutex)> lock(_subscriptionsMutex);
+    natsStatus status;
+    if (queue.empty()) {
+        status = natsConnection_Subscribe(
+            &handler->sub, _conn, topic.c_str(), HandleMsg, handler.get());
+    } else {
+        status = natsConnection_QueueSubscribe(
+            &handler->sub, _conn, topic.c_str(), queue.c_str(), HandleMsg, handler.get());
+    }
     if (status != NATS_OK) {
         _log->error("Failed to subscribe");
         return status;
     }
+
+    _subscriptions.push_back(std::move(handler));
     return status;
 }
 
 natsStatus
-NatsClientImpl::Publish(const char* reply, const std::vector<uint8_t>& buf)
+NatsClientImpl::Publish(const char* reply, const uint8_t* data, size_t size)
 {
-    natsStatus status = natsConnection_Publish(_conn, reply, buf.data(), buf.size());
+    natsStatus status = natsConnection_Publish(_conn, reply, data, size);
 
     if (status != NATS_OK) {
         if (status == NATS_TIMEOUT) {
@@ -186,10 +317,28 @@ NatsClientImpl::Publish(const char* reply, const std::vector<uint8_t>& buf)
 
 void
 NatsClientImpl::HandleMsg(natsConnection* nc, natsSubscription* sub, natsMsg* msg, void* user)
+{
+    auto handler = static_cast<SubscriptionHandler*>(user);
+    assert(handler->onMessage);
+    handler->onMessage(std::shared_ptr<NatsMsg>(new NatsMsgImpl(msg)));
+}
+
+void
+NatsClientImpl::HandleReply(natsConnection* nc, natsSubscription* sub, natsMsg* msg, void* user)
 {
     auto natsClient = static_cast<NatsClientImpl*>(user);
-    assert(natsClient->_onMessage);
-    natsClient->_onMessage(std::shared_ptr<NatsMsg>(new NatsMsgImpl(msg)));
+    auto reply = std::shared_ptr<NatsMsg>(new NatsMsgImpl(msg));
+
+    const char* subject = natsMsg_GetSubject(msg);
+    uint64_t token = std::strtoull(subject + natsClient->_replyPrefix.size(), nullptr, 10);
+
+    auto callback = natsClient->_pendingRequests.Take(token);
+    if (!callback) {
+        // The request already timed out.
+        return;
+    }
+
+    callback(NATS_OK, std::move(reply));
 }
 
 void
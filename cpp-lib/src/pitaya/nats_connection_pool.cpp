@@ -0,0 +1,112 @@
+#include "pitaya/nats_connection_pool.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace pitaya {
+
+NatsConnectionPool::NatsConnectionPool(std::vector<std::unique_ptr<NatsClient>> connections,
+                                       std::unique_ptr<NatsClient> subscriber)
+    : _connections(std::move(connections))
+    , _subscriber(std::move(subscriber))
+{
+    if (_connections.empty()) {
+        throw PitayaException("NATS connection pool should have at least one connection");
+    }
+}
+
+NatsConnectionPool::~NatsConnectionPool()
+{
+    // The subscription callbacks publish their replies through the pool, on any of the
+    // connections, so none of them can be destroyed while a callback is still running.
+    DrainSubscriptions();
+}
+
+natsStatus
+NatsConnectionPool::Request(std::shared_ptr<NatsMsg>* natsMsg,
+                            const std::string& topic,
+                            const uint8_t* data,
+                            size_t size,
+                            std::chrono::milliseconds timeout)
+{
+    return ConnectionForTopic(topic).Request(natsMsg, topic, data, size, timeout);
+}
+
+natsStatus
+NatsConnectionPool::RequestAsync(const std::string& topic,
+                                 const uint8_t* data,
+                                 size_t size,
+                                 std::chrono::milliseconds timeout,
+                                 RequestCallback callback)
+{
+    // Every connection has its own inbox, the reply comes back on the connection that sent
+    // the request.
+    return ConnectionForTopic(topic).RequestAsync(
+        topic, data, size, timeout, std::move(callback));
+}
+
+natsStatus
+NatsConnectionPool::Subscribe(const std::string& topic,
+                              std::function<void(std::shared_ptr<NatsMsg>)> onMessage)
+{
+    auto& connection = _subscriber ? *_subscriber : ConnectionForTopic(topic);
+    return connection.Subscribe(topic, std::move(onMessage));
+}
+
+natsStatus
+NatsConnectionPool::QueueSubscribe(const std::string& topic,
+                                   const std::string& queue,
+                                   std::function<void(std::shared_ptr<NatsMsg>)> onMessage)
+{
+    auto& connection = _subscriber ? *_subscriber : ConnectionForTopic(topic);
+    return connection.QueueSubscribe(topic, queue, std::move(onMessage));
+}
+
+natsStatus
+NatsConnectionPool::Publish(const char* reply, const uint8_t* data, size_t size)
+{
+    return ConnectionForTopic(reply).Publish(reply, data, size);
+}
+
+void
+NatsConnectionPool::DrainSubscriptions()
+{
+    if (_subscriber) {
+        _subscriber->DrainSubscriptions();
+    }
+    for (auto& connection : _connections) {
+        connection->DrainSubscriptions();
+    }
+}
+
+NatsClient&
+NatsConnectionPool::ConnectionForTopic(std::string_view topic)
+{
+    if (_connections.size() == 1) {
+        return *_connections[0];
+    }
+    return *_connections[std::hash<std::string_view>()(topic) % _connections.size()];
+}
+
+std::unique_ptr<NatsClient>
+CreateNatsClient(NatsApiType apiType, const NatsConfig& config, const char* loggerName)
+{
+    if (config.numConnections <= 1 && !config.dedicatedSubscriptionConnection) {
+        return std::unique_ptr<NatsClient>(new NatsClientImpl(apiType, config, loggerName));
+    }
+
+    std::vector<std::unique_ptr<NatsClient>> connections;
+    for (int i = 0; i < std::max(config.numConnections, 1); ++i) {
+        connections.emplace_back(new NatsClientImpl(apiType, config, loggerName));
+    }
+
+    std::unique_ptr<NatsClient> subscriber;
+    if (config.dedicatedSubscriptionConnection) {
+        subscriber.reset(new NatsClientImpl(apiType, config, loggerName));
+    }
+
+    return std::unique_ptr<NatsClient>(
+        new NatsConnectionPool(std::move(connections), std::move(subscriber)));
+}
+
+} // namespace pitaya
@@ -1,11 +1,13 @@
 #include "pitaya/utils.h"
 
 #include "pitaya.h"
+#include "pitaya/utils/json.h"
 #include "pitaya/utils/string_utils.h"
 #include "spdlog/spdlog.h"
 
 #include "spdlog/sinks/stdout_color_sinks.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <boost/format.hpp>
 #include <mutex>
@@ -37,14 +39,24 @@ GetTopicForServer(const std::string& serverId, const std::string& serverType)
     return boost::str(boost::format("pitaya/servers/%1%/%2%") % serverType % serverId);
 }
 
-pitaya::Server
+string
+GetTopicForServerType(const std::string& serverType)
+{
+    return "pitaya/servers/" + serverType;
+}
+
+std::mt19937&
+RandomEngine()
+{
+    thread_local std::mt19937 engine{ std::random_device{}() };
+    return engine;
+}
+
+const pitaya::Server&
 RandomServer(const std::vector<Server>& vec)
 {
-    std::random_device random_device;
-    std::mt19937 engine{ random_device() };
-    std::uniform_int_distribution<int> dist(0, vec.size() - 1);
-    Server random_element = vec[dist(engine)];
-    return random_element;
+    std::uniform_int_distribution<size_t> dist(0, vec.size() - 1);
+    return vec[dist(RandomEngine())];
 }
 
 // key is composed by:
@@ -110,6 +122,103 @@ ParseEtcdKey(const string& key,
     return true;
 }
 
+std::string
+JsonObjectFromPairs(const std::vector<std::pair<std::string, std::string>>& pairs)
+{
+    std::string json = "{";
+    for (const auto& pair : pairs) {
+        if (json.size() > 1) {
+            json.push_back(',');
+        }
+        AppendJsonString(json, pair.first);
+        json.push_back(':');
+        AppendJsonString(json, pair.second);
+    }
+    json.push_back('}');
+    return json;
+}
+
+// Finds the members of a serialized json object, without the surrounding braces and spaces.
+static bool
+JsonObjectMembers(const std::string& json, size_t& begin, size_t& end)
+{
+    static constexpr const char* kSpaces = " \t\r\n";
+
+    begin = json.find_first_not_of(kSpaces);
+    end = json.find_last_not_of(kSpaces);
+    if (begin == std::string::npos || json[begin] != '{' || json[end] != '}' || begin == end) {
+        return false;
+    }
+
+    begin = json.find_first_not_of(kSpaces, begin + 1);
+    end = json.find_last_not_of(kSpaces, end - 1) + 1;
+    if (begin > end) {
+        // Empty object
+        end = begin;
+    }
+    return true;
+}
+
+bool
+MergeJsonObjects(const std::string& first, const std::string& second, std::string& merged)
+{
+    size_t secondBegin, secondEnd;
+    if (!JsonObjectMembers(second, secondBegin, secondEnd)) {
+        return false;
+    }
+
+    std::vector<std::string> secondKeys;
+    std::string key;
+    JsonReader secondReader(second);
+    if (!secondReader.EnterObject()) {
+        return false;
+    }
+    while (secondReader.NextKey(key)) {
+        if (!secondReader.SkipValue()) {
+            return false;
+        }
+        secondKeys.push_back(key);
+    }
+    if (!secondReader.AtEnd()) {
+        return false;
+    }
+
+    // The members of the first object are copied as they are, unless the second object
+    // replaces them.
+    merged.clear();
+    merged.reserve(first.size() + (secondEnd - secondBegin) + 2);
+    merged.push_back('{');
+    JsonReader reader(first);
+    if (!reader.EnterObject()) {
+        return false;
+    }
+    std::string_view value;
+    while (reader.NextKey(key)) {
+        if (!reader.SkipValue(&value)) {
+            return false;
+        }
+        if (std::find(secondKeys.begin(), secondKeys.end(), key) != secondKeys.end()) {
+            continue;
+        }
+        if (merged.size() > 1) {
+            merged.push_back(',');
+        }
+        AppendJsonString(merged, key);
+        merged.push_back(':');
+        merged.append(value);
+    }
+    if (!reader.AtEnd()) {
+        return false;
+    }
+
+    if (merged.size() > 1 && secondEnd > secondBegin) {
+        merged.push_back(',');
+    }
+    merged.append(second, secondBegin, secondEnd - secondBegin);
+    merged.push_back('}');
+    return true;
+}
+
 std::shared_ptr<spdlog::logger>
 CloneLoggerOrCreate(const char* loggerNameToClone, const char* loggerName)
 {
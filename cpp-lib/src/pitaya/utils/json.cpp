@@ -0,0 +1,457 @@
+#include "pitaya/utils/json.h"
+
+namespace pitaya {
+namespace utils {
+
+// Maximum nesting of skipped values, deeper documents are rejected instead of
+// overflowing the stack.
+static constexpr int kMaxDepth = 64;
+
+static bool
+IsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static void
+AppendUtf8(std::string& out, uint32_t codePoint)
+{
+    if (codePoint < 0x80) {
+        out.push_back(static_cast<char>(codePoint));
+    } else if (codePoint < 0x800) {
+        out.push_back(static_cast<char>(0xc0 | (codePoint >> 6)));
+        out.push_back(static_cast<char>(0x80 | (codePoint & 0x3f)));
+    } else if (codePoint < 0x10000) {
+        out.push_back(static_cast<char>(0xe0 | (codePoint >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (codePoint & 0x3f)));
+    } else {
+        out.push_back(static_cast<char>(0xf0 | (codePoint >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((codePoint >> 12) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (codePoint & 0x3f)));
+    }
+}
+
+JsonReader::JsonReader(std::string_view json)
+    : _begin(json.data())
+    , _pos(json.data())
+    , _end(json.data() + json.size())
+    , _first(true)
+{}
+
+JsonReader::Type
+JsonReader::Peek()
+{
+    SkipWhitespace();
+    if (Failed() || _pos == _end) {
+        return Type::Invalid;
+    }
+    switch (*_pos) {
+        case '{':
+            return Type::Object;
+        case '[':
+            return Type::Array;
+        case '"':
+            return Type::String;
+        case 't':
+        case 'f':
+            return Type::Bool;
+        case 'n':
+            return Type::Null;
+        default:
+            return *_pos == '-' || IsDigit(*_pos) ? Type::Number : Type::Invalid;
+    }
+}
+
+bool
+JsonReader::EnterObject()
+{
+    if (!Expect('{')) {
+        return false;
+    }
+    _first = true;
+    return true;
+}
+
+bool
+JsonReader::NextKey(std::string& key)
+{
+    SkipWhitespace();
+    if (Failed()) {
+        return false;
+    }
+    if (_pos != _end && *_pos == '}') {
+        ++_pos;
+        // The object was a value of its parent, which already had a key.
+        _first = false;
+        return false;
+    }
+    if (!_first && !Expect(',')) {
+        return false;
+    }
+    _first = false;
+
+    SkipWhitespace();
+    if (_pos == _end || *_pos != '"') {
+        return Fail("expected a key");
+    }
+    key.clear();
+    return ParseString(&key) && Expect(':');
+}
+
+bool
+JsonReader::ReadString(std::string& str)
+{
+    if (Peek() != Type::String) {
+        return Fail("expected a string");
+    }
+    str.clear();
+    return ParseString(&str);
+}
+
+bool
+JsonReader::ReadBool(bool& value)
+{
+    if (Peek() != Type::Bool) {
+        return Fail("expected a boolean");
+    }
+    value = *_pos == 't';
+    return SkipLiteral(value ? "true" : "false");
+}
+
+bool
+JsonReader::SkipValue(std::string_view* raw)
+{
+    SkipWhitespace();
+    const char* start = _pos;
+    if (!SkipValue(0)) {
+        return false;
+    }
+    if (raw) {
+        *raw = std::string_view(start, _pos - start);
+    }
+    return true;
+}
+
+bool
+JsonReader::AtEnd()
+{
+    SkipWhitespace();
+    return !Failed() && _pos == _end;
+}
+
+void
+JsonReader::SkipWhitespace()
+{
+    while (_pos != _end && (*_pos == ' ' || *_pos == '\n' || *_pos == '\r' || *_pos == '\t')) {
+        ++_pos;
+    }
+}
+
+bool
+JsonReader::Expect(char c)
+{
+    SkipWhitespace();
+    if (Failed()) {
+        return false;
+    }
+    if (_pos == _end || *_pos != c) {
+        char msg[] = "expected 'x'";
+        msg[10] = c;
+        return Fail(msg);
+    }
+    ++_pos;
+    return true;
+}
+
+bool
+JsonReader::Fail(const char* msg)
+{
+    if (!Failed()) {
+        _error = std::string(msg) + " at offset " + std::to_string(_pos - _begin);
+    }
+    return false;
+}
+
+bool
+JsonReader::ParseString(std::string* out)
+{
+    // Skips the opening quote, callers already checked it.
+    ++_pos;
+    for (;;) {
+        // Copies the characters that need no decoding at once.
+        const char* start = _pos;
+        while (_pos != _end && *_pos != '"' && *_pos != '\\' &&
+               static_cast<unsigned char>(*_pos) >= 0x20) {
+            ++_pos;
+        }
+        if (out) {
+            out->append(start, _pos);
+        }
+
+        if (_pos == _end) {
+            return Fail("unterminated string");
+        }
+        if (*_pos == '"') {
+            ++_pos;
+            return true;
+        }
+        if (*_pos != '\\') {
+            return Fail("control character in string");
+        }
+
+        ++_pos;
+        if (_pos == _end) {
+            return Fail("unterminated string");
+        }
+        char decoded;
+        switch (*_pos++) {
+            case '"':
+                decoded = '"';
+                break;
+            case '\\':
+                decoded = '\\';
+                break;
+            case '/':
+                decoded = '/';
+                break;
+            case 'b':
+                decoded = '\b';
+                break;
+            case 'f':
+                decoded = '\f';
+                break;
+            case 'n':
+                decoded = '\n';
+                break;
+            case 'r':
+                decoded = '\r';
+                break;
+            case 't':
+                decoded = '\t';
+                break;
+            case 'u': {
+                uint32_t codePoint;
+                if (!ReadHex4(codePoint)) {
+                    return false;
+                }
+                if (codePoint >= 0xd800 && codePoint <= 0xdbff) {
+                    // High surrogate, it must be followed by a low one.
+                    uint32_t low;
+                    if (_end - _pos < 2 || _pos[0] != '\\' || _pos[1] != 'u') {
+                        return Fail("invalid surrogate pair");
+                    }
+                    _pos += 2;
+                    if (!ReadHex4(low)) {
+                        return false;
+                    }
+                    if (low < 0xdc00 || low > 0xdfff) {
+                        return Fail("invalid surrogate pair");
+                    }
+                    codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + (low - 0xdc00);
+                } else if (codePoint >= 0xdc00 && codePoint <= 0xdfff) {
+                    return Fail("invalid surrogate pair");
+                }
+                if (out) {
+                    AppendUtf8(*out, codePoint);
+                }
+                continue;
+            }
+            default:
+                return Fail("invalid escape sequence");
+        }
+        if (out) {
+            out->push_back(decoded);
+        }
+    }
+}
+
+bool
+JsonReader::ReadHex4(uint32_t& value)
+{
+    if (_end - _pos < 4) {
+        return Fail("invalid unicode escape");
+    }
+    value = 0;
+    for (int i = 0; i < 4; ++i) {
+        char c = *_pos++;
+        value <<= 4;
+        if (IsDigit(c)) {
+            value |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value |= c - 'A' + 10;
+        } else {
+            return Fail("invalid unicode escape");
+        }
+    }
+    return true;
+}
+
+bool
+JsonReader::SkipNumber()
+{
+    if (*_pos == '-') {
+        ++_pos;
+    }
+    if (_pos == _end || !IsDigit(*_pos)) {
+        return Fail("invalid number");
+    }
+    if (*_pos == '0') {
+        ++_pos;
+    } else {
+        while (_pos != _end && IsDigit(*_pos)) {
+            ++_pos;
+        }
+    }
+    if (_pos != _end && *_pos == '.') {
+        ++_pos;
+        if (_pos == _end || !IsDigit(*_pos)) {
+            return Fail("invalid number");
+        }
+        while (_pos != _end && IsDigit(*_pos)) {
+            ++_pos;
+        }
+    }
+    if (_pos != _end && (*_pos == 'e' || *_pos == 'E')) {
+        ++_pos;
+        if (_pos != _end && (*_pos == '+' || *_pos == '-')) {
+            ++_pos;
+        }
+        if (_pos == _end || !IsDigit(*_pos)) {
+            return Fail("invalid number");
+        }
+        while (_pos != _end && IsDigit(*_pos)) {
+            ++_pos;
+        }
+    }
+    return true;
+}
+
+bool
+JsonReader::SkipLiteral(std::string_view literal)
+{
+    if (static_cast<size_t>(_end - _pos) < literal.size() ||
+        std::string_view(_pos, literal.size()) != literal) {
+        return Fail("invalid literal");
+    }
+    _pos += literal.size();
+    return true;
+}
+
+bool
+JsonReader::SkipValue(int depth)
+{
+    if (depth > kMaxDepth) {
+        return Fail("document is nested too deeply");
+    }
+
+    switch (Peek()) {
+        case Type::Object: {
+            EnterObject();
+            std::string key;
+            while (NextKey(key)) {
+                if (!SkipValue(depth + 1)) {
+                    return false;
+                }
+            }
+            return !Failed();
+        }
+        case Type::Array: {
+            ++_pos;
+            SkipWhitespace();
+            if (_pos != _end && *_pos == ']') {
+                ++_pos;
+                return true;
+            }
+            for (;;) {
+                if (!SkipValue(depth + 1)) {
+                    return false;
+                }
+                SkipWhitespace();
+                if (_pos != _end && *_pos == ']') {
+                    ++_pos;
+                    return true;
+                }
+                if (!Expect(',')) {
+                    return false;
+                }
+            }
+        }
+        case Type::String:
+            return ParseString(nullptr);
+        case Type::Number:
+            return SkipNumber();
+        case Type::Bool:
+            return SkipLiteral(*_pos == 't' ? "true" : "false");
+        case Type::Null:
+            return SkipLiteral("null");
+        case Type::Invalid:
+        default:
+            return Fail("expected a value");
+    }
+}
+
+void
+AppendJsonString(std::string& out, std::string_view str)
+{
+    static constexpr const char* kHexDigits = "0123456789abcdef";
+
+    out.push_back('"');
+    for (char c : str) {
+        switch (c) {
+            case '"':
+                out.append("\\\"");
+                break;
+            case '\\':
+                out.append("\\\\");
+                break;
+            case '\n':
+                out.append("\\n");
+                break;
+            case '\r':
+                out.append("\\r");
+                break;
+            case '\t':
+                out.append("\\t");
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    out.append("\\u00");
+                    out.push_back(kHexDigits[(c >> 4) & 0xf]);
+                    out.push_back(kHexDigits[c & 0xf]);
+                } else {
+                    out.push_back(c);
+                }
+        }
+    }
+    out.push_back('"');
+}
+
+void
+AppendCompactJson(std::string& out, std::string_view json)
+{
+    out.reserve(out.size() + json.size());
+    bool inString = false;
+    for (size_t i = 0; i < json.size(); ++i) {
+        char c = json[i];
+        if (inString) {
+            out.push_back(c);
+            if (c == '\\') {
+                out.push_back(json[++i]);
+            } else if (c == '"') {
+                inString = false;
+            }
+        } else if (c == '"') {
+            inString = true;
+            out.push_back(c);
+        } else if (c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+            out.push_back(c);
+        }
+    }
+}
+
+} // namespace utils
+} // namespace pitaya
@@ -0,0 +1,88 @@
+#ifndef PITAYA_UTILS_JSON_H
+#define PITAYA_UTILS_JSON_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace pitaya {
+namespace utils {
+
+//
+// Forward only reader for json documents. The caller walks the document and the reader
+// validates it on the way, without building a tree: values are only copied when the
+// caller reads them, and skipped values are just scanned.
+//
+// Every method returns false when the document is invalid or the next value does not
+// have the expected type; Error() describes the first failure and every call after it
+// fails.
+//
+class JsonReader
+{
+public:
+    enum class Type
+    {
+        Object,
+        Array,
+        String,
+        Number,
+        Bool,
+        Null,
+        Invalid,
+    };
+
+    explicit JsonReader(std::string_view json);
+
+    // Type of the next value.
+    Type Peek();
+
+    // Reads the '{' that starts an object.
+    bool EnterObject();
+
+    // Reads the next key of the current object and the ':' after it. Returns false with no
+    // error when the object ends, after reading its '}'.
+    bool NextKey(std::string& key);
+
+    bool ReadString(std::string& str);
+    bool ReadBool(bool& value);
+
+    // Skips the next value. `raw` receives its text as it appears in the document.
+    bool SkipValue(std::string_view* raw = nullptr);
+
+    // True when only whitespace is left.
+    bool AtEnd();
+
+    bool Failed() const { return !_error.empty(); }
+    const std::string& Error() const { return _error; }
+
+private:
+    void SkipWhitespace();
+    bool Expect(char c);
+    bool Fail(const char* msg);
+    // Reads a string, decoding it into `out` when it is not null.
+    bool ParseString(std::string* out);
+    bool SkipNumber();
+    bool SkipLiteral(std::string_view literal);
+    bool SkipValue(int depth);
+    bool ReadHex4(uint32_t& value);
+
+private:
+    const char* _begin;
+    const char* _pos;
+    const char* _end;
+    // Whether the next key is the first one of the current object, the others are preceded
+    // by a comma.
+    bool _first;
+    std::string _error;
+};
+
+// Appends `str` to `out` as a json string, quotes included.
+void AppendJsonString(std::string& out, std::string_view str);
+
+// Appends `json` to `out` without the whitespace outside of strings. `json` must be valid.
+void AppendCompactJson(std::string& out, std::string_view json);
+
+} // namespace utils
+} // namespace pitaya
+
+#endif // PITAYA_UTILS_JSON_H
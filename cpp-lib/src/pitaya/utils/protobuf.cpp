@@ -0,0 +1,23 @@
+#include "pitaya/utils/protobuf.h"
+
+#include <vector>
+
+namespace pitaya {
+namespace utils {
+
+const uint8_t*
+SerializeToThreadBuffer(const google::protobuf::MessageLite& msg, size_t* size)
+{
+    thread_local std::vector<uint8_t> buffer;
+
+    // ByteSizeLong caches the sizes used by SerializeWithCachedSizesToArray.
+    *size = msg.ByteSizeLong();
+    if (buffer.size() < *size) {
+        buffer.resize(*size);
+    }
+    msg.SerializeWithCachedSizesToArray(buffer.data());
+    return buffer.data();
+}
+
+} // namespace utils
+} // namespace pitaya
@@ -0,0 +1,21 @@
+#ifndef PITAYA_UTILS_PROTOBUF_H
+#define PITAYA_UTILS_PROTOBUF_H
+
+#include <google/protobuf/message_lite.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace pitaya {
+namespace utils {
+
+// Serializes the message into a buffer owned by the calling thread and returns it, with
+// the serialized size in `size`. The buffer only grows, so once it fits the largest message
+// the thread sends, serializing does not allocate. The returned bytes are valid until the
+// next call on the same thread.
+const uint8_t* SerializeToThreadBuffer(const google::protobuf::MessageLite& msg, size_t* size);
+
+} // namespace utils
+} // namespace pitaya
+
+#endif // PITAYA_UTILS_PROTOBUF_H
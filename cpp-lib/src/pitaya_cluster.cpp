@@ -9,6 +9,7 @@
 #include "pitaya/protos/msg.pb.h"
 #include "pitaya/protos/request.pb.h"
 #include "pitaya/service_discovery.h"
+#include "pitaya/utils/semaphore.h"
 
 #include <chrono>
 #include <exception>
@@ -54,7 +55,7 @@ Print()
 }
 
 void
-LoopSendRpc(std::shared_ptr<spdlog::logger> logger, int tid)
+LoopSendRpc(std::shared_ptr<spdlog::logger> logger, int maxRpcsInFlight)
 {
     auto msg = new protos::Msg();
     auto session = new protos::Session();
@@ -69,15 +70,25 @@ LoopSendRpc(std::shared_ptr<spdlog::logger> logger, int tid)
     req.set_type(protos::RPCType::Sys);
     req.set_allocated_msg(msg);
     req.set_frontendid("testfid");
-    protos::Response res;
+
+    // A single thread keeps up to maxRpcsInFlight RPCs running at the same time.
+    utils::Semaphore window;
+    window.NotifyAll(maxRpcsInFlight);
+
     while (true) {
-        auto err = Cluster::Instance().RPC("csharp.testHandler.entry", req, res);
-        if (err) {
-            std::cout << "received error:" << err.value().msg << std::endl;
-        } else {
-            // std::cout << "received answer: " << res.data() << std::endl;
-        }
-        qps++;
+        window.Wait();
+        Cluster::Instance().RPCAsync(
+            "csharp.testHandler.entry",
+            req,
+            [&window](boost::optional<PitayaError> err, protos::Response res) {
+                if (err) {
+                    std::cout << "received error:" << err.value().msg << std::endl;
+                } else {
+                    // std::cout << "received answer: " << res.data() << std::endl;
+                }
+                qps++;
+                window.Notify();
+            });
     }
 }
 
@@ -134,10 +145,7 @@ main()
             std::thread thr(Print);
             std::this_thread::sleep_for(std::chrono::seconds(1));
             // FINISH
-            std::thread threads[2];
-            for (int i = 0; i < 2; i++) {
-                threads[i] = std::thread(LoopSendRpc, logger, i);
-            }
+            std::thread sender(LoopSendRpc, logger, 256);
 
             // Now, wait for RPCs
             for (;;) {
@@ -2,14 +2,20 @@
 
 #include "pitaya.h"
 #include "pitaya/c_wrapper.h"
+#include "pitaya/cluster.h"
 #include "pitaya/constants.h"
 #include "pitaya/grpc/rpc_client.h"
 #include "pitaya/protos/pitaya_mock.grpc.pb.h"
 
 #include "mock_binding_storage.h"
 #include "mock_etcd_client.h"
+#include "mock_rpc_client.h"
+#include "mock_rpc_server.h"
 #include "mock_service_discovery.h"
+#include <atomic>
 #include <cpprest/json.h>
+#include <cstdlib>
+#include <cstring>
 #include <regex>
 
 using namespace testing;
@@ -106,3 +112,145 @@ TEST_F(CWrapperTest, RunningOnlyTerminateShouldDoNothing)
 {
     tfg_pitc_Terminate();
 }
+
+// Counts the calls to free with the watched pointer, so that the tests can tell which
+// request buffers the C wrapper releases. glibc lets the program replace free.
+static std::atomic<void*> gWatchedPtr{ nullptr };
+static std::atomic_int gNumWatchedFrees{ 0 };
+
+extern "C" void __libc_free(void* ptr);
+
+extern "C" void
+free(void* ptr)
+{
+    if (ptr && ptr == gWatchedPtr.load(std::memory_order_relaxed)) {
+        gNumWatchedFrees++;
+    }
+    __libc_free(ptr);
+}
+
+class FakeRpc : public pitaya::Rpc
+{
+public:
+    // With null data, the rpc does not keep the request bytes.
+    FakeRpc(const void* data, size_t size)
+        : _data(static_cast<const uint8_t*>(data))
+        , _size(size)
+    {}
+
+    bool RawRequest(const uint8_t** data, size_t* size) const override
+    {
+        if (!_data) {
+            return false;
+        }
+        *data = _data;
+        *size = _size;
+        return true;
+    }
+
+    void Finish(const protos::Response& res) override { response = res; }
+
+    protos::Response response;
+
+private:
+    const uint8_t* _data;
+    size_t _size;
+};
+
+class CWrapperRpcTest : public testing::Test
+{
+public:
+    void SetUp() override
+    {
+        auto mockRpcSv = new NiceMock<MockRpcServer>();
+        auto mockRpcClient = new NiceMock<MockRpcClient>();
+        EXPECT_CALL(*mockRpcSv, Start(_)).WillOnce(SaveArg<0>(&_handlerFunc));
+        ON_CALL(*mockRpcClient, CallsServerTypes()).WillByDefault(Return(false));
+
+        pitaya::Cluster::Instance().Initialize(
+            pitaya::Server(pitaya::Server::Kind::Backend, "my-server-id", "connector"),
+            std::make_shared<NiceMock<MockServiceDiscovery>>(),
+            std::unique_ptr<pitaya::RpcServer>(mockRpcSv),
+            std::unique_ptr<pitaya::RpcClient>(mockRpcClient));
+
+        auto msg = new protos::Msg();
+        msg->set_route("my.custom.route");
+        msg->set_data("REQUEST DATA");
+        _req.set_type(protos::RPCType::User);
+        _req.set_allocated_msg(msg);
+        _reqBytes = _req.SerializeAsString();
+
+        _res.set_data("RESPONSE DATA");
+        _resBytes = _res.SerializeAsString();
+    }
+
+    void TearDown() override
+    {
+        pitaya::Cluster::Instance().Terminate();
+        gWatchedPtr = nullptr;
+        gNumWatchedFrees = 0;
+    }
+
+protected:
+    MemoryBuffer ResponseBuffer()
+    {
+        MemoryBuffer mb;
+        mb.data = &_resBytes[0];
+        mb.size = static_cast<int>(_resBytes.size());
+        return mb;
+    }
+
+    pitaya::RpcHandlerFunc _handlerFunc;
+    protos::Request _req;
+    std::string _reqBytes;
+    protos::Response _res;
+    std::string _resBytes;
+};
+
+TEST_F(CWrapperRpcTest, RawRequestBytesAreBorrowedAndNotFreed)
+{
+    void* raw = malloc(_reqBytes.size());
+    memcpy(raw, _reqBytes.data(), _reqBytes.size());
+    FakeRpc rpc(raw, _reqBytes.size());
+
+    _handlerFunc(_req, &rpc);
+    CRpc* crpc = tfg_pitc_WaitForRpc();
+    ASSERT_NE(crpc, nullptr);
+    EXPECT_EQ(crpc->tag, &rpc);
+    EXPECT_EQ(crpc->req->data, raw);
+    ASSERT_EQ(crpc->req->size, static_cast<int>(_reqBytes.size()));
+    EXPECT_EQ(memcmp(crpc->req->data, _reqBytes.data(), _reqBytes.size()), 0);
+
+    gWatchedPtr = raw;
+    MemoryBuffer mb = ResponseBuffer();
+    tfg_pitc_FinishRpcCall(&mb, crpc);
+    EXPECT_EQ(gNumWatchedFrees, 0);
+    EXPECT_EQ(rpc.response.data(), "RESPONSE DATA");
+
+    gWatchedPtr = nullptr;
+    if (gNumWatchedFrees == 0) {
+        free(raw);
+    }
+}
+
+TEST_F(CWrapperRpcTest, RequestsWithoutRawBytesAreSerializedAndFreed)
+{
+    FakeRpc rpc(nullptr, 0);
+
+    _handlerFunc(_req, &rpc);
+    CRpc* crpc = tfg_pitc_WaitForRpc();
+    ASSERT_NE(crpc, nullptr);
+    EXPECT_EQ(crpc->tag, &rpc);
+    ASSERT_NE(crpc->req->data, nullptr);
+
+    protos::Request req;
+    ASSERT_TRUE(req.ParseFromArray(crpc->req->data, crpc->req->size));
+    EXPECT_EQ(req.msg().route(), "my.custom.route");
+    EXPECT_EQ(req.msg().data(), "REQUEST DATA");
+
+    gWatchedPtr = crpc->req->data;
+    MemoryBuffer mb = ResponseBuffer();
+    tfg_pitc_FinishRpcCall(&mb, crpc);
+    EXPECT_EQ(gNumWatchedFrees, 1);
+    EXPECT_EQ(rpc.response.data(), "RESPONSE DATA");
+}
@@ -7,8 +7,12 @@
 #include "mock_rpc_client.h"
 #include "mock_rpc_server.h"
 #include "mock_service_discovery.h"
+#include <atomic>
 #include <boost/optional.hpp>
+#include <grpcpp/create_channel.h>
 #include <memory>
+#include <thread>
+#include <vector>
 
 using namespace pitaya;
 using namespace ::testing;
@@ -27,6 +31,12 @@ public:
         _server = Server(Server::Kind::Backend, "my-server-id", "connector");
 
         EXPECT_CALL(*_mockRpcSv, Start(_)).WillOnce(SaveArg<0>(&_handlerFunc));
+        EXPECT_CALL(*_mockSd, AddListener(_))
+            .WillRepeatedly(Invoke([this](service_discovery::Listener* listener) {
+                _listeners.push_back(listener);
+            }));
+        EXPECT_CALL(*_mockSd, RemoveListener(_)).Times(AnyNumber());
+        EXPECT_CALL(*_mockRpcClient, CallsServerTypes()).WillRepeatedly(Return(false));
 
         pitaya::Cluster::Instance().Initialize(_server,
                                                std::shared_ptr<ServiceDiscovery>(_mockSd),
@@ -34,7 +44,11 @@ public:
                                                std::unique_ptr<RpcClient>(_mockRpcClient));
     }
 
-    void TearDown() override { pitaya::Cluster::Instance().Terminate(); }
+    void TearDown() override
+    {
+        pitaya::Cluster::Instance().Terminate();
+        pitaya::Cluster::Instance().SetMaxWaitingRpcs(-1);
+    }
 
 protected:
     Server _server;
@@ -42,6 +56,7 @@ protected:
     MockRpcServer* _mockRpcSv;
     MockRpcClient* _mockRpcClient;
     pitaya::RpcHandlerFunc _handlerFunc;
+    std::vector<service_discovery::Listener*> _listeners;
 };
 
 TEST_F(ClusterTest, RpcsCanBeDoneSuccessfuly)
@@ -120,6 +135,106 @@ TEST_F(ClusterTest, FailsWhenNoServerIsFound)
     EXPECT_EQ(pErr.code, constants::kCodeNotFound);
 }
 
+TEST_F(ClusterTest, RpcsCarryThePeerMetadata)
+{
+    EXPECT_CALL(*_mockRpcSv, Shutdown());
+    Server serverToReturn(Server::Kind::Backend, "other-server-id", "room");
+
+    EXPECT_CALL(*_mockSd, GetServerById("other-server-id"))
+        .Times(2)
+        .WillRepeatedly(Return(serverToReturn));
+
+    {
+        InSequence seq;
+        EXPECT_CALL(*_mockRpcClient,
+                    Call(_,
+                         Property(&protos::Request::metadata,
+                                  Eq(R"({"peer.id":"my-server-id","peer.service":"connector"})"))))
+            .WillOnce(Return(protos::Response()));
+        EXPECT_CALL(
+            *_mockRpcClient,
+            Call(_,
+                 Property(
+                     &protos::Request::metadata,
+                     Eq(R"({"span":"1","peer.id":"my-server-id","peer.service":"connector"})"))))
+            .WillOnce(Return(protos::Response()));
+    }
+
+    protos::Request req;
+    protos::Response res;
+    EXPECT_FALSE(Cluster::Instance().RPC("other-server-id", "room.handler.method", req, res));
+
+    // Keys given by the caller are kept.
+    req.set_metadata(R"({"span":"1"})");
+    EXPECT_FALSE(Cluster::Instance().RPC("other-server-id", "room.handler.method", req, res));
+}
+
+TEST_F(ClusterTest, ReusedRequestsKeepTheSameMetadata)
+{
+    EXPECT_CALL(*_mockRpcSv, Shutdown());
+    Server serverToReturn(Server::Kind::Backend, "other-server-id", "room");
+
+    EXPECT_CALL(*_mockSd, GetServerById("other-server-id"))
+        .Times(2)
+        .WillRepeatedly(Return(serverToReturn));
+    EXPECT_CALL(
+        *_mockRpcClient,
+        Call(_,
+             Property(&protos::Request::metadata,
+                      Eq(R"({"span":"1","peer.id":"my-server-id","peer.service":"connector"})"))))
+        .Times(2)
+        .WillRepeatedly(Return(protos::Response()));
+
+    protos::Request req;
+    protos::Response res;
+    req.set_metadata(R"({"span":"1"})");
+    EXPECT_FALSE(Cluster::Instance().RPC("other-server-id", "room.handler.method", req, res));
+    EXPECT_FALSE(Cluster::Instance().RPC("other-server-id", "room.handler.method", req, res));
+}
+
+TEST_F(ClusterTest, RpcsByKeyGoToTheServerThatOwnsTheKey)
+{
+    EXPECT_CALL(*_mockRpcSv, Shutdown());
+
+    protos::Request req;
+    protos::Response res;
+    auto err = Cluster::Instance().RPCByKey("room.handler.method", "user-1", req, res);
+    ASSERT_TRUE(err);
+    EXPECT_EQ(err->code, constants::kCodeNotFound);
+
+    err = Cluster::Instance().RPCByKey("invalid", "user-1", req, res);
+    ASSERT_TRUE(err);
+    EXPECT_EQ(err->code, constants::kCodeInternalError);
+
+    bool called = false;
+    Cluster::Instance().RPCAsyncByKey(
+        "invalid", "user-1", req, [&](optional<PitayaError> err, protos::Response res) {
+            called = true;
+            ASSERT_TRUE(err);
+            EXPECT_EQ(err->code, constants::kCodeInternalError);
+        });
+    EXPECT_TRUE(called);
+
+    ConsistentHashRing expectedRing;
+    for (int i = 0; i < 3; ++i) {
+        Server server(Server::Kind::Backend, "room-" + std::to_string(i), "room");
+        expectedRing.ServerAdded(server);
+        for (auto listener : _listeners) {
+            listener->ServerAdded(server);
+        }
+    }
+    auto owner = expectedRing.ServerIdForKey("room", "user-1").value();
+    Server ownerServer(Server::Kind::Backend, owner, "room");
+
+    EXPECT_CALL(*_mockSd, GetServerById(owner)).Times(2).WillRepeatedly(Return(ownerServer));
+    EXPECT_CALL(*_mockRpcClient, Call(Eq(ownerServer), _))
+        .Times(2)
+        .WillRepeatedly(Return(protos::Response()));
+
+    EXPECT_FALSE(Cluster::Instance().RPCByKey("room.handler.method", "user-1", req, res));
+    EXPECT_FALSE(Cluster::Instance().RPCByKey("room.handler.method", "user-1", req, res));
+}
+
 TEST_F(ClusterTest, RpcReturnsErrorWhenTheCallFails)
 {
     EXPECT_CALL(*_mockRpcSv, Shutdown());
@@ -165,6 +280,136 @@ TEST_F(ClusterTest, RpcReturnsErrorWhenTheCallFails)
     EXPECT_EQ(pErr.msg, "Horrible error");
 }
 
+TEST_F(ClusterTest, AsyncRpcsCanBeDoneSuccessfuly)
+{
+    EXPECT_CALL(*_mockRpcSv, Shutdown());
+    Server serverToReturn(Server::Kind::Backend, "my-server-id", "connector", "random-host");
+
+    protos::Response resToReturn;
+    resToReturn.set_data("ABACATE");
+
+    EXPECT_CALL(*_mockSd, GetServersByType("mytest"))
+        .WillOnce(Return(std::vector<pitaya::Server>{ serverToReturn }));
+    EXPECT_CALL(*_mockSd, GetServerById("my-server-id")).WillOnce(Return(serverToReturn));
+
+    pitaya::CallCallback onResponse;
+    EXPECT_CALL(*_mockRpcClient,
+                CallAsync(Eq(serverToReturn),
+                          Property(&protos::Request::type, Eq(protos::RPCType::User)),
+                          _))
+        .WillOnce(SaveArg<2>(&onResponse));
+
+    protos::Request req;
+    req.set_type(protos::RPCType::User);
+
+    bool called = false;
+    Cluster::Instance().RPCAsync(
+        "mytest.routehandler.route", req, [&](optional<PitayaError> err, protos::Response res) {
+            called = true;
+            EXPECT_FALSE(err);
+            EXPECT_EQ(res.data(), "ABACATE");
+        });
+
+    // The response did not arrive yet.
+    EXPECT_FALSE(called);
+    ASSERT_TRUE(onResponse);
+    onResponse(resToReturn);
+    EXPECT_TRUE(called);
+}
+
+TEST_F(ClusterTest, AsyncRpcsReportErrorsThroughTheCallback)
+{
+    EXPECT_CALL(*_mockRpcSv, Shutdown());
+    Server serverToReturn(Server::Kind::Backend, "my-server-id", "connector", "random-host");
+
+    protos::Response resToReturn;
+    {
+        auto error = new protos::Error();
+        error->set_code(constants::kCodeInternalError);
+        error->set_msg("Horrible error");
+        resToReturn.set_allocated_error(error);
+    }
+
+    EXPECT_CALL(*_mockSd, GetServerById("unknown-id")).WillOnce(Return(boost::none));
+    EXPECT_CALL(*_mockSd, GetServerById("my-server-id")).WillOnce(Return(serverToReturn));
+    EXPECT_CALL(*_mockRpcClient, CallAsync(Eq(serverToReturn), _, _))
+        .WillOnce(InvokeArgument<2>(resToReturn));
+
+    protos::Request req;
+
+    std::vector<PitayaError> errors;
+    auto onResponse = [&](optional<PitayaError> err, protos::Response res) {
+        ASSERT_TRUE(err);
+        errors.push_back(err.value());
+    };
+
+    Cluster::Instance().RPCAsync("unknown-id", "mytest.route", req, onResponse);
+    Cluster::Instance().RPCAsync("my-server-id", "mytest.route", req, onResponse);
+
+    ASSERT_EQ(errors.size(), 2);
+    EXPECT_EQ(errors[0].code, constants::kCodeNotFound);
+    EXPECT_EQ(errors[1].code, constants::kCodeInternalError);
+    EXPECT_EQ(errors[1].msg, "Horrible error");
+}
+
+TEST_F(ClusterTest, RpcsByRouteCanLetTheRpcClientPickTheServer)
+{
+    EXPECT_CALL(*_mockRpcSv, Shutdown());
+    EXPECT_CALL(*_mockRpcClient, CallsServerTypes()).WillRepeatedly(Return(true));
+    EXPECT_CALL(*_mockSd, GetServersByType("room"))
+        .Times(2)
+        .WillRepeatedly(Return(std::vector<pitaya::Server>{
+            Server(Server::Kind::Backend, "room-1", "room") }));
+    EXPECT_CALL(*_mockRpcClient, Call(_, _)).Times(0);
+    EXPECT_CALL(*_mockRpcClient, CallAsync(_, _, _)).Times(0);
+
+    protos::Response resToReturn;
+    resToReturn.set_data("ABACATE");
+    EXPECT_CALL(*_mockRpcClient,
+                CallServerType("room",
+                               Property(&protos::Request::metadata,
+                                        HasSubstr(R"("peer.id":"my-server-id")"))))
+        .WillOnce(Return(resToReturn));
+    EXPECT_CALL(*_mockRpcClient, CallServerTypeAsync("room", _, _))
+        .WillOnce(InvokeArgument<2>(resToReturn));
+
+    protos::Request req;
+    protos::Response res;
+    EXPECT_FALSE(Cluster::Instance().RPC("room.handler.method", req, res));
+    EXPECT_EQ(res.data(), "ABACATE");
+
+    bool called = false;
+    Cluster::Instance().RPCAsync(
+        "room.handler.method", req, [&](optional<PitayaError> err, protos::Response res) {
+            called = true;
+            EXPECT_FALSE(err);
+            EXPECT_EQ(res.data(), "ABACATE");
+        });
+    EXPECT_TRUE(called);
+}
+
+TEST_F(ClusterTest, RpcsWithInvalidRoutesReturnAnError)
+{
+    EXPECT_CALL(*_mockRpcSv, Shutdown());
+    EXPECT_CALL(*_mockRpcClient, Call(_, _)).Times(0);
+    EXPECT_CALL(*_mockRpcClient, CallAsync(_, _, _)).Times(0);
+
+    protos::Request req;
+    protos::Response res;
+    auto err = Cluster::Instance().RPC("invalid", req, res);
+    ASSERT_TRUE(err);
+    EXPECT_EQ(err->code, constants::kCodeInternalError);
+
+    bool called = false;
+    Cluster::Instance().RPCAsync(
+        "invalid", req, [&](optional<PitayaError> err, protos::Response res) {
+            called = true;
+            ASSERT_TRUE(err);
+            EXPECT_EQ(err->code, constants::kCodeInternalError);
+        });
+    EXPECT_TRUE(called);
+}
+
 ACTION_P(SendEmptyRpc, handlerFunc)
 {
     handlerFunc(protos::Request(), nullptr);
@@ -233,3 +478,163 @@ TEST_F(ClusterTest, SemaphoreRestart)
         }
     }
 }
+
+class MockRpc : public pitaya::Rpc
+{
+public:
+    MOCK_METHOD1(Finish, void(const protos::Response&));
+};
+
+TEST_F(ClusterTest, RpcsOverTheMaximumAreRefusedWithoutWaiting)
+{
+    EXPECT_CALL(*_mockRpcSv, Shutdown());
+    Cluster::Instance().SetMaxWaitingRpcs(1);
+
+    MockRpc rpc1, rpc2, rpc3;
+    EXPECT_CALL(rpc2,
+                Finish(Property(&protos::Response::error,
+                                Property(&protos::Error::code,
+                                         Eq(constants::kCodeServiceUnavailable)))));
+
+    protos::Request req;
+    _handlerFunc(req, &rpc1);
+    _handlerFunc(req, &rpc2);
+
+    optional<Cluster::RpcData> data = Cluster::Instance().WaitForRpc();
+    ASSERT_TRUE(data);
+    EXPECT_EQ(data->rpc, &rpc1);
+
+    // Picking up the rpc makes room for the next one.
+    _handlerFunc(req, &rpc3);
+    data = Cluster::Instance().WaitForRpc();
+    ASSERT_TRUE(data);
+    EXPECT_EQ(data->rpc, &rpc3);
+}
+
+TEST_F(ClusterTest, RpcsUpToTheDefaultCapacityAreNotRefused)
+{
+    EXPECT_CALL(*_mockRpcSv, Shutdown());
+
+    // The mock rpc server has a single dispatch shard.
+    std::vector<MockRpc> rpcs(Cluster::kDefaultWaitingRpcShardCapacity);
+    protos::Request req;
+    for (auto& rpc : rpcs) {
+        EXPECT_CALL(rpc, Finish(_)).Times(0);
+        _handlerFunc(req, &rpc);
+    }
+
+    for (auto& rpc : rpcs) {
+        optional<Cluster::RpcData> data = Cluster::Instance().WaitForRpc();
+        ASSERT_TRUE(data);
+        EXPECT_EQ(data->rpc, &rpc);
+    }
+}
+
+TEST_F(ClusterTest, RpcsReceivedBeforeTheServerFinishesAreStillDelivered)
+{
+    EXPECT_NE(_handlerFunc, nullptr);
+    EXPECT_CALL(*_mockRpcSv, Shutdown());
+
+    MockRpc rpc1, rpc2;
+
+    protos::Request req;
+    req.set_type(protos::RPCType::User);
+    _handlerFunc(req, &rpc1);
+    _handlerFunc(req, &rpc2);
+    _handlerFunc(protos::Request(), nullptr);
+
+    optional<Cluster::RpcData> data = Cluster::Instance().WaitForRpc();
+    ASSERT_TRUE(data);
+    EXPECT_EQ(data->rpc, &rpc1);
+    EXPECT_EQ(data->req.type(), protos::RPCType::User);
+
+    data = Cluster::Instance().WaitForRpc();
+    ASSERT_TRUE(data);
+    EXPECT_EQ(data->rpc, &rpc2);
+
+    EXPECT_EQ(Cluster::Instance().WaitForRpc(), boost::none);
+
+    // Rpcs that arrive after the server finished are answered right away.
+    MockRpc lateRpc;
+    EXPECT_CALL(lateRpc, Finish(Property(&protos::Response::has_error, true)));
+    _handlerFunc(req, &lateRpc);
+}
+
+TEST(ClusterShardedDispatchTest, EveryRpcIsDeliveredOnceToTheWaitingThreads)
+{
+    GrpcConfig config;
+    config.host = "localhost";
+    config.port = 58100;
+    config.serverShutdownDeadline = std::chrono::milliseconds(500);
+    config.serverShardedDispatch = true;
+    config.serverNumThreads = 4;
+    config.serverPinThreads = true;
+
+    auto mockRpcClient = new NiceMock<MockRpcClient>();
+    ON_CALL(*mockRpcClient, CallsServerTypes()).WillByDefault(Return(false));
+    Cluster::Instance().Initialize(Server(Server::Kind::Backend, "my-server-id", "connector"),
+                                   std::make_shared<NiceMock<MockServiceDiscovery>>(),
+                                   std::unique_ptr<RpcServer>(new GrpcServer(config)),
+                                   std::unique_ptr<RpcClient>(mockRpcClient));
+
+    const int numRpcs = 400;
+    std::vector<std::atomic_int> numDeliveries(numRpcs);
+    std::atomic_int numFinishedConsumers(0);
+
+    auto consume = [&numDeliveries, &numFinishedConsumers]() {
+        while (optional<Cluster::RpcData> data = Cluster::Instance().WaitForRpc()) {
+            const int id = std::stoi(data->req.msg().data());
+            numDeliveries[id]++;
+            protos::Response res;
+            res.set_data(data->req.msg().data());
+            data->rpc->Finish(res);
+        }
+        numFinishedConsumers++;
+    };
+
+    auto stub = protos::Pitaya::NewStub(grpc::CreateChannel(
+        config.host + ":" + std::to_string(config.port), grpc::InsecureChannelCredentials()));
+    auto sendRpcs = [&stub](int first, int last) {
+        std::vector<std::thread> clients;
+        for (int i = first; i < last; ++i) {
+            clients.emplace_back([&stub, i]() {
+                auto msg = new protos::Msg();
+                msg->set_route("my.custom.route");
+                msg->set_data(std::to_string(i));
+                protos::Request req;
+                req.set_type(protos::RPCType::User);
+                req.set_allocated_msg(msg);
+
+                grpc::ClientContext ctx;
+                protos::Response res;
+                ASSERT_TRUE(stub->Call(&ctx, req, &res).ok());
+                EXPECT_FALSE(res.has_error());
+                EXPECT_EQ(res.data(), std::to_string(i));
+            });
+        }
+        for (auto& client : clients) {
+            client.join();
+        }
+    };
+
+    // A single consumer has to steal the rpcs pushed to the shards of the other threads.
+    std::vector<std::thread> consumers;
+    consumers.emplace_back(consume);
+    sendRpcs(0, numRpcs / 2);
+
+    for (int i = 1; i < config.serverNumThreads; ++i) {
+        consumers.emplace_back(consume);
+    }
+    sendRpcs(numRpcs / 2, numRpcs);
+
+    for (int i = 0; i < numRpcs; ++i) {
+        EXPECT_EQ(numDeliveries[i], 1) << "rpc " << i;
+    }
+
+    // Every consumer is waiting for rpcs, terminating the cluster wakes all of them.
+    Cluster::Instance().Terminate();
+    for (auto& consumer : consumers) {
+        consumer.join();
+    }
+    EXPECT_EQ(numFinishedConsumers, consumers.size());
+}
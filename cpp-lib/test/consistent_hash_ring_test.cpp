@@ -0,0 +1,120 @@
+#include "test_common.h"
+
+#include "pitaya/consistent_hash_ring.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace pitaya;
+using namespace ::testing;
+
+static Server
+MakeServer(const std::string& id, const std::string& type = "room")
+{
+    return Server(Server::Kind::Backend, id, type);
+}
+
+static std::map<std::string, std::string>
+Owners(const ConsistentHashRing& ring, int numKeys)
+{
+    std::map<std::string, std::string> owners;
+    for (int i = 0; i < numKeys; ++i) {
+        auto key = "user-" + std::to_string(i);
+        owners[key] = ring.ServerIdForKey("room", key).value();
+    }
+    return owners;
+}
+
+TEST(ConsistentHashRing, ReturnsNoneWithoutServersOfTheType)
+{
+    ConsistentHashRing ring;
+    EXPECT_FALSE(ring.ServerIdForKey("room", "user-1"));
+
+    ring.ServerAdded(MakeServer("connector-1", "connector"));
+    EXPECT_FALSE(ring.ServerIdForKey("room", "user-1"));
+
+    ring.ServerAdded(MakeServer("room-1"));
+    ring.ServerRemoved(MakeServer("room-1"));
+    EXPECT_FALSE(ring.ServerIdForKey("room", "user-1"));
+    EXPECT_EQ(ring.ServerIdForKey("connector", "user-1").value(), "connector-1");
+}
+
+TEST(ConsistentHashRing, KeysAreSpreadAcrossTheServers)
+{
+    ConsistentHashRing ring;
+    for (int i = 0; i < 4; ++i) {
+        ring.ServerAdded(MakeServer("room-" + std::to_string(i)));
+    }
+
+    std::map<std::string, int> keysPerServer;
+    for (const auto& pair : Owners(ring, 10000)) {
+        keysPerServer[pair.second]++;
+    }
+    ASSERT_EQ(keysPerServer.size(), 4);
+    for (const auto& pair : keysPerServer) {
+        EXPECT_GT(pair.second, 1500) << pair.first;
+        EXPECT_LT(pair.second, 3500) << pair.first;
+    }
+}
+
+TEST(ConsistentHashRing, DoesNotDependOnTheOrderOfTheServers)
+{
+    ConsistentHashRing ring;
+    ConsistentHashRing reversed;
+    for (int i = 0; i < 5; ++i) {
+        ring.ServerAdded(MakeServer("room-" + std::to_string(i)));
+        reversed.ServerAdded(MakeServer("room-" + std::to_string(4 - i)));
+    }
+    // Duplicated notifications are ignored.
+    reversed.ServerAdded(MakeServer("room-2"));
+
+    EXPECT_EQ(Owners(ring, 1000), Owners(reversed, 1000));
+}
+
+TEST(ConsistentHashRing, OnlyTheKeysOfTheChangedServerMove)
+{
+    ConsistentHashRing ring;
+    for (int i = 0; i < 5; ++i) {
+        ring.ServerAdded(MakeServer("room-" + std::to_string(i)));
+    }
+    auto before = Owners(ring, 2000);
+
+    ring.ServerRemoved(MakeServer("room-1"));
+    auto afterRemove = Owners(ring, 2000);
+    for (const auto& pair : before) {
+        if (pair.second != "room-1") {
+            EXPECT_EQ(afterRemove[pair.first], pair.second);
+        } else {
+            EXPECT_NE(afterRemove[pair.first], "room-1");
+        }
+    }
+
+    // Adding the server back restores the previous owners.
+    ring.ServerAdded(MakeServer("room-1"));
+    EXPECT_EQ(Owners(ring, 2000), before);
+}
+
+TEST(ConsistentHashRing, BatchesOfChangesMatchTheSingleChanges)
+{
+    ConsistentHashRing ring;
+    ConsistentHashRing batched;
+    std::vector<Server> servers;
+    for (int i = 0; i < 6; ++i) {
+        servers.push_back(MakeServer("room-" + std::to_string(i)));
+        ring.ServerAdded(servers.back());
+    }
+    batched.ServersChanged(servers, {});
+    EXPECT_EQ(Owners(batched, 1000), Owners(ring, 1000));
+
+    ring.ServerRemoved(servers[1]);
+    ring.ServerRemoved(servers[4]);
+    ring.ServerAdded(MakeServer("room-6"));
+    batched.ServersChanged({ MakeServer("room-6") }, { servers[1], servers[4] });
+    EXPECT_EQ(Owners(batched, 1000), Owners(ring, 1000));
+
+    // A server that is removed and added again in the same batch keeps its keys.
+    auto before = Owners(batched, 1000);
+    batched.ServersChanged({ servers[2] }, { servers[2] });
+    EXPECT_EQ(Owners(batched, 1000), before);
+}
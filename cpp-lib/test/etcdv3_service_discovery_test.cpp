@@ -6,6 +6,8 @@
 
 #include "mock_etcd_client.h"
 #include "mock_service_discovery.h"
+#include <future>
+#include <mutex>
 #include <thread>
 
 using namespace pitaya;
@@ -54,14 +56,18 @@ NewSuccessfullLeaseGrantResponse(int64_t leaseId)
 }
 
 static ListResponse
-NewListResponse(std::vector<std::string> keys = std::vector<std::string>())
+NewListResponse(std::vector<std::string> keys = std::vector<std::string>(),
+                std::vector<std::string> values = std::vector<std::string>())
 {
     ListResponse res;
     if (keys.empty()) {
         res.ok = false;
     } else {
         res.ok = true;
+        // Keys that are never parsed do not need a value.
+        values.resize(keys.size());
         res.keys = std::move(keys);
+        res.values = std::move(values);
     }
     return res;
 }
@@ -179,6 +185,11 @@ TEST_F(Etcdv3ServiceDiscoveryTest, WatchesForKeysAddedAndRemoved)
         ASSERT_EQ(server, Server(Server::Kind::Backend, "myid", "mytype"));
     }
 
+    // Lists returned before a change are not modified by it.
+    auto serverList = serviceDiscovery->GetServerListByType("mytype");
+    ASSERT_EQ(serverList->size(), 1);
+    EXPECT_EQ(serverList->front(), Server(Server::Kind::Backend, "myid", "mytype"));
+
     for (int i = 0; i < 2; ++i) {
         watchRes.action = "delete";
         watchRes.key = "pitaya/servers/mytype/myid";
@@ -189,6 +200,10 @@ TEST_F(Etcdv3ServiceDiscoveryTest, WatchesForKeysAddedAndRemoved)
         auto server = serviceDiscovery->GetServerById("myid");
         ASSERT_EQ(server, boost::none);
     }
+
+    EXPECT_TRUE(serviceDiscovery->GetServerListByType("mytype")->empty());
+    EXPECT_TRUE(serviceDiscovery->GetServersByType("mytype").empty());
+    EXPECT_EQ(serverList->size(), 1);
 }
 
 TEST_F(Etcdv3ServiceDiscoveryTest, SynchronizesServersEveryInterval)
@@ -199,16 +214,27 @@ TEST_F(Etcdv3ServiceDiscoveryTest, SynchronizesServersEveryInterval)
     auto leaseGrantRes = NewSuccessfullLeaseGrantResponse(129310);
     auto setRes = NewSuccessfullSetResponse();
 
-    auto firstListRes = NewListResponse({
-        "other-prefix/servers/connector/super-id",
-        "pitaya/servers/connector/myid",
-        "pitaya/servers/room/awesome-id",
-    });
-
-    auto secondListRes = NewListResponse({
-        "other-prefix/servers/connector/super-id",
-        "pitaya/servers/room/awesome-id",
-    });
+    auto firstListRes = NewListResponse(
+        {
+            "other-prefix/servers/connector/super-id",
+            "pitaya/servers/connector/myid",
+            "pitaya/servers/room/awesome-id",
+        },
+        {
+            "",
+            "{\"id\": \"myid\", \"type\": \"connector\"}",
+            "{\"id\": \"awesome-id\", \"type\": \"room\", \"frontend\": true}",
+        });
+
+    auto secondListRes = NewListResponse(
+        {
+            "other-prefix/servers/connector/super-id",
+            "pitaya/servers/room/awesome-id",
+        },
+        {
+            "",
+            "{\"id\": \"awesome-id\", \"type\": \"room\", \"frontend\": true}",
+        });
 
     LeaseRevokeResponse revokeRes;
     revokeRes.ok = true;
@@ -235,22 +261,6 @@ TEST_F(Etcdv3ServiceDiscoveryTest, SynchronizesServersEveryInterval)
         EXPECT_CALL(*_mockEtcdClient, StopLeaseKeepAlive());
     }
 
-    {
-        GetResponse firstGetRes;
-        firstGetRes.ok = true;
-        firstGetRes.value = "{\"id\": \"myid\", \"type\": \"connector\"}";
-
-        GetResponse secondGetRes;
-        secondGetRes.ok = true;
-        secondGetRes.value = "{\"id\": \"awesome-id\", \"type\": \"room\", \"frontend\": true}";
-
-        InSequence seq;
-        EXPECT_CALL(*_mockEtcdClient, Get("pitaya/servers/connector/myid"))
-            .WillOnce(Return(firstGetRes));
-        EXPECT_CALL(*_mockEtcdClient, Get("pitaya/servers/room/awesome-id"))
-            .WillOnce(Return(secondGetRes));
-    }
-
     auto serviceDiscovery = CreateServiceDiscovery();
 
     ASSERT_NE(_mockEtcdClient->onWatch, nullptr);
@@ -296,16 +306,27 @@ TEST_F(Etcdv3ServiceDiscoveryTest, ListenersCanBeAddedAndRemoved)
     // Will synchronize servers with etcd manually every 2 seconds
     _config.syncServersIntervalSec = std::chrono::seconds(1);
 
-    auto firstListRes = NewListResponse({
-        "other-prefix/servers/connector/super-id",
-        "pitaya/servers/connector/myid",
-        "pitaya/servers/room/awesome-id",
-    });
-
-    auto secondListRes = NewListResponse({
-        "other-prefix/servers/connector/super-id",
-        "pitaya/servers/room/awesome-id",
-    });
+    auto firstListRes = NewListResponse(
+        {
+            "other-prefix/servers/connector/super-id",
+            "pitaya/servers/connector/myid",
+            "pitaya/servers/room/awesome-id",
+        },
+        {
+            "",
+            "{\"id\": \"myid\", \"type\": \"connector\"}",
+            "{\"id\": \"awesome-id\", \"type\": \"room\", \"frontend\": true}",
+        });
+
+    auto secondListRes = NewListResponse(
+        {
+            "other-prefix/servers/connector/super-id",
+            "pitaya/servers/room/awesome-id",
+        },
+        {
+            "",
+            "{\"id\": \"awesome-id\", \"type\": \"room\", \"frontend\": true}",
+        });
 
     LeaseRevokeResponse revokeRes;
     revokeRes.ok = true;
@@ -335,22 +356,6 @@ TEST_F(Etcdv3ServiceDiscoveryTest, ListenersCanBeAddedAndRemoved)
         EXPECT_CALL(*_mockEtcdClient, StopLeaseKeepAlive());
     }
 
-    {
-        GetResponse firstGetRes;
-        firstGetRes.ok = true;
-        firstGetRes.value = "{\"id\": \"myid\", \"type\": \"connector\"}";
-
-        GetResponse secondGetRes;
-        secondGetRes.ok = true;
-        secondGetRes.value = "{\"id\": \"awesome-id\", \"type\": \"room\", \"frontend\": true}";
-
-        InSequence seq;
-        EXPECT_CALL(*_mockEtcdClient, Get("pitaya/servers/connector/myid"))
-            .WillOnce(Return(firstGetRes));
-        EXPECT_CALL(*_mockEtcdClient, Get("pitaya/servers/room/awesome-id"))
-            .WillOnce(Return(secondGetRes));
-    }
-
     // As soon as we add the listener, it will be called with all of the current servers
     // on the service discovery. After it will be called whenever a server is removed or added.
     auto listener =
@@ -389,16 +394,22 @@ TEST_F(Etcdv3ServiceDiscoveryTest, ListenersCanBeAddedAndRemoved)
     EXPECT_EQ(server, boost::none);
 }
 
-TEST_F(Etcdv3ServiceDiscoveryTest, ServerIsIgnoredInSyncServersIfGetFromEtcdFails)
+TEST_F(Etcdv3ServiceDiscoveryTest, ServerIsIgnoredInSyncServersIfItsValueIsInvalid)
 {
     // Will synchronize servers with etcd manually every 2 seconds
     _config.syncServersIntervalSec = std::chrono::seconds(1);
 
-    auto firstListRes = NewListResponse({
-        "other-prefix/servers/connector/super-id",
-        "pitaya/servers/connector/myid",
-        "pitaya/servers/room/awesome-id",
-    });
+    auto firstListRes = NewListResponse(
+        {
+            "other-prefix/servers/connector/super-id",
+            "pitaya/servers/connector/myid",
+            "pitaya/servers/room/awesome-id",
+        },
+        {
+            "",
+            "{\"id\": \"myid\"}",
+            "{\"id\": \"awesome-id\", \"type\": \"room\", \"frontend\": true}",
+        });
 
     LeaseRevokeResponse revokeRes;
     revokeRes.ok = true;
@@ -425,21 +436,6 @@ TEST_F(Etcdv3ServiceDiscoveryTest, ServerIsIgnoredInSyncServersIfGetFromEtcdFail
         EXPECT_CALL(*_mockEtcdClient, StopLeaseKeepAlive());
     }
 
-    {
-        GetResponse firstGetRes;
-        firstGetRes.ok = false;
-
-        GetResponse secondGetRes;
-        secondGetRes.ok = true;
-        secondGetRes.value = "{\"id\": \"awesome-id\", \"type\": \"room\", \"frontend\": true}";
-
-        InSequence seq;
-        EXPECT_CALL(*_mockEtcdClient, Get("pitaya/servers/connector/myid"))
-            .WillOnce(Return(firstGetRes));
-        EXPECT_CALL(*_mockEtcdClient, Get("pitaya/servers/room/awesome-id"))
-            .WillOnce(Return(secondGetRes));
-    }
-
     auto serviceDiscovery = CreateServiceDiscovery();
 
     std::this_thread::sleep_for(std::chrono::milliseconds(5));
@@ -468,14 +464,23 @@ TEST_F(Etcdv3ServiceDiscoveryTest, ServerIsIgnoredInSyncServersIfTheServerTypeIs
         "server-type1", "server-type2", "server-type3",
     };
     
-    auto listRes = NewListResponse({
-        "pitaya/servers/room/awesome-id1",
-        "pitaya/servers/server-type1/awesome-id2",
-        "pitaya/servers/connector/myid",
-        "pitaya/servers/server-type3/awesome-id3",
-        "other-prefix/servers/connector/super-id4",
-        "pitaya/servers/server-type2/awesome-id5",
-    });
+    auto listRes = NewListResponse(
+        {
+            "pitaya/servers/room/awesome-id1",
+            "pitaya/servers/server-type1/awesome-id2",
+            "pitaya/servers/connector/myid",
+            "pitaya/servers/server-type3/awesome-id3",
+            "other-prefix/servers/connector/super-id4",
+            "pitaya/servers/server-type2/awesome-id5",
+        },
+        {
+            "",
+            "{\"id\": \"awesome-id2\", \"type\": \"server-type1\", \"frontend\": true}",
+            "",
+            "{\"id\": \"awesome-id3\", \"type\": \"server-type3\", \"frontend\": true}",
+            "",
+            "{\"id\": \"awesome-id5\", \"type\": \"server-type2\", \"frontend\": true}",
+        });
     
     LeaseRevokeResponse revokeRes;
     revokeRes.ok = true;
@@ -502,28 +507,6 @@ TEST_F(Etcdv3ServiceDiscoveryTest, ServerIsIgnoredInSyncServersIfTheServerTypeIs
         EXPECT_CALL(*_mockEtcdClient, StopLeaseKeepAlive());
     }
 
-    {
-        GetResponse firstGetRes;
-        firstGetRes.ok = true;
-        firstGetRes.value = "{\"id\": \"awesome-id2\", \"type\": \"server-type1\", \"frontend\": true}";
-
-        GetResponse secondGetRes;
-        secondGetRes.ok = true;
-        secondGetRes.value = "{\"id\": \"awesome-id3\", \"type\": \"server-type3\", \"frontend\": true}";
-
-        GetResponse thirdGetRes;
-        thirdGetRes.ok = true;
-        thirdGetRes.value = "{\"id\": \"awesome-id5\", \"type\": \"server-type2\", \"frontend\": true}";
-
-        InSequence seq;
-        EXPECT_CALL(*_mockEtcdClient, Get("pitaya/servers/server-type1/awesome-id2"))
-        .WillOnce(Return(firstGetRes));
-        EXPECT_CALL(*_mockEtcdClient, Get("pitaya/servers/server-type3/awesome-id3"))
-        .WillOnce(Return(secondGetRes));
-        EXPECT_CALL(*_mockEtcdClient, Get("pitaya/servers/server-type2/awesome-id5"))
-        .WillOnce(Return(thirdGetRes));
-    }
-
     auto serviceDiscovery = CreateServiceDiscovery();
 
     std::this_thread::sleep_for(std::chrono::milliseconds(200));
@@ -543,6 +526,347 @@ TEST_F(Etcdv3ServiceDiscoveryTest, ServerIsIgnoredInSyncServersIfTheServerTypeIs
     }
 }
 
+TEST_F(Etcdv3ServiceDiscoveryTest, ResumesTheWatchAfterTheLastRevision)
+{
+    auto leaseGrantRes = NewSuccessfullLeaseGrantResponse(129310);
+    auto setRes = NewSuccessfullSetResponse();
+
+    ListResponse listRes;
+    listRes.ok = true;
+    listRes.revision = 10;
+
+    LeaseRevokeResponse revokeRes;
+    revokeRes.ok = true;
+
+    EXPECT_CALL(*_mockEtcdClient, List(Eq(_config.etcdPrefix + "servers/metagame/")))
+        .WillOnce(Return(listRes));
+
+    {
+        InSequence seq;
+        EXPECT_CALL(*_mockEtcdClient, LeaseGrant(Eq(_config.heartbeatTTLSec)))
+            .WillOnce(Return(leaseGrantRes));
+        EXPECT_CALL(*_mockEtcdClient, Set(_, _, Eq(leaseGrantRes.leaseId)))
+            .WillOnce(Return(setRes));
+        EXPECT_CALL(*_mockEtcdClient, LeaseRevoke(Eq(leaseGrantRes.leaseId)))
+            .WillOnce(Return(revokeRes));
+    }
+
+    {
+        InSequence seq;
+        EXPECT_CALL(*_mockEtcdClient, LeaseKeepAlive(Eq(leaseGrantRes.leaseId), _));
+        EXPECT_CALL(*_mockEtcdClient, CancelWatch());
+        EXPECT_CALL(*_mockEtcdClient, StopLeaseKeepAlive());
+    }
+
+    auto serviceDiscovery = CreateServiceDiscovery();
+
+    // The watch starts right after the revision of the initial synchronization.
+    ASSERT_EQ(_mockEtcdClient->watchFromRevisions, std::vector<int64_t>({ 11 }));
+
+    pitaya::WatchResponse watchRes;
+    watchRes.ok = true;
+    watchRes.action = "create";
+    watchRes.key = "pitaya/servers/mytype/myid";
+    watchRes.value = "{\"id\": \"myid\", \"type\": \"mytype\"}";
+    watchRes.revision = 15;
+    _mockEtcdClient->onWatch(watchRes);
+
+    // Changes older than the ones already seen are ignored.
+    watchRes.action = "delete";
+    watchRes.revision = 12;
+    _mockEtcdClient->onWatch(watchRes);
+
+    pitaya::WatchResponse errorRes;
+    errorRes.ok = false;
+    _mockEtcdClient->onWatch(errorRes);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    EXPECT_TRUE(serviceDiscovery->GetServerById("myid"));
+    EXPECT_EQ(_mockEtcdClient->watchFromRevisions, std::vector<int64_t>({ 11, 16 }));
+}
+
+TEST_F(Etcdv3ServiceDiscoveryTest, SynchronizesAllServersWhenTheRevisionWasCompacted)
+{
+    auto leaseGrantRes = NewSuccessfullLeaseGrantResponse(129310);
+    auto setRes = NewSuccessfullSetResponse();
+
+    ListResponse firstListRes;
+    firstListRes.ok = true;
+    firstListRes.revision = 10;
+
+    auto secondListRes =
+        NewListResponse({ "pitaya/servers/mytype/myid" },
+                        { "{\"id\": \"myid\", \"type\": \"mytype\"}" });
+    secondListRes.revision = 30;
+
+    LeaseRevokeResponse revokeRes;
+    revokeRes.ok = true;
+
+    EXPECT_CALL(*_mockEtcdClient, List(Eq(_config.etcdPrefix + "servers/metagame/")))
+        .Times(2)
+        .WillOnce(Return(firstListRes))
+        .WillOnce(Return(secondListRes));
+
+    {
+        InSequence seq;
+        EXPECT_CALL(*_mockEtcdClient, LeaseGrant(Eq(_config.heartbeatTTLSec)))
+            .WillOnce(Return(leaseGrantRes));
+        EXPECT_CALL(*_mockEtcdClient, Set(_, _, Eq(leaseGrantRes.leaseId)))
+            .WillOnce(Return(setRes));
+        EXPECT_CALL(*_mockEtcdClient, LeaseRevoke(Eq(leaseGrantRes.leaseId)))
+            .WillOnce(Return(revokeRes));
+    }
+
+    {
+        InSequence seq;
+        EXPECT_CALL(*_mockEtcdClient, LeaseKeepAlive(Eq(leaseGrantRes.leaseId), _));
+        EXPECT_CALL(*_mockEtcdClient, CancelWatch());
+        EXPECT_CALL(*_mockEtcdClient, StopLeaseKeepAlive());
+    }
+
+    auto serviceDiscovery = CreateServiceDiscovery();
+    ASSERT_EQ(_mockEtcdClient->watchFromRevisions, std::vector<int64_t>({ 11 }));
+
+    // The watch breaks and etcd compacted the revisions after the last one seen.
+    _mockEtcdClient->compactedRevision = 20;
+    pitaya::WatchResponse errorRes;
+    errorRes.ok = false;
+    _mockEtcdClient->onWatch(errorRes);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    EXPECT_EQ(serviceDiscovery->GetServerById("myid"),
+              Server(Server::Kind::Backend, "myid", "mytype"));
+    EXPECT_EQ(_mockEtcdClient->watchFromRevisions, std::vector<int64_t>({ 11, 11, 31 }));
+}
+
+// Records every batch of changes. The first batch blocks the worker thread until it is
+// released, so the events sent meanwhile are queued together.
+class BatchListener : public service_discovery::Listener
+{
+public:
+    using Batch = std::pair<std::vector<Server>, std::vector<Server>>;
+
+    void ServerAdded(const Server& server) override {}
+    void ServerRemoved(const Server& server) override {}
+
+    void ServersChanged(const std::vector<Server>& added,
+                        const std::vector<Server>& removed) override
+    {
+        size_t numBatches;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _batches.emplace_back(added, removed);
+            numBatches = _batches.size();
+        }
+        if (numBatches == 1) {
+            _released.wait();
+        }
+    }
+
+    void Release() { _release.set_value(); }
+
+    std::vector<Batch> Batches()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _batches;
+    }
+
+private:
+    std::mutex _mutex;
+    std::vector<Batch> _batches;
+    std::promise<void> _release;
+    std::shared_future<void> _released = _release.get_future().share();
+};
+
+TEST_F(Etcdv3ServiceDiscoveryTest, CoalescesTheWatchEventsThatArriveTogether)
+{
+    auto leaseGrantRes = NewSuccessfullLeaseGrantResponse(129310);
+    auto setRes = NewSuccessfullSetResponse();
+
+    ListResponse listRes;
+    listRes.ok = true;
+
+    LeaseRevokeResponse revokeRes;
+    revokeRes.ok = true;
+
+    EXPECT_CALL(*_mockEtcdClient, List(Eq(_config.etcdPrefix + "servers/metagame/")))
+        .WillRepeatedly(Return(listRes));
+
+    {
+        InSequence seq;
+        EXPECT_CALL(*_mockEtcdClient, LeaseGrant(Eq(_config.heartbeatTTLSec)))
+            .WillOnce(Return(leaseGrantRes));
+        EXPECT_CALL(*_mockEtcdClient, Set(_, _, Eq(leaseGrantRes.leaseId)))
+            .WillOnce(Return(setRes));
+        EXPECT_CALL(*_mockEtcdClient, LeaseRevoke(Eq(leaseGrantRes.leaseId)))
+            .WillOnce(Return(revokeRes));
+    }
+
+    {
+        InSequence seq;
+        EXPECT_CALL(*_mockEtcdClient, LeaseKeepAlive(Eq(leaseGrantRes.leaseId), _));
+        EXPECT_CALL(*_mockEtcdClient, CancelWatch());
+        EXPECT_CALL(*_mockEtcdClient, StopLeaseKeepAlive());
+    }
+
+    auto serviceDiscovery = CreateServiceDiscovery();
+
+    BatchListener listener;
+    serviceDiscovery->AddListener(&listener);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    auto sendWatch = [this](const std::string& action, const std::string& id) {
+        pitaya::WatchResponse watchRes;
+        watchRes.ok = true;
+        watchRes.action = action;
+        watchRes.key = "pitaya/servers/mytype/" + id;
+        watchRes.value = "{\"id\": \"" + id + "\", \"type\": \"mytype\"}";
+        _mockEtcdClient->onWatch(watchRes);
+    };
+
+    sendWatch("create", "server-a");
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_EQ(listener.Batches().size(), 1);
+
+    // Sent while the worker is still notifying the first change.
+    sendWatch("create", "server-b");
+    sendWatch("create", "server-c");
+    sendWatch("delete", "server-b");
+    sendWatch("delete", "server-a");
+    listener.Release();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    auto batches = listener.Batches();
+    ASSERT_EQ(batches.size(), 2);
+    EXPECT_EQ(batches[0].first,
+              std::vector<Server>({ Server(Server::Kind::Backend, "server-a", "mytype") }));
+    EXPECT_TRUE(batches[0].second.empty());
+    // The server that was created and deleted in the same batch is never reported.
+    EXPECT_EQ(batches[1].first,
+              std::vector<Server>({ Server(Server::Kind::Backend, "server-c", "mytype") }));
+    EXPECT_EQ(batches[1].second,
+              std::vector<Server>({ Server(Server::Kind::Backend, "server-a", "mytype") }));
+
+    EXPECT_EQ(serviceDiscovery->GetServersByType("mytype"),
+              std::vector<Server>({ Server(Server::Kind::Backend, "server-c", "mytype") }));
+
+    serviceDiscovery->RemoveListener(&listener);
+}
+
+TEST_F(Etcdv3ServiceDiscoveryTest, KeepsTheServerIndexesWhenServersAreRemoved)
+{
+    auto leaseGrantRes = NewSuccessfullLeaseGrantResponse(129310);
+    auto setRes = NewSuccessfullSetResponse();
+
+    ListResponse listRes;
+    listRes.ok = true;
+
+    LeaseRevokeResponse revokeRes;
+    revokeRes.ok = true;
+
+    EXPECT_CALL(*_mockEtcdClient, List(Eq(_config.etcdPrefix + "servers/metagame/")))
+        .WillRepeatedly(Return(listRes));
+
+    {
+        InSequence seq;
+        EXPECT_CALL(*_mockEtcdClient, LeaseGrant(Eq(_config.heartbeatTTLSec)))
+            .WillOnce(Return(leaseGrantRes));
+        EXPECT_CALL(*_mockEtcdClient, Set(_, _, Eq(leaseGrantRes.leaseId)))
+            .WillOnce(Return(setRes));
+        EXPECT_CALL(*_mockEtcdClient, LeaseRevoke(Eq(leaseGrantRes.leaseId)))
+            .WillOnce(Return(revokeRes));
+    }
+
+    {
+        InSequence seq;
+        EXPECT_CALL(*_mockEtcdClient, LeaseKeepAlive(Eq(leaseGrantRes.leaseId), _));
+        EXPECT_CALL(*_mockEtcdClient, CancelWatch());
+        EXPECT_CALL(*_mockEtcdClient, StopLeaseKeepAlive());
+    }
+
+    auto serviceDiscovery = CreateServiceDiscovery();
+
+    auto sendWatch = [this](const std::string& action,
+                            const std::string& id,
+                            const std::string& hostname = "") {
+        pitaya::WatchResponse watchRes;
+        watchRes.ok = true;
+        watchRes.action = action;
+        watchRes.key = "pitaya/servers/mytype/" + id;
+        watchRes.value = "{\"id\": \"" + id + "\", \"type\": \"mytype\", \"hostname\": \"" +
+                         hostname + "\"}";
+        _mockEtcdClient->onWatch(watchRes);
+    };
+
+    auto server = [](const std::string& id, const std::string& hostname = "") {
+        return Server(Server::Kind::Backend, id, "mytype", hostname);
+    };
+
+    // Every server of the list must be found by its id, and no other server of the type.
+    auto expectServers = [&](const std::vector<Server>& expected) {
+        EXPECT_EQ(serviceDiscovery->GetServersByType("mytype"), expected);
+        for (const auto& sv : expected) {
+            EXPECT_EQ(serviceDiscovery->GetServerById(sv.Id()), sv);
+        }
+    };
+
+    for (const auto& id : { "server-a", "server-b", "server-c", "server-d" }) {
+        sendWatch("create", id);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    expectServers({ server("server-a"), server("server-b"), server("server-c"),
+                    server("server-d") });
+
+    // The last server of the list takes the place of the removed one.
+    sendWatch("delete", "server-b");
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_EQ(serviceDiscovery->GetServerById("server-b"), boost::none);
+    expectServers({ server("server-a"), server("server-d"), server("server-c") });
+
+    // Removing the server that was moved must use its new position.
+    sendWatch("delete", "server-d");
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_EQ(serviceDiscovery->GetServerById("server-d"), boost::none);
+    expectServers({ server("server-a"), server("server-c") });
+
+    // The known servers are reported to a new listener in a first batch, which blocks the
+    // worker thread until it is released.
+    BatchListener listener;
+    serviceDiscovery->AddListener(&listener);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    ASSERT_EQ(listener.Batches().size(), 1);
+
+    // Deleted and created again in the same batch, so the server is replaced.
+    sendWatch("delete", "server-a");
+    sendWatch("create", "server-a", "new-host");
+    listener.Release();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    auto batches = listener.Batches();
+    ASSERT_EQ(batches.size(), 2);
+    EXPECT_EQ(batches[1].first, std::vector<Server>({ server("server-a", "new-host") }));
+    EXPECT_EQ(batches[1].second, std::vector<Server>({ server("server-a") }));
+    expectServers({ server("server-c"), server("server-a", "new-host") });
+
+    sendWatch("create", "server-e");
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    expectServers({ server("server-c"), server("server-a", "new-host"), server("server-e") });
+
+    sendWatch("delete", "server-c");
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    expectServers({ server("server-e"), server("server-a", "new-host") });
+
+    sendWatch("delete", "server-a");
+    sendWatch("delete", "server-e");
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    expectServers({});
+    EXPECT_TRUE(serviceDiscovery->GetServerListByType("mytype")->empty());
+
+    serviceDiscovery->RemoveListener(&listener);
+}
+
 ACTION_TEMPLATE(SaveFunction,
                 HAS_1_TEMPLATE_PARAMS(int, k),
                 AND_1_VALUE_PARAMS(pointer))
@@ -832,6 +1156,9 @@ TEST_F(Etcdv3ServiceDiscoveryTest, ReconnectsAfterSomeRetrieUsingExponentialBack
         .WillOnce(Return(secondLeaseGrantRes));
         EXPECT_CALL(*_mockEtcdClient, Set(_, _, Eq(secondLeaseGrantRes.leaseId)))
         .WillOnce(Return(setRes));
+        // The servers are listed again before watching from the revision of the list.
+        EXPECT_CALL(*_mockEtcdClient, List(Eq(_config.etcdPrefix + "servers/metagame/")))
+        .WillOnce(Return(listRes));
         EXPECT_CALL(*_mockEtcdClient, LeaseKeepAlive(Eq(secondLeaseGrantRes.leaseId), _))
         .WillOnce(SaveFunction<1>(&onLeaseKeepAliveExit));
         EXPECT_CALL(*_mockEtcdClient, LeaseRevoke(10101010));
@@ -9,8 +9,10 @@
 #include "mock_binding_storage.h"
 #include "mock_etcd_client.h"
 #include "mock_service_discovery.h"
+#include <condition_variable>
 #include <cpprest/json.h>
 #include <regex>
+#include <set>
 
 namespace json = web::json;
 using namespace testing;
@@ -211,6 +213,58 @@ TEST_F(GrpcClientTest, CanSuccessfullyDoRpc)
     EXPECT_EQ(res.data(), resResult.data());
 }
 
+TEST_F(GrpcClientTest, RpcsRunInParallelAndServersCanBeRemovedMeanwhile)
+{
+    auto client = CreateClient();
+    auto mockStub1 = new protos::MockPitayaStub();
+    auto mockStub2 = new protos::MockPitayaStub();
+    _mockStubs.push_back(mockStub1);
+    _mockStubs.push_back(mockStub2);
+
+    auto server1 = pitaya::Server(pitaya::Server::Kind::Frontend, "server-id-1", "server-type")
+                       .WithMetadata(pitaya::constants::kGrpcHostKey, "localhost")
+                       .WithMetadata(pitaya::constants::kGrpcPortKey, "3435");
+    auto server2 = pitaya::Server(pitaya::Server::Kind::Frontend, "server-id-2", "server-type")
+                       .WithMetadata(pitaya::constants::kGrpcHostKey, "localhost")
+                       .WithMetadata(pitaya::constants::kGrpcPortKey, "3436");
+
+    client->ServerAdded(server1);
+    client->ServerAdded(server2);
+
+    // Each call only returns after both calls are in flight. If the client serialized the
+    // calls, the first one would give up waiting and report it.
+    std::atomic_int inFlight(0);
+    auto waitForBoth = [&]() {
+        inFlight++;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+        while (inFlight < 2 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (inFlight < 2) {
+            return grpc::Status::CANCELLED;
+        }
+        // Removing the server while its RPC is running must neither block nor destroy the stub.
+        client->ServerRemoved(server1);
+        return grpc::Status::OK;
+    };
+
+    EXPECT_CALL(*mockStub1, Call(_, _, _)).WillOnce(InvokeWithoutArgs(waitForBoth));
+    EXPECT_CALL(*mockStub2, Call(_, _, _)).WillOnce(InvokeWithoutArgs(waitForBoth));
+
+    protos::Response res1, res2;
+    auto t = std::thread([&]() { res1 = client->Call(server1, protos::Request()); });
+    res2 = client->Call(server2, protos::Request());
+    t.join();
+
+    EXPECT_FALSE(res1.has_error());
+    EXPECT_FALSE(res2.has_error());
+
+    auto res = client->Call(server1, protos::Request());
+    ASSERT_TRUE(res.has_error());
+    EXPECT_TRUE(std::regex_search(res.error().msg(),
+                                  std::regex("is not added to the connections map")));
+}
+
 TEST_F(GrpcClientTest, CanSuccessfullySendPushesWithId)
 {
     auto client = CreateClient();
@@ -475,3 +529,79 @@ TEST_F(GrpcClientTest, RpcsCanTimeout)
     
     EXPECT_TRUE(called);
 }
+
+TEST_F(GrpcClientTest, CallAsyncFailsWhenNoConnectionsExist)
+{
+    pitaya::Server target(pitaya::Server::Kind::Frontend, "myid", "mytype");
+    protos::Request req;
+
+    auto client = CreateClient();
+
+    protos::Response res;
+    client->CallAsync(target, req, [&](protos::Response r) { res = std::move(r); });
+
+    // The callback is called before returning, since the request is never sent.
+    ASSERT_TRUE(res.has_error());
+    EXPECT_EQ(res.error().code(), pitaya::constants::kCodeInternalError);
+    EXPECT_FALSE(res.error().msg().empty());
+}
+
+TEST_F(GrpcClientTest, ManyAsyncRpcsCanBeInFlight)
+{
+    static constexpr int kNumCalls = 50;
+
+    auto rpcServer = CreateServer([&](const protos::Request& req, pitaya::Rpc* rpc) {
+        if (rpc) {
+            protos::Response res;
+            res.set_data(req.msg().data());
+            rpc->Finish(res);
+        }
+    });
+
+    auto client = CreateClient([](std::shared_ptr<grpc::ChannelInterface> channel)
+                                   -> std::unique_ptr<protos::Pitaya::StubInterface> {
+        return protos::Pitaya::NewStub(channel);
+    });
+
+    auto server = pitaya::Server(pitaya::Server::Kind::Frontend, "server-id", "server-type")
+                      .WithMetadata(pitaya::constants::kGrpcHostKey, "localhost")
+                      .WithMetadata(pitaya::constants::kGrpcPortKey, "3030");
+
+    client->ServerAdded(server);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<protos::Response> responses;
+
+    for (int i = 0; i < kNumCalls; ++i) {
+        auto msg = new protos::Msg();
+        msg->set_route("my.custom.route");
+        msg->set_data(std::to_string(i));
+
+        protos::Request req;
+        req.set_allocated_msg(msg);
+        req.set_type(protos::RPCType::User);
+
+        client->CallAsync(server, req, [&](protos::Response res) {
+            std::lock_guard<std::mutex> lock(mutex);
+            responses.push_back(std::move(res));
+            cv.notify_one();
+        });
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(5), [&]() {
+            return responses.size() == kNumCalls;
+        }));
+    }
+
+    std::set<std::string> received;
+    for (const auto& res : responses) {
+        EXPECT_FALSE(res.has_error());
+        received.insert(res.data());
+    }
+    EXPECT_EQ(received.size(), kNumCalls);
+
+    rpcServer->Shutdown();
+}
@@ -10,6 +10,7 @@
 #include "mock_binding_storage.h"
 #include "mock_service_discovery.h"
 #include <cpprest/json.h>
+#include <mutex>
 #include <regex>
 
 namespace json = web::json;
@@ -363,3 +364,94 @@ TEST_F(GrpcServerTest, TheLastRpcIsNull)
     server->Shutdown();
     EXPECT_EQ(lastRpc, nullptr);
 }
+
+TEST_F(GrpcServerTest, ReusedCallsAnswerEveryRpcCorrectly)
+{
+    // A single thread, so that every call goes through the same pool of calls. It keeps
+    // fewer calls than the number of rpcs done here.
+    _config.serverNumThreads = 1;
+    // The finish of an rpc may be processed by the server after the client got the
+    // response, so there is room for one more rpc than the ones done at a time.
+    _config.serverMaxNumberOfRpcs = 2;
+    const int numRpcs = 300;
+
+    std::mutex mutex;
+    std::vector<pitaya::Rpc*> heldRpcs;
+
+    auto server = CreateServer([&](const protos::Request& req, pitaya::Rpc* rpc) {
+        if (!rpc) {
+            return;
+        }
+        if (req.msg().route() == "hold") {
+            std::lock_guard<std::mutex> lock(mutex);
+            heldRpcs.push_back(rpc);
+            return;
+        }
+        protos::Response res;
+        res.set_data(req.msg().data());
+        rpc->Finish(res);
+    });
+
+    auto c = CreateClient();
+    c.client->ServerAdded(_server);
+
+    auto call = [&c, this](const std::string& route, const std::string& data) {
+        auto msg = new protos::Msg();
+        msg->set_route(route);
+        msg->set_data(data);
+
+        protos::Request req;
+        req.set_type(protos::RPCType::User);
+        req.set_allocated_msg(msg);
+        return c.client->Call(_server, req);
+    };
+
+    for (int i = 0; i < numRpcs; ++i) {
+        const std::string data = "data " + std::to_string(i);
+        auto res = call("my.custom.route", data);
+        ASSERT_FALSE(res.has_error()) << res.error().msg();
+        EXPECT_EQ(res.data(), data);
+
+        if (i != numRpcs / 2) {
+            continue;
+        }
+
+        // Holding every slot makes the next rpc be refused, its error is created on the
+        // arena of a call that was already reused.
+        std::vector<std::thread> holders;
+        for (int j = 0; j < _config.serverMaxNumberOfRpcs; ++j) {
+            holders.emplace_back([&call]() {
+                auto res = call("hold", "");
+                EXPECT_FALSE(res.has_error());
+                EXPECT_EQ(res.data(), "held");
+            });
+        }
+        for (;;) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            std::lock_guard<std::mutex> lock(mutex);
+            if (heldRpcs.size() == holders.size()) {
+                break;
+            }
+        }
+
+        auto refused = call("my.custom.route", "refused");
+        ASSERT_TRUE(refused.has_error());
+        EXPECT_EQ(refused.error().code(), constants::kCodeServiceUnavailable);
+        EXPECT_EQ(refused.data(), "");
+
+        protos::Response heldRes;
+        heldRes.set_data("held");
+        for (auto rpc : heldRpcs) {
+            rpc->Finish(heldRes);
+        }
+        for (auto& holder : holders) {
+            holder.join();
+        }
+        // Waits for the server to process the finish of the held rpcs.
+        while (call("my.custom.route", "").has_error()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    server->Shutdown();
+}
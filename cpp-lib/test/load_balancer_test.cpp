@@ -0,0 +1,209 @@
+#include "test_common.h"
+
+#include "pitaya/load_balancer.h"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace pitaya;
+using namespace ::testing;
+using std::chrono::milliseconds;
+
+static std::vector<Server>
+MakeServers(int numServers)
+{
+    std::vector<Server> servers;
+    for (int i = 0; i < numServers; ++i) {
+        servers.emplace_back(Server::Kind::Backend, "server-" + std::to_string(i), "room");
+    }
+    return servers;
+}
+
+static protos::Request
+RequestWithUid(const std::string& uid)
+{
+    protos::Request req;
+    req.mutable_session()->set_uid(uid);
+    return req;
+}
+
+TEST(LoadBalancer, RandomPicksEveryServer)
+{
+    auto lb = CreateLoadBalancer(LoadBalancingStrategy::Random);
+    auto servers = MakeServers(4);
+    protos::Request req;
+
+    std::map<std::string, int> picks;
+    for (int i = 0; i < 1000; ++i) {
+        picks[lb->Pick(servers, req).Id()]++;
+    }
+    EXPECT_EQ(picks.size(), servers.size());
+}
+
+TEST(LoadBalancer, RoundRobinPicksTheServersInTurn)
+{
+    auto lb = CreateLoadBalancer(LoadBalancingStrategy::RoundRobin);
+    auto servers = MakeServers(3);
+    protos::Request req;
+
+    for (int i = 0; i < 9; ++i) {
+        EXPECT_EQ(lb->Pick(servers, req).Id(), servers[i % 3].Id());
+    }
+}
+
+TEST(LoadBalancer, PowerOfTwoChoicesPrefersServersWithFewerRpcsInFlight)
+{
+    auto lb = CreateLoadBalancer(LoadBalancingStrategy::PowerOfTwoChoices);
+    auto servers = MakeServers(2);
+    lb->ServersChanged(servers, {});
+    protos::Request req;
+
+    lb->RpcStarted("server-0");
+    auto first = lb->RpcStarted("server-1");
+    auto second = lb->RpcStarted("server-1");
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(lb->Pick(servers, req).Id(), "server-0");
+    }
+
+    lb->RpcFinished("server-1", milliseconds(1), first);
+    lb->RpcFinished("server-1", milliseconds(1), second);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(lb->Pick(servers, req).Id(), "server-1");
+    }
+}
+
+TEST(LoadBalancer, PowerOfTwoChoicesPrefersFasterServers)
+{
+    auto lb = CreateLoadBalancer(LoadBalancingStrategy::PowerOfTwoChoices);
+    auto servers = MakeServers(2);
+    lb->ServersChanged(servers, {});
+    protos::Request req;
+
+    lb->RpcFinished("server-0", milliseconds(50), lb->RpcStarted("server-0"));
+    lb->RpcFinished("server-1", milliseconds(5), lb->RpcStarted("server-1"));
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(lb->Pick(servers, req).Id(), "server-1");
+    }
+
+    // Servers that were removed lose their stats and are tried first when they come back.
+    lb->ServerRemoved(servers[0]);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(lb->Pick(servers, req).Id(), "server-0");
+    }
+}
+
+TEST(LoadBalancer, PowerOfTwoChoicesIgnoresRpcsToRemovedServers)
+{
+    auto lb = CreateLoadBalancer(LoadBalancingStrategy::PowerOfTwoChoices);
+    auto servers = MakeServers(2);
+    lb->ServersChanged(servers, {});
+    protos::Request req;
+
+    lb->RpcStarted("server-1");
+    lb->ServerRemoved(servers[0]);
+    lb->RpcStarted("server-0");
+    lb->RpcFinished("server-0", milliseconds(50), lb->RpcStarted("server-0"));
+
+    // The server comes back without the RPCs sent while it was removed.
+    lb->ServerAdded(servers[0]);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(lb->Pick(servers, req).Id(), "server-0");
+    }
+}
+
+TEST(LoadBalancer, PowerOfTwoChoicesOnlyFinishesTheRpcsItStarted)
+{
+    auto lb = CreateLoadBalancer(LoadBalancingStrategy::PowerOfTwoChoices);
+    auto servers = MakeServers(2);
+    lb->ServerAdded(servers[1]);
+    protos::Request req;
+
+    // The RPC starts before the server is known and finishes after it is, so it is not
+    // counted, and the server does not get ahead of the other one.
+    auto beforeAdded = lb->RpcStarted("server-0");
+    lb->ServerAdded(servers[0]);
+    lb->RpcStarted("server-0");
+    lb->RpcFinished("server-0", milliseconds(1), beforeAdded);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(lb->Pick(servers, req).Id(), "server-1");
+    }
+
+    // The RPC starts before the server is removed and finishes after it was added again.
+    auto beforeRemoved = lb->RpcStarted("server-1");
+    lb->ServerRemoved(servers[1]);
+    lb->ServerAdded(servers[1]);
+    lb->RpcStarted("server-1");
+    lb->RpcStarted("server-1");
+    lb->RpcFinished("server-1", milliseconds(1), beforeRemoved);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(lb->Pick(servers, req).Id(), "server-0");
+    }
+}
+
+TEST(LoadBalancer, ConsistentHashKeepsUsersOnTheSameServer)
+{
+    auto lb = CreateLoadBalancer(LoadBalancingStrategy::ConsistentHash);
+    auto servers = MakeServers(8);
+    for (const auto& server : servers) {
+        lb->ServerAdded(server);
+    }
+
+    std::map<std::string, std::string> owners;
+    for (int i = 0; i < 200; ++i) {
+        auto uid = "user-" + std::to_string(i);
+        owners[uid] = lb->Pick(servers, RequestWithUid(uid)).Id();
+        EXPECT_EQ(lb->Pick(servers, RequestWithUid(uid)).Id(), owners[uid]);
+    }
+
+    // Removing a server only moves the users that were on it.
+    auto removed = servers.back();
+    servers.pop_back();
+    lb->ServerRemoved(removed);
+    for (const auto& pair : owners) {
+        auto owner = lb->Pick(servers, RequestWithUid(pair.first)).Id();
+        if (pair.second != removed.Id()) {
+            EXPECT_EQ(owner, pair.second);
+        } else {
+            EXPECT_NE(owner, removed.Id());
+        }
+    }
+}
+
+TEST(LoadBalancer, ConsistentHashPicksTheServerLastReported)
+{
+    auto lb = CreateLoadBalancer(LoadBalancingStrategy::ConsistentHash);
+    auto servers = MakeServers(4);
+    lb->ServersChanged(servers, {});
+    auto req = RequestWithUid("user-1");
+    auto owner = lb->Pick(servers, req);
+
+    // The metadata of the owner changed under the same id.
+    auto updated = owner;
+    updated.WithMetadata("version", "2");
+    lb->ServerAdded(updated);
+
+    auto picked = lb->Pick(servers, req);
+    EXPECT_EQ(picked.Id(), owner.Id());
+    EXPECT_EQ(picked.Metadata(), updated.Metadata());
+    EXPECT_NE(picked.Metadata(), owner.Metadata());
+}
+
+TEST(LoadBalancer, ConsistentHashPicksTheOwnerOnItsRing)
+{
+    EXPECT_FALSE(CreateLoadBalancer(LoadBalancingStrategy::Random)->HashRing());
+
+    auto lb = CreateLoadBalancer(LoadBalancingStrategy::ConsistentHash);
+    auto servers = MakeServers(4);
+    lb->ServersChanged(servers, {});
+
+    // The cluster uses this ring for RPCByKey.
+    auto ring = lb->HashRing();
+    ASSERT_TRUE(ring);
+    for (int i = 0; i < 50; ++i) {
+        auto uid = "user-" + std::to_string(i);
+        EXPECT_EQ(lb->Pick(servers, RequestWithUid(uid)).Id(),
+                  ring->ServerIdForKey("room", uid).value());
+    }
+}
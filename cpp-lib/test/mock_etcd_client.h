@@ -1,11 +1,13 @@
 #ifndef PITAYA_MOCK_ETCD_CLIENT_H
 #define PITAYA_MOCK_ETCD_CLIENT_H
 
+#include "pitaya.h"
 #include "pitaya/etcd_client.h"
 
 #include <chrono>
 #include <gmock/gmock.h>
 #include <stdlib.h>
+#include <vector>
 
 class MockEtcdClient : public pitaya::EtcdClient
 {
@@ -16,8 +18,12 @@ public:
     MOCK_METHOD1(Get, pitaya::GetResponse(const std::string&));
     MOCK_METHOD1(List, pitaya::ListResponse(const std::string&));
 
-    void Watch(std::function<void(pitaya::WatchResponse)> onWatch) override
+    void Watch(int64_t fromRevision, std::function<void(pitaya::WatchResponse)> onWatch) override
     {
+        watchFromRevisions.push_back(fromRevision);
+        if (fromRevision > 0 && fromRevision <= compactedRevision) {
+            throw pitaya::PitayaException("required revision has been compacted");
+        }
         this->onWatch = std::move(onWatch);
     }
 
@@ -28,6 +34,8 @@ public:
     MOCK_METHOD0(StopLeaseKeepAlive, void());
 
     std::function<void(pitaya::WatchResponse)> onWatch;
+    std::vector<int64_t> watchFromRevisions;
+    int64_t compactedRevision = 0;
 };
 
 #endif // PITAYA_MOCK_ETCD_CLIENT_H
@@ -8,18 +8,58 @@
 class MockNatsClient : public pitaya::NatsClient
 {
 public:
+    // The raw buffer overloads are forwarded to mocks taking vectors, so that expectations
+    // can match the published bytes.
+    natsStatus Request(std::shared_ptr<pitaya::NatsMsg>* natsMsg,
+                       const std::string& topic,
+                       const uint8_t* data,
+                       size_t size,
+                       std::chrono::milliseconds timeout) override
+    {
+        return Request(natsMsg, topic, std::vector<uint8_t>(data, data + size), timeout);
+    }
+
+    natsStatus RequestAsync(const std::string& topic,
+                            const uint8_t* data,
+                            size_t size,
+                            std::chrono::milliseconds timeout,
+                            pitaya::RequestCallback callback) override
+    {
+        return RequestAsync(
+            topic, std::vector<uint8_t>(data, data + size), timeout, std::move(callback));
+    }
+
+    natsStatus Publish(const char* reply, const uint8_t* data, size_t size) override
+    {
+        return Publish(reply, std::vector<uint8_t>(data, data + size));
+    }
+
     MOCK_METHOD4(Request,
                  natsStatus(std::shared_ptr<pitaya::NatsMsg>* natsMsg,
                                     const std::string& topic,
                                     const std::vector<uint8_t>& data,
                                     std::chrono::milliseconds timeout));
 
+    MOCK_METHOD4(RequestAsync,
+                 natsStatus(const std::string& topic,
+                            const std::vector<uint8_t>& data,
+                            std::chrono::milliseconds timeout,
+                            pitaya::RequestCallback callback));
+
     MOCK_METHOD2(
         Subscribe,
         natsStatus(const std::string& topic,
                            std::function<void(std::shared_ptr<pitaya::NatsMsg>)> onMessage));
 
+    MOCK_METHOD3(
+        QueueSubscribe,
+        natsStatus(const std::string& topic,
+                   const std::string& queue,
+                   std::function<void(std::shared_ptr<pitaya::NatsMsg>)> onMessage));
+
     MOCK_METHOD2(Publish, natsStatus(const char* reply, const std::vector<uint8_t>& buf));
+
+    MOCK_METHOD0(DrainSubscriptions, void());
 };
 
 class MockNatsMsg : public pitaya::NatsMsg
@@ -10,6 +10,15 @@ class MockRpcClient : public pitaya::RpcClient
 {
 public:
     MOCK_METHOD2(Call, protos::Response(const pitaya::Server&, const protos::Request&));
+    MOCK_METHOD3(CallAsync,
+                 void(const pitaya::Server&, const protos::Request&, pitaya::CallCallback));
+    MOCK_CONST_METHOD0(CallsServerTypes, bool());
+    MOCK_METHOD2(CallServerType,
+                 protos::Response(const std::string& serverType, const protos::Request&));
+    MOCK_METHOD3(CallServerTypeAsync,
+                 void(const std::string& serverType,
+                      const protos::Request&,
+                      pitaya::CallCallback));
     MOCK_METHOD3(SendPushToUser,
                  boost::optional<pitaya::PitayaError>(const std::string& server_id,
                                                       const std::string& server_type,
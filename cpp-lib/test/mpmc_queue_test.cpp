@@ -0,0 +1,134 @@
+#include "test_common.h"
+
+#include "pitaya/utils/mpmc_queue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+using namespace ::testing;
+using namespace pitaya::utils;
+
+TEST(MpmcQueue, CapacityIsRoundedUpToAPowerOfTwo)
+{
+    MpmcQueue<int> queue(5);
+    EXPECT_EQ(queue.Capacity(), 8);
+}
+
+TEST(MpmcQueue, ElementsArePoppedInOrder)
+{
+    MpmcQueue<int> queue(4);
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(queue.TryPush(int(i)));
+    }
+    EXPECT_FALSE(queue.TryPush(4));
+
+    int value;
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(queue.TryPop(value));
+        EXPECT_EQ(value, i);
+    }
+    EXPECT_FALSE(queue.TryPop(value));
+}
+
+TEST(MpmcQueue, CloseWakesUpWaitingConsumers)
+{
+    MpmcQueue<int> queue(4);
+
+    std::vector<std::thread> consumers(4);
+    for (auto& thread : consumers) {
+        thread = std::thread([&]() {
+            int value;
+            EXPECT_FALSE(queue.Pop(value));
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    queue.Close();
+
+    for (auto& thread : consumers) {
+        thread.join();
+    }
+}
+
+TEST(MpmcQueue, ElementsCanBePoppedAfterClose)
+{
+    MpmcQueue<int> queue(4);
+    ASSERT_TRUE(queue.Push(1));
+    queue.Close();
+
+    EXPECT_FALSE(queue.Push(2));
+
+    int value;
+    ASSERT_TRUE(queue.Pop(value));
+    EXPECT_EQ(value, 1);
+    EXPECT_FALSE(queue.Pop(value));
+
+    queue.Reopen();
+    EXPECT_TRUE(queue.Push(3));
+}
+
+TEST(MpmcQueue, ProducersWaitWhenTheQueueIsFull)
+{
+    MpmcQueue<int> queue(2);
+    ASSERT_TRUE(queue.Push(0));
+    ASSERT_TRUE(queue.Push(1));
+
+    std::atomic_bool pushed(false);
+    std::thread producer([&]() {
+        EXPECT_TRUE(queue.Push(2));
+        pushed = true;
+    });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(pushed);
+
+    int value;
+    for (int i = 0; i < 3; ++i) {
+        ASSERT_TRUE(queue.Pop(value));
+        EXPECT_EQ(value, i);
+    }
+
+    producer.join();
+    EXPECT_TRUE(pushed);
+}
+
+TEST(MpmcQueue, EveryElementIsReceivedExactlyOnce)
+{
+    static constexpr int kNumProducers = 4;
+    static constexpr int kNumConsumers = 4;
+    static constexpr int kElementsPerProducer = 20000;
+
+    MpmcQueue<int> queue(64);
+    std::vector<std::atomic_int> received(kNumProducers * kElementsPerProducer);
+
+    std::vector<std::thread> consumers;
+    for (int c = 0; c < kNumConsumers; ++c) {
+        consumers.emplace_back([&]() {
+            int value;
+            while (queue.Pop(value)) {
+                received[value]++;
+            }
+        });
+    }
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kNumProducers; ++p) {
+        producers.emplace_back([&, p]() {
+            for (int i = 0; i < kElementsPerProducer; ++i) {
+                EXPECT_TRUE(queue.Push(p * kElementsPerProducer + i));
+            }
+        });
+    }
+
+    for (auto& thread : producers) {
+        thread.join();
+    }
+    queue.Close();
+    for (auto& thread : consumers) {
+        thread.join();
+    }
+
+    EXPECT_TRUE(std::all_of(
+        received.begin(), received.end(), [](const std::atomic_int& n) { return n == 1; }));
+}
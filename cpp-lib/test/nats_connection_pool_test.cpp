@@ -0,0 +1,148 @@
+#include "pitaya/nats_connection_pool.h"
+
+#include "mock_nats_client.h"
+#include <algorithm>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace testing;
+using pitaya::NatsClient;
+using pitaya::NatsConnectionPool;
+
+class NatsConnectionPoolTest : public testing::Test
+{
+public:
+    void SetUp() override
+    {
+        std::vector<std::unique_ptr<NatsClient>> connections;
+        for (int i = 0; i < 4; ++i) {
+            _mockConnections.push_back(new StrictMock<MockNatsClient>());
+            connections.emplace_back(_mockConnections.back());
+            EXPECT_CALL(*_mockConnections.back(), DrainSubscriptions());
+        }
+        _mockSubscriber = new StrictMock<MockNatsClient>();
+        EXPECT_CALL(*_mockSubscriber, DrainSubscriptions());
+        _pool.reset(new NatsConnectionPool(std::move(connections),
+                                           std::unique_ptr<NatsClient>(_mockSubscriber)));
+    }
+
+protected:
+    std::vector<StrictMock<MockNatsClient>*> _mockConnections;
+    StrictMock<MockNatsClient>* _mockSubscriber;
+    std::unique_ptr<NatsConnectionPool> _pool;
+};
+
+TEST_F(NatsConnectionPoolTest, ThrowsWithoutConnections)
+{
+    EXPECT_THROW(NatsConnectionPool({}), pitaya::PitayaException);
+}
+
+TEST_F(NatsConnectionPoolTest, ShardsPublishesByTopic)
+{
+    std::vector<uint8_t> data = { 1, 2, 3 };
+    std::vector<int> numPublishes(_mockConnections.size());
+
+    for (size_t i = 0; i < _mockConnections.size(); ++i) {
+        EXPECT_CALL(*_mockConnections[i], Publish(_, data))
+            .WillRepeatedly(InvokeWithoutArgs([&numPublishes, i] {
+                ++numPublishes[i];
+                return NATS_OK;
+            }));
+    }
+
+    // The same topic always goes to the same connection.
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_EQ(_pool->Publish("pitaya/servers/room/id", data), NATS_OK);
+    }
+    EXPECT_EQ(std::count(numPublishes.begin(), numPublishes.end(), 10), 1);
+
+    for (int i = 0; i < 100; ++i) {
+        auto topic = "pitaya/servers/room/id-" + std::to_string(i);
+        EXPECT_EQ(_pool->Publish(topic.c_str(), data), NATS_OK);
+    }
+    for (int num : numPublishes) {
+        EXPECT_GT(num, 0);
+    }
+}
+
+TEST_F(NatsConnectionPoolTest, RequestsGoToTheConnectionOfTheirTopic)
+{
+    const std::string topic = "pitaya/servers/room/id";
+    std::vector<uint8_t> data = { 1, 2, 3 };
+
+    // Finds the connection of the topic with a publish.
+    StrictMock<MockNatsClient>* topicConnection = nullptr;
+    for (auto mock : _mockConnections) {
+        EXPECT_CALL(*mock, Publish(StrEq(topic), data))
+            .Times(AtMost(1))
+            .WillRepeatedly(InvokeWithoutArgs([&topicConnection, mock] {
+                topicConnection = mock;
+                return NATS_OK;
+            }));
+    }
+    _pool->Publish(topic.c_str(), data);
+    ASSERT_NE(topicConnection, nullptr);
+
+    EXPECT_CALL(*topicConnection, Request(_, topic, data, std::chrono::milliseconds(10)))
+        .WillOnce(Return(NATS_TIMEOUT));
+    EXPECT_CALL(*topicConnection, RequestAsync(topic, data, std::chrono::milliseconds(10), _))
+        .WillOnce(Return(NATS_OK));
+
+    std::shared_ptr<pitaya::NatsMsg> reply;
+    EXPECT_EQ(_pool->Request(&reply, topic, data, std::chrono::milliseconds(10)), NATS_TIMEOUT);
+    EXPECT_EQ(_pool->RequestAsync(topic, data, std::chrono::milliseconds(10), nullptr), NATS_OK);
+}
+
+TEST_F(NatsConnectionPoolTest, SubscriptionsUseTheSubscriberConnection)
+{
+    EXPECT_CALL(*_mockSubscriber, Subscribe("pitaya/servers/room/id", _)).WillOnce(Return(NATS_OK));
+    EXPECT_EQ(_pool->Subscribe("pitaya/servers/room/id", nullptr), NATS_OK);
+}
+
+// Records when it is destroyed, to check the order of the pool shutdown.
+class DestructionRecordingNatsClient : public MockNatsClient
+{
+public:
+    DestructionRecordingNatsClient(std::vector<std::string>* events, std::string name)
+        : _events(events)
+        , _name(std::move(name))
+    {
+        ON_CALL(*this, DrainSubscriptions()).WillByDefault(Invoke([this] {
+            _events->push_back("drain " + _name);
+        }));
+    }
+
+    ~DestructionRecordingNatsClient() { _events->push_back("destroy " + _name); }
+
+private:
+    std::vector<std::string>* _events;
+    std::string _name;
+};
+
+TEST(NatsConnectionPoolShutdownTest, DrainsEverySubscriptionBeforeDestroyingConnections)
+{
+    std::vector<std::string> events;
+
+    {
+        std::vector<std::unique_ptr<NatsClient>> connections;
+        for (int i = 0; i < 3; ++i) {
+            connections.emplace_back(
+                new NiceMock<DestructionRecordingNatsClient>(&events, std::to_string(i)));
+        }
+        NatsConnectionPool pool(
+            std::move(connections),
+            std::unique_ptr<NatsClient>(
+                new NiceMock<DestructionRecordingNatsClient>(&events, "subscriber")));
+    }
+
+    ASSERT_EQ(events.size(), 8u);
+    for (size_t i = 0; i < 4; ++i) {
+        EXPECT_EQ(events[i].rfind("drain ", 0), 0u) << events[i];
+    }
+    for (size_t i = 4; i < events.size(); ++i) {
+        EXPECT_EQ(events[i].rfind("destroy ", 0), 0u) << events[i];
+    }
+}
@@ -5,6 +5,8 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 using namespace testing;
 namespace constants = pitaya::constants;
@@ -59,6 +61,47 @@ TEST_F(NatsRpcClientTest, CanSendRpcs)
     EXPECT_EQ(rpcRes.data(), natsResData.data());
 }
 
+TEST_F(NatsRpcClientTest, CanSendRpcsToTheQueueGroupOfAServerType)
+{
+    using namespace pitaya;
+
+    EXPECT_FALSE(_rpcClient->CallsServerTypes());
+
+    _config.serverQueueGroupByType = true;
+    _mockNatsClient = new MockNatsClient();
+    _rpcClient = std::unique_ptr<NatsRpcClient>(
+        new NatsRpcClient(_config, std::unique_ptr<NatsClient>(_mockNatsClient)));
+    EXPECT_TRUE(_rpcClient->CallsServerTypes());
+
+    protos::Response natsResData;
+    natsResData.set_data("my awesome response data");
+    std::vector<uint8_t> buffer(natsResData.ByteSizeLong());
+    natsResData.SerializeToArray(buffer.data(), buffer.size());
+
+    auto mockNatsMsg = new MockNatsMsg();
+    auto retMsg = std::shared_ptr<NatsMsg>(mockNatsMsg);
+    EXPECT_CALL(*mockNatsMsg, GetData()).WillRepeatedly(Return(buffer.data()));
+    EXPECT_CALL(*mockNatsMsg, GetSize()).WillRepeatedly(Return(buffer.size()));
+
+    EXPECT_CALL(*_mockNatsClient, Request(_, "pitaya/servers/my-type", _, _))
+        .WillOnce(DoAll(SetArgPointee<0>(retMsg), Return(NATS_OK)));
+    EXPECT_CALL(*_mockNatsClient, RequestAsync("pitaya/servers/my-type", _, _, _))
+        .WillOnce(DoAll(InvokeArgument<3>(NATS_OK, retMsg), Return(NATS_OK)));
+
+    protos::Request req;
+    auto rpcRes = _rpcClient->CallServerType("my-type", req);
+    ASSERT_FALSE(rpcRes.has_error());
+    EXPECT_EQ(rpcRes.data(), natsResData.data());
+
+    bool called = false;
+    _rpcClient->CallServerTypeAsync("my-type", req, [&](protos::Response res) {
+        called = true;
+        ASSERT_FALSE(res.has_error());
+        EXPECT_EQ(res.data(), natsResData.data());
+    });
+    EXPECT_TRUE(called);
+}
+
 TEST_F(NatsRpcClientTest, RpcsCanReturnError)
 {
     using namespace pitaya;
@@ -246,3 +289,229 @@ TEST_F(NatsRpcClientTest, UserPushesCanFail)
     EXPECT_EQ(error->code, constants::kCodeInternalError);
     EXPECT_EQ(error->msg, "nats error - Error");
 }
+
+TEST_F(NatsRpcClientTest, CanSendAsyncRpcs)
+{
+    using namespace pitaya;
+
+    auto mockNatsMsg = new MockNatsMsg();
+    auto retMsg = std::shared_ptr<NatsMsg>(mockNatsMsg);
+
+    protos::Response natsResData;
+    natsResData.set_data("my awesome response data");
+
+    std::vector<uint8_t> buffer(natsResData.ByteSizeLong());
+    natsResData.SerializeToArray(buffer.data(), buffer.size());
+
+    EXPECT_CALL(*mockNatsMsg, GetData()).WillOnce(Return(buffer.data()));
+    EXPECT_CALL(*mockNatsMsg, GetSize()).WillOnce(Return(buffer.size()));
+
+    RequestCallback onReply;
+    EXPECT_CALL(*_mockNatsClient,
+                RequestAsync("pitaya/servers/my-id/my-type", _, _config.requestTimeout, _))
+        .WillOnce(DoAll(SaveArg<3>(&onReply), Return(NATS_OK)));
+
+    auto target = pitaya::Server(pitaya::Server::Kind::Backend, "my-type", "my-id");
+    protos::Request req;
+
+    bool called = false;
+    protos::Response rpcRes;
+    _rpcClient->CallAsync(target, req, [&](protos::Response res) {
+        called = true;
+        rpcRes = std::move(res);
+    });
+
+    // The reply did not arrive yet.
+    EXPECT_FALSE(called);
+    ASSERT_TRUE(onReply);
+    onReply(NATS_OK, retMsg);
+
+    ASSERT_TRUE(called);
+    ASSERT_FALSE(rpcRes.has_error());
+    EXPECT_EQ(rpcRes.data(), natsResData.data());
+}
+
+TEST_F(NatsRpcClientTest, AsyncRpcsCanTimeout)
+{
+    using namespace pitaya;
+
+    EXPECT_CALL(*_mockNatsClient, RequestAsync(_, _, _, _))
+        .WillOnce(DoAll(InvokeArgument<3>(NATS_TIMEOUT, nullptr), Return(NATS_OK)));
+
+    auto target = pitaya::Server(pitaya::Server::Kind::Backend, "my-type", "my-id");
+    protos::Request req;
+
+    protos::Response rpcRes;
+    _rpcClient->CallAsync(target, req, [&](protos::Response res) { rpcRes = std::move(res); });
+
+    ASSERT_TRUE(rpcRes.has_error());
+    EXPECT_EQ(rpcRes.error().code(), constants::kCodeTimeout);
+    EXPECT_EQ(rpcRes.error().msg(), "nats timeout - sending request");
+}
+
+TEST_F(NatsRpcClientTest, AsyncRpcsReportPublishErrors)
+{
+    using namespace pitaya;
+
+    EXPECT_CALL(*_mockNatsClient, RequestAsync(_, _, _, _)).WillOnce(Return(NATS_ERR));
+
+    auto target = pitaya::Server(pitaya::Server::Kind::Backend, "my-type", "my-id");
+    protos::Request req;
+
+    int numCalls = 0;
+    protos::Response rpcRes;
+    _rpcClient->CallAsync(target, req, [&](protos::Response res) {
+        numCalls++;
+        rpcRes = std::move(res);
+    });
+
+    EXPECT_EQ(numCalls, 1);
+    ASSERT_TRUE(rpcRes.has_error());
+    EXPECT_EQ(rpcRes.error().code(), constants::kCodeInternalError);
+    EXPECT_EQ(rpcRes.error().msg(), "nats error - Error");
+}
+
+TEST_F(NatsRpcClientTest, PushesCanBePublishedWithoutAck)
+{
+    using namespace pitaya;
+
+    auto mockNatsClient = new MockNatsClient();
+    _config.publishPushesWithoutAck = true;
+    NatsRpcClient rpcClient(_config, std::unique_ptr<NatsClient>(mockNatsClient));
+
+    protos::Push push;
+    push.set_uid("user-id");
+    push.set_route("my.push.route");
+    push.set_data("Push data");
+
+    std::vector<uint8_t> pushData(push.ByteSizeLong());
+    push.SerializeToArray(pushData.data(), pushData.size());
+
+    EXPECT_CALL(*mockNatsClient, Request(_, _, _, _)).Times(0);
+    EXPECT_CALL(*mockNatsClient, Publish(StrEq("pitaya/connector/user/user-id/push"), pushData))
+        .WillOnce(Return(NATS_OK))
+        .WillOnce(Return(NATS_CONNECTION_CLOSED));
+
+    EXPECT_FALSE(rpcClient.SendPushToUser("", "connector", push));
+
+    auto error = rpcClient.SendPushToUser("", "connector", push);
+    ASSERT_TRUE(error);
+    EXPECT_EQ(error->code, constants::kCodeInternalError);
+}
+
+TEST_F(NatsRpcClientTest, CanPublishBatchesOfPushes)
+{
+    using namespace pitaya;
+
+    auto mockNatsClient = new MockNatsClient();
+    _config.publishPushesWithoutAck = true;
+    NatsRpcClient rpcClient(_config, std::unique_ptr<NatsClient>(mockNatsClient));
+
+    std::vector<protos::Push> pushes(3);
+    for (size_t i = 0; i < pushes.size(); ++i) {
+        pushes[i].set_uid("user-" + std::to_string(i));
+        pushes[i].set_data("Push data");
+    }
+
+    {
+        InSequence seq;
+        for (const auto& push : pushes) {
+            std::vector<uint8_t> pushData(push.ByteSizeLong());
+            push.SerializeToArray(pushData.data(), pushData.size());
+            EXPECT_CALL(
+                *mockNatsClient,
+                Publish(StrEq("pitaya/connector/user/" + push.uid() + "/push"), pushData))
+                .WillOnce(Return(NATS_OK));
+        }
+    }
+    EXPECT_CALL(*mockNatsClient, Request(_, _, _, _)).Times(0);
+
+    EXPECT_FALSE(rpcClient.SendPushesToUsers("connector", pushes));
+}
+
+TEST_F(NatsRpcClientTest, BatchesOfPushesWaitForTheAcks)
+{
+    using namespace pitaya;
+
+    std::vector<protos::Push> pushes(2);
+    pushes[0].set_uid("user-0");
+    pushes[1].set_uid("user-1");
+
+    std::mutex mutex;
+    std::vector<RequestCallback> onReplies;
+    auto saveCallback = [&](const std::string&,
+                            const std::vector<uint8_t>&,
+                            std::chrono::milliseconds,
+                            RequestCallback callback) {
+        std::lock_guard<std::mutex> lock(mutex);
+        onReplies.push_back(std::move(callback));
+        return NATS_OK;
+    };
+
+    EXPECT_CALL(*_mockNatsClient, Publish(_, _)).Times(0);
+    EXPECT_CALL(*_mockNatsClient, Request(_, _, _, _)).Times(0);
+    EXPECT_CALL(*_mockNatsClient,
+                RequestAsync("pitaya/connector/user/user-0/push", _, _config.requestTimeout, _))
+        .WillOnce(Invoke(saveCallback));
+    EXPECT_CALL(*_mockNatsClient,
+                RequestAsync("pitaya/connector/user/user-1/push", _, _config.requestTimeout, _))
+        .WillOnce(Invoke(saveCallback));
+
+    // The acks only arrive once every push was sent.
+    std::thread acks([&] {
+        for (;;) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (onReplies.size() == 2) {
+                break;
+            }
+        }
+        onReplies[1](NATS_TIMEOUT, nullptr);
+        onReplies[0](NATS_OK, nullptr);
+    });
+
+    auto error = _rpcClient->SendPushesToUsers("connector", pushes);
+    acks.join();
+    ASSERT_TRUE(error);
+    EXPECT_EQ(error->code, constants::kCodeTimeout);
+    EXPECT_EQ(error->msg, "nats timeout - sending push to user");
+}
+
+TEST_F(NatsRpcClientTest, BatchesOfPushesReportPublishErrors)
+{
+    using namespace pitaya;
+
+    std::vector<protos::Push> pushes(3);
+    for (size_t i = 0; i < pushes.size(); ++i) {
+        pushes[i].set_uid("user-" + std::to_string(i));
+    }
+
+    // The pushes after the one that failed are still sent.
+    EXPECT_CALL(*_mockNatsClient, RequestAsync(_, _, _, _))
+        .WillOnce(DoAll(InvokeArgument<3>(NATS_OK, nullptr), Return(NATS_OK)))
+        .WillOnce(Return(NATS_ERR))
+        .WillOnce(DoAll(InvokeArgument<3>(NATS_OK, nullptr), Return(NATS_OK)));
+
+    auto error = _rpcClient->SendPushesToUsers("connector", pushes);
+    ASSERT_TRUE(error);
+    EXPECT_EQ(error->code, constants::kCodeInternalError);
+    EXPECT_EQ(error->msg, "nats error - Error");
+}
+
+TEST_F(NatsRpcClientTest, BatchesOfPushesWithAnEmptyUidSendNothing)
+{
+    using namespace pitaya;
+
+    std::vector<protos::Push> pushes(3);
+    for (size_t i = 0; i < pushes.size(); ++i) {
+        pushes[i].set_uid("user-" + std::to_string(i));
+    }
+    pushes[1].clear_uid();
+
+    EXPECT_CALL(*_mockNatsClient, Publish(_, _)).Times(0);
+    EXPECT_CALL(*_mockNatsClient, Request(_, _, _, _)).Times(0);
+    EXPECT_CALL(*_mockNatsClient, RequestAsync(_, _, _, _)).Times(0);
+
+    auto error = _rpcClient->SendPushesToUsers("connector", pushes);
+    ASSERT_TRUE(error);
+    EXPECT_EQ(error->msg, "Received an empty user id");
+}
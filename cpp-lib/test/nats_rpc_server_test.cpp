@@ -1,5 +1,6 @@
 #include "pitaya/constants.h"
 #include "pitaya/nats/rpc_server.h"
+#include "pitaya/utils.h"
 
 #include "mock_nats_client.h"
 #include "mock_rpc_server.h"
@@ -70,6 +71,38 @@ TEST_F(NatsRpcServerTest, StartThrowsExceptionIfItFails)
         PitayaException);
 }
 
+TEST_F(NatsRpcServerTest, CanShardTheServerTopicInAQueueGroup)
+{
+    _config.serverNumSubscriptions = 3;
+    auto mockClient = new MockNatsClient();
+
+    const auto topic = utils::GetTopicForServer(_server.Id(), _server.Type());
+    EXPECT_CALL(*mockClient, Subscribe(_, _)).Times(0);
+    EXPECT_CALL(*mockClient, QueueSubscribe(topic, topic, _))
+        .Times(3)
+        .WillRepeatedly(Return(NATS_OK));
+
+    auto server = CreateServer(mockClient);
+    server->Start([](const protos::Request& req, pitaya::Rpc* rpc) {});
+    server->Shutdown();
+}
+
+TEST_F(NatsRpcServerTest, CanJoinTheQueueGroupOfTheServerType)
+{
+    _config.serverQueueGroupByType = true;
+    auto mockClient = new MockNatsClient();
+
+    EXPECT_CALL(*mockClient, Subscribe(utils::GetTopicForServer(_server.Id(), _server.Type()), _))
+        .WillOnce(Return(NATS_OK));
+    EXPECT_CALL(*mockClient, QueueSubscribe("pitaya/servers/my-type", "my-type", _))
+        .WillOnce(Return(NATS_INVALID_SUBSCRIPTION));
+
+    auto server = CreateServer(mockClient);
+    EXPECT_THROW(
+        server->Start([](const protos::Request& req, pitaya::Rpc* rpc) { EXPECT_TRUE(false); }),
+        PitayaException);
+}
+
 static std::thread gCallbackThread;
 
 ACTION_TEMPLATE(ExecuteCallback, HAS_1_TEMPLATE_PARAMS(unsigned, Index), AND_1_VALUE_PARAMS(a))
@@ -142,6 +175,49 @@ TEST_F(NatsRpcServerTest, CanHandleRpcs)
     EXPECT_EQ(lastRpc, nullptr);
 }
 
+TEST_F(NatsRpcServerTest, RpcsGiveAccessToTheReceivedBytes)
+{
+    auto mockClient = new MockNatsClient();
+    auto mockNatsMsg = new MockNatsMsg();
+
+    protos::Request req;
+    req.set_type(protos::RPCType::User);
+
+    std::vector<uint8_t> buf(req.ByteSizeLong());
+    req.SerializeToArray(buf.data(), buf.size());
+
+    EXPECT_CALL(*mockNatsMsg, GetSize()).WillRepeatedly(Return(buf.size()));
+    EXPECT_CALL(*mockNatsMsg, GetData()).WillRepeatedly(Return(buf.data()));
+    EXPECT_CALL(*mockNatsMsg, GetReply()).WillOnce(Return("my.reply.server"));
+
+    EXPECT_CALL(*mockClient, Subscribe(_, _))
+        .WillOnce(DoAll(ExecuteCallback<1>(std::shared_ptr<NatsMsg>(mockNatsMsg)),
+                        Return(NATS_OK)));
+    EXPECT_CALL(*mockClient, Publish("my.reply.server", _)).WillOnce(Return(NATS_OK));
+
+    auto server = CreateServer(mockClient);
+
+    bool called = false;
+    server->Start([&](const protos::Request& req, pitaya::Rpc* rpc) {
+        if (rpc) {
+            called = true;
+            const uint8_t* data = nullptr;
+            size_t size = 0;
+            ASSERT_TRUE(rpc->RawRequest(&data, &size));
+            EXPECT_EQ(data, buf.data());
+            EXPECT_EQ(size, buf.size());
+            rpc->Finish(protos::Response());
+        }
+    });
+
+    if (gCallbackThread.joinable()) {
+        gCallbackThread.join();
+    }
+
+    server->Shutdown();
+    EXPECT_TRUE(called);
+}
+
 TEST_F(NatsRpcServerTest, HasGracefulShutdown)
 {
     using std::chrono::milliseconds;
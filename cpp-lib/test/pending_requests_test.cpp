@@ -0,0 +1,131 @@
+#include "test_common.h"
+
+#include "pitaya/utils/pending_requests.h"
+#include "pitaya/utils/ticker.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+using namespace ::testing;
+using namespace pitaya::utils;
+
+using Callback = std::function<void()>;
+using Clock = PendingRequests<Callback>::Clock;
+
+TEST(PendingRequests, RequestsAnsweredBeforeTheirDeadlineDoNotExpire)
+{
+    PendingRequests<Callback> requests;
+    const auto now = Clock::now();
+
+    int numCalls = 0;
+    auto token = requests.Add([&numCalls]() { ++numCalls; }, now + std::chrono::seconds(1));
+
+    auto callback = requests.Take(token);
+    ASSERT_TRUE(callback);
+    callback();
+    EXPECT_EQ(requests.Size(), 0);
+
+    EXPECT_TRUE(requests.TakeExpired(now + std::chrono::seconds(2)).empty());
+    EXPECT_FALSE(requests.Take(token));
+    EXPECT_EQ(numCalls, 1);
+}
+
+TEST(PendingRequests, ExpiredRequestsAreTakenOnce)
+{
+    PendingRequests<Callback> requests;
+    const auto now = Clock::now();
+
+    auto token = requests.Add([]() {}, now + std::chrono::seconds(1));
+
+    EXPECT_TRUE(requests.TakeExpired(now).empty());
+    EXPECT_EQ(requests.TakeExpired(now + std::chrono::seconds(1)).size(), 1);
+    EXPECT_TRUE(requests.TakeExpired(now + std::chrono::seconds(2)).empty());
+
+    // A reply arriving after the deadline finds nothing.
+    EXPECT_FALSE(requests.Take(token));
+    EXPECT_EQ(requests.Size(), 0);
+}
+
+TEST(PendingRequests, RequestsExpireInTheOrderOfTheirDeadlines)
+{
+    PendingRequests<Callback> requests;
+    const auto now = Clock::now();
+
+    std::vector<int> order;
+    for (int seconds : { 3, 1, 4, 2 }) {
+        requests.Add([&order, seconds]() { order.push_back(seconds); },
+                     now + std::chrono::seconds(seconds));
+    }
+
+    for (auto& callback : requests.TakeExpired(now + std::chrono::seconds(2))) {
+        callback();
+    }
+    EXPECT_EQ(order, std::vector<int>({ 1, 2 }));
+    EXPECT_EQ(requests.Size(), 2);
+
+    for (auto& callback : requests.TakeExpired(now + std::chrono::seconds(4))) {
+        callback();
+    }
+    EXPECT_EQ(order, std::vector<int>({ 1, 2, 3, 4 }));
+}
+
+TEST(PendingRequests, TakeAllEmptiesTheTable)
+{
+    PendingRequests<Callback> requests;
+    const auto now = Clock::now();
+
+    auto token = requests.Add([]() {}, now + std::chrono::seconds(1));
+    requests.Add([]() {}, now + std::chrono::seconds(2));
+
+    EXPECT_EQ(requests.TakeAll().size(), 2);
+    EXPECT_FALSE(requests.Take(token));
+    EXPECT_TRUE(requests.TakeExpired(now + std::chrono::seconds(3)).empty());
+}
+
+TEST(PendingRequests, FailedSendsTakeTheRequestBack)
+{
+    PendingRequests<Callback> requests;
+
+    int numCalls = 0;
+    bool sent = requests.AddAndSend([&numCalls]() { ++numCalls; },
+                                    Clock::now() + std::chrono::seconds(1),
+                                    [](uint64_t) { return false; });
+
+    EXPECT_FALSE(sent);
+    EXPECT_EQ(requests.Size(), 0);
+    EXPECT_TRUE(requests.TakeExpired(Clock::now() + std::chrono::seconds(2)).empty());
+    EXPECT_EQ(numCalls, 0);
+}
+
+TEST(PendingRequests, RequestsExpiringWhileTheirSendFailsAreReportedOnce)
+{
+    PendingRequests<Callback> requests;
+
+    std::atomic_int numCalls(0);
+    Ticker ticker(std::chrono::milliseconds(1), [&requests]() {
+        for (auto& callback : requests.TakeExpired(Clock::now())) {
+            callback();
+        }
+    });
+    ticker.Start();
+
+    // The publish fails only after the ticker expired the request.
+    bool sent = requests.AddAndSend([&numCalls]() { ++numCalls; },
+                                    Clock::now() + std::chrono::milliseconds(1),
+                                    [&numCalls](uint64_t) {
+                                        while (numCalls == 0) {
+                                            std::this_thread::sleep_for(
+                                                std::chrono::milliseconds(1));
+                                        }
+                                        return false;
+                                    });
+    ticker.Stop();
+
+    // The caller must not report the failure, since the callback already ran.
+    EXPECT_TRUE(sent);
+    EXPECT_EQ(numCalls, 1);
+    EXPECT_EQ(requests.Size(), 0);
+}
@@ -0,0 +1,216 @@
+#include "test_common.h"
+
+#include "pitaya/utils/sharded_queue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace ::testing;
+using namespace pitaya::utils;
+
+TEST(ShardedQueue, NumberOfShardsIsCapped)
+{
+    ShardedQueue<int> queue(4, 8);
+    EXPECT_EQ(queue.NumShards(), 1);
+
+    queue.Close();
+    queue.Reopen(16);
+    EXPECT_EQ(queue.NumShards(), 4);
+
+    queue.Close();
+    queue.Reopen(0);
+    EXPECT_EQ(queue.NumShards(), 1);
+}
+
+TEST(ShardedQueue, ConsumersPopFromTheirHomeShardFirst)
+{
+    ShardedQueue<int> queue(2, 8);
+    queue.Close();
+    queue.Reopen(2);
+
+    ASSERT_TRUE(queue.Push(0, 0));
+    ASSERT_TRUE(queue.Push(1, 1));
+
+    int value;
+    ASSERT_TRUE(queue.Pop(value, 1));
+    EXPECT_EQ(value, 1);
+    ASSERT_TRUE(queue.Pop(value, 1));
+    EXPECT_EQ(value, 0);
+}
+
+TEST(ShardedQueue, TryPushFailsWhenTheShardIsFullOrTheQueueIsClosed)
+{
+    ShardedQueue<std::unique_ptr<int>> queue(1, 2);
+
+    auto value = std::unique_ptr<int>(new int(0));
+    ASSERT_TRUE(queue.TryPush(value, 0));
+    value.reset(new int(1));
+    ASSERT_TRUE(queue.TryPush(value, 0));
+
+    value.reset(new int(2));
+    EXPECT_FALSE(queue.TryPush(value, 0));
+    // The value is left untouched.
+    ASSERT_TRUE(value);
+    EXPECT_EQ(*value, 2);
+
+    std::unique_ptr<int> popped;
+    ASSERT_TRUE(queue.Pop(popped, 0));
+    EXPECT_EQ(*popped, 0);
+
+    queue.Close();
+    EXPECT_FALSE(queue.TryPush(value, 0));
+    ASSERT_TRUE(value);
+}
+
+TEST(ShardedQueue, ElementsLeftInRemovedShardsCanStillBePopped)
+{
+    ShardedQueue<int> queue(2, 8);
+    queue.Close();
+    queue.Reopen(2);
+    ASSERT_TRUE(queue.Push(1, 1));
+
+    queue.Close();
+    queue.Reopen(1);
+
+    int value;
+    ASSERT_TRUE(queue.Pop(value, 0));
+    EXPECT_EQ(value, 1);
+}
+
+TEST(ShardedQueue, ReopenCanChangeTheCapacityOfTheShards)
+{
+    ShardedQueue<int> queue(2, 2);
+    int value = 0;
+    ASSERT_TRUE(queue.TryPush(value, 0));
+    ASSERT_TRUE(queue.TryPush(value, 0));
+    EXPECT_FALSE(queue.TryPush(value, 0));
+
+    queue.Close();
+    queue.Reopen(2, 4);
+    EXPECT_EQ(queue.NumShards(), 2);
+    EXPECT_EQ(queue.ShardCapacity(), 4);
+    for (int i = 0; i < 4; ++i) {
+        value = i;
+        ASSERT_TRUE(queue.TryPush(value, 1));
+    }
+    EXPECT_FALSE(queue.TryPush(value, 1));
+
+    // The elements of the replaced shards are dropped.
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(queue.Pop(value, 0));
+        EXPECT_EQ(value, i);
+    }
+    queue.Close();
+    EXPECT_FALSE(queue.Pop(value, 0));
+}
+
+TEST(ShardedQueue, CloseWakesUpWaitingConsumers)
+{
+    ShardedQueue<int> queue(4, 8);
+    queue.Close();
+    queue.Reopen(4);
+
+    std::vector<std::thread> consumers(4);
+    for (size_t i = 0; i < consumers.size(); ++i) {
+        consumers[i] = std::thread([&queue, i]() {
+            int value;
+            EXPECT_FALSE(queue.Pop(value, i));
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    queue.Close();
+
+    for (auto& thread : consumers) {
+        thread.join();
+    }
+
+    EXPECT_FALSE(queue.Push(1, 0));
+}
+
+TEST(ShardedQueue, EveryElementIsReceivedExactlyOnce)
+{
+    static constexpr int kNumProducers = 4;
+    static constexpr int kNumConsumers = 3;
+    static constexpr int kElementsPerProducer = 20000;
+
+    ShardedQueue<int> queue(kNumProducers, 64);
+    queue.Close();
+    queue.Reopen(kNumProducers);
+    std::vector<std::atomic_int> received(kNumProducers * kElementsPerProducer);
+
+    std::vector<std::thread> consumers;
+    for (int c = 0; c < kNumConsumers; ++c) {
+        consumers.emplace_back([&, c]() {
+            int value;
+            while (queue.Pop(value, c)) {
+                received[value]++;
+            }
+        });
+    }
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kNumProducers; ++p) {
+        producers.emplace_back([&, p]() {
+            for (int i = 0; i < kElementsPerProducer; ++i) {
+                EXPECT_TRUE(queue.Push(p * kElementsPerProducer + i, p));
+            }
+        });
+    }
+
+    for (auto& thread : producers) {
+        thread.join();
+    }
+    queue.Close();
+    for (auto& thread : consumers) {
+        thread.join();
+    }
+
+    EXPECT_TRUE(std::all_of(
+        received.begin(), received.end(), [](const std::atomic_int& n) { return n == 1; }));
+}
+
+TEST(ShardedQueue, ElementsPushedWhileClosingAreRefusedOrPopped)
+{
+    for (int round = 0; round < 50; ++round) {
+        ShardedQueue<int> queue(4, 1024);
+        queue.Close();
+        queue.Reopen(4);
+
+        std::atomic_int numPushed(0);
+        std::atomic_int numPopped(0);
+        std::atomic_bool start(false);
+
+        std::vector<std::thread> threads;
+        for (size_t shard = 0; shard < 4; ++shard) {
+            threads.emplace_back([&, shard]() {
+                while (!start) {
+                    std::this_thread::yield();
+                }
+                for (int i = 0; i < 256; ++i) {
+                    int value = i;
+                    if (queue.TryPush(value, shard)) {
+                        ++numPushed;
+                    }
+                }
+            });
+            threads.emplace_back([&, shard]() {
+                int value;
+                while (queue.Pop(value, shard)) {
+                    ++numPopped;
+                }
+            });
+        }
+
+        start = true;
+        queue.Close();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        EXPECT_EQ(numPopped, numPushed);
+    }
+}
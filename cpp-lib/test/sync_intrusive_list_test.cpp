@@ -0,0 +1,70 @@
+#include "test_common.h"
+
+#include "pitaya/utils/sync_intrusive_list.h"
+
+#include <vector>
+
+using namespace ::testing;
+using namespace pitaya::utils;
+
+struct Element : public IntrusiveListNode<Element>
+{
+    explicit Element(int value)
+        : value(value)
+    {}
+
+    int value;
+};
+
+static std::vector<int>
+Values(SyncIntrusiveList<Element>& list)
+{
+    std::vector<int> values;
+    for (auto el : list) {
+        values.push_back(el->value);
+    }
+    return values;
+}
+
+TEST(SyncIntrusiveList, ElementsCanBeErasedFromAnyPosition)
+{
+    Element e1(1), e2(2), e3(3), e4(4);
+    SyncIntrusiveList<Element> list;
+
+    list.PushBack(&e1);
+    list.PushBack(&e2);
+    list.PushBack(&e3);
+    list.PushBack(&e4);
+    EXPECT_EQ(list.Size(), 4);
+    EXPECT_TRUE(e2.IsLinked());
+
+    list.Erase(&e2);
+    EXPECT_FALSE(e2.IsLinked());
+    EXPECT_EQ(Values(list), std::vector<int>({ 1, 3, 4 }));
+
+    list.Erase(&e1);
+    list.Erase(&e4);
+    EXPECT_EQ(Values(list), std::vector<int>({ 3 }));
+
+    // Erasing an element that is not in the list is ignored.
+    list.Erase(&e1);
+    EXPECT_EQ(list.Size(), 1);
+
+    list.PushBack(&e1);
+    EXPECT_EQ(Values(list), std::vector<int>({ 3, 1 }));
+}
+
+TEST(SyncIntrusiveList, ClearUnlinksEveryElement)
+{
+    Element e1(1), e2(2);
+    SyncIntrusiveList<Element> list;
+
+    list.PushBack(&e1);
+    list.PushBack(&e2);
+    list.Clear();
+
+    EXPECT_EQ(list.Size(), 0);
+    EXPECT_FALSE(e1.IsLinked());
+    EXPECT_FALSE(e2.IsLinked());
+    EXPECT_TRUE(Values(list).empty());
+}
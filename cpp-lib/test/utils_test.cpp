@@ -4,8 +4,13 @@
 #include "pitaya/constants.h"
 #include "pitaya/etcd_config.h"
 #include "pitaya/etcdv3_service_discovery.h"
+#include "pitaya/etcdv3_service_discovery/worker.h"
 #include "pitaya/utils.h"
 #include "pitaya/utils/grpc.h"
+#include "pitaya/protos/response.pb.h"
+#include "pitaya/utils/json.h"
+#include "pitaya/utils/protobuf.h"
+#include "pitaya/utils/route_cache.h"
 
 #include "mock_etcd_client.h"
 
@@ -135,3 +140,315 @@ TEST(GetGrpcAddressFromServerTest, ReturnsTheFullAddress)
         EXPECT_EQ(address, entry.host + ":" + entry.port);
     }
 }
+
+TEST(JsonObjectFromPairsTest, EscapesKeysAndValues)
+{
+    EXPECT_EQ(JsonObjectFromPairs({}), "{}");
+    EXPECT_EQ(JsonObjectFromPairs({ { "peer.id", "my-id" }, { "peer.service", "room" } }),
+              R"({"peer.id":"my-id","peer.service":"room"})");
+    EXPECT_EQ(JsonObjectFromPairs({ { "a\"b", "c\\d\n\x01" } }), R"({"a\"b":"c\\d\n\u0001"})");
+}
+
+TEST(MergeJsonObjectsTest, AppendsTheMembersOfTheSecondObject)
+{
+    struct
+    {
+        std::string first;
+        std::string second;
+        std::string merged;
+    } arr[] = {
+        { R"({"a":"1"})", R"({"b":"2"})", R"({"a":"1","b":"2"})" },
+        { R"( { "a" : {"x":1} } )", R"({"b":"2"})", R"({"a":{"x":1},"b":"2"})" },
+        { "{}", R"({"b":"2"})", R"({"b":"2"})" },
+        { R"({"a":"1"})", "{ }", R"({"a":"1"})" },
+        { "{}", "{}", "{}" },
+    };
+
+    for (const auto& entry : arr) {
+        std::string merged;
+        ASSERT_TRUE(MergeJsonObjects(entry.first, entry.second, merged));
+        EXPECT_EQ(merged, entry.merged);
+    }
+}
+
+TEST(MergeJsonObjectsTest, KeysOfTheSecondObjectReplaceTheFirstOnes)
+{
+    std::string merged;
+    ASSERT_TRUE(MergeJsonObjects(R"({"peer.id":"old","a":"1","peer.service":"old"})",
+                                 R"({"peer.id":"new","peer.service":"new"})",
+                                 merged));
+    EXPECT_EQ(merged, R"({"a":"1","peer.id":"new","peer.service":"new"})");
+
+    std::string mergedAgain;
+    ASSERT_TRUE(
+        MergeJsonObjects(merged, R"({"peer.id":"new","peer.service":"new"})", mergedAgain));
+    EXPECT_EQ(mergedAgain, merged);
+}
+
+TEST(MergeJsonObjectsTest, FailsWhenAnyOfTheValuesIsNotAnObject)
+{
+    std::string merged;
+    EXPECT_FALSE(MergeJsonObjects("", "{}", merged));
+    EXPECT_FALSE(MergeJsonObjects("{}", "[1]", merged));
+    EXPECT_FALSE(MergeJsonObjects("\"str\"", "{}", merged));
+    EXPECT_FALSE(MergeJsonObjects("{", "{}", merged));
+    EXPECT_FALSE(MergeJsonObjects(R"({"a":})", "{}", merged));
+    EXPECT_FALSE(MergeJsonObjects("{}", R"({"a" 1})", merged));
+}
+
+TEST(JsonReaderTest, ReadsTheMembersOfAnObject)
+{
+    JsonReader reader(R"( {"str": "a\"b\u00e9\ud83d\ude00", "yes":true, "no" : false,)"
+                      R"( "nested": {"arr": [1, -2.5e3, null, {}], "empty": {}}, "last": "x"} )");
+
+    std::string key, str;
+    bool yes = false, no = true;
+    std::string_view nested;
+
+    ASSERT_TRUE(reader.EnterObject());
+    ASSERT_TRUE(reader.NextKey(key));
+    EXPECT_EQ(key, "str");
+    ASSERT_TRUE(reader.ReadString(str));
+    EXPECT_EQ(str, "a\"b\xc3\xa9\xf0\x9f\x98\x80");
+    ASSERT_TRUE(reader.NextKey(key));
+    ASSERT_TRUE(reader.ReadBool(yes));
+    ASSERT_TRUE(reader.NextKey(key));
+    ASSERT_TRUE(reader.ReadBool(no));
+    ASSERT_TRUE(reader.NextKey(key));
+    EXPECT_EQ(key, "nested");
+    ASSERT_TRUE(reader.SkipValue(&nested));
+    EXPECT_EQ(nested, R"({"arr": [1, -2.5e3, null, {}], "empty": {}})");
+    ASSERT_TRUE(reader.NextKey(key));
+    EXPECT_EQ(key, "last");
+    ASSERT_TRUE(reader.ReadString(str));
+    EXPECT_FALSE(reader.NextKey(key));
+    EXPECT_FALSE(reader.Failed());
+    EXPECT_TRUE(reader.AtEnd());
+
+    EXPECT_TRUE(yes);
+    EXPECT_FALSE(no);
+}
+
+TEST(JsonReaderTest, FailsOnInvalidDocuments)
+{
+    const char* arr[] = {
+        "",
+        "{",
+        R"({"a")",
+        R"({"a":})",
+        R"({"a":1,})",
+        R"({"a":1 "b":2})",
+        R"({"a":01})",
+        R"({"a":"\x"})",
+        R"({"a":"\ud83d"})",
+        R"({"a":tru})",
+        R"({"a":[1,]})",
+        "{\"a\":\"\n\"}",
+    };
+
+    for (const auto& json : arr) {
+        JsonReader reader(json);
+        bool ok = reader.SkipValue() && reader.AtEnd();
+        EXPECT_FALSE(ok) << json;
+        EXPECT_EQ(reader.Failed(), !reader.Error().empty());
+    }
+
+    std::string nested(1000, '[');
+    JsonReader reader(nested);
+    EXPECT_FALSE(reader.SkipValue());
+}
+
+TEST(JsonReaderTest, CompactsAndEscapesJson)
+{
+    std::string out;
+    AppendCompactJson(out, " { \"a b\" : [ 1 , \"x \\\" y\" ] } ");
+    EXPECT_EQ(out, R"({"a b":[1,"x \" y"]})");
+}
+
+TEST(ParseServerTest, ReadsTheServerFromItsJson)
+{
+    auto log = CloneLoggerOrCreate(nullptr, "parse_server_test");
+    auto server = pitaya::etcdv3_service_discovery::Worker::ParseServer(
+        R"({"id": "my-id", "type": "room", "unknown": [1, {"id": "other"}],)"
+        R"( "metadata": { "grpcHost": "10.0.0.1", "grpcPort": "3434" },)"
+        R"( "hostname": "host", "frontend": true})",
+        log);
+
+    ASSERT_TRUE(server);
+    EXPECT_EQ(server.value(),
+              pitaya::Server(pitaya::Server::Kind::Frontend, "my-id", "room", "host")
+                  .WithRawMetadata(R"({"grpcHost":"10.0.0.1","grpcPort":"3434"})"));
+    EXPECT_EQ(GetGrpcAddressFromServer(server.value()), "10.0.0.1:3434");
+
+    const char* invalid[] = {
+        R"({"type": "room"})",
+        R"({"id": "my-id"})",
+        R"({"id": "my-id", "type": "room")",
+        R"({"id": "my-id", "type": "room"} {})",
+        R"(["my-id", "room"])",
+    };
+    for (const auto& json : invalid) {
+        EXPECT_FALSE(pitaya::etcdv3_service_discovery::Worker::ParseServer(json, log)) << json;
+    }
+}
+
+TEST(ServerMetadataTest, ParsesTheMetadataIntoEntries)
+{
+    auto server = pitaya::Server(pitaya::Server::Kind::Backend, "id", "type")
+                      .WithRawMetadata(R"( {"grpcHost": "10.0.0.1", "nested": { "a" : [1, 2] },)"
+                                       R"( "grpcPort": "3434", "grpcHost": "10.0.0.2"} )");
+
+    ASSERT_TRUE(server.HasMetadata());
+    EXPECT_EQ(server.MetadataError(), "");
+    EXPECT_EQ(server.MetadataEntries().size(), 3);
+    EXPECT_EQ(server.GrpcHost(), "10.0.0.2");
+    EXPECT_EQ(server.GrpcPort(), "3434");
+    EXPECT_EQ(server.MetadataValue("nested"), nullptr);
+    EXPECT_EQ(server.MetadataValue("unknown"), nullptr);
+    EXPECT_EQ(server.Metadata(),
+              R"({"grpcHost":"10.0.0.2","nested":{"a":[1,2]},"grpcPort":"3434"})");
+}
+
+TEST(ServerMetadataTest, CopiesAreNotChangedByWithMetadata)
+{
+    auto server = pitaya::Server(pitaya::Server::Kind::Backend, "id", "type")
+                      .WithMetadata(kGrpcHostKey, "host");
+    auto copy = server;
+    copy.WithMetadata(kGrpcHostKey, "other-host").WithMetadata("key", "value");
+
+    EXPECT_EQ(server.Metadata(), R"({"grpcHost":"host"})");
+    EXPECT_EQ(copy.Metadata(), R"({"grpcHost":"other-host","key":"value"})");
+    ASSERT_NE(copy.MetadataValue("key"), nullptr);
+    EXPECT_EQ(*copy.MetadataValue("key"), "value");
+    EXPECT_FALSE(server == copy);
+}
+
+TEST(ServerMetadataTest, KeepsMetadataThatIsNotAnObject)
+{
+    for (const char* json : { "{\"broken-json", "[\"array\"]" }) {
+        auto server =
+            pitaya::Server(pitaya::Server::Kind::Backend, "id", "type").WithRawMetadata(json);
+        EXPECT_NE(server.MetadataError(), "") << json;
+        EXPECT_EQ(server.Metadata(), json);
+        EXPECT_TRUE(server.MetadataEntries().empty());
+        EXPECT_THROW(server.WithMetadata("key", "value"), pitaya::PitayaException);
+    }
+}
+
+TEST(ServerTest, CopiesShareTheServerData)
+{
+    pitaya::Server server(pitaya::Server::Kind::Frontend, "id", "connector", "host");
+    pitaya::Server other(pitaya::Server::Kind::Backend, "other-id", "connector");
+
+    auto copy = server;
+    EXPECT_EQ(&copy.Id(), &server.Id());
+    EXPECT_EQ(&other.Type(), &server.Type());
+
+    copy.WithMetadata(kGrpcHostKey, "host");
+    EXPECT_NE(&copy.Id(), &server.Id());
+    EXPECT_EQ(copy.Id(), "id");
+    EXPECT_EQ(copy.Hostname(), "host");
+    EXPECT_TRUE(copy.IsFrontend());
+    EXPECT_FALSE(server.HasMetadata());
+
+    EXPECT_EQ(pitaya::Server().Id(), "");
+    EXPECT_FALSE(pitaya::Server().IsFrontend());
+}
+
+TEST(RouteTest, SplitsTheRoute)
+{
+    pitaya::Route route("room.roomHandler.join.extra");
+    EXPECT_EQ(route.server_type, "room");
+    EXPECT_EQ(route.handler, "roomHandler");
+    EXPECT_EQ(route.method, "join");
+
+    pitaya::Route emptyMethod("room.roomHandler.");
+    EXPECT_EQ(emptyMethod.method, "");
+
+    EXPECT_THROW(pitaya::Route(""), pitaya::PitayaException);
+    EXPECT_THROW(pitaya::Route("room.roomHandler"), pitaya::PitayaException);
+}
+
+TEST(RouteCacheTest, ParsesEachRouteOnce)
+{
+    RouteCache routes(2);
+
+    const auto& route = routes.Get("room.roomHandler.join");
+    EXPECT_EQ(route.server_type, "room");
+    EXPECT_EQ(route.handler, "roomHandler");
+    EXPECT_EQ(route.method, "join");
+    EXPECT_EQ(&routes.Get("room.roomHandler.join"), &route);
+
+    // Routes past the limit are still parsed, but not cached.
+    const auto& leave = routes.Get("room.roomHandler.leave");
+    const auto& uncached = routes.Get("connector.handler.entry");
+    EXPECT_EQ(uncached.server_type, "connector");
+    EXPECT_EQ(uncached.method, "entry");
+    EXPECT_EQ(routes.Get("room.roomHandler.other").method, "other");
+    EXPECT_EQ(&uncached, &routes.Get("connector.handler.entry"));
+
+    // The cached routes stay where they are.
+    EXPECT_EQ(&routes.Get("room.roomHandler.join"), &route);
+    EXPECT_EQ(&routes.Get("room.roomHandler.leave"), &leave);
+    EXPECT_EQ(leave.method, "leave");
+
+    EXPECT_THROW(routes.Get("invalid"), pitaya::PitayaException);
+}
+
+TEST(RouteCacheTest, KeepsTheCaseOfTheRoutes)
+{
+    RouteCache routes;
+
+    const auto& route = routes.Get("Room.roomHandler.getState");
+    EXPECT_EQ(route.server_type, "Room");
+    EXPECT_EQ(route.handler, "roomHandler");
+    EXPECT_EQ(route.method, "getState");
+    EXPECT_NE(&routes.Get("room.roomhandler.getstate"), &route);
+    EXPECT_EQ(routes.Get("room.roomhandler.getstate").server_type, "room");
+}
+
+TEST(RouteCacheTest, CanBeUsedFromManyThreads)
+{
+    RouteCache routes(128);
+    std::vector<std::thread> threads;
+    std::atomic_int failures(0);
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&routes, &failures]() {
+            for (int i = 0; i < 1000; ++i) {
+                auto type = "type" + std::to_string(i % 100);
+                if (routes.Get(type + ".handler.method").server_type != type) {
+                    ++failures;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(failures, 0);
+
+    // Every thread sees the same cached route.
+    EXPECT_EQ(&routes.Get("type0.handler.method"), &routes.Get("type0.handler.method"));
+}
+
+TEST(SerializeToThreadBufferTest, ReusesTheBufferOfTheThread)
+{
+    protos::Response big;
+    big.set_data(std::string(256, 'x'));
+    protos::Response small;
+    small.set_data("small");
+
+    size_t size;
+    auto data = pitaya::utils::SerializeToThreadBuffer(big, &size);
+    EXPECT_EQ(std::string(reinterpret_cast<const char*>(data), size), big.SerializeAsString());
+
+    auto smallData = pitaya::utils::SerializeToThreadBuffer(small, &size);
+    EXPECT_EQ(smallData, data);
+    EXPECT_EQ(std::string(reinterpret_cast<const char*>(smallData), size),
+              small.SerializeAsString());
+}
+
+TEST(SetThreadAffinityTest, WorksWithoutLogger)
+{
+    std::thread([] { SetThreadAffinity(0, nullptr); }).join();
+}